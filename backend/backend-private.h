@@ -29,6 +29,8 @@
 #  include <signal.h>
 #  include <unistd.h>
 #  include <fcntl.h>
+#  include <sys/time.h>
+#  include <sys/resource.h>
 
 #  ifdef __linux
 #    include <sys/ioctl.h>
@@ -58,6 +60,18 @@ extern "C" {
 #  endif /* __cplusplus */
 
 
+/*
+ * Types...
+ */
+
+typedef struct backend_stats_s		/* Job throughput measurement */
+{
+  struct timeval	start;		/* Start time */
+  struct rusage		usage;		/* CPU usage at start */
+  long			writes;		/* Number of write calls */
+} backend_stats_t;
+
+
 /*
  * Prototypes...
  */
@@ -72,6 +86,12 @@ extern int		backendGetDeviceID(int fd, char *device_id,
 extern int		backendGetMakeModel(const char *device_id,
 			                    char *make_model,
 				            int make_model_size);
+extern ssize_t		backendSendFile(int device_fd, int print_fd,
+			                size_t bytes);
+extern void		backendStatsReport(backend_stats_t *stats,
+			                   ssize_t total_bytes);
+extern void		backendStatsStart(backend_stats_t *stats);
+extern int		backendWaitWritable(int device_fd, int msec);
 
 
 #  ifdef __cplusplus
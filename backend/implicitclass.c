@@ -27,7 +27,12 @@
 #include <ctype.h>
 #include <cups/cups.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <time.h>
 #include <cupsfilters/pdftoippprinter.h>
 
 /*
@@ -38,12 +43,24 @@
    the current job */
 #define CUPS_BROWSED_DEST_PRINTER "cups-browsed-dest-printer"
 
+/* Name prefix of the UNIX socket in CUPS_STATEDIR on which cups-browsed
+   wakes us up when it has updated the above attribute or when a
+   destination in a cluster got free, followed by the queue name. Only
+   root can create files in CUPS_STATEDIR, so no other user can take the
+   name. The datagrams only serve as wake-up calls, the destination is
+   always read from the attribute */
+#define CUPS_BROWSED_NOTIFY_SOCKET "cups-browsed-implicitclass-"
+
 static int		job_canceled = 0; /* Set to 1 on SIGTERM */
+static struct sockaddr_un notify_addr;	/* Address of our wake-up socket */
 
 /*
  * Local functions... */
 
 static void		sigterm_handler(int sig);
+static void		notify_close(int fd);
+static int		notify_open(const char *queue_name);
+static void		notify_wait(int fd, int msec);
 
 #if (CUPS_VERSION_MAJOR > 1) || (CUPS_VERSION_MINOR > 5)
 #define HAVE_CUPS_1_6 1
@@ -100,6 +117,8 @@ main(int  argc,				/* I - Number of command-line args */
   char uri[HTTP_MAX_URI];
   char    *argv_nt[8];
   int     outbuflen, filefd, savestdout, exit_status, dup_status;
+  int     notify_fd;		/* Socket for wake-ups from cups-browsed */
+  time_t  timeout;		/* When to give up waiting for cups-browsed */
   char buf[1024];
   const char *serverbin;
   static const char *pattrs[] =
@@ -154,7 +173,11 @@ main(int  argc,				/* I - Number of command-line args */
     httpAssembleURIf(HTTP_URI_CODING_ALL, uri, sizeof(uri), "ipp", NULL,
 		     "localhost", ippPort(), "/printers/%s", queue_name);
     job_id = argv[1];
-    for (i = 0; i < 40; i++) {
+    /* Listen for cups-browsed's wake-ups before reading the attribute the
+       first time, so that we cannot miss an update */
+    notify_fd = notify_open(queue_name);
+    timeout = time(NULL) + 20;
+    for (i = 0; ; i++) {
       /* Wait up to 20 sec for cups-browsed to supply the destination host */
       /* Try reading the option in which cups-browsed has deposited the
 	 destination host */
@@ -214,27 +237,38 @@ main(int  argc,				/* I - Number of command-line args */
 	break;
       }
     failed:
-      /* Pause half a second before next attempt */
-      usleep(500000);
+      ippDelete(response);
+      response = NULL;
+      if (time(NULL) >= timeout)
+	break;
+      /* Wait for cups-browsed to wake us up, re-check at least every 2 sec
+	 (every half second if we cannot get woken up) */
+      notify_wait(notify_fd, notify_fd >= 0 ? 2000 : 500);
     }
 
-    if (i >= 40) {
+    if (response == NULL) {
       /* Timeout, no useful data from cups-browsed received */
       fprintf(stderr, "ERROR: No destination host name supplied by cups-browsed for printer \"%s\", is cups-browsed running?\n",
 	      queue_name);
+      notify_close(notify_fd);
       return (CUPS_BACKEND_STOP);
     }
+    fprintf(stderr, "DEBUG: Got destination from cups-browsed after %d attempt(s)\n",
+	    i + 1);
     strncpy(dest_host,ptr1,sizeof(dest_host) - 1);
     if (!strcmp(dest_host, "NO_DEST_FOUND")) {
       /* All remote queues are either disabled or not accepting jobs, let
 	 CUPS retry after the usual interval */
       fprintf(stderr, "ERROR: No suitable destination host found by cups-browsed.\n");
+      notify_close(notify_fd);
       return (CUPS_BACKEND_RETRY);
     } else if (!strcmp(dest_host, "ALL_DESTS_BUSY")) {
       /* We queue on the client and all remote queues are busy, so we wait
-	 5 sec  and check again then */
-      fprintf(stderr, "DEBUG: No free destination host found by cups-browsed, retrying in 5 sec.\n");
-      sleep(5);
+	 until cups-browsed tells us that a destination got free, but at most
+	 5 sec, and check again then */
+      fprintf(stderr, "DEBUG: No free destination host found by cups-browsed, retrying when one gets free (at most 5 sec).\n");
+      notify_wait(notify_fd, 5000);
+      notify_close(notify_fd);
       return (CUPS_BACKEND_RETRY_CURRENT);
     } else {
       /* We have the destination host name now, do the job */
@@ -246,6 +280,7 @@ main(int  argc,				/* I - Number of command-line args */
 
       fprintf(stderr, "DEBUG: Received destination host name from cups-browsed: printer-uri %s\n",
 	      ptr1);
+      notify_close(notify_fd);
 
       /* Parse the command line options and prepare them for the new print
 	 job */
@@ -423,6 +458,95 @@ main(int  argc,				/* I - Number of command-line args */
 }
 
 
+/*
+ * 'notify_close()' - Close the socket on which cups-browsed wakes us up.
+ */
+
+static void
+notify_close(int fd)			/* I - Socket or -1 */
+{
+  if (fd < 0)
+    return;
+
+  close(fd);
+  unlink(notify_addr.sun_path);
+}
+
+
+/*
+ * 'notify_open()' - Open the socket on which cups-browsed wakes us up.
+ */
+
+static int				/* O - Socket or -1 if not available */
+notify_open(const char *queue_name)	/* I - Name of our queue */
+{
+  int			fd;		/* Socket */
+  const char		*statedir;	/* CUPS_STATEDIR environment variable */
+  mode_t		mask;		/* Saved umask */
+
+
+  if ((statedir = getenv("CUPS_STATEDIR")) == NULL)
+    statedir = CUPS_STATEDIR;
+
+  memset(&notify_addr, 0, sizeof(notify_addr));
+  notify_addr.sun_family = AF_UNIX;
+  if (snprintf(notify_addr.sun_path, sizeof(notify_addr.sun_path),
+	       "%s/" CUPS_BROWSED_NOTIFY_SOCKET "%s", statedir, queue_name) >=
+      (int)sizeof(notify_addr.sun_path))
+    return (-1);
+
+  if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+    return (-1);
+
+  /* CUPS runs only one job per queue at a time, so a socket with our name
+     is left over from a backend which got killed */
+  unlink(notify_addr.sun_path);
+
+  /* Only cups-browsed, running as root, may wake us up */
+  mask = umask(077);
+  if (bind(fd, (struct sockaddr *)&notify_addr, sizeof(notify_addr))) {
+    umask(mask);
+    fprintf(stderr, "DEBUG: Cannot listen for cups-browsed wake-ups: %s\n",
+	    strerror(errno));
+    close(fd);
+    return (-1);
+  }
+  umask(mask);
+
+  return (fd);
+}
+
+
+/*
+ * 'notify_wait()' - Wait for a wake-up from cups-browsed or a timeout.
+ */
+
+static void
+notify_wait(int fd,			/* I - Socket or -1 */
+	    int msec)			/* I - Timeout in milliseconds */
+{
+  struct pollfd	pfd;			/* Polled socket */
+  char		buf[256];		/* Datagram (content not used) */
+  struct timespec delay;		/* Time to sleep without socket */
+
+
+  if (fd < 0) {
+    delay.tv_sec  = msec / 1000;
+    delay.tv_nsec = (msec % 1000) * 1000000L;
+    nanosleep(&delay, NULL);
+    return;
+  }
+
+  pfd.fd     = fd;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, msec) > 0) {
+    fputs("DEBUG: Woken up by cups-browsed\n", stderr);
+    /* Eat all queued up wake-ups */
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) >= 0);
+  }
+}
+
+
 /*
  * 'sigterm_handler()' - Handle termination signals.
  */
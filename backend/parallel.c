@@ -16,6 +16,7 @@
  *   list_devices() - List all parallel devices.
  *   run_loop()     - Read and write print and back-channel data.
  *   side_cb()      - Handle side-channel requests...
+ *   wait_device()  - Wait for the printer to get ready after an error.
  */
 
 /*
@@ -26,9 +27,22 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <termios.h>
+#include <poll.h>
 #include <sys/socket.h>
 
 
+/*
+ * Constants...
+ */
+
+#define DEFAULT_BUFFER_SIZE	65536	/* Default print data buffer size */
+#define MIN_BUFFER_SIZE		1024	/* Minimum "buffer" URI option */
+#define MAX_BUFFER_SIZE		16777216	/* Maximum "buffer" URI option */
+#ifndef CUPS_BC_FD
+#  define CUPS_BC_FD		3	/* Back-channel file descriptor */
+#endif /* !CUPS_BC_FD */
+
+
 /*
  * Local functions...
  */
@@ -36,8 +50,11 @@
 static int	drain_output(int print_fd, int device_fd);
 static void	list_devices(void);
 static ssize_t	run_loop(int print_fd, int device_fd, int use_bc,
-		         int update_state);
+		         int update_state, size_t bufsize,
+			 backend_stats_t *stats);
 static int	side_cb(int print_fd, int device_fd, int use_bc);
+static void	wait_device(int device_fd, int update_state, int *offline,
+		            int *paperout);
 
 
 /*
@@ -56,13 +73,19 @@ main(int  argc,				/* I - Number of command-line arguments (6 or 7) */
 		hostname[1024],		/* Hostname */
 		username[255],		/* Username info (not used) */
 		resource[1024],		/* Resource info (device and options) */
-		*options;		/* Pointer to options */
+		*options,		/* Pointer to options */
+		*name,			/* Name of option */
+		*value,			/* Value of option */
+		sep;			/* Option separator */
   int		port;			/* Port number (not used) */
   int		print_fd,		/* Print file */
 		device_fd,		/* Parallel device */
 		use_bc;			/* Read back-channel data? */
   int		copies;			/* Number of copies to print */
-  ssize_t	tbytes;			/* Total number of bytes written */
+  ssize_t	tbytes,			/* Total number of bytes written */
+		bytes;			/* Bytes written for one copy */
+  size_t	bufsize;		/* Size of print data buffer */
+  backend_stats_t stats;		/* Throughput measurement */
   struct termios opts;			/* Parallel port options */
 #if defined(HAVE_SIGACTION) && !defined(HAVE_SIGSET)
   struct sigaction action;		/* Actions for POSIX signals */
@@ -153,6 +176,59 @@ main(int  argc,				/* I - Number of command-line arguments (6 or 7) */
     *options++ = '\0';
   }
 
+ /*
+  * Process the options...
+  */
+
+  bufsize = DEFAULT_BUFFER_SIZE;
+
+  while (options && *options)
+  {
+   /*
+    * Get the name and value...
+    */
+
+    name = options;
+
+    while (*options && *options != '=' && *options != '+' && *options != '&')
+      options ++;
+
+    if ((sep = *options) != '\0')
+      *options++ = '\0';
+
+    if (sep == '=')
+    {
+      value = options;
+
+      while (*options && *options != '+' && *options != '&')
+	options ++;
+
+      if (*options)
+	*options++ = '\0';
+    }
+    else
+      value = (char *)"";
+
+    if (!strcasecmp(name, "buffer"))
+    {
+     /*
+      * Set the size of the print data buffer, a bigger buffer means less
+      * system calls for fast printers...
+      */
+
+      bufsize = strtoul(value, &value, 10);
+      if (*value == 'k' || *value == 'K')
+        bufsize *= 1024;
+      else if (*value == 'm' || *value == 'M')
+        bufsize *= 1048576;
+
+      if (bufsize < MIN_BUFFER_SIZE)
+        bufsize = MIN_BUFFER_SIZE;
+      else if (bufsize > MAX_BUFFER_SIZE)
+        bufsize = MAX_BUFFER_SIZE;
+    }
+  }
+
  /*
   * Open the parallel port device...
   */
@@ -242,8 +318,11 @@ main(int  argc,				/* I - Number of command-line arguments (6 or 7) */
   */
 
   tbytes = 0;
+  bytes  = 0;
+
+  backendStatsStart(&stats);
 
-  while (copies > 0 && tbytes >= 0)
+  while (copies > 0 && bytes >= 0)
   {
     copies --;
 
@@ -253,12 +332,16 @@ main(int  argc,				/* I - Number of command-line arguments (6 or 7) */
       lseek(print_fd, 0, SEEK_SET);
     }
 
-    tbytes = run_loop(print_fd, device_fd, use_bc, 1);
+    if ((bytes = run_loop(print_fd, device_fd, use_bc, 1, bufsize,
+                          &stats)) > 0)
+      tbytes += bytes;
 
-    if (print_fd != 0 && tbytes >= 0)
+    if (print_fd != 0 && bytes >= 0)
       fputs("INFO: Print file sent.\n", stderr);
   }
 
+  backendStatsReport(&stats, tbytes);
+
  /*
   * Close the socket connection and input file and return...
   */
@@ -358,6 +441,9 @@ drain_output(int print_fd,		/* I - Print file descriptor */
 	  perror("ERROR: Unable to write print data");
 	  return (-1);
 	}
+
+        if (errno == EAGAIN)
+	  backendWaitWritable(device_fd, 1000);
       }
       else
       {
@@ -539,7 +625,9 @@ static ssize_t				/* O - Total bytes on success, -1 on error */
 run_loop(int print_fd,			/* I - Print file descriptor */
 	int device_fd,			/* I - Device file descriptor */
 	int use_bc,			/* I - Use back-channel? */
-	int update_state)		/* I - Update printer-state-reasons? */
+	int update_state,		/* I - Update printer-state-reasons? */
+	size_t bufsize,			/* I - Size of print data buffer */
+	backend_stats_t *stats)		/* IO - Throughput measurement */
 {
   int		nfds;			/* Maximum file descriptor value + 1 */
   fd_set	input,			/* Input set for reading */
@@ -550,9 +638,11 @@ run_loop(int print_fd,			/* I - Print file descriptor */
 		bytes;			/* Bytes written */
   int		paperout;		/* "Paper out" status */
   int		offline;		/* "Off-line" status */
-  char		print_buffer[8192],	/* Print data buffer */
+  char		*print_buffer,		/* Print data buffer */
 		*print_ptr,		/* Pointer into print data buffer */
-		bc_buffer[1024];	/* Back-channel data buffer */
+		bc_buffer[1024],	/* Back-channel data buffer */
+		*bc_ptr;		/* Pointer into back-channel buffer */
+  int		use_sendfile;		/* Copy print file in the kernel? */
   struct timeval timeout;		/* Timeout for select() */
   int           sc_ok;                  /* Flag a side channel error and
 					   stop using the side channel
@@ -596,8 +686,41 @@ run_loop(int print_fd,			/* I - Print file descriptor */
   * Figure out the maximum file descriptor value to use with select()...
   */
 
-  nfds = (print_fd > device_fd ? print_fd : device_fd) + 1;
+  nfds = (print_fd > device_fd ? print_fd : device_fd);
+  if (nfds < CUPS_BC_FD)
+    nfds = CUPS_BC_FD;
+  if (nfds < CUPS_SC_FD)
+    nfds = CUPS_SC_FD;
+  nfds ++;
 
+ /*
+  * Without a back-channel file descriptor (not run by cupsd) select()
+  * would fail on it as soon as we have back-channel data to forward...
+  */
+
+  if (use_bc && fcntl(CUPS_BC_FD, F_GETFD) < 0)
+  {
+    fputs("DEBUG: No back-channel file descriptor, not reading back-channel "
+          "data.\n", stderr);
+    use_bc = 0;
+  }
+
+ /*
+  * Allocate the print data buffer...
+  */
+
+  if ((print_buffer = malloc(bufsize)) == NULL)
+  {
+    perror("ERROR: Unable to allocate print data buffer");
+    return (-1);
+  }
+
+ /*
+  * Print files (not stdin) are copied to the device by the kernel if
+  * possible, we fall back to read()/write() on the first failure...
+  */
+
+  use_sendfile = (print_fd != 0);
 
  /*
   * Side channel is OK...
@@ -609,47 +732,69 @@ run_loop(int print_fd,			/* I - Print file descriptor */
   * Now loop until we are out of data from print_fd...
   */
 
-  for (print_bytes = 0, print_ptr = print_buffer, offline = -1,
-           paperout = -1, total_bytes = 0;;)
+  for (print_bytes = 0, print_ptr = print_buffer, bc_bytes = 0,
+           bc_ptr = bc_buffer, offline = -1, paperout = -1, total_bytes = 0;;)
   {
    /*
     * Use select() to determine whether we have data to copy around...
+    *
+    * Back-channel data is forwarded to the driver only when it is ready
+    * to take it, so that a driver not reading the back-channel does not
+    * hold up the print data...
     */
 
     FD_ZERO(&input);
-    if (!print_bytes)
+    if (!print_bytes && !use_sendfile)
       FD_SET(print_fd, &input);
-    if (use_bc)
+    if (use_bc && !bc_bytes)
       FD_SET(device_fd, &input);
     if (!print_bytes && sc_ok)
       FD_SET(CUPS_SC_FD, &input);
 
     FD_ZERO(&output);
-    if (print_bytes)
+    if (print_bytes || use_sendfile)
       FD_SET(device_fd, &output);
+    if (bc_bytes)
+      FD_SET(CUPS_BC_FD, &output);
 
     timeout.tv_sec  = 5;
     timeout.tv_usec = 0;
 
     if (select(nfds, &input, &output, NULL, &timeout) < 0)
     {
-     /*
-      * Pause printing to clear any pending errors...
-      */
-
-      if (errno == ENXIO && offline != 1 && update_state)
-      {
-	fputs("STATE: +offline-report\n", stderr);
-	offline = 1;
-      }
-      else if (errno == EINTR && total_bytes == 0)
+      if (errno == EINTR && total_bytes == 0)
       {
 	fputs("DEBUG: Received an interrupt before any bytes were "
 	      "written, aborting.\n", stderr);
+	free(print_buffer);
 	return (0);
       }
+      else if (errno == EBADF && bc_bytes)
+      {
+       /*
+        * The back-channel went away, drop its data and stop reading it...
+	*/
+
+        fputs("DEBUG: Back-channel closed, dropping back-channel data.\n",
+	      stderr);
+	bc_bytes = 0;
+	use_bc   = 0;
+      }
+      else if (errno != EINTR)
+      {
+       /*
+        * Pause printing until the printer has cleared the error...
+	*/
+
+	if (errno == ENXIO && offline != 1 && update_state)
+	{
+	  fputs("STATE: +offline-report\n", stderr);
+	  offline = 1;
+	}
+
+	wait_device(device_fd, update_state, &offline, &paperout);
+      }
 
-      sleep(1);
       continue;
     }
 
@@ -683,15 +828,44 @@ run_loop(int print_fd,			/* I - Print file descriptor */
       {
 	fprintf(stderr, "DEBUG: Received %d bytes of back-channel data.\n",
 	        (int)bc_bytes);
-        cupsBackChannelWrite(bc_buffer, bc_bytes, 1.0);
+        bc_ptr = bc_buffer;
+      }
+      else
+      {
+        if (bc_bytes < 0 && errno != EAGAIN && errno != EINTR)
+	{
+	  perror("DEBUG: Error reading back-channel data");
+	  use_bc = 0;
+	}
+	else if (bc_bytes == 0)
+	  use_bc = 0;
+
+        bc_bytes = 0;
       }
-      else if (bc_bytes < 0 && errno != EAGAIN && errno != EINTR)
+    }
+
+   /*
+    * Check if the driver is ready to receive back-channel data...
+    */
+
+    if (bc_bytes && FD_ISSET(CUPS_BC_FD, &output))
+    {
+      if ((bytes = write(CUPS_BC_FD, bc_ptr, bc_bytes)) > 0)
       {
-        perror("DEBUG: Error reading back-channel data");
-	use_bc = 0;
+        bc_bytes -= bytes;
+	bc_ptr   += bytes;
+      }
+      else if (bytes < 0 && errno != EAGAIN && errno != EINTR)
+      {
+       /*
+        * Nobody reads the back-channel, drop the data...
+	*/
+
+        perror("DEBUG: Unable to forward back-channel data");
+	bc_bytes = 0;
+	if (errno == EBADF || errno == EPIPE)
+	  use_bc = 0;
       }
-      else if (bc_bytes == 0)
-        use_bc = 0;
     }
 
    /*
@@ -700,8 +874,7 @@ run_loop(int print_fd,			/* I - Print file descriptor */
 
     if (FD_ISSET(print_fd, &input))
     {
-      if ((print_bytes = read(print_fd, print_buffer,
-                              sizeof(print_buffer))) < 0)
+      if ((print_bytes = read(print_fd, print_buffer, bufsize)) < 0)
       {
        /*
         * Read error - bail if we don't see EAGAIN or EINTR...
@@ -710,6 +883,7 @@ run_loop(int print_fd,			/* I - Print file descriptor */
 	if (errno != EAGAIN && errno != EINTR)
 	{
 	  perror("ERROR: Unable to read print data");
+	  free(print_buffer);
 	  return (-1);
 	}
 
@@ -735,9 +909,33 @@ run_loop(int print_fd,			/* I - Print file descriptor */
     * send...
     */
 
-    if (print_bytes && FD_ISSET(device_fd, &output))
+    if ((print_bytes || use_sendfile) && FD_ISSET(device_fd, &output))
     {
-      if ((bytes = write(device_fd, print_ptr, print_bytes)) < 0)
+      if (use_sendfile)
+        bytes = backendSendFile(device_fd, print_fd, bufsize);
+      else
+        bytes = write(device_fd, print_ptr, print_bytes);
+
+      stats->writes ++;
+
+      if (bytes < 0 && use_sendfile && errno == ENOSYS)
+      {
+       /*
+        * Cannot copy in the kernel, use the print data buffer...
+	*/
+
+        fputs("DEBUG: Copying print data with read() and write().\n", stderr);
+        use_sendfile = 0;
+      }
+      else if (bytes == 0 && use_sendfile)
+      {
+       /*
+        * End of file, break out of the loop...
+	*/
+
+        break;
+      }
+      else if (bytes < 0)
       {
        /*
         * Write error - bail if we don't see an error we can retry...
@@ -750,6 +948,8 @@ run_loop(int print_fd,			/* I - Print file descriptor */
 	    fputs("STATE: +media-empty-warning\n", stderr);
 	    paperout = 1;
 	  }
+
+	  wait_device(device_fd, update_state, &offline, &paperout);
         }
 	else if (errno == ENXIO)
 	{
@@ -758,10 +958,13 @@ run_loop(int print_fd,			/* I - Print file descriptor */
 	    fputs("STATE: +offline-report\n", stderr);
 	    offline = 1;
 	  }
+
+	  wait_device(device_fd, update_state, &offline, &paperout);
 	}
 	else if (errno != EAGAIN && errno != EINTR && errno != ENOTTY)
 	{
 	  perror("ERROR: Unable to write print data");
+	  free(print_buffer);
 	  return (-1);
 	}
       }
@@ -781,17 +984,32 @@ run_loop(int print_fd,			/* I - Print file descriptor */
 
         fprintf(stderr, "DEBUG: Wrote %d bytes of print data...\n", (int)bytes);
 
-        print_bytes -= bytes;
-	print_ptr   += bytes;
+        if (!use_sendfile)
+	{
+	  print_bytes -= bytes;
+	  print_ptr   += bytes;
+	}
 	total_bytes += bytes;
       }
     }
   }
 
+ /*
+  * Forward back-channel data which is still pending if the driver takes
+  * it within a second, otherwise say that we drop it...
+  */
+
+  if (bc_bytes > 0 &&
+      cupsBackChannelWrite(bc_ptr, (size_t)bc_bytes, 1.0) < 0)
+    fprintf(stderr, "DEBUG: Dropping %d bytes of back-channel data at the "
+	    "end of the job.\n", (int)bc_bytes);
+
  /*
   * Return with success...
   */
 
+  free(print_buffer);
+
   return (total_bytes);
 }
 
@@ -859,3 +1077,86 @@ side_cb(int         print_fd,		/* I - Print file */
 
   return (cupsSideChannelWrite(command, status, data, datalen, 1.0));
 }
+
+
+/*
+ * 'wait_device()' - Wait for the printer to get ready after an error.
+ *
+ * Returns as soon as the printer reports that it is on-line again, or after
+ * one second to let the caller retry, updating the printer state while
+ * waiting.  Devices which tell when they take data again, like usblp,
+ * wake us up; the lp driver always claims to be writable, so for it the
+ * status is checked every 50 ms.
+ */
+
+static void
+wait_device(int device_fd,		/* I  - Device file */
+            int update_state,		/* I  - Update printer-state-reasons? */
+	    int *offline,		/* IO - "Off-line" status */
+	    int *paperout)		/* IO - "Paper out" status */
+{
+  int	signals;			/* Does the device tell when it is
+					   writable again? */
+#ifdef LPGETSTATUS
+  int	i,				/* Looping var */
+	status;				/* Port status */
+#endif /* LPGETSTATUS */
+
+
+ /*
+  * A device which is writable right after an error cannot tell us when it
+  * gets ready again...
+  */
+
+  signals = (backendWaitWritable(device_fd, 0) == 0);
+
+#ifdef LPGETSTATUS
+  for (i = 0; i < 20; i ++)
+  {
+    if (ioctl(device_fd, LPGETSTATUS, &status))
+      break;				/* Not a lp device, just wait */
+
+    if (update_state)
+    {
+      if ((status & LP_POUTPA) && *paperout != 1)
+      {
+	fputs("STATE: +media-empty-warning\n", stderr);
+	*paperout = 1;
+      }
+      else if (!(status & LP_POUTPA) && *paperout == 1)
+      {
+	fputs("STATE: -media-empty-warning\n", stderr);
+	*paperout = 0;
+      }
+    }
+
+    if ((status & LP_PSELECD) && (status & LP_PERRORP) &&
+        !(status & LP_POUTPA))
+    {
+     /*
+      * Printer is selected, has no error and has paper, so try again...
+      */
+
+      if (*offline == 1 && update_state)
+      {
+	fputs("STATE: -offline-report\n", stderr);
+	*offline = 0;
+      }
+
+      return;
+    }
+
+    if (!signals)
+      poll(NULL, 0, 50);
+    else if (backendWaitWritable(device_fd, 50) != 0)
+      signals = 0;			/* Check the status now, then wait */
+  }
+
+  if (i < 20)
+#endif /* LPGETSTATUS */
+
+  if (!signals)
+    sleep(1);
+  else
+    backendWaitWritable(device_fd, 1000);
+}
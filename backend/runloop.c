@@ -0,0 +1,142 @@
+/*
+ *   Common print data path functions for OpenPrinting CUPS Filters backends.
+ *
+ *   Copyright 2026 by OpenPrinting.
+ *
+ *   Distribution and use rights are outlined in the file "COPYING"
+ *   which should have been included with this file.
+ *
+ * Contents:
+ *
+ *   backendSendFile()     - Copy print file data to the device in the kernel.
+ *   backendStatsReport()  - Log throughput and CPU time of a job.
+ *   backendStatsStart()   - Start measuring throughput and CPU time.
+ *   backendWaitWritable() - Wait until the device accepts more data.
+ */
+
+/*
+ * Include necessary headers.
+ */
+
+#include "backend-private.h"
+#include <poll.h>
+#include <sys/stat.h>
+#ifdef __linux
+#  include <sys/sendfile.h>
+#endif /* __linux */
+
+
+/*
+ * 'backendSendFile()' - Copy print file data to the device in the kernel.
+ *
+ * The data is copied from the current position of "print_fd", which is
+ * advanced like with read().  Returns -1 with errno set to ENOSYS if the
+ * print file is not a regular file or the system cannot do it, in which
+ * case nothing has been copied and the caller should fall back to
+ * read()/write().
+ */
+
+ssize_t					/* O - Bytes copied, 0 on EOF, -1 on error */
+backendSendFile(int    device_fd,	/* I - Device file descriptor */
+                int    print_fd,	/* I - Print file descriptor */
+		size_t bytes)		/* I - Maximum number of bytes to copy */
+{
+#ifdef __linux
+  struct stat	fileinfo;		/* Print file information */
+  ssize_t	sent;			/* Bytes copied */
+
+
+  if (fstat(print_fd, &fileinfo) || !S_ISREG(fileinfo.st_mode))
+  {
+    errno = ENOSYS;
+    return (-1);
+  }
+
+  if ((sent = sendfile(device_fd, print_fd, NULL, bytes)) < 0 &&
+      errno == EINVAL)
+    errno = ENOSYS;			/* Device does not support it */
+
+  return (sent);
+
+#else
+  (void)device_fd;
+  (void)print_fd;
+  (void)bytes;
+
+  errno = ENOSYS;
+  return (-1);
+#endif /* __linux */
+}
+
+
+/*
+ * 'backendStatsReport()' - Log throughput and CPU time of a job.
+ */
+
+void
+backendStatsReport(
+    backend_stats_t *stats,		/* I - Values from backendStatsStart() */
+    ssize_t         total_bytes)	/* I - Total bytes sent to the device */
+{
+  struct timeval	now;		/* Current time */
+  struct rusage		usage;		/* Current CPU usage */
+  double		secs,		/* Elapsed time */
+			usecs,		/* User CPU time */
+			ssecs;		/* System CPU time */
+
+
+  gettimeofday(&now, NULL);
+  getrusage(RUSAGE_SELF, &usage);
+
+  secs  = (now.tv_sec - stats->start.tv_sec) +
+          0.000001 * (now.tv_usec - stats->start.tv_usec);
+  usecs = (usage.ru_utime.tv_sec - stats->usage.ru_utime.tv_sec) +
+          0.000001 * (usage.ru_utime.tv_usec - stats->usage.ru_utime.tv_usec);
+  ssecs = (usage.ru_stime.tv_sec - stats->usage.ru_stime.tv_sec) +
+          0.000001 * (usage.ru_stime.tv_usec - stats->usage.ru_stime.tv_usec);
+
+  fprintf(stderr,
+          "DEBUG: Sent %ld bytes in %.3f seconds (%.1f kB/s), "
+	  "CPU time %.3fs user, %.3fs system, %ld write calls.\n",
+	  (long)total_bytes, secs,
+	  secs > 0.0 ? total_bytes / secs / 1024.0 : 0.0,
+	  usecs, ssecs, stats->writes);
+}
+
+
+/*
+ * 'backendStatsStart()' - Start measuring throughput and CPU time.
+ */
+
+void
+backendStatsStart(
+    backend_stats_t *stats)		/* O - Start values */
+{
+  gettimeofday(&stats->start, NULL);
+  getrusage(RUSAGE_SELF, &stats->usage);
+  stats->writes = 0;
+}
+
+
+/*
+ * 'backendWaitWritable()' - Wait until the device accepts more data.
+ */
+
+int					/* O - 1 if writable, 0 on timeout, -1 on error */
+backendWaitWritable(int device_fd,	/* I - Device file descriptor */
+                    int msec)		/* I - Timeout in milliseconds, -1 for none */
+{
+  struct pollfd	pfd;			/* Polled device */
+  int		ret;			/* Return value of poll() */
+
+
+  pfd.fd     = device_fd;
+  pfd.events = POLLOUT;
+
+  while ((ret = poll(&pfd, 1, msec)) < 0 && errno == EINTR);
+
+  if (ret > 0 && (pfd.revents & (POLLERR | POLLNVAL)))
+    return (-1);
+
+  return (ret);
+}
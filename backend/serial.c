@@ -12,6 +12,7 @@
  * Contents:
  *
  *   main()         - Send a file to the printer or server.
+ *   dsr_alarm()    - End a wait for DSR.
  *   list_devices() - List all serial devices.
  *   side_cb()      - Handle side-channel requests...
  */
@@ -26,6 +27,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <termios.h>
+#include <poll.h>
 #include <sys/select.h>
 #ifdef HAVE_SYS_IOCTL_H
 #  include <sys/ioctl.h>
@@ -52,11 +54,22 @@
 #endif /* __linux && TIOCGSERIAL */
 
 
+/*
+ * Constants...
+ */
+
+#define MIN_BUFFER_SIZE		16	/* Minimum "buffer" URI option */
+#define MAX_BUFFER_SIZE		16777216	/* Maximum "buffer" URI option */
+
+
 /*
  * Local functions...
  */
 
 static int	drain_output(int print_fd, int device_fd);
+#ifdef TIOCMIWAIT
+static void	dsr_alarm(int sig);
+#endif /* TIOCMIWAIT */
 static void	list_devices(void);
 static int	side_cb(int print_fd, int device_fd, int use_bc);
 
@@ -94,10 +107,13 @@ main(int  argc,				/* I - Number of command-line arguments (6 or 7) */
 		total_bytes,		/* Total bytes written */
 		bytes;			/* Bytes written */
   int		dtrdsr;			/* Do dtr/dsr flow control? */
+  int		dsrwait;		/* Can we wait for DSR in TIOCMIWAIT? */
   int		print_size;		/* Size of output buffer for writes */
-  char		print_buffer[8192],	/* Print data buffer */
+  size_t	bufsize;		/* Size from "buffer" option, 0 if none */
+  char		*print_buffer,		/* Print data buffer */
 		*print_ptr,		/* Pointer into print data buffer */
 		bc_buffer[1024];	/* Back-channel data buffer */
+  backend_stats_t stats;		/* Throughput measurement */
   struct termios opts;			/* Serial port options */
   struct termios origopts;		/* Original port options */
 #if defined(HAVE_SIGACTION) && !defined(HAVE_SIGSET)
@@ -249,6 +265,7 @@ main(int  argc,				/* I - Number of command-line arguments (6 or 7) */
   opts.c_oflag &= ~OPOST;		/* Don't post-process */
 
   print_size = 96;			/* 9600 baud / 10 bits/char / 10Hz */
+  bufsize    = 0;			/* Buffer size from the baud rate */
   dtrdsr     = 0;			/* No dtr/dsr flow control */
 
   if (options)
@@ -442,6 +459,24 @@ main(int  argc,				/* I - Number of command-line arguments (6 or 7) */
 	  dtrdsr = 1;
 	}
       }
+      else if (!strcasecmp(name, "buffer"))
+      {
+       /*
+        * Set the size of the print data buffer instead of what the baud
+	* rate gives, a bigger buffer means less system calls...
+	*/
+
+	bufsize = strtoul(value, &value, 10);
+	if (*value == 'k' || *value == 'K')
+	  bufsize *= 1024;
+	else if (*value == 'm' || *value == 'M')
+	  bufsize *= 1048576;
+
+	if (bufsize < MIN_BUFFER_SIZE)
+	  bufsize = MIN_BUFFER_SIZE;
+	else if (bufsize > MAX_BUFFER_SIZE)
+	  bufsize = MAX_BUFFER_SIZE;
+      }
       else if (!strcasecmp(name, "stop"))
       {
         switch (atoi(value))
@@ -458,9 +493,36 @@ main(int  argc,				/* I - Number of command-line arguments (6 or 7) */
     }
   }
 
+  if (bufsize)
+    print_size = (int)bufsize;
+  else if (print_size < 1)
+    print_size = 1;
+
   tcsetattr(device_fd, TCSANOW, &opts);
   fcntl(device_fd, F_SETFL, 0);
 
+ /*
+  * With DTR/DSR flow control we wait for DSR in TIOCMIWAIT, SIGALRM
+  * ends the wait after a second in case DSR went high just before...
+  */
+
+  dsrwait = 0;
+
+#ifdef TIOCMIWAIT
+  if (dtrdsr)
+  {
+    struct sigaction alarm_action;	/* Action for SIGALRM */
+
+    memset(&alarm_action, 0, sizeof(alarm_action));
+
+    sigemptyset(&alarm_action.sa_mask);
+    alarm_action.sa_handler = dsr_alarm;
+    sigaction(SIGALRM, &alarm_action, NULL);
+
+    dsrwait = 1;
+  }
+#endif /* TIOCMIWAIT */
+
  /*
   * Now that we are "connected" to the port, ignore SIGTERM so that we
   * can finish out any page data the driver sends (e.g. to eject the
@@ -496,11 +558,24 @@ main(int  argc,				/* I - Number of command-line arguments (6 or 7) */
   * of the code here instead...
   */
 
-  if (print_size > sizeof(print_buffer))
-    print_size = sizeof(print_buffer);
+  if ((print_buffer = malloc(print_size)) == NULL)
+  {
+    perror("ERROR: Unable to allocate print data buffer");
+
+    tcsetattr(device_fd, TCSADRAIN, &origopts);
+
+    close(device_fd);
+
+    if (print_fd != 0)
+      close(print_fd);
+
+    return (CUPS_BACKEND_FAILED);
+  }
 
   total_bytes = 0;
 
+  backendStatsStart(&stats);
+
   while (copies > 0)
   {
     copies --;
@@ -632,11 +707,17 @@ main(int  argc,				/* I - Number of command-line arguments (6 or 7) */
 
               do
 	      {
-	       /*
-	        * Poll every 100ms...
-		*/
-
-		usleep(100000);
+#ifdef TIOCMIWAIT
+		if (dsrwait)
+		{
+		  alarm(1);
+		  if (ioctl(device_fd, TIOCMIWAIT, TIOCM_DSR) && errno != EINTR)
+		    dsrwait = 0;		/* Not supported by the driver */
+		  alarm(0);
+		}
+		else
+#endif /* TIOCMIWAIT */
+		poll(NULL, 0, 10);
 
 		if (ioctl(device_fd, TIOCMGET, &status))
 		  break;
@@ -647,6 +728,8 @@ main(int  argc,				/* I - Number of command-line arguments (6 or 7) */
             }
 	}
 
+	stats.writes ++;
+
 	if ((bytes = write(device_fd, print_ptr, print_bytes)) < 0)
 	{
 	 /*
@@ -685,6 +768,10 @@ main(int  argc,				/* I - Number of command-line arguments (6 or 7) */
 
   tcsetattr(device_fd, TCSADRAIN, &origopts);
 
+  backendStatsReport(&stats, total_bytes);
+
+  free(print_buffer);
+
   close(device_fd);
 
   if (print_fd != 0)
@@ -780,6 +867,9 @@ drain_output(int print_fd,		/* I - Print file descriptor */
 	  perror("ERROR: Unable to write print data");
 	  return (-1);
 	}
+
+        if (errno == EAGAIN)
+	  backendWaitWritable(device_fd, 1000);
       }
       else
       {
@@ -793,6 +883,21 @@ drain_output(int print_fd,		/* I - Print file descriptor */
 }
 
 
+#ifdef TIOCMIWAIT
+/*
+ * 'dsr_alarm()' - End a wait for DSR.
+ *
+ * Only interrupts the TIOCMIWAIT ioctl, the caller checks DSR again.
+ */
+
+static void
+dsr_alarm(int sig)			/* I - Signal number (unused) */
+{
+  (void)sig;
+}
+#endif /* TIOCMIWAIT */
+
+
 /*
  * 'list_devices()' - List all serial devices.
  */
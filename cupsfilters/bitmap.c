@@ -26,6 +26,7 @@ MIT Open Source License  -  http://www.opensource.org/
 
 #include "image.h"
 #include <stdio.h>
+#include <stdint.h>
 #include <cups/raster.h>
 
 unsigned int dither1[16][16] = {
@@ -289,6 +290,55 @@ writepixel(unsigned char *dst,        /* I - Destination string */
   }
 }
 
+/*
+ * 'reverseBits()' - Reverse the order of pixels in one line of 1-bit raster
+ *                   data, optionally inverting them.
+ *
+ * Whole 64-pixel words are read with a funnel shift over the pixel
+ * alignment, bit-reversed with masks and stored with the bytes in reverse
+ * order; only the remaining bytes go through revTable.  Padding bits of the
+ * output are cleared (set when inverting).
+ */
+
+static unsigned char *                /* O - Output string */
+reverseBits(unsigned char *src,       /* I - Input line */
+	    unsigned char *dst,       /* I - Destination string */
+	    unsigned int pixels,      /* I - Number of pixels */
+	    unsigned char invert)     /* I - Invert the pixels? */
+{
+  unsigned int size = (pixels+7)/8;
+  unsigned int sw = (size*8)-pixels;
+  unsigned int r = pixels & 7;
+  uint64_t mask = invert ? ~(uint64_t)0 : 0;
+  unsigned int j = 0;
+
+  for (;pixels >= j*8+64;j += 8) {
+    unsigned char *bp = src+(pixels-j*8-64)/8;
+    unsigned char *dp = dst+j;
+    uint64_t w = 0;
+
+    for (int k = 0;k < 8;k++) {
+      w = (w << 8) | bp[k];
+    }
+    if (r) {
+      w = (w << r) | (bp[8] >> (8-r));
+    }
+    w ^= mask;
+    w = ((w >> 1) & 0x5555555555555555ULL) | ((w & 0x5555555555555555ULL) << 1);
+    w = ((w >> 2) & 0x3333333333333333ULL) | ((w & 0x3333333333333333ULL) << 2);
+    w = ((w >> 4) & 0x0f0f0f0f0f0f0f0fULL) | ((w & 0x0f0f0f0f0f0f0f0fULL) << 4);
+    for (int k = 0;k < 8;k++,w >>= 8) {
+      dp[k] = w & 0xff;
+    }
+  }
+  for (;j < size;j++) {
+    unsigned int d = (j+2 <= size) ? src[size-2-j] : 0;
+
+    dst[j] = revTable[(((d << 8) | src[size-1-j]) >> sw) & 0xff] ^ (mask & 0xff);
+  }
+  return dst;
+}
+
 /*
  * 'reverseOneBitLine()' - Reverse the order of pixels in one line of 1-bit raster data.
  */
@@ -299,34 +349,7 @@ reverseOneBitLine(unsigned char *src, /* I - Input line */
 		  unsigned int pixels,/* I - Number of pixels */
 		  unsigned int size)  /* I - Bytesperline */
 {
-  unsigned char *bp;
-  unsigned char *dp;
-  unsigned int npadbits = (size*8)-pixels;
-
-  if (npadbits == 0) {
-    bp = src+size-1;
-    dp = dst;
-    for (unsigned int j = 0;j < size;j++,bp--,dp++) {
-      *dp = revTable[*bp];
-    }
-  } else {
-    unsigned int pd,d;
-    unsigned int sw;
-
-    size = (pixels+7)/8;
-    sw = (size*8)-pixels;
-    bp = src+size-1;
-    dp = dst;
-
-    pd = *bp--;
-    for (unsigned int j = 1;j < size;j++,bp--,dp++) {
-      d = *bp;
-      *dp = revTable[(((d << 8) | pd) >> sw) & 0xff];
-      pd = d;
-    }
-    *dp = revTable[(pd >> sw) & 0xff];
-  }
-  return dst;
+  return reverseBits(src, dst, pixels, 0);
 }
 
 
@@ -341,34 +364,7 @@ reverseOneBitLineSwap(unsigned char *src, /* I - Input line */
 		      unsigned int pixels,/* I - Number of pixels */
 		      unsigned int size)  /* I - Bytesperline */
 {
-  unsigned char *bp;
-  unsigned char *dp;
-  unsigned int npadbits = (size*8)-pixels;
-
-  if (npadbits == 0) {
-    bp = src+size-1;
-    dp = dst;
-    for (unsigned int j = 0;j < size;j++,bp--,dp++) {
-      *dp = revTable[(unsigned char)(~*bp)];
-    }
-  } else {
-    unsigned int pd,d;
-    unsigned int sw;
-
-    size = (pixels+7)/8;
-    sw = (size*8)-pixels;
-    bp = src+size-1;
-    dp = dst;
-
-    pd = *bp--;
-    for (unsigned int j = 1;j < size;j++,bp--,dp++) {
-      d = *bp;
-      *dp = ~revTable[(((d << 8) | pd) >> sw) & 0xff];
-      pd = d;
-    }
-    *dp = ~revTable[(pd >> sw) & 0xff];
-  }
-  return dst;
+  return reverseBits(src, dst, pixels, 1);
 }
 
 /*
@@ -0,0 +1,761 @@
+/*
+ *   Filter functions support for OpenPrinting CUPS Filters.
+ *
+ *   Copyright 2026 by OpenPrinting.
+ *
+ *   Distribution and use rights are outlined in the file "COPYING"
+ *   which should have been included with this file.
+ *
+ * Contents:
+ *
+ *   filterChain()        - Run a chain of filter functions.
+ *   filterExternalCUPS() - Run an external CUPS filter executable.
+ *   filterGziptoany()    - Uncompress gzip-compressed data.
+ *   filterRunCUPSChain() - Run a chain of CUPS filters given by name.
+ *   filter_thread()      - Run one filter function of a chain.
+ *   filter_thread_init() - Create the key for the current filter thread.
+ *   open_pipe()          - Create a pipe between two filters.
+ *   options_string()     - Make an option string like argv[5].
+ *   write_all()          - Write a buffer completely.
+ */
+
+/*
+ * Include necessary headers...
+ */
+
+#include <config.h>
+#include "filter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <zlib.h>
+
+
+/*
+ * Constants...
+ */
+
+#define FILTER_PIPE_SIZE	(1024 * 1024)
+					/* Data queued between two filters */
+#define FILTER_BUFFER_SIZE	65536	/* Copy buffer size */
+#define FILTER_CANCEL_CHECK	100	/* Milliseconds between checks whether
+					   the job got canceled */
+
+
+/*
+ * Types...
+ */
+
+typedef struct filter_thread_s		/* Filter running in a thread */
+{
+  filter_filter_in_chain_t *filter;	/* Filter function and parameters */
+  int		inputfd,		/* Input of the filter */
+		outputfd,		/* Output of the filter */
+		inputseekable,		/* Is the input seekable? */
+		close_input,		/* Close input when done? */
+		close_output,		/* Close output when done? */
+		status,			/* Return value of the filter */
+		done;			/* Has the filter finished? */
+  volatile sig_atomic_t *jobcanceled;	/* Set when job is canceled */
+  filter_data_t	*data;			/* Job data */
+  pthread_t	thread;			/* Thread running the filter */
+  pid_t		child;			/* Process of an external filter */
+} filter_thread_t;
+
+
+/*
+ * Local globals...
+ */
+
+static pthread_mutex_t	chain_mutex = PTHREAD_MUTEX_INITIALIZER;
+					/* Protects "done" and "child" */
+static pthread_cond_t	chain_cond = PTHREAD_COND_INITIALIZER;
+					/* Signaled when a filter finishes */
+static pthread_once_t	thread_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t	thread_key;	/* filter_thread_t of current thread */
+
+
+/*
+ * Local functions...
+ */
+
+static void	*filter_thread(void *arg);
+static void	filter_thread_init(void);
+static int	open_pipe(int *fds);
+static char	*options_string(int num_options, cups_option_t *options);
+static int	write_all(int fd, const char *buffer, size_t bytes);
+
+
+/*
+ * 'filterChain()' - Run a chain of filter functions.
+ *
+ * All filters of the chain run at the same time, each in its own thread,
+ * connected by pipes.  So the job options and the PPD file in "data" are
+ * only parsed once, in-process filters need no process of their own, and
+ * the pipes bound the data queued between two filters.
+ */
+
+int					/* O - 0 on success, 1 on error */
+filterChain(int           inputfd,	/* I - Input of the first filter */
+	    int           outputfd,	/* I - Output of the last filter */
+	    int           inputseekable,/* I - Is the input seekable? */
+	    volatile sig_atomic_t *jobcanceled,
+					/* I - Set when job is canceled */
+	    filter_data_t *data,	/* I - Job data */
+	    void          *parameters)	/* I - Array of filters */
+{
+  cups_array_t	*filters = (cups_array_t *)parameters;
+					/* Filters to run */
+  filter_filter_in_chain_t *filter;	/* Current filter */
+  filter_thread_t *threads;		/* Running filters */
+  int		num_filters,		/* Number of filters */
+		started,		/* Number of started filters */
+		fds[2],			/* Pipe to the next filter */
+		infd,			/* Input of current filter */
+		i,			/* Looping var */
+		running,		/* Number of running filters */
+		canceled = 0,		/* Did we kill external filters? */
+		retval = 0;		/* Return value */
+  struct timespec until;		/* End of wait for filters */
+
+
+  if ((num_filters = cupsArrayCount(filters)) == 0)
+    return (0);
+
+  pthread_once(&thread_key_once, filter_thread_init);
+
+  if ((threads = calloc(num_filters, sizeof(filter_thread_t))) == NULL)
+  {
+    fputs("ERROR: Unable to allocate memory for filter chain\n", stderr);
+    return (1);
+  }
+
+  for (filter = (filter_filter_in_chain_t *)cupsArrayFirst(filters),
+	 infd = inputfd, started = 0;
+       filter;
+       filter = (filter_filter_in_chain_t *)cupsArrayNext(filters),
+	 started ++)
+  {
+    threads[started].filter        = filter;
+    threads[started].inputfd       = infd;
+    threads[started].inputseekable = (started == 0 && inputseekable);
+    threads[started].close_input   = (started > 0);
+    threads[started].jobcanceled   = jobcanceled;
+    threads[started].data          = data;
+
+    if (started < num_filters - 1)
+    {
+      if (open_pipe(fds))
+      {
+	fprintf(stderr, "ERROR: Unable to create pipe to %s: %s\n",
+		filter->name, strerror(errno));
+	if (started > 0)
+	  close(infd);
+	retval = 1;
+	break;
+      }
+
+      threads[started].outputfd     = fds[1];
+      threads[started].close_output = 1;
+      infd                          = fds[0];
+    }
+    else
+      threads[started].outputfd = outputfd;
+
+    if (pthread_create(&threads[started].thread, NULL, filter_thread,
+		       threads + started))
+    {
+      fprintf(stderr, "ERROR: Unable to start %s\n", filter->name);
+      if (threads[started].close_input)
+	close(threads[started].inputfd);
+      if (threads[started].close_output)
+      {
+	close(threads[started].outputfd);
+	close(infd);
+      }
+      retval = 1;
+      break;
+    }
+
+    fprintf(stderr, "INFO: %s started.\n", filter->name);
+  }
+
+ /*
+  * Wait for the filters to finish; filters after a failed one see the end
+  * of their input, filters before it an error writing their output.  The
+  * SIGTERM which cancels the job comes to this thread, so we kill the
+  * external filters when we see it...
+  */
+
+  pthread_mutex_lock(&chain_mutex);
+  for (;;)
+  {
+    for (i = 0, running = 0; i < started; i ++)
+      if (!threads[i].done)
+	running ++;
+    if (!running)
+      break;
+
+    if (jobcanceled && *jobcanceled && !canceled)
+    {
+      for (i = 0; i < started; i ++)
+	if (threads[i].child > 0)
+	{
+	  fprintf(stderr, "DEBUG: Job canceled, killing %s ...\n",
+		  threads[i].filter->name);
+	  kill(threads[i].child, SIGTERM);
+	}
+      canceled = 1;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += FILTER_CANCEL_CHECK * 1000000L;
+    if (until.tv_nsec >= 1000000000L)
+    {
+      until.tv_sec ++;
+      until.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&chain_cond, &chain_mutex, &until);
+  }
+  pthread_mutex_unlock(&chain_mutex);
+
+  for (i = 0; i < started; i ++)
+  {
+    pthread_join(threads[i].thread, NULL);
+
+    if (threads[i].status)
+    {
+      fprintf(stderr, "ERROR: %s stopped with status %d\n",
+	      threads[i].filter->name, threads[i].status);
+      retval = 1;
+    }
+    else
+      fprintf(stderr, "INFO: %s exited with no errors.\n",
+	      threads[i].filter->name);
+  }
+
+  free(threads);
+
+  return (retval);
+}
+
+
+/*
+ * 'filterExternalCUPS()' - Run an external CUPS filter executable.
+ *
+ * This is the fallback for all filters which are not available as filter
+ * functions.  The filter gets the job data as CUPS filter command line and
+ * reads its input from stdin.
+ */
+
+int					/* O - Exit status of the filter */
+filterExternalCUPS(int           inputfd,	/* I - Input */
+		   int           outputfd,	/* I - Output */
+		   int           inputseekable,	/* I - Input seekable? */
+		   volatile sig_atomic_t *jobcanceled,
+						/* I - Set when canceled */
+		   filter_data_t *data,		/* I - Job data */
+		   void          *parameters)	/* I - Filter to run */
+{
+  filter_external_cups_t *params = (filter_external_cups_t *)parameters;
+  char		program[1024],		/* Filter executable */
+		job_id[32],		/* Job ID */
+		copies[32],		/* Number of copies */
+		*options,		/* Job options */
+		*argv[7];		/* Command line */
+  const char	*cups_serverbin;	/* CUPS_SERVERBIN environment variable */
+  int		pid,			/* Process ID */
+		fd,			/* Temporary file descriptor */
+		status;			/* Exit status */
+  siginfo_t	info;			/* Process state */
+  sigset_t	mask;			/* Signal mask of the filter */
+  filter_thread_t *t;			/* Our thread in filterChain() */
+
+
+  (void)inputseekable;
+
+  if (params->filter[0] == '/')
+    snprintf(program, sizeof(program), "%s", params->filter);
+  else
+  {
+    if ((cups_serverbin = getenv("CUPS_SERVERBIN")) == NULL)
+      cups_serverbin = CUPS_SERVERBIN;
+    snprintf(program, sizeof(program), "%s/filter/%s", cups_serverbin,
+	     params->filter);
+  }
+
+  snprintf(job_id, sizeof(job_id), "%d", data->job_id);
+  snprintf(copies, sizeof(copies), "%d", data->copies);
+  options = options_string(data->num_options, data->options);
+
+  argv[0] = data->printer ? data->printer : program;
+  argv[1] = job_id;
+  argv[2] = data->job_user ? data->job_user : "";
+  argv[3] = data->job_title ? data->job_title : "";
+  argv[4] = copies;
+  argv[5] = options ? options : "";
+  argv[6] = NULL;
+
+  if ((pid = fork()) == 0)
+  {
+   /*
+    * Child process goes here...
+    *
+    * Update stdin/stdout as needed and put the side and back channels
+    * to the Nirwana...
+    */
+
+    if (inputfd != 0)
+    {
+      dup2(inputfd, 0);
+      close(inputfd);
+    }
+
+    if (outputfd != 1)
+    {
+      dup2(outputfd, 1);
+      close(outputfd);
+    }
+
+    for (fd = 3; fd <= 4; fd ++)
+    {
+      int nullfd = open("/dev/null", O_RDWR);
+
+      if (nullfd > fd)
+      {
+	dup2(nullfd, fd);
+	close(nullfd);
+      }
+      else if (nullfd >= 0 && nullfd < fd)
+	close(nullfd);
+      fcntl(fd, F_SETFL, O_NDELAY);
+    }
+
+   /*
+    * Our thread blocks SIGTERM and the caller ignores SIGPIPE, give the
+    * filter the defaults so that it can get canceled...
+    */
+
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+
+    execvp(program, argv);
+    perror(program);
+    _exit(errno);
+  }
+
+  free(options);
+
+  if (pid < 0)
+  {
+    fprintf(stderr, "ERROR: Unable to start %s: %s\n", program,
+	    strerror(errno));
+    return (1);
+  }
+
+  fprintf(stderr, "DEBUG: %s (PID %d) started.\n", program, pid);
+
+ /*
+  * Wait for the filter.  The SIGTERM which cancels the job goes to the
+  * main thread, filterChain() there kills the filter, so it needs to know
+  * it until we have seen it exiting, before we reap it...
+  */
+
+  if ((t = pthread_getspecific(thread_key)) != NULL)
+  {
+    pthread_mutex_lock(&chain_mutex);
+    t->child = pid;
+    if (jobcanceled && *jobcanceled)
+      kill(pid, SIGTERM);
+    pthread_mutex_unlock(&chain_mutex);
+  }
+
+  while (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) < 0 && errno == EINTR);
+
+  if (t)
+  {
+    pthread_mutex_lock(&chain_mutex);
+    t->child = 0;
+    pthread_mutex_unlock(&chain_mutex);
+  }
+
+  while (waitpid(pid, &status, 0) < 0)
+    if (errno != EINTR)
+    {
+      fprintf(stderr, "ERROR: Unable to wait for %s: %s\n", program,
+	      strerror(errno));
+      return (1);
+    }
+
+  if (WIFEXITED(status))
+    return (WEXITSTATUS(status));
+  else if (WIFSIGNALED(status))
+  {
+    fprintf(stderr, "DEBUG: %s (PID %d) crashed on signal %d\n", program, pid,
+	    WTERMSIG(status));
+    return (256 * WTERMSIG(status));
+  }
+
+  return (1);
+}
+
+
+/*
+ * 'filterGziptoany()' - Uncompress gzip-compressed data.
+ *
+ * Does the same as CUPS' "gziptoany" filter: uncompressed input is passed
+ * through unchanged, and copies are only made when the output goes to a
+ * raw queue directly and the input can be read again.
+ */
+
+int					/* O - 0 on success, 1 on error */
+filterGziptoany(int           inputfd,	/* I - Input */
+		int           outputfd,	/* I - Output */
+		int           inputseekable, /* I - Input seekable? */
+		volatile sig_atomic_t *jobcanceled,
+					/* I - Set when canceled */
+		filter_data_t *data,	/* I - Job data */
+		void          *parameters) /* I - Unused */
+{
+  gzFile	gz;			/* Input */
+  const char	*final_type;		/* FINAL_CONTENT_TYPE */
+  char		*buffer;		/* Copy buffer */
+  int		copies,			/* Copies to make */
+		fd,			/* Input for zlib */
+		bytes,			/* Bytes read */
+		retval = 0;		/* Return value */
+
+
+  (void)parameters;
+
+  final_type = getenv("FINAL_CONTENT_TYPE");
+  if (inputseekable && data->copies > 1 && final_type &&
+      !strncmp(final_type, "printer/", 8))
+    copies = data->copies;
+  else
+    copies = 1;
+
+  if ((fd = dup(inputfd)) < 0 || (gz = gzdopen(fd, "r")) == NULL)
+  {
+    fputs("ERROR: Unable to open input for uncompressing\n", stderr);
+    if (fd >= 0)
+      close(fd);
+    return (1);
+  }
+
+  if ((buffer = malloc(FILTER_BUFFER_SIZE)) == NULL)
+  {
+    gzclose(gz);
+    return (1);
+  }
+
+  for (; copies > 0 && !retval; copies --)
+  {
+    while ((bytes = gzread(gz, buffer, FILTER_BUFFER_SIZE)) > 0)
+    {
+      if (jobcanceled && *jobcanceled)
+      {
+	retval = 1;
+	break;
+      }
+
+      if (write_all(outputfd, buffer, bytes))
+      {
+	fprintf(stderr, "ERROR: Unable to write uncompressed data: %s\n",
+		strerror(errno));
+	retval = 1;
+	break;
+      }
+    }
+
+    if (bytes < 0)
+    {
+      fputs("ERROR: Unable to read compressed data\n", stderr);
+      retval = 1;
+    }
+
+    if (copies > 1 && gzrewind(gz))
+      break;
+  }
+
+  free(buffer);
+  gzclose(gz);
+
+  return (retval);
+}
+
+
+/*
+ * 'filterRunCUPSChain()' - Run a chain of CUPS filters given by name.
+ *
+ * "argv" is a CUPS filter command line with the input file in argv[6].
+ * Filters which have an in-process implementation are called as
+ * functions, all others are executed; "-" entries are skipped.
+ */
+
+int					/* O - 0 on success, 1 on error */
+filterRunCUPSChain(cups_array_t *filters,	/* I - Filter names */
+		   char         **argv,		/* I - Command line */
+		   volatile sig_atomic_t *jobcanceled)
+						/* I - Set when canceled */
+{
+  filter_data_t	data;			/* Job data */
+  cups_array_t	*chain;			/* Filter functions */
+  filter_filter_in_chain_t *entry;	/* Entry in chain */
+  filter_external_cups_t *params;	/* Parameters of external filter */
+  char		*name;			/* Filter name */
+  int		i,			/* Looping var */
+		inputfd,		/* Input file */
+		retval;			/* Return value */
+
+
+  for (i = 0; argv[i]; i ++)
+    fprintf(stderr, "DEBUG: argv[%d]=\"%s\"\n", i, argv[i]);
+
+  memset(&data, 0, sizeof(data));
+  data.printer     = argv[0];
+  data.job_id      = atoi(argv[1]);
+  data.job_user    = argv[2];
+  data.job_title   = argv[3];
+  data.copies      = atoi(argv[4]);
+  data.num_options = cupsParseOptions(argv[5], 0, &data.options);
+
+  if (argv[6])
+  {
+    if ((inputfd = open(argv[6], O_RDONLY | O_CLOEXEC)) < 0)
+    {
+      fprintf(stderr, "ERROR: Unable to open \"%s\": %s\n", argv[6],
+	      strerror(errno));
+      cupsFreeOptions(data.num_options, data.options);
+      return (1);
+    }
+  }
+  else
+    inputfd = 0;
+
+  chain = cupsArrayNew(NULL, NULL);
+
+  for (name = (char *)cupsArrayFirst(filters);
+       name;
+       name = (char *)cupsArrayNext(filters))
+  {
+    if (!strcmp(name, "-"))
+      continue;
+
+    entry = calloc(1, sizeof(filter_filter_in_chain_t));
+    entry->name = name;
+
+    if (!strcmp(name, "gziptoany"))
+      entry->function = filterGziptoany;
+    else
+    {
+      params         = calloc(1, sizeof(filter_external_cups_t));
+      params->filter = name;
+      entry->function   = filterExternalCUPS;
+      entry->parameters = params;
+    }
+
+    cupsArrayAdd(chain, entry);
+  }
+
+  retval = filterChain(inputfd, 1, argv[6] != NULL, jobcanceled, &data,
+		       chain);
+
+  for (entry = (filter_filter_in_chain_t *)cupsArrayFirst(chain);
+       entry;
+       entry = (filter_filter_in_chain_t *)cupsArrayNext(chain))
+  {
+    free(entry->parameters);
+    free(entry);
+  }
+  cupsArrayDelete(chain);
+
+  if (inputfd > 0)
+    close(inputfd);
+  cupsFreeOptions(data.num_options, data.options);
+
+  return (retval);
+}
+
+
+/*
+ * 'filter_thread()' - Run one filter function of a chain.
+ */
+
+static void *				/* O - Unused */
+filter_thread(void *arg)		/* I - Filter to run */
+{
+  filter_thread_t *t = (filter_thread_t *)arg;
+					/* Filter to run */
+  sigset_t	mask;			/* Blocked signals */
+
+
+ /*
+  * Let the main thread take the SIGTERM which cancels the job...
+  */
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+  pthread_setspecific(thread_key, t);
+
+  t->status = (t->filter->function)(t->inputfd, t->outputfd,
+				    t->inputseekable, t->jobcanceled, t->data,
+				    t->filter->parameters);
+
+ /*
+  * Closing our ends of the pipes lets the neighbouring filters see the
+  * end of the data, or the error...
+  */
+
+  if (t->close_input)
+    close(t->inputfd);
+  if (t->close_output)
+    close(t->outputfd);
+
+  pthread_mutex_lock(&chain_mutex);
+  t->done = 1;
+  pthread_cond_signal(&chain_cond);
+  pthread_mutex_unlock(&chain_mutex);
+
+  return (NULL);
+}
+
+
+/*
+ * 'filter_thread_init()' - Create the key for the current filter thread.
+ */
+
+static void
+filter_thread_init(void)
+{
+  pthread_key_create(&thread_key, NULL);
+}
+
+
+/*
+ * 'open_pipe()' - Create a pipe between two filters.
+ *
+ * The pipe is closed on exec, so that external filters do not keep the
+ * pipes of other filters open, and as big as the system allows up to
+ * FILTER_PIPE_SIZE.
+ */
+
+static int				/* O - 0 on success, -1 on error */
+open_pipe(int *fds)			/* O - Pipe file descriptors (2) */
+{
+#ifdef __linux
+  if (pipe2(fds, O_CLOEXEC))
+    return (-1);
+#else
+  if (pipe(fds))
+    return (-1);
+
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#endif /* __linux */
+
+#ifdef F_SETPIPE_SZ
+  fcntl(fds[1], F_SETPIPE_SZ, FILTER_PIPE_SIZE);
+#endif /* F_SETPIPE_SZ */
+
+  return (0);
+}
+
+
+/*
+ * 'options_string()' - Make an option string like argv[5].
+ */
+
+static char *				/* O - Option string, free() it */
+options_string(int           num_options,	/* I - Number of options */
+	       cups_option_t *options)		/* I - Options */
+{
+  char		*buffer,		/* Option string */
+		*bufptr;		/* Pointer into string */
+  const char	*valptr;		/* Pointer into value */
+  size_t	bytes = 1;		/* Size of string */
+  int		i;			/* Looping var */
+
+
+  for (i = 0; i < num_options; i ++)
+    bytes += strlen(options[i].name) + 2 * strlen(options[i].value) + 4;
+
+  if ((buffer = malloc(bytes)) == NULL)
+    return (NULL);
+
+  for (i = 0, bufptr = buffer; i < num_options; i ++)
+  {
+    if (i)
+      *bufptr++ = ' ';
+
+    strcpy(bufptr, options[i].name);
+    bufptr += strlen(bufptr);
+
+    if (!options[i].value[0])
+      continue;
+
+    *bufptr++ = '=';
+
+    if (strpbrk(options[i].value, " \t\\\"'"))
+    {
+      *bufptr++ = '\"';
+      for (valptr = options[i].value; *valptr; valptr ++)
+      {
+	if (*valptr == '\\' || *valptr == '\"')
+	  *bufptr++ = '\\';
+	*bufptr++ = *valptr;
+      }
+      *bufptr++ = '\"';
+    }
+    else
+    {
+      strcpy(bufptr, options[i].value);
+      bufptr += strlen(bufptr);
+    }
+  }
+
+  *bufptr = '\0';
+
+  return (buffer);
+}
+
+
+/*
+ * 'write_all()' - Write a buffer completely.
+ */
+
+static int				/* O - 0 on success, -1 on error */
+write_all(int        fd,		/* I - File descriptor */
+	  const char *buffer,		/* I - Data */
+	  size_t     bytes)		/* I - Number of bytes */
+{
+  ssize_t	written;		/* Bytes written */
+
+
+  while (bytes > 0)
+  {
+    if ((written = write(fd, buffer, bytes)) < 0)
+    {
+      if (errno == EINTR || errno == EAGAIN)
+	continue;
+
+      return (-1);
+    }
+
+    buffer += written;
+    bytes  -= written;
+  }
+
+  return (0);
+}
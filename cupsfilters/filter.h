@@ -0,0 +1,90 @@
+/*
+ *   Filter functions support for OpenPrinting CUPS Filters.
+ *
+ *   Copyright 2026 by OpenPrinting.
+ *
+ *   Distribution and use rights are outlined in the file "COPYING"
+ *   which should have been included with this file.
+ */
+
+#ifndef _CUPS_FILTERS_FILTER_H_
+#  define _CUPS_FILTERS_FILTER_H_
+
+#  ifdef __cplusplus
+extern "C" {
+#  endif /* __cplusplus */
+
+/*
+ * Include necessary headers...
+ */
+
+#  include <signal.h>
+#  include <cups/cups.h>
+#  include <ppd/ppd.h>
+
+
+/*
+ * Types and structures...
+ */
+
+typedef struct filter_data_s {
+  char *printer;             /* Print queue name */
+  int job_id;                /* Job ID */
+  char *job_user;            /* Job user */
+  char *job_title;           /* Job title */
+  int copies;                /* Number of copies */
+  int num_options;           /* Number of job options */
+  cups_option_t *options;    /* Job options, parsed once for all filters */
+  ppd_file_t *ppd;           /* PPD file, opened once for all filters,
+				NULL if none */
+} filter_data_t;
+
+typedef int (*filter_function_t)(int inputfd, int outputfd, int inputseekable,
+				 volatile sig_atomic_t *jobcanceled,
+				 filter_data_t *data, void *parameters);
+/* "jobcanceled" gets set by the SIGTERM handler of the main program and is
+   read by all filters of a chain, in their own threads */
+
+typedef struct filter_filter_in_chain_s { /* filter entry for filterChain() */
+  filter_function_t function;   /* Filter function to be called */
+  void *parameters;             /* Parameters for this filter function call */
+  const char *name;             /* Name/comment, only for logging */
+} filter_filter_in_chain_t;
+
+typedef struct filter_external_cups_s { /* Parameters of filterExternalCUPS() */
+  const char *filter;           /* CUPS filter executable, absolute path or
+				   name in $CUPS_SERVERBIN/filter */
+} filter_external_cups_t;
+
+
+/*
+ * Prototypes...
+ */
+
+extern int filterChain(int inputfd, int outputfd, int inputseekable,
+		       volatile sig_atomic_t *jobcanceled,
+		       filter_data_t *data, void *parameters);
+/* Parameters: cups_array_t of filter_filter_in_chain_t, the filters are
+   run as threads of this process, connected by pipes */
+
+extern int filterExternalCUPS(int inputfd, int outputfd, int inputseekable,
+			      volatile sig_atomic_t *jobcanceled,
+			      filter_data_t *data, void *parameters);
+/* Parameters: filter_external_cups_t, runs a CUPS filter executable, which
+   gets killed on cancellation when run by filterChain() */
+
+extern int filterGziptoany(int inputfd, int outputfd, int inputseekable,
+			   volatile sig_atomic_t *jobcanceled,
+			   filter_data_t *data, void *parameters);
+/* Parameters: None, in-process replacement for CUPS' gziptoany */
+
+extern int filterRunCUPSChain(cups_array_t *filters, char **argv,
+			      volatile sig_atomic_t *jobcanceled);
+/* Runs a chain of CUPS filters given by name with a CUPS filter command
+   line, filters with an in-process implementation are not executed */
+
+#  ifdef __cplusplus
+}
+#  endif /* __cplusplus */
+
+#endif /* !_CUPS_FILTERS_FILTER_H_ */
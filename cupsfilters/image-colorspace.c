@@ -476,6 +476,16 @@ cupsImageLut(cups_ib_t       *pixels,	/* IO - Input/output pixels */
              int             count,	/* I  - Number of pixels/bytes to adjust */
              const cups_ib_t *lut)	/* I  - Lookup table */
 {
+  while (count > 3)
+  {
+    pixels[0] = lut[pixels[0]];
+    pixels[1] = lut[pixels[1]];
+    pixels[2] = lut[pixels[2]];
+    pixels[3] = lut[pixels[3]];
+    pixels += 4;
+    count  -= 4;
+  }
+
   while (count > 0)
   {
     *pixels = lut[*pixels];
@@ -496,10 +506,13 @@ cupsImageRGBAdjust(cups_ib_t *pixels,	/* IO - Input/output pixels */
         	   int       hue)	/* I - Color hue (degrees) */
 {
   int			i, j, k;	/* Looping vars */
+  const int		*r, *g, *b;	/* Table entries for current pixel */
   float			mat[3][3];	/* Color adjustment matrix */
   static int		last_sat = 100,	/* Last saturation used */
-			last_hue = 0;	/* Last hue used */
-  static cups_clut_t	*lut = NULL;	/* Lookup table for matrix */
+			last_hue = 0,	/* Last hue used */
+			identity = 1;	/* Is the matrix a no-op? */
+  static int		(*lut)[256][4] = NULL;
+					/* Lookup table for matrix */
 
 
   if (saturation != last_sat || hue != last_hue || !lut)
@@ -517,19 +530,28 @@ cupsImageRGBAdjust(cups_ib_t *pixels,	/* IO - Input/output pixels */
     */
 
     if (lut == NULL)
-      lut = calloc(3, sizeof(cups_clut_t));
+      lut = calloc(3, sizeof(*lut));
 
     if (lut == NULL)
       return;
 
    /*
-    * Convert the matrix into a 3x3 array of lookup tables...
+    * Convert the matrix into lookup tables, one per input component, that
+    * hold the contributions of each input value to all three outputs
+    * side by side...
     */
 
+    identity = 1;
+
     for (i = 0; i < 3; i ++)
-      for (j = 0; j < 3; j ++)
-        for (k = 0; k < 256; k ++)
-          lut[i][j][k] = mat[i][j] * k + 0.5;
+      for (k = 0; k < 256; k ++)
+        for (j = 0; j < 3; j ++)
+	{
+          lut[i][k][j] = mat[i][j] * k + 0.5;
+
+	  if (lut[i][k][j] != (i == j ? k : 0))
+	    identity = 0;
+	}
 
    /*
     * Save the saturation and hue to compare later...
@@ -540,14 +562,24 @@ cupsImageRGBAdjust(cups_ib_t *pixels,	/* IO - Input/output pixels */
   }
 
  /*
-  * Adjust each pixel in the given buffer.
+  * Nothing to do if the rounded matrix leaves every value unchanged...
+  */
+
+  if (identity)
+    return;
+
+ /*
+  * Adjust each pixel in the given buffer.  Note that the green and blue
+  * outputs use the already adjusted red (and green) values...
   */
 
   while (count > 0)
   {
-    i = lut[0][0][pixels[0]] +
-        lut[1][0][pixels[1]] +
-        lut[2][0][pixels[2]];
+    r = lut[0][pixels[0]];
+    g = lut[1][pixels[1]];
+    b = lut[2][pixels[2]];
+
+    i = r[0] + g[0] + b[0];
     if (i < 0)
       pixels[0] = 0;
     else if (i > 255)
@@ -555,9 +587,9 @@ cupsImageRGBAdjust(cups_ib_t *pixels,	/* IO - Input/output pixels */
     else
       pixels[0] = i;
 
-    i = lut[0][1][pixels[0]] +
-        lut[1][1][pixels[1]] +
-        lut[2][1][pixels[2]];
+    r = lut[0][pixels[0]];
+
+    i = r[1] + g[1] + b[1];
     if (i < 0)
       pixels[1] = 0;
     else if (i > 255)
@@ -565,9 +597,9 @@ cupsImageRGBAdjust(cups_ib_t *pixels,	/* IO - Input/output pixels */
     else
       pixels[1] = i;
 
-    i = lut[0][2][pixels[0]] +
-        lut[1][2][pixels[1]] +
-        lut[2][2][pixels[2]];
+    g = lut[1][pixels[1]];
+
+    i = r[2] + g[2] + b[2];
     if (i < 0)
       pixels[2] = 0;
     else if (i > 255)
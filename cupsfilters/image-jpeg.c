@@ -117,6 +117,17 @@ _cupsImageReadJPEG(
     img->colorspace = (primary == CUPS_IMAGE_RGB_CMYK) ? CUPS_IMAGE_RGB : primary;
   }
 
+  if (img->read_scale > 1)
+  {
+   /*
+    * Let the DCT produce a smaller image for preview jobs...
+    */
+
+    cinfo.scale_num   = 1;
+    cinfo.scale_denom = img->read_scale >= 8 ? 8 :
+                        img->read_scale >= 4 ? 4 : 2;
+  }
+
   jpeg_calc_output_dimensions(&cinfo);
 
   if (cinfo.output_width <= 0 || cinfo.output_width > CUPS_IMAGE_MAX_WIDTH ||
@@ -155,6 +166,13 @@ _cupsImageReadJPEG(
     }
   }
 
+  if (cinfo.output_width != cinfo.image_width ||
+      cinfo.output_height != cinfo.image_height)
+  {
+    img->xppi = max(1, img->xppi * cinfo.output_width / cinfo.image_width);
+    img->yppi = max(1, img->yppi * cinfo.output_height / cinfo.image_height);
+  }
+
   fprintf(stderr, "DEBUG: JPEG image %dx%dx%d, %dx%d PPI\n",
           img->xsize, img->ysize, cinfo.output_components,
 	  img->xppi, img->yppi);
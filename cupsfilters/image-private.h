@@ -99,6 +99,7 @@ struct cups_image_s			/**** Image file data ****/
 			yppi,		/* Y resolution in pixels-per-inch */
 			num_ics,	/* Number of cached tiles */
 			max_ics;	/* Maximum number of cached tiles */
+  int			read_scale;	/* Scale-down factor for decoding */
   cups_itile_t		**tiles;	/* Tiles in image */
   cups_ic_t		*first,		/* First cached tile in image */
 			*last;		/* Last cached tile in image */
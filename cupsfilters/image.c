@@ -24,6 +24,7 @@
  *   _cupsImagePutCol()       - Put a column of pixels to an image.
  *   _cupsImagePutRow()       - Put a row of pixels to an image.
  *   cupsImageSetMaxTiles()   - Set the maximum number of tiles to cache.
+ *   cupsImageSetReadScale()  - Set the scale-down factor for image decoding.
  *   flush_tile()             - Flush the least-recently-used tile in the cache.
  *   get_tile()               - Get a cached tile.
  */
@@ -35,6 +36,14 @@
 #include "image-private.h"
 
 
+/*
+ * Local globals...
+ */
+
+static int		cupsImageReadScale = 1;
+					/* Scale-down factor for decoders */
+
+
 /*
  * Local functions...
  */
@@ -349,6 +358,7 @@ cupsImageOpen(
   img->max_ics   = CUPS_TILE_MINIMUM;
   img->xppi      = 128;
   img->yppi      = 128;
+  img->read_scale = cupsImageReadScale;
 
   if (!memcmp(header, "GIF87a", 6) || !memcmp(header, "GIF89a", 6))
     status = _cupsImageReadGIF(img, fp, primary, secondary, saturation, hue,
@@ -610,6 +620,22 @@ cupsImageSetMaxTiles(
 }
 
 
+/*
+ * 'cupsImageSetReadScale()' - Set the scale-down factor for image decoding.
+ *
+ * Image formats which can decode at a reduced size cheaply (JPEG DCT
+ * scaling) produce an image up to "scale" times smaller in each direction,
+ * with the resolution reduced to match.  Other formats ignore it.  Used by
+ * preview jobs which render at a fraction of the device resolution.
+ */
+
+void
+cupsImageSetReadScale(int scale)	/* I - Scale-down factor, 1 = none */
+{
+  cupsImageReadScale = scale > 1 ? scale : 1;
+}
+
+
 /*
  * 'flush_tile()' - Flush the least-recently-used tile in the cache.
  */
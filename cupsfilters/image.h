@@ -99,6 +99,7 @@ extern void		cupsImageRGBToRGB(const cups_ib_t *in,
 extern void		cupsImageRGBToWhite(const cups_ib_t *in,
 			                    cups_ib_t *out, int count) _CUPS_API_1_2;
 extern void		cupsImageSetMaxTiles(cups_image_t *img, int max_tiles) _CUPS_API_1_2;
+extern void		cupsImageSetReadScale(int scale) _CUPS_API_1_2;
 extern void		cupsImageSetProfile(float d, float g,
 			                    float matrix[3][3]) _CUPS_API_1_2;
 extern void		cupsImageSetRasterColorSpace(cups_cspace_t cs) _CUPS_API_1_2;
@@ -15,6 +15,8 @@
  *   cupsPackHorizontal2()   - Pack 2-bit pixels horizontally...
  *   cupsPackHorizontalBit() - Pack pixels horizontally by bit...
  *   cupsPackVertical()      - Pack pixels vertically...
+ *   pack_mask16()           - Collect the non-zero bytes of a vector as bits.
+ *   pack_gather16()         - Load 16 pixels that are "step" bytes apart.
  */
 
 /*
@@ -22,6 +24,84 @@
  */
 
 #include "driver.h"
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif /* __SSE2__ */
+
+
+#ifdef __SSE2__
+/*
+ * Local functions...
+ */
+
+static unsigned	pack_mask16(__m128i v);
+static __m128i	pack_gather16(const unsigned char *ipixels, int step);
+
+
+/*
+ * 'pack_mask16()' - Collect the non-zero bytes of a vector as bits.
+ *
+ * The returned value holds two output bytes, pixel 0 in bit 7 of the low
+ * byte and pixel 8 in bit 7 of the high byte, matching the bit order of
+ * the packed output.
+ */
+
+static unsigned				/* O - Bits for non-zero pixels */
+pack_mask16(__m128i v)			/* I - 16 pixels */
+{
+ /*
+  * Reverse the order of the pixels within each group of 8 so that
+  * _mm_movemask_epi8() puts the first pixel into the most significant
+  * bit, then flag the non-zero pixels...
+  */
+
+  v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+  v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+  v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+
+  return (~_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) &
+          0xffff);
+}
+
+
+/*
+ * 'pack_gather16()' - Load 16 pixels that are "step" bytes apart.
+ *
+ * Steps of 1, 2 and 4 (microweave and the common softweave column steps)
+ * are gathered with loads and packs; the caller must make sure that the
+ * pixel following the 16th one is still inside the buffer.
+ */
+
+static __m128i				/* O - 16 pixels */
+pack_gather16(const unsigned char *ipixels,	/* I - Input pixels */
+              int                 step)		/* I - Step value between pixels */
+{
+  const __m128i	*p = (const __m128i *)ipixels;
+					/* Input vectors */
+  __m128i	lo, hi;			/* Even/odd halves */
+
+
+  switch (step)
+  {
+    case 1 :
+        return (_mm_loadu_si128(p));
+
+    case 2 :
+        lo = _mm_and_si128(_mm_loadu_si128(p), _mm_set1_epi16(0x00ff));
+        hi = _mm_and_si128(_mm_loadu_si128(p + 1), _mm_set1_epi16(0x00ff));
+	return (_mm_packus_epi16(lo, hi));
+
+    default : /* 4 */
+        lo = _mm_packs_epi32(
+	         _mm_and_si128(_mm_loadu_si128(p), _mm_set1_epi32(0xff)),
+	         _mm_and_si128(_mm_loadu_si128(p + 1), _mm_set1_epi32(0xff)));
+        hi = _mm_packs_epi32(
+	         _mm_and_si128(_mm_loadu_si128(p + 2), _mm_set1_epi32(0xff)),
+	         _mm_and_si128(_mm_loadu_si128(p + 3), _mm_set1_epi32(0xff)));
+	return (_mm_packus_epi16(lo, hi));
+  }
+}
+#endif /* __SSE2__ */
 
 
 /*
@@ -36,6 +116,29 @@ cupsPackHorizontal(const unsigned char *ipixels,/* I - Input pixels */
 		   const int           step)	/* I - Step value between pixels */
 {
   register unsigned char	b;		/* Current byte */
+#ifdef __SSE2__
+  unsigned		bits;		/* Packed bits for 16 pixels */
+
+
+ /*
+  * Do 16 pixels at a time for the steps we can gather cheaply; a step
+  * other than 1 reads up to the next pixel, so keep one pixel in reserve...
+  */
+
+  if (step == 1 || step == 2 || step == 4)
+  {
+    while (width > 16 || (step == 1 && width == 16))
+    {
+      bits = pack_mask16(pack_gather16(ipixels, step));
+
+      *obytes++ = clearto ^ (unsigned char)bits;
+      *obytes++ = clearto ^ (unsigned char)(bits >> 8);
+
+      ipixels += 16 * step;
+      width   -= 16;
+    }
+  }
+#endif /* __SSE2__ */
 
 
  /*
@@ -122,6 +225,47 @@ cupsPackHorizontal2(const unsigned char *ipixels,	/* I - Input pixels */
 		    const int           step)		/* I - Stepping value */
 {
   register unsigned char	b;			/* Current byte */
+#ifdef __SSE2__
+  const __m128i		*p;			/* Input vectors */
+  __m128i		v[4];			/* Packed pixels */
+  int			i;			/* Looping var */
+
+
+ /*
+  * Do 64 pixels at a time for contiguous pixels, combining neighbouring
+  * pixels in 16-bit and then 32-bit lanes before packing down to bytes...
+  */
+
+  if (step == 1)
+  {
+    while (width > 63)
+    {
+      p = (const __m128i *)ipixels;
+
+      for (i = 0; i < 4; i ++)
+      {
+        v[i] = _mm_loadu_si128(p + i);
+	v[i] = _mm_or_si128(
+	           _mm_slli_epi16(_mm_and_si128(v[i], _mm_set1_epi16(0x00ff)),
+		                  2),
+		   _mm_srli_epi16(v[i], 8));
+	v[i] = _mm_or_si128(
+	           _mm_slli_epi32(_mm_and_si128(v[i], _mm_set1_epi32(0xffff)),
+		                  4),
+		   _mm_srli_epi32(v[i], 16));
+	v[i] = _mm_and_si128(v[i], _mm_set1_epi32(0xff));
+      }
+
+      _mm_storeu_si128((__m128i *)obytes,
+                       _mm_packus_epi16(_mm_packs_epi32(v[0], v[1]),
+		                        _mm_packs_epi32(v[2], v[3])));
+
+      ipixels += 64;
+      obytes  += 16;
+      width   -= 64;
+    }
+  }
+#endif /* __SSE2__ */
 
 
  /*
@@ -176,6 +320,28 @@ cupsPackHorizontalBit(const unsigned char *ipixels,	/* I - Input pixels */
 		      const unsigned char bit)		/* I - Bit to check */
 {
   register unsigned char	b;			/* Current byte */
+#ifdef __SSE2__
+  __m128i		mask = _mm_set1_epi8((char)bit);
+					/* Bit to check in every pixel */
+  unsigned		bits;		/* Packed bits for 16 pixels */
+
+
+ /*
+  * Do 16 pixels at a time...
+  */
+
+  while (width > 15)
+  {
+    bits = pack_mask16(_mm_and_si128(_mm_loadu_si128((const __m128i *)ipixels),
+                                     mask));
+
+    *obytes++ = clearto ^ (unsigned char)bits;
+    *obytes++ = clearto ^ (unsigned char)(bits >> 8);
+
+    ipixels += 16;
+    width   -= 16;
+  }
+#endif /* __SSE2__ */
 
 
  /*
@@ -254,6 +420,30 @@ cupsPackVertical(const unsigned char *ipixels,	/* I - Input pixels */
                  const unsigned char bit,	/* I - Output bit */
                  const int           step)	/* I - Number of bytes between columns */
 {
+#ifdef __SSE2__
+  unsigned	bits;			/* Non-zero pixels */
+
+
+ /*
+  * Scan 16 pixels at a time and only touch the output columns of the
+  * non-zero pixels, so blank runs cost a single compare...
+  */
+
+  while (width > 15)
+  {
+    bits = ~_mm_movemask_epi8(_mm_cmpeq_epi8(
+                                  _mm_loadu_si128((const __m128i *)ipixels),
+				  _mm_setzero_si128())) & 0xffff;
+
+    for (; bits; bits &= bits - 1)
+      obytes[__builtin_ctz(bits) * step] ^= bit;
+
+    ipixels += 16;
+    obytes  += 16 * step;
+    width   -= 16;
+  }
+#endif /* __SSE2__ */
+
  /*
   * Loop through the entire array...
   */
@@ -8,8 +8,10 @@
  *
  * Contents:
  *
- *   cupsRasterParseIPPOptions() - Parse IPP options from the command line
- *                                 and apply them to the CUPS Raster header.
+ *   cupsRasterParseIPPOptions()   - Parse IPP options from the command line
+ *                                   and apply them to the CUPS Raster header.
+ *   cupsRasterPreviewResolution() - Reduce the resolution of the CUPS Raster
+ *                                   header for preview jobs.
  */
 
 #include <config.h>
@@ -1127,6 +1129,90 @@ cupsRasterParseIPPOptions(cups_page_header2_t *h, /* I - Raster header */
 }
 
 
+/*
+ * 'cupsRasterPreviewResolution()' - Reduce the resolution of the CUPS Raster
+ *                                   header for preview jobs.
+ *
+ * If the "preview-resolution" option (value like "150", "150x75dpi" or
+ * "60dpcm") asks for less than the header's HWResolution, divide the
+ * resolution by the smallest integer factor which brings both axes down
+ * to the requested value and update cupsWidth, cupsHeight, and
+ * cupsBytesPerLine to match.  Raster filters call this after they have
+ * set up the header so that they can render, decode, or sample at the
+ * lower resolution.
+ */
+
+int                                            /* O - Reduction factor, 1 if
+						      unchanged */
+cupsRasterPreviewResolution(cups_page_header2_t *h, /* I - Raster header */
+			    int num_options,        /* I - Number of options */
+			    cups_option_t *options) /* I - Options */
+{
+  int		xres,			/* Requested X resolution */
+		yres,			/* Requested Y resolution */
+		factor,			/* Reduction factor */
+		yfactor;		/* Reduction factor for Y */
+  const char	*val;			/* Option value */
+  char		*ptr;			/* Pointer into value */
+
+
+  if (!h || h->HWResolution[0] == 0 || h->HWResolution[1] == 0)
+    return (1);
+
+  if ((val = cupsGetOption("preview-resolution", num_options,
+			   options)) == NULL &&
+      (val = cupsGetOption("PreviewResolution", num_options,
+			   options)) == NULL)
+    return (1);
+
+  xres = yres = strtol(val, &ptr, 10);
+  if (ptr > val && xres > 0 && *ptr == 'x')
+    yres = strtol(ptr + 1, &ptr, 10);
+
+  if (ptr <= val || xres <= 0 || yres <= 0 ||
+      (*ptr != '\0' &&
+       strcasecmp(ptr, "dpi") &&
+       strcasecmp(ptr, "dpc") &&
+       strcasecmp(ptr, "dpcm")))
+  {
+    fprintf(stderr, "DEBUG: Bad preview-resolution value \"%s\".\n", val);
+    return (1);
+  }
+
+  if (!strcasecmp(ptr, "dpc") || !strcasecmp(ptr, "dpcm"))
+  {
+    xres = xres * 254 / 100;
+    yres = yres * 254 / 100;
+    if (xres <= 0)
+      xres = 1;
+    if (yres <= 0)
+      yres = 1;
+  }
+
+  factor  = (h->HWResolution[0] + xres - 1) / xres;
+  yfactor = (h->HWResolution[1] + yres - 1) / yres;
+  if (yfactor > factor)
+    factor = yfactor;
+
+  if (factor <= 1)
+    return (1);
+
+  fprintf(stderr, "DEBUG: Preview mode, reducing resolution %dx%d by %d\n",
+	  h->HWResolution[0], h->HWResolution[1], factor);
+
+  h->HWResolution[0] = (h->HWResolution[0] + factor - 1) / factor;
+  h->HWResolution[1] = (h->HWResolution[1] + factor - 1) / factor;
+
+  h->cupsWidth  = h->HWResolution[0] * h->PageSize[0] / 72;
+  h->cupsHeight = h->HWResolution[1] * h->PageSize[1] / 72;
+  h->cupsBytesPerLine = (h->cupsBitsPerPixel * h->cupsWidth + 7) / 8;
+  if (h->cupsColorOrder == CUPS_ORDER_BANDED)
+    h->cupsBytesPerLine *= h->cupsNumColors;
+
+  return (factor);
+}
+
+
 /*
  * End
  */
@@ -33,6 +33,15 @@ extern "C" {
 #  include <cups/cups.h>
 #  include <cups/raster.h>
 
+/*
+ * Types...
+ */
+
+typedef struct cups_raster_shm_s cups_raster_shm_t;
+					/* Raster stream between filters,
+					   see cupsRasterShmOpen() */
+
+
 /*
  * Prototypes...
  */
@@ -42,6 +51,23 @@ extern int              cupsRasterParseIPPOptions(cups_page_header2_t *h,
 						  cups_option_t *options,
 						  int pwg_raster,
 						  int set_defaults);
+extern int              cupsRasterPreviewResolution(cups_page_header2_t *h,
+						    int num_options,
+						    cups_option_t *options);
+extern void		cupsRasterShmClose(cups_raster_shm_t *r);
+extern cups_raster_shm_t *cupsRasterShmOpen(int fd, cups_mode_t mode,
+					    int num_options,
+					    cups_option_t *options);
+extern unsigned		cupsRasterShmReadHeader(cups_raster_shm_t *r,
+						cups_page_header2_t *h);
+extern unsigned		cupsRasterShmReadPixels(cups_raster_shm_t *r,
+						unsigned char *p,
+						unsigned len);
+extern unsigned		cupsRasterShmWriteHeader(cups_raster_shm_t *r,
+						 cups_page_header2_t *h);
+extern unsigned		cupsRasterShmWritePixels(cups_raster_shm_t *r,
+						 unsigned char *p,
+						 unsigned len);
 
 #  ifdef __cplusplus
 }
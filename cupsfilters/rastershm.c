@@ -0,0 +1,1071 @@
+/*
+ *   Shared-memory raster transport for OpenPrinting CUPS Filters.
+ *
+ *   A raster producer and a raster consumer connected by a pipe find each
+ *   other through an abstract UNIX socket named after the pipe (both ends
+ *   of a pipe share the same inode).  The consumer listens on it while it
+ *   waits for the first bytes of the stream.  If the producer was asked to
+ *   use shared memory and gets connected, it passes a memfd with a ring of
+ *   band slots over the socket and writes a magic word followed by small
+ *   records to the pipe: page headers inline and bands as slot numbers.
+ *   The consumer maps the ring and returns each slot over the socket when
+ *   it is done with it.  In all other cases the normal CUPS Raster stream
+ *   is used, which the consumer recognizes by its sync word.
+ *
+ *   Copyright 2026 by OpenPrinting.
+ *
+ *   Distribution and use rights are outlined in the file "COPYING"
+ *   which should have been included with this file.
+ *
+ * Contents:
+ *
+ *   cupsRasterShmClose()       - Close a raster stream.
+ *   cupsRasterShmOpen()        - Open a raster stream, using shared memory
+ *                                when both sides support it.
+ *   cupsRasterShmReadHeader()  - Read a page header.
+ *   cupsRasterShmReadPixels()  - Read pixel data.
+ *   cupsRasterShmWriteHeader() - Write a page header.
+ *   cupsRasterShmWritePixels() - Write pixel data.
+ *   shm_accept()               - Accept the producer and map its ring.
+ *   shm_buffer_cb()            - Raster stream callback for a header
+ *                                buffer.
+ *   shm_connect()              - Connect to the consumer and share a ring.
+ *   shm_flush()                - Pass the current band to the consumer.
+ *   shm_header_decode()        - Read a page header the CUPS way.
+ *   shm_header_encode()        - Write a page header the CUPS way.
+ *   shm_listen()               - Offer shared memory to the producer.
+ *   shm_read()                 - Read a buffer completely.
+ *   shm_read_cb()              - Read callback for the raster stream.
+ *   shm_record()               - Read the next record from the producer.
+ *   shm_release()              - Return the current band to the producer.
+ *   shm_socket_name()          - Make the rendezvous socket name of a pipe.
+ *   shm_write()                - Write a buffer completely.
+ */
+
+/*
+ * Include necessary headers...
+ */
+
+#include <config.h>
+#include "raster.h"
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+
+#if defined(__linux) && defined(MFD_CLOEXEC) && defined(SO_PEERCRED)
+#  define HAVE_RASTER_SHM 1
+#endif /* __linux && MFD_CLOEXEC && SO_PEERCRED */
+
+
+/*
+ * Constants...
+ */
+
+#define SHM_MAGIC	"CFsm"		/* Replaces the CUPS Raster sync word */
+#define SHM_SLOTS	4		/* Number of band slots in the ring */
+#define SHM_SLOT_SIZE	(4 * 1024 * 1024)
+					/* Bytes per band slot */
+#define SHM_TIMEOUT	5000		/* Milliseconds to wait for the peer */
+#define SHM_HEADER_MAX	2048		/* Maximum bytes of an encoded header */
+
+#define SHM_HEADER	1		/* Record: encoded page header follows */
+#define SHM_BAND	2		/* Record: band in ring slot */
+#define SHM_END		3		/* Record: end of stream */
+
+
+/*
+ * Types...
+ */
+
+typedef struct shm_record_s		/* Record on the pipe */
+{
+  unsigned	type,			/* SHM_HEADER, SHM_BAND or SHM_END */
+		slot,			/* Ring slot of band */
+		bytes;			/* Bytes in band or encoded header */
+} shm_record_t;
+
+typedef struct shm_buffer_s		/* Encoded page header */
+{
+  unsigned char	data[SHM_HEADER_MAX];	/* Raster stream bytes */
+  size_t	used,			/* Bytes in data */
+		pos;			/* Bytes of data read */
+} shm_buffer_t;
+
+typedef struct shm_ring_s		/* Ring description sent with memfd */
+{
+  unsigned	slots,			/* Number of slots */
+		slot_size;		/* Bytes per slot */
+} shm_ring_t;
+
+struct cups_raster_shm_s		/* Raster stream */
+{
+  cups_mode_t		mode;		/* Read/write mode */
+  int			fd;		/* Pipe or file */
+  cups_raster_t		*ras;		/* Raster stream, NULL for shared memory */
+  int			use_shm,	/* Producer: try shared memory */
+			sock;		/* Socket to the peer, -1 if none */
+  unsigned char		*ring;		/* Mapped ring of band slots */
+  unsigned		slots,		/* Number of slots */
+			slot_size,	/* Bytes per slot */
+			next_slot,	/* Producer: next slot to fill */
+			busy,		/* Producer: slots not returned yet */
+			slot,		/* Slot of current band */
+			band_bytes,	/* Bytes in current band */
+			band_used;	/* Bytes of current band filled/read */
+  size_t		page_bytes;	/* Producer: bytes left in page */
+  int			have_header;	/* Consumer: header read ahead */
+  cups_page_header2_t	header;		/* Consumer: header read ahead */
+  unsigned char		peek[4];	/* Consumer: sync word read ahead */
+  size_t		peek_len,	/* Bytes in peek */
+			peek_pos;	/* Bytes of peek returned */
+};
+
+
+/*
+ * Local functions...
+ */
+
+static ssize_t	shm_read(int fd, void *buffer, size_t bytes);
+static ssize_t	shm_read_cb(void *ctx, unsigned char *buffer, size_t bytes);
+#ifdef HAVE_RASTER_SHM
+static int	shm_accept(cups_raster_shm_t *r, int lsock);
+static ssize_t	shm_buffer_cb(void *ctx, unsigned char *buffer, size_t bytes);
+static int	shm_connect(cups_raster_shm_t *r);
+static int	shm_flush(cups_raster_shm_t *r);
+static int	shm_header_decode(shm_buffer_t *b, cups_page_header2_t *h);
+static int	shm_header_encode(cups_mode_t mode, cups_page_header2_t *h,
+		                  shm_buffer_t *b);
+static int	shm_listen(int fd);
+static int	shm_record(cups_raster_shm_t *r, shm_record_t *rec);
+static void	shm_release(cups_raster_shm_t *r);
+static int	shm_socket_name(int fd, struct sockaddr_un *addr,
+		                socklen_t *addrlen);
+static ssize_t	shm_write(int fd, const void *buffer, size_t bytes);
+#endif /* HAVE_RASTER_SHM */
+
+
+/*
+ * 'cupsRasterShmClose()' - Close a raster stream.
+ *
+ * The file descriptor itself is not closed, like with cupsRasterClose().
+ */
+
+void
+cupsRasterShmClose(cups_raster_shm_t *r)/* I - Stream to close */
+{
+  if (!r)
+    return;
+
+#ifdef HAVE_RASTER_SHM
+  if (r->ring)
+  {
+    if (r->mode == CUPS_RASTER_READ)
+      shm_release(r);
+    else
+    {
+      shm_record_t	rec;		/* End record */
+
+      shm_flush(r);
+
+      memset(&rec, 0, sizeof(rec));
+      rec.type = SHM_END;
+      shm_write(r->fd, &rec, sizeof(rec));
+    }
+
+    munmap(r->ring, (size_t)r->slots * r->slot_size);
+  }
+#endif /* HAVE_RASTER_SHM */
+
+ /*
+  * A producer which never wrote a page still writes an empty stream...
+  */
+
+  if (r->use_shm && !r->ring && !r->ras)
+    r->ras = cupsRasterOpen(r->fd, r->mode);
+
+  if (r->ras)
+    cupsRasterClose(r->ras);
+
+  if (r->sock >= 0)
+    close(r->sock);
+
+  free(r);
+}
+
+
+/*
+ * 'cupsRasterShmOpen()' - Open a raster stream, using shared memory when
+ *                         both sides support it.
+ *
+ * Shared memory is only used when the "raster-transport" option is "shm".
+ * Then a producer uses it if its output is a pipe and the filter reading
+ * the pipe opened it with this function.  The decision is made when the
+ * first page header is written, to give the consumer time to start.  A
+ * consumer accepts both kinds of streams, but only offers shared memory
+ * with the option set.
+ *
+ * gstoraster does not use this, its raster is written by the "cups"
+ * output device of Ghostscript, so the filter after it always gets the
+ * raster stream.
+ */
+
+cups_raster_shm_t *			/* O - New stream or NULL on error */
+cupsRasterShmOpen(int           fd,	/* I - File descriptor */
+                  cups_mode_t   mode,	/* I - CUPS_RASTER_READ or a write mode */
+		  int           num_options,
+					/* I - Number of job options */
+		  cups_option_t *options)/* I - Job options */
+{
+  cups_raster_shm_t	*r;		/* New stream */
+  const char		*val;		/* Option value */
+  ssize_t		bytes;		/* Bytes read */
+  int			lsock = -1;	/* Listening socket */
+
+
+  if ((r = calloc(1, sizeof(cups_raster_shm_t))) == NULL)
+    return (NULL);
+
+  r->mode = mode;
+  r->fd   = fd;
+  r->sock = -1;
+
+  if (mode != CUPS_RASTER_READ)
+  {
+#ifdef HAVE_RASTER_SHM
+    struct stat	fileinfo;		/* Output file information */
+
+    if ((val = cupsGetOption("raster-transport", num_options,
+                             options)) != NULL &&
+        !strcasecmp(val, "shm") &&
+	!fstat(fd, &fileinfo) && S_ISFIFO(fileinfo.st_mode))
+    {
+      r->use_shm = 1;
+      return (r);
+    }
+#endif /* HAVE_RASTER_SHM */
+
+    if ((r->ras = cupsRasterOpen(fd, mode)) == NULL)
+    {
+      free(r);
+      return (NULL);
+    }
+
+    return (r);
+  }
+
+ /*
+  * Offer shared memory if it is asked for, then look at how the stream
+  * starts...
+  */
+
+#ifdef HAVE_RASTER_SHM
+  if ((val = cupsGetOption("raster-transport", num_options,
+                           options)) != NULL && !strcasecmp(val, "shm"))
+    lsock = shm_listen(fd);
+#else
+  (void)val;
+  (void)num_options;
+  (void)options;
+#endif /* HAVE_RASTER_SHM */
+
+  if ((bytes = shm_read(fd, r->peek, sizeof(r->peek))) > 0)
+    r->peek_len = (size_t)bytes;
+
+#ifdef HAVE_RASTER_SHM
+  if (r->peek_len == 4 && !memcmp(r->peek, SHM_MAGIC, 4))
+  {
+    if (lsock < 0 || shm_accept(r, lsock))
+    {
+      fputs("ERROR: Unable to map shared-memory raster data.\n", stderr);
+
+      if (lsock >= 0)
+        close(lsock);
+
+      cupsRasterShmClose(r);
+      return (NULL);
+    }
+
+    close(lsock);
+    fputs("DEBUG: Reading raster data through shared memory.\n", stderr);
+    return (r);
+  }
+#endif /* HAVE_RASTER_SHM */
+
+  if (lsock >= 0)
+    close(lsock);
+
+  if ((r->ras = cupsRasterOpenIO(shm_read_cb, r, CUPS_RASTER_READ)) == NULL)
+  {
+    free(r);
+    return (NULL);
+  }
+
+  return (r);
+}
+
+
+/*
+ * 'cupsRasterShmReadHeader()' - Read a page header.
+ *
+ * Bands of the previous page which were not read are skipped.
+ */
+
+unsigned				/* O - 1 on success, 0 on EOF/error */
+cupsRasterShmReadHeader(
+    cups_raster_shm_t   *r,		/* I - Stream to read from */
+    cups_page_header2_t *h)		/* O - Page header */
+{
+  if (!r)
+    return (0);
+
+  if (r->ras)
+    return (cupsRasterReadHeader2(r->ras, h));
+
+#ifdef HAVE_RASTER_SHM
+  {
+    shm_record_t	rec;		/* Record from the producer */
+
+    shm_release(r);
+
+    while (!r->have_header)
+    {
+      if (shm_record(r, &rec) || rec.type == SHM_END)
+	return (0);
+
+      if (rec.type == SHM_BAND)
+        shm_release(r);
+    }
+
+    r->have_header = 0;
+    memcpy(h, &r->header, sizeof(cups_page_header2_t));
+
+    return (1);
+  }
+#else
+  return (0);
+#endif /* HAVE_RASTER_SHM */
+}
+
+
+/*
+ * 'cupsRasterShmReadPixels()' - Read pixel data.
+ *
+ * The data is copied straight out of the mapped band slot.
+ */
+
+unsigned				/* O - Bytes read, 0 on EOF/error */
+cupsRasterShmReadPixels(
+    cups_raster_shm_t *r,		/* I - Stream to read from */
+    unsigned char     *p,		/* O - Pixel buffer */
+    unsigned          len)		/* I - Bytes to read */
+{
+  if (!r)
+    return (0);
+
+  if (r->ras)
+    return (cupsRasterReadPixels(r->ras, p, len));
+
+#ifdef HAVE_RASTER_SHM
+  {
+    shm_record_t	rec;		/* Record from the producer */
+    unsigned		done,		/* Bytes copied */
+			count;		/* Bytes to copy from this band */
+
+
+    for (done = 0; done < len; done += count, r->band_used += count)
+    {
+      while (r->band_used >= r->band_bytes)
+      {
+	shm_release(r);
+
+	if (r->have_header || shm_record(r, &rec) || rec.type != SHM_BAND)
+	  return (0);
+      }
+
+      if ((count = r->band_bytes - r->band_used) > len - done)
+        count = len - done;
+
+      memcpy(p + done, r->ring + (size_t)r->slot * r->slot_size +
+                       r->band_used, count);
+    }
+
+    return (len);
+  }
+#else
+  (void)p;
+  (void)len;
+
+  return (0);
+#endif /* HAVE_RASTER_SHM */
+}
+
+
+/*
+ * 'cupsRasterShmWriteHeader()' - Write a page header.
+ */
+
+unsigned				/* O - 1 on success, 0 on error */
+cupsRasterShmWriteHeader(
+    cups_raster_shm_t   *r,		/* I - Stream to write to */
+    cups_page_header2_t *h)		/* I - Page header */
+{
+  if (!r)
+    return (0);
+
+#ifdef HAVE_RASTER_SHM
+  if (r->use_shm && !r->ring && !r->ras)
+  {
+    if (shm_connect(r))
+    {
+      fputs("DEBUG: Shared-memory raster transport not available, using "
+            "the raster stream.\n", stderr);
+
+      if ((r->ras = cupsRasterOpen(r->fd, r->mode)) == NULL)
+        return (0);
+    }
+    else
+      fputs("DEBUG: Writing raster data through shared memory.\n", stderr);
+  }
+
+  if (r->ring)
+  {
+    shm_record_t	rec;		/* Header record */
+    shm_buffer_t	b;		/* Encoded header */
+
+    if (shm_flush(r) || shm_header_encode(r->mode, h, &b))
+      return (0);
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type  = SHM_HEADER;
+    rec.bytes = (unsigned)b.used;
+
+    if (shm_write(r->fd, &rec, sizeof(rec)) < 0 ||
+        shm_write(r->fd, b.data, b.used) < 0)
+      return (0);
+
+    r->page_bytes = (size_t)h->cupsBytesPerLine * h->cupsHeight;
+
+    return (1);
+  }
+#endif /* HAVE_RASTER_SHM */
+
+  return (cupsRasterWriteHeader2(r->ras, h));
+}
+
+
+/*
+ * 'cupsRasterShmWritePixels()' - Write pixel data.
+ *
+ * Bands are passed to the consumer when a slot is full or the page is
+ * complete.
+ */
+
+unsigned				/* O - Bytes written, 0 on error */
+cupsRasterShmWritePixels(
+    cups_raster_shm_t *r,		/* I - Stream to write to */
+    unsigned char     *p,		/* I - Pixel data */
+    unsigned          len)		/* I - Bytes to write */
+{
+  if (!r)
+    return (0);
+
+#ifdef HAVE_RASTER_SHM
+  if (r->ring)
+  {
+    unsigned	done,			/* Bytes copied */
+		count;			/* Bytes to copy into this band */
+
+    for (done = 0; done < len; done += count)
+    {
+      if (r->band_used >= r->slot_size && shm_flush(r))
+        return (0);
+
+      if ((count = r->slot_size - r->band_used) > len - done)
+        count = len - done;
+
+      memcpy(r->ring + (size_t)r->next_slot * r->slot_size + r->band_used,
+             p + done, count);
+      r->band_used += count;
+
+      if (r->page_bytes > count)
+        r->page_bytes -= count;
+      else
+        r->page_bytes = 0;
+
+      if (!r->page_bytes && shm_flush(r))
+        return (0);
+    }
+
+    return (len);
+  }
+#endif /* HAVE_RASTER_SHM */
+
+  if (!r->ras)
+    return (0);
+
+  return (cupsRasterWritePixels(r->ras, p, len));
+}
+
+
+#ifdef HAVE_RASTER_SHM
+/*
+ * 'shm_accept()' - Accept the producer and map its ring.
+ */
+
+static int				/* O - 0 on success, -1 on error */
+shm_accept(cups_raster_shm_t *r,	/* I - Stream */
+           int               lsock)	/* I - Listening socket */
+{
+  struct pollfd		pfd;		/* Listening socket */
+  struct ucred		cred;		/* Credentials of the producer */
+  socklen_t		credlen = sizeof(cred);
+					/* Size of credentials */
+  shm_ring_t		ring;		/* Ring description */
+  struct iovec		iov;		/* Ring description buffer */
+  struct msghdr		msg;		/* Message with the memfd */
+  struct cmsghdr	*cmsg;		/* Control message */
+  char			control[CMSG_SPACE(sizeof(int))];
+					/* Control message buffer */
+  int			memfd = -1;	/* Ring file */
+
+
+  pfd.fd     = lsock;
+  pfd.events = POLLIN;
+
+  if (poll(&pfd, 1, SHM_TIMEOUT) <= 0 ||
+      (r->sock = accept4(lsock, NULL, NULL, SOCK_CLOEXEC)) < 0)
+    return (-1);
+
+  if (getsockopt(r->sock, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) ||
+      cred.uid != geteuid())
+    return (-1);
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base       = &ring;
+  iov.iov_len        = sizeof(ring);
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control;
+  msg.msg_controllen = sizeof(control);
+
+  if (recvmsg(r->sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(ring))
+    return (-1);
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+
+  if (memfd < 0)
+    return (-1);
+
+  if (ring.slots > 0 && ring.slots <= 256 && ring.slot_size > 0)
+  {
+    r->ring = mmap(NULL, (size_t)ring.slots * ring.slot_size, PROT_READ,
+                   MAP_SHARED, memfd, 0);
+    if (r->ring == MAP_FAILED)
+      r->ring = NULL;
+  }
+
+  close(memfd);
+
+  if (!r->ring)
+    return (-1);
+
+  r->slots     = ring.slots;
+  r->slot_size = ring.slot_size;
+
+  return (0);
+}
+
+
+/*
+ * 'shm_buffer_cb()' - Raster stream callback for a header buffer.
+ */
+
+static ssize_t				/* O - Bytes read/written, -1 on error */
+shm_buffer_cb(void          *ctx,	/* I - Buffer */
+              unsigned char *buffer,	/* I/O - Data */
+	      size_t        bytes)	/* I - Bytes to read/write */
+{
+  shm_buffer_t	*b = (shm_buffer_t *)ctx;
+					/* Buffer */
+
+
+  if (b->pos < b->used)
+  {
+    if (bytes > b->used - b->pos)
+      bytes = b->used - b->pos;
+
+    memcpy(buffer, b->data + b->pos, bytes);
+    b->pos += bytes;
+  }
+  else if (b->pos == 0 && bytes <= sizeof(b->data) - b->used)
+  {
+    memcpy(b->data + b->used, buffer, bytes);
+    b->used += bytes;
+  }
+  else
+    return (b->pos ? 0 : -1);
+
+  return ((ssize_t)bytes);
+}
+
+
+/*
+ * 'shm_connect()' - Connect to the consumer and share a ring.
+ *
+ * On success the magic word which starts the stream is written.
+ */
+
+static int				/* O - 0 on success, -1 on error */
+shm_connect(cups_raster_shm_t *r)	/* I - Stream */
+{
+  struct sockaddr_un	addr;		/* Rendezvous address */
+  socklen_t		addrlen;	/* Length of address */
+  struct ucred		cred;		/* Credentials of the consumer */
+  socklen_t		credlen = sizeof(cred);
+					/* Size of credentials */
+  shm_ring_t		ring;		/* Ring description */
+  struct iovec		iov;		/* Ring description buffer */
+  struct msghdr		msg;		/* Message with the memfd */
+  struct cmsghdr	*cmsg;		/* Control message */
+  char			control[CMSG_SPACE(sizeof(int))];
+					/* Control message buffer */
+  size_t		size = 0;	/* Size of ring */
+  int			memfd,		/* Ring file */
+			tries;		/* Connection attempts */
+
+
+  if (shm_socket_name(r->fd, &addr, &addrlen) ||
+      (r->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+    return (-1);
+
+ /*
+  * The consumer is started right after us, give it a moment...
+  */
+
+  for (tries = 0; connect(r->sock, (struct sockaddr *)&addr, addrlen); tries ++)
+  {
+    if (tries >= 10 || (errno != ECONNREFUSED && errno != ENOENT))
+      goto error;
+
+    usleep(10000);
+  }
+
+  if (getsockopt(r->sock, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) ||
+      cred.uid != geteuid())
+    goto error;
+
+  ring.slots     = SHM_SLOTS;
+  ring.slot_size = SHM_SLOT_SIZE;
+  size           = (size_t)ring.slots * ring.slot_size;
+
+  if ((memfd = memfd_create("cups-raster", MFD_CLOEXEC)) < 0)
+    goto error;
+
+  if (ftruncate(memfd, (off_t)size) ||
+      (r->ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd,
+                      0)) == MAP_FAILED)
+  {
+    r->ring = NULL;
+    close(memfd);
+    goto error;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  iov.iov_base       = &ring;
+  iov.iov_len        = sizeof(ring);
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control;
+  msg.msg_controllen = sizeof(control);
+
+  cmsg             = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type  = SCM_RIGHTS;
+  cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+  if (sendmsg(r->sock, &msg, MSG_NOSIGNAL) != sizeof(ring))
+  {
+    close(memfd);
+    goto error;
+  }
+
+  close(memfd);
+
+  r->slots     = ring.slots;
+  r->slot_size = ring.slot_size;
+
+  if (shm_write(r->fd, SHM_MAGIC, 4) < 0)
+  {
+    munmap(r->ring, size);
+    r->ring = NULL;
+    return (-1);
+  }
+
+  return (0);
+
+ /*
+  * Nothing has been written to the pipe yet, so the caller can still use
+  * the raster stream...
+  */
+
+  error:
+
+  if (r->ring)
+  {
+    munmap(r->ring, size);
+    r->ring = NULL;
+  }
+
+  close(r->sock);
+  r->sock = -1;
+
+  return (-1);
+}
+
+
+/*
+ * 'shm_flush()' - Pass the current band to the consumer.
+ *
+ * Waits for the consumer to return a slot if all of them are in use.
+ */
+
+static int				/* O - 0 on success, -1 on error */
+shm_flush(cups_raster_shm_t *r)		/* I - Stream */
+{
+  shm_record_t	rec;			/* Band record */
+  unsigned	slot;			/* Slot returned by the consumer */
+
+
+  if (!r->band_used)
+    return (0);
+
+  memset(&rec, 0, sizeof(rec));
+  rec.type  = SHM_BAND;
+  rec.slot  = r->next_slot;
+  rec.bytes = r->band_used;
+
+  if (shm_write(r->fd, &rec, sizeof(rec)) < 0)
+    return (-1);
+
+  r->busy ++;
+  r->next_slot = (r->next_slot + 1) % r->slots;
+  r->band_used = 0;
+
+ /*
+  * Slots are returned in order, so the next one is free once the oldest
+  * band has come back...
+  */
+
+  while (r->busy >= r->slots)
+  {
+    if (shm_read(r->sock, &slot, sizeof(slot)) != sizeof(slot))
+      return (-1);
+
+    r->busy --;
+  }
+
+  return (0);
+}
+
+
+/*
+ * 'shm_header_decode()' - Read a page header the CUPS way.
+ *
+ * The header goes through cupsRasterReadHeader2(), so the consumer gets
+ * the same checks and the same header as from the raster stream.
+ */
+
+static int				/* O - 0 on success, -1 on error */
+shm_header_decode(shm_buffer_t        *b,
+					/* I - Encoded header */
+                  cups_page_header2_t *h)
+					/* O - Page header */
+{
+  cups_raster_t	*ras;			/* Raster stream over buffer */
+  unsigned	ok;			/* Header valid? */
+
+
+  b->pos = 0;
+
+  if ((ras = cupsRasterOpenIO(shm_buffer_cb, b, CUPS_RASTER_READ)) == NULL)
+    return (-1);
+
+  ok = cupsRasterReadHeader2(ras, h);
+  cupsRasterClose(ras);
+
+  if (!ok)
+  {
+    fputs("ERROR: Bad raster page header from shared memory.\n", stderr);
+    return (-1);
+  }
+
+  return (0);
+}
+
+
+/*
+ * 'shm_header_encode()' - Write a page header the CUPS way.
+ *
+ * The header goes through cupsRasterWriteHeader2() in the mode of the
+ * stream, so that PWG Raster headers are normalized as in the raster
+ * stream.
+ */
+
+static int				/* O - 0 on success, -1 on error */
+shm_header_encode(cups_mode_t         mode,
+					/* I - Write mode of the stream */
+                  cups_page_header2_t *h,
+					/* I - Page header */
+		  shm_buffer_t        *b)
+					/* O - Encoded header */
+{
+  cups_raster_t	*ras;			/* Raster stream into buffer */
+  unsigned	ok;			/* Header written? */
+
+
+  b->used = 0;
+  b->pos  = 0;
+
+  if ((ras = cupsRasterOpenIO(shm_buffer_cb, b, mode)) == NULL)
+    return (-1);
+
+  ok = cupsRasterWriteHeader2(ras, h);
+  cupsRasterClose(ras);
+
+  return (ok && b->used > 0 ? 0 : -1);
+}
+
+
+/*
+ * 'shm_listen()' - Offer shared memory to the producer.
+ */
+
+static int				/* O - Listening socket or -1 */
+shm_listen(int fd)			/* I - Input pipe */
+{
+  struct sockaddr_un	addr;		/* Rendezvous address */
+  socklen_t		addrlen;	/* Length of address */
+  int			lsock;		/* Listening socket */
+
+
+  if (shm_socket_name(fd, &addr, &addrlen) ||
+      (lsock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+    return (-1);
+
+  if (bind(lsock, (struct sockaddr *)&addr, addrlen) || listen(lsock, 1))
+  {
+    close(lsock);
+    return (-1);
+  }
+
+  return (lsock);
+}
+
+
+/*
+ * 'shm_record()' - Read the next record from the producer.
+ *
+ * Band records become the current band, header records are read into the
+ * stream.
+ */
+
+static int				/* O - 0 on success, -1 on EOF/error */
+shm_record(cups_raster_shm_t *r,	/* I - Stream */
+           shm_record_t      *rec)	/* O - Record */
+{
+  if (shm_read(r->fd, rec, sizeof(shm_record_t)) != sizeof(shm_record_t))
+    return (-1);
+
+  switch (rec->type)
+  {
+    case SHM_HEADER :
+        {
+	  shm_buffer_t	b;		/* Encoded header */
+
+	  if (rec->bytes == 0 || rec->bytes > sizeof(b.data) ||
+	      shm_read(r->fd, b.data, rec->bytes) != (ssize_t)rec->bytes)
+	    return (-1);
+
+	  b.used = rec->bytes;
+
+	  if (shm_header_decode(&b, &r->header))
+	    return (-1);
+	}
+
+        r->have_header = 1;
+	break;
+
+    case SHM_BAND :
+        if (rec->slot >= r->slots || rec->bytes > r->slot_size)
+	  return (-1);
+
+        r->slot       = rec->slot;
+	r->band_bytes = rec->bytes;
+	r->band_used  = 0;
+	break;
+
+    case SHM_END :
+        break;
+
+    default :
+        return (-1);
+  }
+
+  return (0);
+}
+
+
+/*
+ * 'shm_release()' - Return the current band to the producer.
+ */
+
+static void
+shm_release(cups_raster_shm_t *r)	/* I - Stream */
+{
+  if (!r->band_bytes)
+    return;
+
+  send(r->sock, &r->slot, sizeof(r->slot), MSG_NOSIGNAL);
+
+  r->band_bytes = 0;
+  r->band_used  = 0;
+}
+
+
+/*
+ * 'shm_socket_name()' - Make the rendezvous socket name of a pipe.
+ */
+
+static int				/* O - 0 on success, -1 if not a pipe */
+shm_socket_name(int                fd,	/* I - Pipe */
+                struct sockaddr_un *addr,
+					/* O - Abstract socket address */
+		socklen_t          *addrlen)
+					/* O - Length of address */
+{
+  struct stat	fileinfo;		/* Pipe information */
+  int		len;			/* Length of name */
+
+
+  if (fstat(fd, &fileinfo) || !S_ISFIFO(fileinfo.st_mode))
+    return (-1);
+
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+
+  len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+                 "cups-filters-raster-%lx-%lx", (unsigned long)fileinfo.st_dev,
+		 (unsigned long)fileinfo.st_ino);
+
+  *addrlen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + len);
+
+  return (0);
+}
+
+
+/*
+ * 'shm_write()' - Write a buffer completely.
+ */
+
+static ssize_t				/* O - Bytes written or -1 on error */
+shm_write(int        fd,		/* I - File descriptor */
+          const void *buffer,		/* I - Buffer */
+	  size_t     bytes)		/* I - Bytes to write */
+{
+  size_t	total;			/* Bytes written so far */
+  ssize_t	count;			/* Bytes written this time */
+
+
+  for (total = 0; total < bytes; total += (size_t)count)
+    if ((count = write(fd, (const char *)buffer + total, bytes - total)) < 0)
+    {
+      if (errno == EINTR || errno == EAGAIN)
+      {
+        count = 0;
+	continue;
+      }
+
+      return (-1);
+    }
+
+  return ((ssize_t)total);
+}
+#endif /* HAVE_RASTER_SHM */
+
+
+/*
+ * 'shm_read()' - Read a buffer completely.
+ */
+
+static ssize_t				/* O - Bytes read, short on EOF, -1 on error */
+shm_read(int    fd,			/* I - File descriptor */
+         void   *buffer,		/* O - Buffer */
+	 size_t bytes)			/* I - Bytes to read */
+{
+  size_t	total;			/* Bytes read so far */
+  ssize_t	count;			/* Bytes read this time */
+
+
+  for (total = 0; total < bytes; total += (size_t)count)
+  {
+    if ((count = read(fd, (char *)buffer + total, bytes - total)) < 0)
+    {
+      if (errno == EINTR || errno == EAGAIN)
+      {
+        count = 0;
+	continue;
+      }
+
+      return (-1);
+    }
+    else if (count == 0)
+      break;
+  }
+
+  return ((ssize_t)total);
+}
+
+
+/*
+ * 'shm_read_cb()' - Read callback for the raster stream.
+ *
+ * Returns the sync word looked at by cupsRasterShmOpen() before the rest
+ * of the stream.
+ */
+
+static ssize_t				/* O - Bytes read, -1 on error */
+shm_read_cb(void          *ctx,		/* I - Stream */
+            unsigned char *buffer,	/* O - Buffer */
+	    size_t        bytes)	/* I - Bytes to read */
+{
+  cups_raster_shm_t	*r = (cups_raster_shm_t *)ctx;
+					/* Stream */
+  ssize_t		count;		/* Bytes read */
+
+
+  if (r->peek_pos < r->peek_len)
+  {
+    if (bytes > r->peek_len - r->peek_pos)
+      bytes = r->peek_len - r->peek_pos;
+
+    memcpy(buffer, r->peek + r->peek_pos, bytes);
+    r->peek_pos += bytes;
+
+    return ((ssize_t)bytes);
+  }
+
+  while ((count = read(r->fd, buffer, bytes)) < 0)
+    if (errno != EINTR && errno != EAGAIN)
+      break;
+
+  return (count);
+}
@@ -0,0 +1,358 @@
+/*
+ *   Bit packing test program for CUPS.
+ *
+ *   Compares the bit packing functions against straight-forward per-pixel
+ *   implementations for all widths up to a few vector lengths, all common
+ *   steps and several pixel patterns.
+ *
+ *   Copyright 2026 by OpenPrinting.
+ *
+ *   Distribution and use rights are outlined in the file "COPYING"
+ *   which should have been included with this file.
+ *
+ * Contents:
+ *
+ *   main()       - Test the bit packing functions.
+ *   fill()       - Fill a pixel buffer with a test pattern.
+ *   ref_pack()   - Reference cupsPackHorizontal().
+ *   ref_pack2()  - Reference cupsPackHorizontal2().
+ *   ref_packb()  - Reference cupsPackHorizontalBit().
+ *   ref_packv()  - Reference cupsPackVertical().
+ */
+
+/*
+ * Include necessary headers.
+ */
+
+#include "driver.h"
+#include <config.h>
+#include <string.h>
+
+
+/*
+ * Constants...
+ */
+
+#define MAX_WIDTH	300		/* Maximum width to test */
+#define MAX_STEP	8		/* Maximum step to test */
+#define NUM_PATTERNS	5		/* Number of pixel patterns */
+#define GUARD		0xa5		/* Guard byte value */
+
+
+/*
+ * Local functions...
+ */
+
+static void	fill(unsigned char *pixels, int count, int pattern, int seed);
+static void	ref_pack(const unsigned char *ipixels, unsigned char *obytes,
+		         int width, unsigned char clearto, int step);
+static void	ref_pack2(const unsigned char *ipixels, unsigned char *obytes,
+		          int width, int step);
+static void	ref_packb(const unsigned char *ipixels, unsigned char *obytes,
+		          int width, unsigned char clearto,
+			  unsigned char bit);
+static void	ref_packv(const unsigned char *ipixels, unsigned char *obytes,
+		          int width, unsigned char bit, int step);
+
+
+/*
+ * 'main()' - Test the bit packing functions.
+ */
+
+int					/* O - Exit status */
+main(void)
+{
+  int		width,			/* Width in pixels */
+		step,			/* Step between pixels */
+		pattern,		/* Pixel pattern */
+		count,			/* Number of input bytes */
+		obytes,			/* Number of output bytes */
+		bit,			/* Bit to test */
+		clearto,		/* Initial value of bytes */
+		errors = 0;		/* Number of errors */
+  unsigned char	*ipixels,		/* Input pixels */
+		expect[MAX_WIDTH * MAX_STEP + 1],
+					/* Expected output */
+		actual[MAX_WIDTH * MAX_STEP + 1];
+					/* Actual output */
+
+
+  fputs("cupsPackHorizontal: ", stdout);
+
+  for (width = 0; width <= MAX_WIDTH; width ++)
+    for (step = 1; step <= MAX_STEP; step ++)
+      for (pattern = 0; pattern < NUM_PATTERNS; pattern ++)
+        for (clearto = 0; clearto < 256; clearto += 255)
+	{
+	 /*
+	  * Allocate exactly the bytes the function may look at...
+	  */
+
+	  count   = width ? (width - 1) * step + 1 : 1;
+	  obytes  = (width + 7) / 8;
+	  ipixels = malloc(count);
+
+	  fill(ipixels, count, pattern, width * step);
+	  memset(expect, GUARD, sizeof(expect));
+	  memset(actual, GUARD, sizeof(actual));
+
+	  ref_pack(ipixels, expect, width, clearto, step);
+	  cupsPackHorizontal(ipixels, actual, width, clearto, step);
+
+	  if (memcmp(expect, actual, obytes + 1))
+	  {
+	    if (!errors)
+	      puts("FAIL");
+	    printf("    width=%d, step=%d, pattern=%d, clearto=%d\n", width,
+	           step, pattern, clearto);
+	    errors ++;
+	  }
+
+	  free(ipixels);
+	}
+
+  if (!errors)
+    puts("PASS");
+
+  fputs("cupsPackHorizontal2: ", stdout);
+
+  for (width = 0; width <= MAX_WIDTH; width ++)
+    for (step = 1; step <= MAX_STEP; step ++)
+      for (pattern = 0; pattern < NUM_PATTERNS; pattern ++)
+      {
+	count   = width ? (width - 1) * step + 1 : 1;
+	obytes  = (width + 3) / 4;
+	ipixels = malloc(count);
+
+	fill(ipixels, count, pattern, width * step);
+	memset(expect, GUARD, sizeof(expect));
+	memset(actual, GUARD, sizeof(actual));
+
+	ref_pack2(ipixels, expect, width, step);
+	cupsPackHorizontal2(ipixels, actual, width, step);
+
+	if (memcmp(expect, actual, obytes + 1))
+	{
+	  if (!errors)
+	    puts("FAIL");
+	  printf("    width=%d, step=%d, pattern=%d\n", width, step, pattern);
+	  errors ++;
+	}
+
+	free(ipixels);
+      }
+
+  if (!errors)
+    puts("PASS");
+
+  fputs("cupsPackHorizontalBit: ", stdout);
+
+  for (width = 0; width <= MAX_WIDTH; width ++)
+    for (bit = 1; bit < 256; bit <<= 1)
+      for (pattern = 0; pattern < NUM_PATTERNS; pattern ++)
+        for (clearto = 0; clearto < 256; clearto += 255)
+	{
+	  count   = width ? width : 1;
+	  obytes  = (width + 7) / 8;
+	  ipixels = malloc(count);
+
+	  fill(ipixels, count, pattern, width * bit);
+	  memset(expect, GUARD, sizeof(expect));
+	  memset(actual, GUARD, sizeof(actual));
+
+	  ref_packb(ipixels, expect, width, clearto, bit);
+	  cupsPackHorizontalBit(ipixels, actual, width, clearto, bit);
+
+	  if (memcmp(expect, actual, obytes + 1))
+	  {
+	    if (!errors)
+	      puts("FAIL");
+	    printf("    width=%d, bit=%d, pattern=%d, clearto=%d\n", width,
+	           bit, pattern, clearto);
+	    errors ++;
+	  }
+
+	  free(ipixels);
+	}
+
+  if (!errors)
+    puts("PASS");
+
+  fputs("cupsPackVertical: ", stdout);
+
+  for (width = 0; width <= MAX_WIDTH; width ++)
+    for (step = 1; step <= MAX_STEP; step ++)
+      for (bit = 1; bit < 256; bit <<= 1)
+	for (pattern = 0; pattern < NUM_PATTERNS; pattern ++)
+	{
+	  count   = width ? width : 1;
+	  obytes  = width * step;
+	  ipixels = malloc(count);
+
+	  fill(ipixels, count, pattern, width + step);
+	  fill(expect, sizeof(expect), 4, bit);
+	  memcpy(actual, expect, sizeof(actual));
+
+	  ref_packv(ipixels, expect, width, bit, step);
+	  cupsPackVertical(ipixels, actual, width, bit, step);
+
+	  if (memcmp(expect, actual, obytes + 1))
+	  {
+	    if (!errors)
+	      puts("FAIL");
+	    printf("    width=%d, step=%d, bit=%d, pattern=%d\n", width, step,
+	           bit, pattern);
+	    errors ++;
+	  }
+
+	  free(ipixels);
+	}
+
+  if (!errors)
+    puts("PASS");
+
+  return (errors != 0);
+}
+
+
+/*
+ * 'fill()' - Fill a pixel buffer with a test pattern.
+ */
+
+static void
+fill(unsigned char *pixels,		/* I - Pixel buffer */
+     int           count,		/* I - Number of bytes */
+     int           pattern,		/* I - Pattern number */
+     int           seed)		/* I - Seed for random patterns */
+{
+  int	i;				/* Looping var */
+
+
+  srand(seed);
+
+  for (i = 0; i < count; i ++)
+    switch (pattern)
+    {
+      case 0 :				/* All clear */
+          pixels[i] = 0;
+	  break;
+      case 1 :				/* All set */
+          pixels[i] = 255;
+	  break;
+      case 2 :				/* Sparse dither output */
+          pixels[i] = (rand() & 15) ? 0 : 1;
+	  break;
+      case 3 :				/* 2-bit dither output */
+          pixels[i] = rand() & 3;
+	  break;
+      default :				/* Random bytes */
+          pixels[i] = rand() & 255;
+	  break;
+    }
+}
+
+
+/*
+ * 'ref_pack()' - Reference cupsPackHorizontal().
+ */
+
+static void
+ref_pack(const unsigned char *ipixels,	/* I - Input pixels */
+         unsigned char       *obytes,	/* O - Output bytes */
+         int                 width,	/* I - Number of pixels */
+         unsigned char       clearto,	/* I - Initial value of bytes */
+         int                 step)	/* I - Step value between pixels */
+{
+  int	i;				/* Looping var */
+
+
+  for (i = 0; i < width; i ++)
+  {
+    if (!(i & 7))
+      obytes[i / 8] = clearto;
+
+    if (ipixels[i * step])
+      obytes[i / 8] ^= 0x80 >> (i & 7);
+  }
+}
+
+
+/*
+ * 'ref_pack2()' - Reference cupsPackHorizontal2().
+ */
+
+static void
+ref_pack2(const unsigned char *ipixels,	/* I - Input pixels */
+          unsigned char       *obytes,	/* O - Output bytes */
+          int                 width,	/* I - Number of pixels */
+          int                 step)	/* I - Step value between pixels */
+{
+  int	i,				/* Looping var */
+	last;				/* Number of pixels in last byte */
+
+
+  last = width & 3;
+
+  for (i = 0; i < width - last; i ++)
+  {
+    if (!(i & 3))
+      obytes[i / 4] = 0;
+
+    obytes[i / 4] |= ipixels[i * step] << (6 - 2 * (i & 3));
+  }
+
+ /*
+  * The pixels of a partial last byte are packed last to first...
+  */
+
+  if (last)
+    obytes[i / 4] = 0;
+
+  for (; i < width; i ++)
+    obytes[i / 4] |= ipixels[i * step] << (2 * (i & 3) + 8 - 2 * last);
+}
+
+
+/*
+ * 'ref_packb()' - Reference cupsPackHorizontalBit().
+ */
+
+static void
+ref_packb(const unsigned char *ipixels,	/* I - Input pixels */
+          unsigned char       *obytes,	/* O - Output bytes */
+          int                 width,	/* I - Number of pixels */
+          unsigned char       clearto,	/* I - Initial value of bytes */
+          unsigned char       bit)	/* I - Bit to check */
+{
+  int	i;				/* Looping var */
+
+
+  for (i = 0; i < width; i ++)
+  {
+    if (!(i & 7))
+      obytes[i / 8] = clearto;
+
+    if (ipixels[i] & bit)
+      obytes[i / 8] ^= 0x80 >> (i & 7);
+  }
+}
+
+
+/*
+ * 'ref_packv()' - Reference cupsPackVertical().
+ */
+
+static void
+ref_packv(const unsigned char *ipixels,	/* I - Input pixels */
+          unsigned char       *obytes,	/* O - Output bytes */
+          int                 width,	/* I - Number of pixels */
+          unsigned char       bit,	/* I - Output bit */
+          int                 step)	/* I - Bytes between columns */
+{
+  int	i;				/* Looping var */
+
+
+  for (i = 0; i < width; i ++)
+    if (ipixels[i])
+      obytes[i * step] ^= bit;
+}
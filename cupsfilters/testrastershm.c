@@ -0,0 +1,401 @@
+/*
+ *   Shared-memory raster transport test program for CUPS.
+ *
+ *   Sends the same pages from a producer process to a consumer through
+ *   a pipe, once with the raster stream, once with shared memory and
+ *   once with a producer asking for shared memory which the consumer does
+ *   not offer.  The consumer checks the pixels and that all transports
+ *   give the same page headers.  The pages are a small 8-bit one and a
+ *   16-bit PWG Raster one which does not fit into the ring at once.
+ *
+ *   Copyright 2026 by OpenPrinting.
+ *
+ *   Distribution and use rights are outlined in the file "COPYING"
+ *   which should have been included with this file.
+ *
+ * Contents:
+ *
+ *   main()       - Test the shared-memory raster transport.
+ *   consume()    - Read and check the pages.
+ *   fill_line()  - Make the pixels of a line.
+ *   init_page()  - Make the page header of a test page.
+ *   produce()    - Write the pages.
+ *   run()        - Run one producer/consumer pair.
+ */
+
+/*
+ * Include necessary headers.
+ */
+
+#include <config.h>
+#include "raster.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+
+/*
+ * Constants...
+ */
+
+#define NUM_PAGES	2		/* Number of test pages */
+
+
+/*
+ * Local functions...
+ */
+
+static int	consume(int fd, int num_options, cups_option_t *options,
+		        cups_page_header2_t *headers);
+static void	fill_line(unsigned char *line, unsigned bytes, int page,
+		          unsigned y);
+static void	init_page(cups_page_header2_t *h, int page);
+static int	produce(int fd, int num_options, cups_option_t *options);
+static int	run(const char *name, int producer_shm, int consumer_shm,
+		    int expect_shm, cups_page_header2_t *headers);
+
+
+/*
+ * 'main()' - Test the shared-memory raster transport.
+ */
+
+int					/* O - Exit status */
+main(void)
+{
+  cups_page_header2_t	stream[NUM_PAGES],
+					/* Headers read from the stream */
+			shm[NUM_PAGES],	/* Headers read from shared memory */
+			fallback[NUM_PAGES];
+					/* Headers read after the fallback */
+  int			errors = 0;	/* Number of errors */
+
+
+  errors += run("Raster stream", 0, 0, 0, stream);
+#ifdef __linux
+  errors += run("Shared memory", 1, 1, 1, shm);
+#else
+  errors += run("Shared memory", 1, 1, 0, shm);
+#endif /* __linux */
+  errors += run("Fallback to the raster stream", 1, 0, 0, fallback);
+
+  fputs("Same page headers with all transports: ", stdout);
+  if (memcmp(stream, shm, sizeof(stream)) ||
+      memcmp(stream, fallback, sizeof(stream)))
+  {
+    puts("FAIL");
+    errors ++;
+  }
+  else
+    puts("PASS");
+
+  return (errors ? 1 : 0);
+}
+
+
+/*
+ * 'consume()' - Read and check the pages.
+ */
+
+static int				/* O - Number of errors */
+consume(int                 fd,		/* I - Input pipe */
+        int                 num_options,/* I - Number of options */
+        cups_option_t       *options,	/* I - Options */
+	cups_page_header2_t *headers)	/* O - Page headers read */
+{
+  cups_raster_shm_t	*ras;		/* Raster stream */
+  cups_page_header2_t	h;		/* Page header */
+  unsigned char		*line,		/* Line read */
+			*expect;	/* Line expected */
+  unsigned		y;		/* Current line */
+  int			page,		/* Current page */
+			errors = 0;	/* Number of errors */
+
+
+  if ((ras = cupsRasterShmOpen(fd, CUPS_RASTER_READ, num_options,
+                               options)) == NULL)
+  {
+    puts("FAIL (cupsRasterShmOpen)");
+    return (1);
+  }
+
+  for (page = 0; cupsRasterShmReadHeader(ras, &h); page ++)
+  {
+    if (page >= NUM_PAGES)
+    {
+      printf("FAIL (extra page %d)\n", page + 1);
+      errors ++;
+      break;
+    }
+
+    headers[page] = h;
+
+    line   = malloc(h.cupsBytesPerLine);
+    expect = malloc(h.cupsBytesPerLine);
+
+    for (y = 0; y < h.cupsHeight; y ++)
+    {
+      if (cupsRasterShmReadPixels(ras, line, h.cupsBytesPerLine) !=
+              h.cupsBytesPerLine)
+      {
+	printf("FAIL (short read, page %d, line %u)\n", page + 1, y);
+	errors ++;
+	break;
+      }
+
+      fill_line(expect, h.cupsBytesPerLine, page, y);
+      if (memcmp(line, expect, h.cupsBytesPerLine))
+      {
+	printf("FAIL (bad pixels, page %d, line %u)\n", page + 1, y);
+	errors ++;
+	break;
+      }
+    }
+
+    free(line);
+    free(expect);
+
+    if (errors)
+      break;
+  }
+
+  if (!errors && page != NUM_PAGES)
+  {
+    printf("FAIL (%d pages instead of %d)\n", page, NUM_PAGES);
+    errors ++;
+  }
+
+  cupsRasterShmClose(ras);
+
+  return (errors);
+}
+
+
+/*
+ * 'fill_line()' - Make the pixels of a line.
+ */
+
+static void
+fill_line(unsigned char *line,		/* O - Pixels */
+          unsigned      bytes,		/* I - Bytes per line */
+	  int           page,		/* I - Page number */
+	  unsigned      y)		/* I - Line number */
+{
+  unsigned	x;			/* Current byte */
+
+
+  for (x = 0; x < bytes; x ++)
+    line[x] = (unsigned char)(x * 7 + y * 31 + page * 101);
+}
+
+
+/*
+ * 'init_page()' - Make the page header of a test page.
+ *
+ * The MediaClass gets normalized to "PwgRaster" by the PWG Raster writer,
+ * so it tells whether the normalization also happens with shared memory.
+ */
+
+static void
+init_page(cups_page_header2_t *h,	/* O - Page header */
+          int                 page)	/* I - Page number */
+{
+  memset(h, 0, sizeof(cups_page_header2_t));
+
+  strcpy(h->MediaClass, "TestClass");
+  strcpy(h->MediaType, "stationery");
+  h->HWResolution[0] = 300;
+  h->HWResolution[1] = 300;
+  h->PageSize[0]     = 612;
+  h->PageSize[1]     = 792;
+  h->NumCopies       = 1;
+  h->cupsColorOrder  = CUPS_ORDER_CHUNKED;
+
+  if (page == 0)
+  {
+   /*
+    * Small 8-bit gray page...
+    */
+
+    h->cupsWidth        = 1000;
+    h->cupsHeight       = 100;
+    h->cupsBitsPerColor = 8;
+    h->cupsBitsPerPixel = 8;
+    h->cupsColorSpace   = CUPS_CSPACE_SW;
+    h->cupsNumColors    = 1;
+  }
+  else
+  {
+   /*
+    * 16-bit RGB page of about 18 MB, more than the ring holds...
+    */
+
+    h->cupsWidth        = 1024;
+    h->cupsHeight       = 3000;
+    h->cupsBitsPerColor = 16;
+    h->cupsBitsPerPixel = 48;
+    h->cupsColorSpace   = CUPS_CSPACE_SRGB;
+    h->cupsNumColors    = 3;
+  }
+
+  h->cupsBytesPerLine = h->cupsWidth * h->cupsBitsPerPixel / 8;
+}
+
+
+/*
+ * 'produce()' - Write the pages.
+ */
+
+static int				/* O - 0 on success, 1 on error */
+produce(int           fd,		/* I - Output pipe */
+        int           num_options,	/* I - Number of options */
+        cups_option_t *options)		/* I - Options */
+{
+  cups_raster_shm_t	*ras;		/* Raster stream */
+  cups_page_header2_t	h;		/* Page header */
+  unsigned char		*line;		/* Line to write */
+  unsigned		y;		/* Current line */
+  int			page;		/* Current page */
+
+
+  if ((ras = cupsRasterShmOpen(fd, CUPS_RASTER_WRITE_PWG, num_options,
+                               options)) == NULL)
+    return (1);
+
+ /*
+  * Give the consumer the time to start listening...
+  */
+
+  poll(NULL, 0, 50);
+
+  for (page = 0; page < NUM_PAGES; page ++)
+  {
+    init_page(&h, page);
+
+    if (!cupsRasterShmWriteHeader(ras, &h))
+      return (1);
+
+    line = malloc(h.cupsBytesPerLine);
+
+    for (y = 0; y < h.cupsHeight; y ++)
+    {
+      fill_line(line, h.cupsBytesPerLine, page, y);
+      if (cupsRasterShmWritePixels(ras, line, h.cupsBytesPerLine) !=
+              h.cupsBytesPerLine)
+        return (1);
+    }
+
+    free(line);
+  }
+
+  cupsRasterShmClose(ras);
+
+  return (0);
+}
+
+
+/*
+ * 'run()' - Run one producer/consumer pair.
+ */
+
+static int				/* O - Number of errors */
+run(const char          *name,		/* I - Name of test */
+    int                 producer_shm,	/* I - Producer asks for shm? */
+    int                 consumer_shm,	/* I - Consumer offers shm? */
+    int                 expect_shm,	/* I - Expect shm to be used? */
+    cups_page_header2_t *headers)	/* O - Page headers read */
+{
+  int			fds[2],		/* Pipe between the two */
+			status,		/* Exit status of producer */
+			errors;		/* Number of errors */
+  pid_t			pid;		/* Producer process */
+  int			num_options = 0;/* Number of options */
+  cups_option_t		*options = NULL;/* Options */
+  FILE			*log;		/* Messages of consumer */
+  int			saved_stderr;	/* Our stderr */
+  char			buffer[1024];	/* Line from messages */
+  int			used_shm = 0;	/* Was shm used? */
+
+
+  printf("%s: ", name);
+  fflush(stdout);
+
+  memset(headers, 0, NUM_PAGES * sizeof(cups_page_header2_t));
+
+  if (pipe(fds))
+  {
+    puts("FAIL (pipe)");
+    return (1);
+  }
+
+  if ((pid = fork()) == 0)
+  {
+    close(fds[0]);
+
+    if (producer_shm)
+      num_options = cupsAddOption("raster-transport", "shm", num_options,
+                                  &options);
+
+    _exit(produce(fds[1], num_options, options));
+  }
+
+  close(fds[1]);
+
+  if (pid < 0)
+  {
+    close(fds[0]);
+    puts("FAIL (fork)");
+    return (1);
+  }
+
+  if (consumer_shm)
+    num_options = cupsAddOption("raster-transport", "shm", num_options,
+                                &options);
+
+ /*
+  * Catch the messages of the consumer to see which transport it used...
+  */
+
+  log = tmpfile();
+  fflush(stderr);
+  saved_stderr = dup(2);
+  dup2(fileno(log), 2);
+
+  errors = consume(fds[0], num_options, options, headers);
+
+  fflush(stderr);
+  dup2(saved_stderr, 2);
+  close(saved_stderr);
+  close(fds[0]);
+  cupsFreeOptions(num_options, options);
+
+  rewind(log);
+  while (fgets(buffer, sizeof(buffer), log))
+    if (strstr(buffer, "through shared memory"))
+      used_shm = 1;
+  fclose(log);
+
+  while (waitpid(pid, &status, 0) < 0)
+    if (errno != EINTR)
+      break;
+
+  if (!errors && (!WIFEXITED(status) || WEXITSTATUS(status)))
+  {
+    puts("FAIL (producer failed)");
+    errors ++;
+  }
+
+  if (!errors && used_shm != expect_shm)
+  {
+    printf("FAIL (%s used)\n", used_shm ? "shared memory" : "raster stream");
+    errors ++;
+  }
+
+  if (!errors)
+    puts("PASS");
+
+  return (errors);
+}
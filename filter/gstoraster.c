@@ -933,6 +933,10 @@ main (int argc, char **argv, char *envp[])
     h.cupsHeight = h.HWResolution[1] * h.PageSize[1] / 72;
   }
 
+  /* Preview jobs: pass the reduced resolution on to Ghostscript */
+  if (outformat == OUTPUT_FORMAT_RASTER)
+    cupsRasterPreviewResolution(&h, num_options, options);
+
   /* set PDF-specific options */
   if (doc_type == GS_DOC_TYPE_PDF) {
     parse_pdf_header_options(fp, &h);
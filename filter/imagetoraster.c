@@ -171,6 +171,7 @@ main(int  argc,				/* I - Number of command-line arguments */
   float			b;		/* Brightness factor */
   float			zoom;		/* Zoom facter */
   int			xppi, yppi;	/* Pixels-per-inch */
+  int			preview;	/* Preview resolution reduction factor */
   int			hue, sat;	/* Hue and saturation adjustment */
   cups_izoom_t		*z;		/* Image zoom buffer */
   cups_iztype_t		zoom_type;	/* Image zoom type */
@@ -397,6 +398,16 @@ main(int  argc,				/* I - Number of command-line arguments */
     return (1);
   }
 
+ /*
+  * Preview jobs render at a reduced resolution; unless the image resolution
+  * was given explicitly, also let the decoder produce a smaller image so
+  * that the image keeps its size relative to the output pixels...
+  */
+
+  if ((preview = cupsRasterPreviewResolution(&header, num_options,
+                                             options)) > 1 && xppi == 0)
+    cupsImageSetReadScale(preview);
+
  /*
   * Get the media type and resolution that have been chosen...
   */
@@ -29,7 +29,8 @@ MIT Open Source License  -  http://www.opensource.org/
 */
 
 
-/* PS/PDF to CUPS Raster filter based on mutool */
+/* PS/PDF to CUPS Raster filter based on mutool, or on libmupdf when built
+   with --enable-libmupdf */
 
 #include <config.h>
 #include <cups/cups.h>
@@ -49,6 +50,12 @@ MIT Open Source License  -  http://www.opensource.org/
 #include <signal.h>
 #include <unistd.h>
 #include <errno.h>
+#ifdef HAVE_LIBMUPDF
+#include <mupdf/fitz.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif /* HAVE_PTHREAD_H */
+#endif /* HAVE_LIBMUPDF */
 
 #define PDF_MAX_CHECK_COMMENT_LINES	20
 
@@ -61,6 +68,26 @@ typedef cups_page_header2_t mupdf_page_header;
 typedef cups_page_header_t mupdf_page_header;
 #endif /* CUPS_RASTER_SYNCv1 */
 
+#ifdef HAVE_LIBMUPDF
+#define MUPDF_BAND_BYTES	(4 * 1024 * 1024)
+#define MUPDF_MAX_THREADS	16
+
+typedef struct mupdf_band_s {
+  fz_context *ctx;		/* Context of the rendering thread */
+  fz_colorspace *cs;		/* Output color space */
+  fz_display_list *list;	/* Page to render */
+  fz_matrix ctm;		/* Page to device transformation */
+  fz_irect bbox;		/* Band in device space */
+  int page_y0;			/* Top of the page in device space */
+  int mono;			/* Halftone to 1 bit? */
+  unsigned char *samples;	/* Band buffer */
+  size_t size;			/* Size of band buffer */
+  fz_bitmap *bitmap;		/* Halftoned band */
+  int error;			/* Did rendering fail? */
+  int thread;			/* Running in its own thread? */
+} mupdf_band_t;
+#endif /* HAVE_LIBMUPDF */
+
 
 int
 parse_doc_type(FILE *fp)
@@ -117,6 +144,7 @@ parse_pdf_header_options(FILE *fp, mupdf_page_header *h)
   }
 }
 
+#ifndef HAVE_LIBMUPDF
 static void
 add_pdf_header_options(mupdf_page_header *h,
 		       cups_array_t 	 *mupdf_args)
@@ -229,13 +257,381 @@ mutool_spawn (const char *filename,
   free(mutoolargv);
   return status;
 }
+#endif /* !HAVE_LIBMUPDF */
+
+#ifdef HAVE_LIBMUPDF
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t mupdf_mutexes[FZ_LOCK_MAX];
+
+static void
+mupdf_lock(void *user, int lock)
+{
+  (void)user;
+  pthread_mutex_lock(&mupdf_mutexes[lock]);
+}
+
+static void
+mupdf_unlock(void *user, int lock)
+{
+  (void)user;
+  pthread_mutex_unlock(&mupdf_mutexes[lock]);
+}
+#endif /* HAVE_PTHREAD_H */
+
+/* Render one band of a page's display list into the band's own sample
+   buffer, so that several bands can be rendered at the same time with
+   cloned contexts */
+static void *
+mupdf_render_band(void *data)
+{
+  mupdf_band_t *band = (mupdf_band_t *)data;
+  fz_context *ctx = band->ctx;
+  fz_pixmap *pix = NULL;
+  fz_device *dev = NULL;
+
+  band->error = 0;
+  band->bitmap = NULL;
+
+  fz_var(pix);
+  fz_var(dev);
+
+  fz_try(ctx) {
+    pix = fz_new_pixmap_with_bbox_and_data(ctx, band->cs, band->bbox, NULL, 0,
+					   band->samples);
+    /* Paper white */
+    if (fz_colorspace_n(ctx, band->cs) == 4)
+      fz_clear_pixmap(ctx, pix);
+    else
+      fz_clear_pixmap_with_value(ctx, pix, 255);
+
+    dev = fz_new_draw_device(ctx, fz_identity, pix);
+    fz_run_display_list(ctx, band->list, dev, band->ctm,
+			fz_rect_from_irect(band->bbox), NULL);
+    fz_close_device(ctx, dev);
+
+    /* Halftone the band like mutool does for its mono output; the
+       halftone phase follows the position of the band on the page */
+    if (band->mono)
+      band->bitmap = fz_new_bitmap_from_pixmap_band(ctx, pix, NULL,
+						    band->bbox.y0 -
+						    band->page_y0);
+  }
+  fz_always(ctx) {
+    fz_drop_device(ctx, dev);
+    fz_drop_pixmap(ctx, pix);
+  }
+  fz_catch(ctx) {
+    fprintf(stderr, "ERROR: Unable to render page band: %s\n",
+	    fz_caught_message(ctx));
+    band->error = 1;
+  }
+
+  return NULL;
+}
+
+/* Interpret a page once into a display list; the bands of the page are
+   then rendered from the list without touching the document again */
+static fz_display_list *
+mupdf_load_page(fz_context *ctx, fz_document *doc, int pageno,
+		fz_rect *bounds)
+{
+  fz_page *page;
+  fz_display_list *list = NULL;
+
+  page = fz_load_page(ctx, doc, pageno);
+  fz_try(ctx) {
+    *bounds = fz_bound_page(ctx, page);
+    list = fz_new_display_list_from_page(ctx, page);
+  }
+  fz_always(ctx)
+    fz_drop_page(ctx, page);
+  fz_catch(ctx)
+    fz_rethrow(ctx);
+
+  return list;
+}
+
+/* Scale the page to the resolution and fit it into fit_width x fit_height
+   pixels, keeping the aspect ratio, the same way as "mutool draw -r -w -h" */
+static fz_irect
+mupdf_page_ctm(mupdf_page_header *h, unsigned fit_width, unsigned fit_height,
+	       fz_rect bounds, fz_matrix *ctm)
+{
+  fz_rect tbounds;
+  float scalex, scaley;
+
+  *ctm = fz_scale(h->HWResolution[0] / 72.0f, h->HWResolution[1] / 72.0f);
+  tbounds = fz_transform_rect(bounds, *ctm);
+  if (tbounds.x1 > tbounds.x0 && tbounds.y1 > tbounds.y0) {
+    scalex = fit_width / (tbounds.x1 - tbounds.x0);
+    scaley = fit_height / (tbounds.y1 - tbounds.y0);
+    if (scaley < scalex)
+      scalex = scaley;
+    *ctm = fz_post_scale(*ctm, scalex, scalex);
+    tbounds = fz_transform_rect(bounds, *ctm);
+  }
+
+  return fz_round_rect(tbounds);
+}
+
+static int
+mupdf_render(const char *filename,
+	     mupdf_page_header *h,
+	     int num_options,
+	     cups_option_t *options)
+{
+  cups_raster_t *ras = NULL;
+  fz_context *ctx;
+  fz_document *doc = NULL;
+  fz_display_list *list = NULL;
+  fz_display_list *next_list = NULL;
+  fz_colorspace *cs;
+  fz_matrix ctm;
+  fz_rect bounds, next_bounds;
+  fz_irect ibounds;
+  mupdf_band_t bands[MUPDF_MAX_THREADS];
+  const char *val;
+  unsigned char *row;
+  size_t band_size;
+  int band_height = 0;
+  int rows;
+  int line;
+  int num_threads = 1;
+  int num_pages;
+  int pageno;
+  int active;
+  int mono = 0;
+  int width;
+  unsigned fit_width = h->cupsWidth;	/* Page size in pixels, the header */
+  unsigned fit_height = h->cupsHeight;	/* gets the size of each page */
+  int stride;
+  int y;
+  int i;
+  int status = 1;
+#ifdef HAVE_PTHREAD_H
+  fz_locks_context locks;
+  pthread_t threads[MUPDF_MAX_THREADS];
+#endif /* HAVE_PTHREAD_H */
+
+  if ((val = cupsGetOption("mupdf-band-height", num_options,
+			   options)) != NULL)
+    band_height = atoi(val);
+#ifdef HAVE_PTHREAD_H
+  if ((val = cupsGetOption("mupdf-threads", num_options, options)) != NULL) {
+    num_threads = atoi(val);
+    if (num_threads < 1)
+      num_threads = 1;
+    else if (num_threads > MUPDF_MAX_THREADS)
+      num_threads = MUPDF_MAX_THREADS;
+  }
+
+  for (i = 0; i < FZ_LOCK_MAX; i ++)
+    pthread_mutex_init(&mupdf_mutexes[i], NULL);
+  locks.user = NULL;
+  locks.lock = mupdf_lock;
+  locks.unlock = mupdf_unlock;
+  ctx = fz_new_context(NULL, &locks, FZ_STORE_DEFAULT);
+#else
+  ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+#endif /* HAVE_PTHREAD_H */
+  if (!ctx) {
+    fprintf(stderr, "ERROR: Unable to create MuPDF context\n");
+    return 1;
+  }
+
+  memset(bands, 0, sizeof(bands));
+
+  /* Same output color spaces as with the mutool command line */
+  switch (h->cupsColorSpace) {
+  case CUPS_CSPACE_RGB:
+  case CUPS_CSPACE_CMY:
+  case CUPS_CSPACE_SRGB:
+  case CUPS_CSPACE_ADOBERGB:
+    cs = fz_device_rgb(ctx);
+    h->cupsColorSpace = CUPS_CSPACE_SRGB;
+    break;
+
+  case CUPS_CSPACE_CMYK:
+    cs = fz_device_cmyk(ctx);
+    break;
+
+  case CUPS_CSPACE_SW:
+    cs = fz_device_gray(ctx);
+    break;
+
+  default:
+  case CUPS_CSPACE_K:
+  case CUPS_CSPACE_W:
+    cs = fz_device_gray(ctx);
+    h->cupsColorSpace = CUPS_CSPACE_K;
+    mono = 1;
+    break;
+  }
+  h->cupsColorOrder = CUPS_ORDER_CHUNKED;
+  h->cupsNumColors = fz_colorspace_n(ctx, cs);
+  h->cupsBitsPerColor = mono ? 1 : 8;
+  h->cupsBitsPerPixel = mono ? 1 : 8 * h->cupsNumColors;
+
+  for (i = 0; i < num_threads; i ++) {
+    bands[i].ctx = i ? fz_clone_context(ctx) : ctx;
+    bands[i].cs = cs;
+    bands[i].mono = mono;
+    if (!bands[i].ctx) {
+      num_threads = i;
+      break;
+    }
+  }
+  fprintf(stderr, "DEBUG: Rendering with libmupdf %s, %d thread(s)\n",
+	  FZ_VERSION, num_threads);
+
+  fz_var(doc);
+  fz_var(list);
+  fz_var(next_list);
+  fz_var(ras);
+
+  fz_try(ctx) {
+    fz_register_document_handlers(ctx);
+    doc = fz_open_document(ctx, filename);
+    num_pages = fz_count_pages(ctx, doc);
+
+    if ((ras = cupsRasterOpen(1, CUPS_RASTER_WRITE_PWG)) == NULL)
+      fz_throw(ctx, FZ_ERROR_GENERIC, "Unable to open raster stream");
+
+    if (num_pages > 0)
+      next_list = mupdf_load_page(ctx, doc, 0, &next_bounds);
+
+    for (pageno = 0; pageno < num_pages; pageno ++) {
+      fprintf(stderr, "INFO: Rendering page %d\n", pageno + 1);
+
+      fz_drop_display_list(ctx, list);
+      list = next_list;
+      next_list = NULL;
+      bounds = next_bounds;
+
+      ibounds = mupdf_page_ctm(h, fit_width, fit_height, bounds, &ctm);
+      width = ibounds.x1 - ibounds.x0;
+      stride = width * h->cupsNumColors;
+      h->cupsWidth = width;
+      h->cupsHeight = ibounds.y1 - ibounds.y0;
+      h->cupsBytesPerLine = mono ? (width + 7) / 8 : stride;
+
+      if (!cupsRasterWriteHeader2(ras, h))
+	fz_throw(ctx, FZ_ERROR_GENERIC, "Unable to write raster header");
+
+      /* Only one band per thread is ever held in memory */
+      if ((rows = band_height) <= 0)
+	rows = MUPDF_BAND_BYTES / (stride > 0 ? stride : 1);
+      if (rows < 1)
+	rows = 1;
+      band_size = (size_t)rows * (stride > 0 ? stride : 1);
+      for (i = 0; i < num_threads; i ++) {
+	if (bands[i].size < band_size) {
+	  free(bands[i].samples);
+	  bands[i].size = 0;
+	  if ((bands[i].samples = malloc(band_size)) == NULL)
+	    fz_throw(ctx, FZ_ERROR_GENERIC, "Unable to allocate band buffer");
+	  bands[i].size = band_size;
+	}
+	bands[i].list = list;
+	bands[i].ctm = ctm;
+	bands[i].page_y0 = ibounds.y0;
+      }
+
+      for (y = ibounds.y0; y < ibounds.y1;) {
+	for (active = 0; active < num_threads && y < ibounds.y1;
+	     active ++, y += rows) {
+	  bands[active].bbox = ibounds;
+	  bands[active].bbox.y0 = y;
+	  if (y + rows < ibounds.y1)
+	    bands[active].bbox.y1 = y + rows;
+	  if (active == 0)
+	    continue;
+#ifdef HAVE_PTHREAD_H
+	  if (pthread_create(&threads[active], NULL, mupdf_render_band,
+			     &bands[active]) == 0) {
+	    bands[active].thread = 1;
+	    continue;
+	  }
+#endif /* HAVE_PTHREAD_H */
+	  mupdf_render_band(&bands[active]);
+	}
+
+	/* The first band of each round is rendered here; while the other
+	   threads are busy the next page also gets interpreted, so that
+	   the document itself is only ever used from this thread */
+	mupdf_render_band(&bands[0]);
+	if (!next_list && pageno + 1 < num_pages) {
+	  fz_try(ctx)
+	    next_list = mupdf_load_page(ctx, doc, pageno + 1, &next_bounds);
+	  fz_catch(ctx) {
+	    fprintf(stderr, "ERROR: Unable to load page %d: %s\n", pageno + 2,
+		    fz_caught_message(ctx));
+	    bands[0].error = 1;
+	  }
+	}
+
+#ifdef HAVE_PTHREAD_H
+	for (i = 1; i < active; i ++)
+	  if (bands[i].thread) {
+	    pthread_join(threads[i], NULL);
+	    bands[i].thread = 0;
+	  }
+#endif /* HAVE_PTHREAD_H */
+
+	/* Write the bands in page order */
+	for (i = 0; i < active; i ++) {
+	  if (bands[i].error)
+	    continue;
+	  for (line = 0; line < bands[i].bbox.y1 - bands[i].bbox.y0; line ++) {
+	    if (mono)
+	      row = bands[i].bitmap->samples + line * bands[i].bitmap->stride;
+	    else
+	      row = bands[i].samples + line * stride;
+	    cupsRasterWritePixels(ras, row, h->cupsBytesPerLine);
+	  }
+	  fz_drop_bitmap(ctx, bands[i].bitmap);
+	  bands[i].bitmap = NULL;
+	}
+
+	for (i = 0; i < active; i ++)
+	  if (bands[i].error)
+	    fz_throw(ctx, FZ_ERROR_GENERIC, "Rendering of page %d failed",
+		     pageno + 1);
+      }
+    }
+
+    status = 0;
+  }
+  fz_always(ctx) {
+    fz_drop_display_list(ctx, list);
+    fz_drop_display_list(ctx, next_list);
+    fz_drop_document(ctx, doc);
+    if (ras)
+      cupsRasterClose(ras);
+  }
+  fz_catch(ctx) {
+    fprintf(stderr, "ERROR: %s\n", fz_caught_message(ctx));
+  }
+
+  for (i = 0; i < num_threads; i ++) {
+    free(bands[i].samples);
+    if (i > 0)
+      fz_drop_context(bands[i].ctx);
+  }
+  fz_drop_context(ctx);
+
+  return status;
+}
+#endif /* HAVE_LIBMUPDF */
 
 int
 main (int argc, char **argv, char *envp[])
 {
   char buf[BUFSIZ];
   char *icc_profile = NULL;
+#ifndef HAVE_LIBMUPDF
   char tmpstr[1024];
+#endif /* !HAVE_LIBMUPDF */
   const char *t = NULL;
   cups_array_t *mupdf_args = NULL;
   cups_option_t *options = NULL;
@@ -332,6 +728,7 @@ main (int argc, char **argv, char *envp[])
   if (!cm_disabled)
     cmGetPrinterIccProfile(getenv("PRINTER"), &icc_profile, ppd);
 
+#ifndef HAVE_LIBMUPDF
   /* mutool parameters */
   mupdf_args = cupsArrayNew(NULL, NULL);
   if (!mupdf_args) {
@@ -349,6 +746,7 @@ main (int argc, char **argv, char *envp[])
 
   /* mutool output parameters */
   cupsArrayAdd(mupdf_args, strdup("-Fpwg"));
+#endif /* !HAVE_LIBMUPDF */
 
   /* Note that MuPDF only creates PWG Raster and never CUPS Raster,
      so we always set the PWG Raster flag in the cupsRasterParseIPPOptions()
@@ -402,6 +800,11 @@ main (int argc, char **argv, char *envp[])
   h.MirrorPrint = CUPS_FALSE;
   h.Orientation = CUPS_ORIENT_0;
 
+#ifdef HAVE_LIBMUPDF
+  /* render in-process, band by band, straight into the raster stream */
+  if (!empty)
+    status = mupdf_render(infilename, &h, num_options, options);
+#else
   /* get all the data from the header and pass it to mutool */
   add_pdf_header_options (&h, mupdf_args);
 
@@ -414,6 +817,7 @@ main (int argc, char **argv, char *envp[])
   /* call mutool */
   status = mutool_spawn (tmpstr, mupdf_args, envp);
   if (status != 0) status = 1;
+#endif /* HAVE_LIBMUPDF */
 
   if(empty)
   {
@@ -25,6 +25,7 @@
 
 #include <qpdf/QPDF.hh>
 #include <qpdf/QPDFObjectHandle.hh>
+#include <vector>
 #include <cupsfilters/raster.h>
 #include <cupsfilters/image.h>
 #include <cupsfilters/bitmap.h>
@@ -48,6 +49,7 @@ namespace {
   ppd_file_t *ppd = 0;
   char pageSizeRequested[64];
   int bi_level = 0;
+  int preview = 1; /* preview resolution reduction factor */
   /* image swapping */
   bool swap_image_x = false;
   bool swap_image_y = false;
@@ -164,6 +166,7 @@ static void parseOpts(int argc, char **argv)
     exit(1);
 #endif /* HAVE_CUPS_1_7 */
   }
+  preview = cupsRasterPreviewResolution(&header, num_options, options);
   if ((val = cupsGetOption("print-color-mode", num_options, options)) != NULL
                            && !strncasecmp(val, "bi-level", 8))
     bi_level = 1;
@@ -515,6 +518,27 @@ static void selectConvertFunc (std::string colorspace, int pgno) {
 
 }
 
+/*
+ * Check whether the page's image data already is in the output format, so
+ * that the strips can be written out as they are, without rotating, color
+ * converting or re-packing them line by line.
+ */
+static bool canPassThrough(std::string colorspace, int pgno, long long rotate)
+{
+  if (rotate || preview > 1)
+    return false;
+  if (header.Duplex && (pgno & 1) && (swap_image_x || swap_image_y))
+    return false;
+  if (header.cupsBitsPerColor != 8 ||
+      header.cupsColorOrder != CUPS_ORDER_CHUNKED)
+    return false;
+
+  selectConvertFunc(colorspace, pgno);
+
+  return (convertcspace == convertcspaceNoop &&
+	  header.cupsBitsPerPixel == 8 * numcolors);
+}
+
 static void outPage(cups_raster_t *raster, QPDFObjectHandle page, int pgno) {
   long long		rotate = 0,
 			height,
@@ -532,6 +556,8 @@ static void outPage(cups_raster_t *raster, QPDFObjectHandle page, int pgno) {
   QPDFObjectHandle	image;
   QPDFObjectHandle	imgdict;
   QPDFObjectHandle	colorspace_obj;
+  std::vector<PointerHolder<Buffer> > strips;
+  bool			passthrough = true;
 
   // Check if page is rotated.
   if (page.getKey("/Rotate").isInteger())
@@ -626,19 +652,59 @@ static void outPage(cups_raster_t *raster, QPDFObjectHandle page, int pgno) {
     colorspace_obj = imgdict.getKey("/ColorSpace");
     header.cupsHeight += height;
     bufsize = actual_data->getSize();
-
-    if(!pixel_count) {
-      bitmap = (unsigned char *) malloc(bufsize);
-    }
-    else {
-      bitmap = (unsigned char *) realloc(bitmap, pixel_count + bufsize);
-    }
-    memcpy(bitmap + pixel_count, actual_data->getBuffer(), bufsize);
     pixel_count += bufsize;
 
+    // All strips must be complete and of the same width to be passed through
+    if (strips.size() && width != header.cupsWidth)
+      passthrough = false;
+    strips.push_back(actual_data);
+
     if (width > header.cupsWidth) header.cupsWidth = width;
   }
 
+  colorspace = (colorspace_obj.isName() ? colorspace_obj.getName() : "/DeviceRGB"); // Default for pclm files in DeviceRGB
+
+  if (passthrough && !strips.empty() &&
+      canPassThrough(colorspace, pgno, rotate) &&
+      pixel_count == (long long)header.cupsHeight * rowsize) {
+    bytesPerLine = header.cupsBytesPerLine = rowsize;
+
+    if (!cupsRasterWriteHeader2(raster,&header)) {
+      fprintf(stderr, "ERROR: Can't write page %d header\n", pgno + 1);
+      exit(1);
+    }
+
+    fprintf(stderr, "DEBUG: Page %d matches output format, passing it through\n", pgno + 1);
+    for (auto const& strip: strips)
+      cupsRasterWritePixels(raster, strip->getBuffer(), strip->getSize());
+    return;
+  }
+
+  // Collect the strips into one bitmap for conversion
+  bitmap = (unsigned char *) malloc(pixel_count ? pixel_count : 1);
+  pixel_count = 0;
+  for (auto const& strip: strips) {
+    memcpy(bitmap + pixel_count, strip->getBuffer(), strip->getSize());
+    pixel_count += strip->getSize();
+  }
+  strips.clear();
+
+  // Preview jobs: keep only every preview-th column of every preview-th row
+  if (preview > 1 && bitmap) {
+    unsigned int bpp = (colorspace == "/DeviceGray" ? 1 : colorspace == "/DeviceCMYK" ? 4 : 3);
+    unsigned int w = (header.cupsWidth + preview - 1) / preview;
+    unsigned int h = (header.cupsHeight + preview - 1) / preview;
+    for (unsigned int y = 0; y < h; y ++) {
+      unsigned char *sp = bitmap + (size_t)y * preview * header.cupsWidth * bpp;
+      unsigned char *dp = bitmap + (size_t)y * w * bpp;
+      for (unsigned int x = 0; x < w; x ++, sp += preview * bpp, dp += bpp)
+        memmove(dp, sp, bpp);
+    }
+    header.cupsWidth = w;
+    header.cupsHeight = h;
+    pixel_count = w * h * bpp;
+  }
+
   // Swap width and height in landscape images
   if (rotate == 270 || rotate == 90) {
     temp = header.cupsHeight;
@@ -656,8 +722,6 @@ static void outPage(cups_raster_t *raster, QPDFObjectHandle page, int pgno) {
     exit(1);
   }
 
-  colorspace = (colorspace_obj.isName() ? colorspace_obj.getName() : "/DeviceRGB"); // Default for pclm files in DeviceRGB
-
   // If page is to be swapped in both x and y, rotate it by 180 degress
   if (header.Duplex && (pgno & 1) && swap_image_y && swap_image_x) {
     rotate = (rotate + 180) % 360;
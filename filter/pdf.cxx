@@ -53,6 +53,23 @@ static QPDFObjectHandle makeRealBox(float values[4])
 }
 
 
+/**
+ * 'get_page()' - Look up a page in the page list cached by QPDF, without
+ *                copying the list.
+ * O - Page object, null object if there is no such page
+ * I - Pointer to QPDF object
+ * I - page number, starting at 1
+ */
+static QPDFObjectHandle get_page(pdf_t *pdf, unsigned page_num)
+{
+  std::vector<QPDFObjectHandle> const& pages = pdf->getAllPages();
+  if (page_num < 1 || page_num > pages.size())
+    return QPDFObjectHandle::newNull();
+
+  return pages[page_num - 1];
+}
+
+
 /**
  * 'pdf_load_template()' - Load an existing PDF file and do initial parsing
  *                         using QPDF.
@@ -121,14 +138,12 @@ extern "C" void pdf_prepend_stream(pdf_t *pdf,
                                    char const *buf,
                                    size_t len)
 {
-  std::vector<QPDFObjectHandle> pages = pdf->getAllPages();
-  if (pages.empty() || page_num > pages.size()) {
+  QPDFObjectHandle page = get_page(pdf, page_num);
+  if (page.isNull()) {
     fprintf(stderr, "ERROR: Unable to prepend stream to requested PDF page\n");
     return;
   }
 
-  QPDFObjectHandle page = pages[page_num - 1];
-
   // get page contents stream / array  
   QPDFObjectHandle contents = page.getKey("/Contents");
   if (!contents.isStream() && !contents.isArray())
@@ -168,14 +183,12 @@ extern "C" void pdf_add_type1_font(pdf_t *pdf,
                                    unsigned page_num,
                                    const char *name)
 {
-  std::vector<QPDFObjectHandle> pages = pdf->getAllPages();
-  if (pages.empty() || page_num > pages.size()) {
+  QPDFObjectHandle page = get_page(pdf, page_num);
+  if (page.isNull()) {
     fprintf(stderr, "ERROR: Unable to add type1 font to requested PDF page\n");
     return;
   }
 
-  QPDFObjectHandle page = pages[page_num - 1];
-
   QPDFObjectHandle resources = page.getKey("/Resources");
   if (!resources.isDictionary())
   {
@@ -289,13 +302,12 @@ extern "C" void pdf_resize_page (pdf_t *pdf,
                                  float length,
                                  float *scale)
 {
-  std::vector<QPDFObjectHandle> pages = pdf->getAllPages();
-  if (pages.empty() || page_num > pages.size()) {
+  QPDFObjectHandle page = get_page(pdf, page_num);
+  if (page.isNull()) {
     fprintf(stderr, "ERROR: Unable to resize requested PDF page\n");
     return;
   }
 
-  QPDFObjectHandle page = pages[page_num - 1];
   float new_mediabox[4] = { 0.0, 0.0, width, length };
   float old_mediabox[4];
   QPDFObjectHandle media_box;
@@ -326,18 +338,21 @@ extern "C" void pdf_duplicate_page (pdf_t *pdf,
                                     unsigned page_num,
                                     unsigned count)
 {
-  std::vector<QPDFObjectHandle> pages = pdf->getAllPages();
-  if (pages.empty() || page_num > pages.size()) {
+  QPDFObjectHandle page = get_page(pdf, page_num);
+  if (page.isNull()) {
     fprintf(stderr, "ERROR: Unable to duplicate requested PDF page\n");
     return;
   }
 
-  QPDFObjectHandle page = pages[page_num - 1];
+  // let all copies refer to the same resources instead of writing them
+  // out once per page; the content streams are shared already
+  QPDFObjectHandle resources = page.getKey("/Resources");
+  if (resources.isDictionary() && !resources.isIndirect())
+    page.replaceKey("/Resources", pdf->makeIndirectObject(resources));
+
+  // each copy is only a small page dictionary of its own
   for (unsigned i = 0; i < count; ++i)
-  {
-    page = pdf->makeIndirectObject(page);
-    pdf->addPage(page, false);
-  }
+    pdf->addPage(pdf->makeIndirectObject(page.shallowCopy()), false);
 }
 
 
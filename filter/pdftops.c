@@ -14,6 +14,11 @@
  *
  *   parsePDFTOPDFComment() - Check whether we are executed after pdftopdf
  *   remove_options()       - Remove unwished entries from an option list
+ *   post_process()         - Apply workarounds and PPD-less option settings
+ *                            to the renderer's output
+ *   pp_fill()              - Refill the post-processing input buffer
+ *   pp_gets()              - Read a line of renderer output
+ *   pp_copy()              - Copy the rest of the renderer output
  *   log_command_line()     - Log the command line of a program which we call
  *   main()                 - Main entry for filter...
  *   cancel_job()           - Flag the job as canceled.
@@ -45,11 +50,22 @@
 typedef unsigned renderer_t;
 enum renderer_e {GS = 0, PDFTOPS = 1, ACROREAD = 2, PDFTOCAIRO = 3, MUPDF = 4, HYBRID = 5};
 
+typedef struct pp_file_s		/* Renderer output to post-process */
+{
+  int		fd;			/* Pipe from the renderer */
+  char		buf[65536],		/* Read buffer */
+		*ptr,			/* Next byte in buffer */
+		*end;			/* End of data in buffer */
+} pp_file_t;
+
 /*
  * Local functions...
  */
 
 static void		cancel_job(int sig);
+static int		pp_fill(pp_file_t *pf);
+static int		pp_gets(pp_file_t *pf, char *line, int linesize);
+static void		pp_copy(pp_file_t *pf);
 
 
 /*
@@ -263,6 +279,434 @@ int is_empty(char *filename)
 }
 
 
+/*
+ * 'pp_fill()' - Refill the post-processing input buffer.
+ */
+
+static int				/* O - Bytes read, 0 on EOF or error */
+pp_fill(pp_file_t *pf)			/* I - Renderer output */
+{
+  ssize_t	bytes;			/* Bytes read */
+
+
+  while ((bytes = read(pf->fd, pf->buf, sizeof(pf->buf))) < 0)
+    if (errno != EINTR || job_canceled)
+      return (0);
+
+  pf->ptr = pf->buf;
+  pf->end = pf->buf + bytes;
+
+  return ((int)bytes);
+}
+
+
+/*
+ * 'pp_gets()' - Read a CR and/or LF-terminated line of renderer output,
+ *               like cupsFileGetLine().
+ */
+
+static int				/* O - Bytes in line, 0 on EOF */
+pp_gets(pp_file_t *pf,			/* I - Renderer output */
+        char      *line,		/* O - Line, including line ending */
+	int       linesize)		/* I - Size of line buffer */
+{
+  char	*lineptr = line,		/* Current position in line */
+	*lineend = line + linesize - 3;	/* End of line buffer */
+
+
+  while (lineptr < lineend)
+  {
+    if (pf->ptr >= pf->end && !pp_fill(pf))
+      break;
+
+    *lineptr++ = *pf->ptr++;
+
+    if (lineptr[-1] == '\r')
+    {
+     /*
+      * Check for CR LF...
+      */
+
+      if (pf->ptr < pf->end || pp_fill(pf))
+        if (*pf->ptr == '\n')
+	  *lineptr++ = *pf->ptr++;
+
+      break;
+    }
+    else if (lineptr[-1] == '\n')
+      break;
+  }
+
+  *lineptr = '\0';
+
+  return ((int)(lineptr - line));
+}
+
+
+/*
+ * 'pp_copy()' - Copy the rest of the renderer output to stdout.
+ *
+ * Only the beginning of the PostScript output is modified, the rest is
+ * moved from the renderer's pipe to pstops' pipe in the kernel if possible.
+ */
+
+static void
+pp_copy(pp_file_t *pf)			/* I - Renderer output */
+{
+  ssize_t	bytes;			/* Bytes copied */
+
+
+  fflush(stdout);
+
+  do
+  {
+    while (pf->ptr < pf->end)
+    {
+      if ((bytes = write(1, pf->ptr, pf->end - pf->ptr)) < 0)
+      {
+        if (errno == EINTR && !job_canceled)
+	  continue;
+
+	perror("DEBUG: Unable to write post-processed output");
+	return;
+      }
+
+      pf->ptr += bytes;
+    }
+
+#ifdef SPLICE_F_MOVE
+    while ((bytes = splice(pf->fd, NULL, 1, NULL, sizeof(pf->buf),
+			   SPLICE_F_MOVE | SPLICE_F_MORE)) > 0 ||
+	   (bytes < 0 && errno == EINTR && !job_canceled));
+
+    if (bytes == 0 || errno != EINVAL)
+      return;
+#endif /* SPLICE_F_MOVE */
+  }
+  while (pp_fill(pf) > 0);
+}
+
+
+/*
+ * 'post_process()' - Apply workarounds for the printer's PostScript
+ *                    interpreter and PPD-less option settings to the
+ *                    renderer's output on its way to pstops.
+ */
+
+static void
+post_process(pp_file_t     *pf,		/* I - Renderer output */
+	     renderer_t    renderer,	/* I - Renderer used */
+	     char          *argv[],	/* I - Filter arguments */
+	     ppd_file_t    *ppd,	/* I - PPD file */
+	     int           num_options,	/* I - Number of options */
+	     cups_option_t *options,	/* I - Options */
+	     int           xres,	/* I - Horizontal resolution */
+	     int           yres)	/* I - Vertical resolution */
+{
+  char		buffer[8192];		/* Line buffer */
+  int		bytes;			/* Bytes in line */
+  const char	*val;			/* Option value */
+  int		duplex, tumble;		/* Duplex settings for PPD-less
+					   printing */
+
+
+  if (renderer == ACROREAD)
+  {
+   /*
+    * Set %Title and %For from filter arguments since acroread inserts
+    * garbage for these when using -toPostScript
+    */
+
+    while ((bytes = pp_gets(pf, buffer, sizeof(buffer))) > 0 &&
+	   strncmp(buffer, "%%BeginProlog", 13))
+    {
+      if (strncmp(buffer, "%%Title", 7) == 0)
+	printf("%%%%Title: %s\n", argv[3]);
+      else if (strncmp(buffer, "%%For", 5) == 0)
+	printf("%%%%For: %s\n", argv[2]);
+      else
+	printf("%s", buffer);
+    }
+
+   /*
+    * Copy the rest of the file
+    */
+    pp_copy(pf);
+  }
+  else
+  {
+
+   /*
+    * Copy everything until after initial comments (Prolog section)
+    */
+    while ((bytes = pp_gets(pf, buffer, sizeof(buffer))) > 0 &&
+	   strncmp(buffer, "%%BeginProlog", 13) &&
+	   strncmp(buffer, "%%EndProlog", 11) &&
+	   strncmp(buffer, "%%BeginSetup", 12) &&
+	   strncmp(buffer, "%%Page:", 7))
+      printf("%s", buffer);
+
+    if (bytes > 0)
+    {
+     /*
+      * Insert PostScript interpreter bug fix code in the beginning of
+      * the Prolog section (before the first active PostScript code)
+      */
+      if (strncmp(buffer, "%%BeginProlog", 13))
+      {
+	/* No Prolog section, create one */
+	fprintf(stderr, "DEBUG: Adding Prolog section for workaround PostScript code\n");
+	puts("%%BeginProlog");
+      }
+      else
+	printf("%s", buffer);
+
+      if (renderer == GS && make_model[0])
+      {
+
+       /*
+	* Kyocera (and Utax) printers have a bug in their PostScript
+	* interpreter making them crashing on PostScript input data
+	* generated by Ghostscript's "ps2write" output device.
+	*
+	* The problem can be simply worked around by preceding the
+	* PostScript code with some extra bits.
+	*
+	* See https://bugs.launchpad.net/bugs/951627
+	*
+	* In addition, at least some of Kyocera's PostScript printers are
+	* very slow on rendering images which request interpolation. So we
+	* also add some code to eliminate interpolation requests.
+	*
+	* See https://bugs.launchpad.net/bugs/1026974
+	*/
+
+	if (!strncasecmp(make_model, "Kyocera", 7) ||
+	    !strncasecmp(make_model, "Utax", 4))
+	{
+	  fprintf(stderr, "DEBUG: Inserted workaround PostScript code for Kyocera and Utax printers\n");
+	  puts("% ===== Workaround insertion by pdftops CUPS filter =====");
+	  puts("% Kyocera's/Utax's PostScript interpreter crashes on early name binding,");
+	  puts("% so eliminate all \"bind\"s by redefining \"bind\" to no-op");
+	  puts("/bind {} bind def");
+	  puts("% Some Kyocera and Utax printers have an unacceptably slow implementation");
+	  puts("% of image interpolation.");
+	  puts("/image");
+	  puts("{");
+	  puts("  dup /Interpolate known");
+	  puts("  {");
+	  puts("    dup /Interpolate undef");
+	  puts("  } if");
+	  puts("  systemdict /image get exec");
+	  puts("} def");
+	  puts("% =====");
+	}
+
+       /*
+	* Brother printers have a bug in their PostScript interpreter
+	* making them printing one blank page if PostScript input data
+	* generated by Ghostscript's "ps2write" output device is used.
+	*
+	* The problem can be simply worked around by preceding the PostScript
+	* code with some extra bits.
+	*
+	* See https://bugs.launchpad.net/bugs/950713
+	*/
+
+	else if (!strncasecmp(make_model, "Brother", 7))
+	{
+	  fprintf(stderr, "DEBUG: Inserted workaround PostScript code for Brother printers\n");
+	  puts("% ===== Workaround insertion by pdftops CUPS filter =====");
+	  puts("% Brother's PostScript interpreter spits out the current page");
+	  puts("% and aborts the job on the \"currenthalftone\" operator, so redefine");
+	  puts("% it to null");
+	  puts("/currenthalftone {//null} bind def");
+	  puts("/orig.sethalftone systemdict /sethalftone get def");
+	  puts("/sethalftone {dup //null eq not {//orig.sethalftone}{pop} ifelse} bind def");
+	  puts("% =====");
+	}
+      }
+
+      if (strncmp(buffer, "%%BeginProlog", 13))
+      {
+	/* Close newly created Prolog section */
+	if (strncmp(buffer, "%%EndProlog", 11))
+	  puts("%%EndProlog");
+	printf("%s", buffer);
+      }
+
+      if (!ppd)
+      {
+       /*
+	* Copy everything until the setup section
+	*/
+	while (bytes > 0 &&
+	       strncmp(buffer, "%%BeginSetup", 12) &&
+	       strncmp(buffer, "%%EndSetup", 10) &&
+	       strncmp(buffer, "%%Page:", 7))
+	{
+	  bytes = pp_gets(pf, buffer, sizeof(buffer));
+	  if (strncmp(buffer, "%%Page:", 7) &&
+	      strncmp(buffer, "%%EndSetup", 10))
+	    printf("%s", buffer);
+	}
+
+	if (bytes > 0)
+	{
+	 /*
+	  * Insert option PostScript code in Setup section
+	  */
+	  if (strncmp(buffer, "%%BeginSetup", 12))
+	  {
+	    /* No Setup section, create one */
+	    fprintf(stderr, "DEBUG: Adding Setup section for option PostScript code\n");
+	    puts("%%BeginSetup");
+	  }
+
+	 /*
+	  * Duplex
+	  */
+	  duplex = 0;
+	  tumble = 0;
+	  if ((val = cupsGetOption("sides", num_options, options)) != NULL ||
+	      (val = cupsGetOption("Duplex", num_options, options)) != NULL)
+	  {
+	    if (!strcasecmp(val, "On") ||
+		     !strcasecmp(val, "True") || !strcasecmp(val, "Yes") ||
+		     !strncasecmp(val, "two-sided", 9) ||
+		     !strncasecmp(val, "TwoSided", 8) ||
+		     !strncasecmp(val, "Duplex", 6))
+	    {
+	      duplex = 1;
+	      if (!strncasecmp(val, "DuplexTumble", 12))
+		tumble = 1;
+	    }
+	  }
+
+	  if ((val = cupsGetOption("sides", num_options, options)) != NULL ||
+	      (val = cupsGetOption("Tumble", num_options, options)) != NULL)
+	  {
+	    if (!strcasecmp(val, "None") || !strcasecmp(val, "Off") ||
+		!strcasecmp(val, "False") || !strcasecmp(val, "No") ||
+		!strcasecmp(val, "one-sided") || !strcasecmp(val, "OneSided") ||
+		!strcasecmp(val, "two-sided-long-edge") ||
+		!strcasecmp(val, "TwoSidedLongEdge") ||
+		!strcasecmp(val, "DuplexNoTumble"))
+	      tumble = 0;
+	    else if (!strcasecmp(val, "On") ||
+		     !strcasecmp(val, "True") || !strcasecmp(val, "Yes") ||
+		     !strcasecmp(val, "two-sided-short-edge") ||
+		     !strcasecmp(val, "TwoSidedShortEdge") ||
+		     !strcasecmp(val, "DuplexTumble"))
+	      tumble = 1;
+	  }
+
+	  if (duplex)
+	  {
+	    if (tumble)
+	      puts("<</Duplex true /Tumble true>> setpagedevice");
+	    else
+	      puts("<</Duplex true /Tumble false>> setpagedevice");
+	  }
+	  else
+	    puts("<</Duplex false>> setpagedevice");
+
+	 /*
+	  * Resolution
+	  */
+	  if ((xres > 0) && (yres > 0))
+	    printf("<</HWResolution[%d %d]>> setpagedevice\n", xres, yres);
+
+	 /*
+	  * InputSlot/MediaSource
+	  */
+	  if ((val = cupsGetOption("media-position", num_options,
+				   options)) != NULL ||
+	      (val = cupsGetOption("MediaPosition", num_options,
+				   options)) != NULL ||
+	      (val = cupsGetOption("media-source", num_options,
+				   options)) != NULL ||
+	      (val = cupsGetOption("MediaSource", num_options,
+				   options)) != NULL ||
+	      (val = cupsGetOption("InputSlot", num_options,
+				   options)) != NULL)
+	  {
+	    if (!strncasecmp(val, "Auto", 4) ||
+		!strncasecmp(val, "Default", 7))
+	      puts("<</ManualFeed false /MediaPosition 7>> setpagedevice");
+	    else if (!strcasecmp(val, "Main"))
+	      puts("<</MediaPosition 0 /ManualFeed false>> setpagedevice");
+	    else if (!strcasecmp(val, "Alternate"))
+	      puts("<</MediaPosition 1 /ManualFeed false>> setpagedevice");
+	    else if (!strcasecmp(val, "Manual"))
+	      puts("<</MediaPosition 3 /ManualFeed true>> setpagedevice");
+	    else if (!strcasecmp(val, "Top"))
+	      puts("<</MediaPosition 0 /ManualFeed false>> setpagedevice");
+	    else if (!strcasecmp(val, "Bottom"))
+	      puts("<</MediaPosition 1 /ManualFeed false>> setpagedevice");
+	    else if (!strcasecmp(val, "ByPassTray"))
+	      puts("<</MediaPosition 3 /ManualFeed false>> setpagedevice");
+	    else if (!strcasecmp(val, "Tray1"))
+	      puts("<</MediaPosition 3 /ManualFeed false>> setpagedevice");
+	    else if (!strcasecmp(val, "Tray2"))
+	      puts("<</MediaPosition 0 /ManualFeed false>> setpagedevice");
+	    else if (!strcasecmp(val, "Tray3"))
+	      puts("<</MediaPosition 1 /ManualFeed false>> setpagedevice");
+	  }
+
+	 /*
+	  * ColorModel
+	  */
+	  if ((val = cupsGetOption("pwg-raster-document-type", num_options,
+				   options)) != NULL ||
+	      (val = cupsGetOption("PwgRasterDocumentType", num_options,
+				   options)) != NULL ||
+	      (val = cupsGetOption("print-color-mode", num_options,
+				   options)) != NULL ||
+	      (val = cupsGetOption("PrintColorMode", num_options,
+				   options)) != NULL ||
+	      (val = cupsGetOption("color-space", num_options,
+				   options)) != NULL ||
+	      (val = cupsGetOption("ColorSpace", num_options,
+				   options)) != NULL ||
+	      (val = cupsGetOption("color-model", num_options,
+				   options)) != NULL ||
+	      (val = cupsGetOption("ColorModel", num_options,
+				   options)) != NULL)
+	  {
+	    if (!strncasecmp(val, "Black", 5))
+	      puts("<</ProcessColorModel /DeviceGray>> setpagedevice");
+	    else if (!strncasecmp(val, "Cmyk", 4))
+	      puts("<</ProcessColorModel /DeviceCMYK>> setpagedevice");
+	    else if (!strncasecmp(val, "Cmy", 3))
+	      puts("<</ProcessColorModel /DeviceCMY>> setpagedevice");
+	    else if (!strncasecmp(val, "Rgb", 3))
+	      puts("<</ProcessColorModel /DeviceRGB>> setpagedevice");
+	    else if (!strncasecmp(val, "Gray", 4))
+	      puts("<</ProcessColorModel /DeviceGray>> setpagedevice");
+	    else if (!strncasecmp(val, "Color", 5))
+	      puts("<</ProcessColorModel /DeviceRGB>> setpagedevice");
+	  }
+
+	  if (strncmp(buffer, "%%BeginSetup", 12))
+	  {
+	    /* Close newly created Setup section */
+	    if (strncmp(buffer, "%%EndSetup", 10))
+	      puts("%%EndSetup");
+	    printf("%s", buffer);
+	  }
+	}
+      }
+
+     /*
+      * Copy the rest of the file
+      */
+      pp_copy(pf);
+    }
+  }
+}
+
+
 /*
  * Before calling any command line utility, log its command line in CUPS'
  * debug mode
@@ -317,13 +761,12 @@ main(int  argc,				/* I - Number of command-line args */
   ppd_choice_t  *choice;
   ppd_attr_t    *attr;
   cups_page_header2_t header;
-  cups_file_t	*fp;			/* Post-processing input file */
+  pp_file_t	pf;			/* Post-processing input */
   int		pdf_pid,		/* Process ID for pdftops/gs */
 		pdf_argc = 0,		/* Number of args for pdftops/gs */
 		pstops_pid,		/* Process ID of pstops filter */
 		pstops_pipe[2],		/* Pipe to pstops filter */
 		need_post_proc = 0,     /* Post-processing needed? */
-		post_proc_pid = 0,	/* Process ID of post-processing */
 		post_proc_pipe[2],	/* Pipe to post-processing */
 		wait_children,		/* Number of child processes left */
 		wait_pid,		/* Process ID from wait() */
@@ -338,8 +781,6 @@ main(int  argc,				/* I - Number of command-line args */
 		*ptr;			/* Pointer into value */
   const char	*cups_serverbin;	/* CUPS_SERVERBIN environment
 					   variable */
-  int		duplex, tumble;         /* Duplex settings for PPD-less
-					   printing */
 #if defined(HAVE_SIGACTION) && !defined(HAVE_SIGSET)
   struct sigaction action;		/* Actions for POSIX signals */
 #endif /* HAVE_SIGACTION && !HAVE_SIGSET */
@@ -1138,337 +1579,6 @@ main(int  argc,				/* I - Number of command-line args */
 
   fprintf(stderr, "DEBUG: Started filter %s (PID %d)\n", pdf_argv[0], pdf_pid);
 
-  if (need_post_proc)
-  {
-    if ((post_proc_pid = fork()) == 0)
-    {
-     /*
-      * Child comes here...
-      */
-
-      dup2(post_proc_pipe[0], 0);
-      close(post_proc_pipe[0]);
-      close(post_proc_pipe[1]);
-      dup2(pstops_pipe[1], 1);
-      close(pstops_pipe[0]);
-      close(pstops_pipe[1]);
-
-      fp = cupsFileStdin();
-
-      if (renderer == ACROREAD)
-      {
-       /*
-        * Set %Title and %For from filter arguments since acroread inserts
-        * garbage for these when using -toPostScript
-        */
-
-        while ((bytes = cupsFileGetLine(fp, buffer, sizeof(buffer))) > 0 &&
-               strncmp(buffer, "%%BeginProlog", 13))
-        {
-          if (strncmp(buffer, "%%Title", 7) == 0)
-            printf("%%%%Title: %s\n", argv[3]);
-          else if (strncmp(buffer, "%%For", 5) == 0)
-            printf("%%%%For: %s\n", argv[2]);
-          else
-            printf("%s", buffer);
-        }
-
-       /*
-	* Copy the rest of the file
-	*/
-	while ((bytes = cupsFileRead(fp, buffer, sizeof(buffer))) > 0)
-	  fwrite(buffer, 1, bytes, stdout);
-      }
-      else
-      {
-
-       /*
-	* Copy everything until after initial comments (Prolog section)
-	*/
-	while ((bytes = cupsFileGetLine(fp, buffer, sizeof(buffer))) > 0 &&
-	       strncmp(buffer, "%%BeginProlog", 13) &&
-	       strncmp(buffer, "%%EndProlog", 11) &&
-	       strncmp(buffer, "%%BeginSetup", 12) &&
-	       strncmp(buffer, "%%Page:", 7))
-	  printf("%s", buffer);
-
-	if (bytes > 0)
-	{
-	 /*
-	  * Insert PostScript interpreter bug fix code in the beginning of
-	  * the Prolog section (before the first active PostScript code)
-	  */
-	  if (strncmp(buffer, "%%BeginProlog", 13))
-	  {
-	    /* No Prolog section, create one */
-	    fprintf(stderr, "DEBUG: Adding Prolog section for workaround PostScript code\n");
-	    puts("%%BeginProlog");
-	  }
-	  else
-	    printf("%s", buffer);
-
-	  if (renderer == GS && make_model[0])
-	  {
-
-	   /*
-	    * Kyocera (and Utax) printers have a bug in their PostScript
-	    * interpreter making them crashing on PostScript input data
-	    * generated by Ghostscript's "ps2write" output device.
-	    *
-	    * The problem can be simply worked around by preceding the
-	    * PostScript code with some extra bits.
-	    *
-	    * See https://bugs.launchpad.net/bugs/951627
-	    *
-	    * In addition, at least some of Kyocera's PostScript printers are
-	    * very slow on rendering images which request interpolation. So we
-	    * also add some code to eliminate interpolation requests.
-	    *
-	    * See https://bugs.launchpad.net/bugs/1026974
-	    */
-
-	    if (!strncasecmp(make_model, "Kyocera", 7) ||
-		!strncasecmp(make_model, "Utax", 4))
-	    {
-	      fprintf(stderr, "DEBUG: Inserted workaround PostScript code for Kyocera and Utax printers\n");
-	      puts("% ===== Workaround insertion by pdftops CUPS filter =====");
-	      puts("% Kyocera's/Utax's PostScript interpreter crashes on early name binding,");
-	      puts("% so eliminate all \"bind\"s by redefining \"bind\" to no-op");
-	      puts("/bind {} bind def");
-	      puts("% Some Kyocera and Utax printers have an unacceptably slow implementation");
-	      puts("% of image interpolation.");
-	      puts("/image");
-	      puts("{");
-	      puts("  dup /Interpolate known");
-	      puts("  {");
-	      puts("    dup /Interpolate undef");
-	      puts("  } if");
-	      puts("  systemdict /image get exec");
-	      puts("} def");
-	      puts("% =====");
-	    }
-
-	   /*
-	    * Brother printers have a bug in their PostScript interpreter
-	    * making them printing one blank page if PostScript input data
-	    * generated by Ghostscript's "ps2write" output device is used.
-	    *
-	    * The problem can be simply worked around by preceding the PostScript
-	    * code with some extra bits.
-	    *
-	    * See https://bugs.launchpad.net/bugs/950713
-	    */
-
-	    else if (!strncasecmp(make_model, "Brother", 7))
-	    {
-	      fprintf(stderr, "DEBUG: Inserted workaround PostScript code for Brother printers\n");
-	      puts("% ===== Workaround insertion by pdftops CUPS filter =====");
-	      puts("% Brother's PostScript interpreter spits out the current page");
-	      puts("% and aborts the job on the \"currenthalftone\" operator, so redefine");
-	      puts("% it to null");
-	      puts("/currenthalftone {//null} bind def");
-	      puts("/orig.sethalftone systemdict /sethalftone get def");
-	      puts("/sethalftone {dup //null eq not {//orig.sethalftone}{pop} ifelse} bind def");
-	      puts("% =====");
-	    }
-	  }
-
-	  if (strncmp(buffer, "%%BeginProlog", 13))
-	  {
-	    /* Close newly created Prolog section */
-	    if (strncmp(buffer, "%%EndProlog", 11))
-	      puts("%%EndProlog");
-	    printf("%s", buffer);
-	  }
-
-	  if (!ppd)
-	  {
-	   /*
-	    * Copy everything until the setup section
-	    */
-	    while (bytes > 0 &&
-		   strncmp(buffer, "%%BeginSetup", 12) &&
-		   strncmp(buffer, "%%EndSetup", 10) &&
-		   strncmp(buffer, "%%Page:", 7))
-	    {
-	      bytes = cupsFileGetLine(fp, buffer, sizeof(buffer));
-	      if (strncmp(buffer, "%%Page:", 7) &&
-		  strncmp(buffer, "%%EndSetup", 10))
-		printf("%s", buffer);
-	    }
-	  
-	    if (bytes > 0)
-	    {
-	     /*
-	      * Insert option PostScript code in Setup section
-	      */
-	      if (strncmp(buffer, "%%BeginSetup", 12))
-	      {
-		/* No Setup section, create one */
-		fprintf(stderr, "DEBUG: Adding Setup section for option PostScript code\n");
-		puts("%%BeginSetup");
-	      }
-
-	     /*
-	      * Duplex
-	      */
-	      duplex = 0;
-	      tumble = 0;
-	      if ((val = cupsGetOption("sides", num_options, options)) != NULL ||
-		  (val = cupsGetOption("Duplex", num_options, options)) != NULL)
-	      {
-		if (!strcasecmp(val, "On") ||
-			 !strcasecmp(val, "True") || !strcasecmp(val, "Yes") ||
-			 !strncasecmp(val, "two-sided", 9) ||
-			 !strncasecmp(val, "TwoSided", 8) ||
-			 !strncasecmp(val, "Duplex", 6))
-		{
-		  duplex = 1;
-		  if (!strncasecmp(val, "DuplexTumble", 12))
-		    tumble = 1;
-		}
-	      }
-
-	      if ((val = cupsGetOption("sides", num_options, options)) != NULL ||
-		  (val = cupsGetOption("Tumble", num_options, options)) != NULL)
-	      {
-		if (!strcasecmp(val, "None") || !strcasecmp(val, "Off") ||
-		    !strcasecmp(val, "False") || !strcasecmp(val, "No") ||
-		    !strcasecmp(val, "one-sided") || !strcasecmp(val, "OneSided") ||
-		    !strcasecmp(val, "two-sided-long-edge") ||
-		    !strcasecmp(val, "TwoSidedLongEdge") ||
-		    !strcasecmp(val, "DuplexNoTumble"))
-		  tumble = 0;
-		else if (!strcasecmp(val, "On") ||
-			 !strcasecmp(val, "True") || !strcasecmp(val, "Yes") ||
-			 !strcasecmp(val, "two-sided-short-edge") ||
-			 !strcasecmp(val, "TwoSidedShortEdge") ||
-			 !strcasecmp(val, "DuplexTumble"))
-		  tumble = 1;
-	      }
-
-	      if (duplex)
-	      {
-		if (tumble)
-		  puts("<</Duplex true /Tumble true>> setpagedevice");
-		else
-		  puts("<</Duplex true /Tumble false>> setpagedevice");
-	      }
-	      else
-		puts("<</Duplex false>> setpagedevice");
-
-	     /*
-	      * Resolution
-	      */
-	      if ((xres > 0) && (yres > 0))
-		printf("<</HWResolution[%d %d]>> setpagedevice\n", xres, yres);
-
-	     /*
-	      * InputSlot/MediaSource
-	      */
-	      if ((val = cupsGetOption("media-position", num_options,
-				       options)) != NULL ||
-		  (val = cupsGetOption("MediaPosition", num_options,
-				       options)) != NULL ||
-		  (val = cupsGetOption("media-source", num_options,
-				       options)) != NULL ||
-		  (val = cupsGetOption("MediaSource", num_options,
-				       options)) != NULL ||
-		  (val = cupsGetOption("InputSlot", num_options,
-				       options)) != NULL)
-	      {
-		if (!strncasecmp(val, "Auto", 4) ||
-		    !strncasecmp(val, "Default", 7))
-		  puts("<</ManualFeed false /MediaPosition 7>> setpagedevice");
-		else if (!strcasecmp(val, "Main"))
-		  puts("<</MediaPosition 0 /ManualFeed false>> setpagedevice");
-		else if (!strcasecmp(val, "Alternate"))
-		  puts("<</MediaPosition 1 /ManualFeed false>> setpagedevice");
-		else if (!strcasecmp(val, "Manual"))
-		  puts("<</MediaPosition 3 /ManualFeed true>> setpagedevice");
-		else if (!strcasecmp(val, "Top"))
-		  puts("<</MediaPosition 0 /ManualFeed false>> setpagedevice");
-		else if (!strcasecmp(val, "Bottom"))
-		  puts("<</MediaPosition 1 /ManualFeed false>> setpagedevice");
-		else if (!strcasecmp(val, "ByPassTray"))
-		  puts("<</MediaPosition 3 /ManualFeed false>> setpagedevice");
-		else if (!strcasecmp(val, "Tray1"))
-		  puts("<</MediaPosition 3 /ManualFeed false>> setpagedevice");
-		else if (!strcasecmp(val, "Tray2"))
-		  puts("<</MediaPosition 0 /ManualFeed false>> setpagedevice");
-		else if (!strcasecmp(val, "Tray3"))
-		  puts("<</MediaPosition 1 /ManualFeed false>> setpagedevice");
-	      }
-
-	     /*
-	      * ColorModel
-	      */
-	      if ((val = cupsGetOption("pwg-raster-document-type", num_options,
-				       options)) != NULL ||
-		  (val = cupsGetOption("PwgRasterDocumentType", num_options,
-				       options)) != NULL ||
-		  (val = cupsGetOption("print-color-mode", num_options,
-				       options)) != NULL ||
-		  (val = cupsGetOption("PrintColorMode", num_options,
-				       options)) != NULL ||
-		  (val = cupsGetOption("color-space", num_options,
-				       options)) != NULL ||
-		  (val = cupsGetOption("ColorSpace", num_options,
-				       options)) != NULL ||
-		  (val = cupsGetOption("color-model", num_options,
-				       options)) != NULL ||
-		  (val = cupsGetOption("ColorModel", num_options,
-				       options)) != NULL)
-	      {
-		if (!strncasecmp(val, "Black", 5))
-		  puts("<</ProcessColorModel /DeviceGray>> setpagedevice");
-		else if (!strncasecmp(val, "Cmyk", 4))
-		  puts("<</ProcessColorModel /DeviceCMYK>> setpagedevice");
-		else if (!strncasecmp(val, "Cmy", 3))
-		  puts("<</ProcessColorModel /DeviceCMY>> setpagedevice");
-		else if (!strncasecmp(val, "Rgb", 3))
-		  puts("<</ProcessColorModel /DeviceRGB>> setpagedevice");
-		else if (!strncasecmp(val, "Gray", 4))
-		  puts("<</ProcessColorModel /DeviceGray>> setpagedevice");
-		else if (!strncasecmp(val, "Color", 5))
-		  puts("<</ProcessColorModel /DeviceRGB>> setpagedevice");
-	      }
-
-	      if (strncmp(buffer, "%%BeginSetup", 12))
-	      {
-		/* Close newly created Setup section */
-		if (strncmp(buffer, "%%EndSetup", 10))
-		  puts("%%EndSetup");
-		printf("%s", buffer);
-	      }
-	    }
-	  }
-
-	 /*
-	  * Copy the rest of the file
-	  */
-	  while ((bytes = cupsFileRead(fp, buffer, sizeof(buffer))) > 0)
-	    fwrite(buffer, 1, bytes, stdout);
-	}
-      }
-
-      exit(0);
-    }
-    else if (post_proc_pid < 0)
-    {
-     /*
-      * Unable to fork!
-      */
-
-      perror("DEBUG: Unable to execute post-processing process");
-
-      exit_status = 1;
-      goto error;
-    }
-
-    fprintf(stderr, "DEBUG: Started post-processing (PID %d)\n", post_proc_pid);
-  }
-
   if ((pstops_pid = fork()) == 0)
   {
    /*
@@ -1504,18 +1614,42 @@ main(int  argc,				/* I - Number of command-line args */
   fprintf(stderr, "DEBUG: Started filter pstops (PID %d)\n", pstops_pid);
 
   close(pstops_pipe[0]);
-  close(pstops_pipe[1]);
+
   if (need_post_proc)
   {
-    close(post_proc_pipe[0]);
+   /*
+    * Do the post-processing ourselves, between the renderer and pstops,
+    * instead of in an extra process...
+    */
+
     close(post_proc_pipe[1]);
+    dup2(pstops_pipe[1], 1);
+    close(pstops_pipe[1]);
+
+    fputs("DEBUG: Post-processing renderer output\n", stderr);
+
+    pf.fd  = post_proc_pipe[0];
+    pf.ptr = pf.end = pf.buf;
+
+    post_process(&pf, renderer, argv, ppd, num_options, options, xres, yres);
+
+    close(post_proc_pipe[0]);
+
+   /*
+    * Close our end of the pipe so that pstops sees the end of the data...
+    */
+
+    fflush(stdout);
+    close(1);
   }
+  else
+    close(pstops_pipe[1]);
 
  /*
   * Wait for the child processes to exit...
   */
 
-  wait_children = 2 + need_post_proc;
+  wait_children = 2;
 
   while (wait_children > 0)
   {
@@ -1528,8 +1662,6 @@ main(int  argc,				/* I - Number of command-line args */
       if (job_canceled)
       {
 	kill(pdf_pid, SIGTERM);
-	if (need_post_proc)
-	  kill(post_proc_pid, SIGTERM);
 	kill(pstops_pid, SIGTERM);
 
 	job_canceled = 0;
@@ -1561,8 +1693,7 @@ main(int  argc,				/* I - Number of command-line args */
 		(renderer == MUPDF ? "mutool" :
 		 "Unknown renderer"))))) :
 		(wait_pid == pstops_pid ? "pstops" :
-		(wait_pid == post_proc_pid ? "Post-processing" :
-		 "Unknown process")),
+		 "Unknown process"),
 		exit_status);
       }
       else if (WTERMSIG(wait_status) == SIGTERM)
@@ -1578,8 +1709,7 @@ main(int  argc,				/* I - Number of command-line args */
 		(renderer == MUPDF ? "mutool" :
 		 "Unknown renderer"))))) :
 		(wait_pid == pstops_pid ? "pstops" :
-		(wait_pid == post_proc_pid ? "Post-processing" :
-		 "Unknown process")),
+		 "Unknown process"),
 		exit_status);
       }
       else
@@ -1596,8 +1726,7 @@ main(int  argc,				/* I - Number of command-line args */
 		(renderer == MUPDF ? "mutool" :
 		 "Unknown renderer"))))) :
 		(wait_pid == pstops_pid ? "pstops" :
-		(wait_pid == post_proc_pid ? "Post-processing" :
-		 "Unknown process")),
+		 "Unknown process"),
 		exit_status);
       }
     }
@@ -1613,8 +1742,7 @@ main(int  argc,				/* I - Number of command-line args */
 	      (renderer == MUPDF ? "mutool" :
 	       "Unknown renderer"))))) :
 	      (wait_pid == pstops_pid ? "pstops" :
-	      (wait_pid == post_proc_pid ? "Post-processing" :
-	       "Unknown process")));
+	       "Unknown process"));
     }
   }
 
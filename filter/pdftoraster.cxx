@@ -38,6 +38,8 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #ifdef HAVE_CPP_POPPLER_VERSION_H
 #include <poppler/cpp/poppler-version.h>
 #endif
@@ -101,6 +103,8 @@ namespace {
     unsigned char *pixelBuf, unsigned int x, unsigned int y);
 
   int exitCode = 0;
+  int num_options = 0;
+  cups_option_t *options = 0;
   int pwgraster = 0;
   int bi_level = 0;
   int deviceCopies = 1;
@@ -276,8 +280,6 @@ static void  handleRqeuiresPageRegion() {
 
 static void parseOpts(int argc, char **argv)
 {
-  int num_options = 0;
-  cups_option_t *options = 0;
   char *profile = 0;
   const char *t = NULL;
   ppd_attr_t *attr;
@@ -411,6 +413,8 @@ static void parseOpts(int argc, char **argv)
     exit(1);
 #endif /* HAVE_CUPS_1_7 */
   }
+  /* preview jobs: let Poppler render at the reduced resolution */
+  cupsRasterPreviewResolution(&header, num_options, options);
   if ((val = cupsGetOption("print-color-mode", num_options, options)) != NULL
                            && !strncasecmp(val, "bi-level", 8))
     bi_level = 1;
@@ -451,13 +455,49 @@ static void parsePDFTOPDFComment(FILE *fp)
   }
 }
 
+/*
+ * Copy a line with its bytes in reverse order, optionally inverted, eight
+ * bytes at a time.
+ */
+static void swapBytes(const unsigned char *src, unsigned char *dst,
+     unsigned int size, bool invert)
+{
+  const unsigned char *bp = src+size;
+  unsigned char *dp = dst;
+  uint64_t mask = invert ? ~(uint64_t)0 : 0;
+
+  for (;size >= 8;size -= 8,dp += 8) {
+    uint64_t w = 0;
+
+    bp -= 8;
+    for (int k = 0;k < 8;k++) {
+      w = (w << 8) | bp[k];
+    }
+    w ^= mask;
+    for (int k = 0;k < 8;k++,w >>= 8) {
+      dp[k] = w & 0xff;
+    }
+  }
+  while (size-- > 0) {
+    *dp++ = *--bp ^ (mask & 0xff);
+  }
+}
+
 static unsigned char *reverseLine(unsigned char *src, unsigned char *dst,
      unsigned int row, unsigned int plane, unsigned int pixels,
      unsigned int size)
 {
   unsigned char *p = src;
+  unsigned int j = 0;
 
-  for (unsigned int j = 0;j < size;j++,p++) {
+  for (;j+8 <= size;j += 8,p += 8) {
+    uint64_t w;
+
+    memcpy(&w,p,8);
+    w = ~w;
+    memcpy(p,&w,8);
+  }
+  for (;j < size;j++,p++) {
     *p = ~*p;
   }
   return src;
@@ -467,12 +507,7 @@ static unsigned char *reverseLineSwapByte(unsigned char *src,
     unsigned char *dst, unsigned int row, unsigned int plane,
     unsigned int pixels, unsigned int size)
 {
-  unsigned char *bp = src+size-1;
-  unsigned char *dp = dst;
-
-  for (unsigned int j = 0;j < size;j++,bp--,dp++) {
-    *dp = ~*bp;
-  }
+  swapBytes(src, dst, size, true);
   return dst;
 }
 
@@ -594,12 +629,7 @@ static unsigned char *lineSwapByte(unsigned char *src, unsigned char *dst,
      unsigned int row, unsigned int plane, unsigned int pixels,
      unsigned int size)
 {
-  unsigned char *bp = src+size-1;
-  unsigned char *dp = dst;
-
-  for (unsigned int j = 0;j < size;j++,bp--,dp++) {
-    *dp = *bp;
-  }
+  swapBytes(src, dst, size, false);
   return dst;
 }
 
@@ -947,7 +977,7 @@ static unsigned int getCMSColorSpaceType(cmsColorSpaceSignature cs)
 }
 
 /* select convertLine function */
-static void selectConvertFunc(cups_raster_t *raster)
+static void selectConvertFunc(cups_raster_shm_t *raster)
 {
   if ((colorProfile == NULL || popplerColorProfile == colorProfile)
       && (header.cupsColorOrder == CUPS_ORDER_CHUNKED
@@ -1138,7 +1168,7 @@ static unsigned char *removeAlpha(unsigned char *src, unsigned char *dst, unsign
   return temp;
 }
 
-static void writePageImage(cups_raster_t *raster, poppler::document *doc,
+static void writePageImage(cups_raster_shm_t *raster, poppler::document *doc,
   int pageNo)
 {
   ConvertLineFunc convertLine;
@@ -1213,7 +1243,7 @@ static void writePageImage(cups_raster_t *raster, poppler::document *doc,
         for (unsigned int band = 0;band < nbands;band++) {
           dp = convertLine(bp,lineBuf,h - 1,plane+band,header.cupsWidth,
                  bytesPerLine);
-          cupsRasterWritePixels(raster,dp,bytesPerLine);
+          cupsRasterShmWritePixels(raster,dp,bytesPerLine);
         }
         bp -= rowsize;
       }
@@ -1226,7 +1256,7 @@ static void writePageImage(cups_raster_t *raster, poppler::document *doc,
         for (unsigned int band = 0;band < nbands;band++) {
           dp = convertLine(bp,lineBuf,h,plane+band,header.cupsWidth,
                  bytesPerLine);
-          cupsRasterWritePixels(raster,dp,bytesPerLine);
+          cupsRasterShmWritePixels(raster,dp,bytesPerLine);
         }
         bp += rowsize;
       }
@@ -1236,7 +1266,7 @@ static void writePageImage(cups_raster_t *raster, poppler::document *doc,
 }
 
 static void outPage(poppler::document *doc, int pageNo,
-  cups_raster_t *raster)
+  cups_raster_shm_t *raster)
 {
   int rotate = 0;
   double paperdimensions[2], /* Physical size of the paper */
@@ -1357,7 +1387,7 @@ static void outPage(poppler::document *doc, int pageNo,
   if (header.cupsColorOrder == CUPS_ORDER_BANDED) {
     header.cupsBytesPerLine *= header.cupsNumColors;
   }
-  if (!cupsRasterWriteHeader2(raster,&header)) {
+  if (!cupsRasterShmWriteHeader(raster,&header)) {
       fprintf(stderr, "ERROR: Can't write page %d header\n",pageNo );
       exit(1);
   }
@@ -1455,7 +1485,7 @@ int main(int argc, char *argv[]) {
   poppler::document *doc;
   int i;
   int npages=0;
-  cups_raster_t *raster;
+  cups_raster_shm_t *raster;
 
   cmsSetLogErrorHandler(lcmsErrorHandler);
   parseOpts(argc, argv);
@@ -1592,8 +1622,9 @@ int main(int argc, char *argv[]) {
     setPopplerColorProfile();
   }
 
-  if ((raster = cupsRasterOpen(1, pwgraster ? CUPS_RASTER_WRITE_PWG :
-			       CUPS_RASTER_WRITE)) == 0) {
+  if ((raster = cupsRasterShmOpen(1, pwgraster ? CUPS_RASTER_WRITE_PWG :
+				  CUPS_RASTER_WRITE, num_options,
+				  options)) == 0) {
         fprintf(stderr, "ERROR: Can't open raster stream\n");
 	exit(1);
   }
@@ -1605,7 +1636,7 @@ int main(int argc, char *argv[]) {
   } else
     fprintf(stderr, "DEBUG: Input is empty, outputting empty file.\n");
 
-  cupsRasterClose(raster);
+  cupsRasterShmClose(raster);
 
   delete doc;
   if (ppd != NULL) {
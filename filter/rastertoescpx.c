@@ -28,6 +28,7 @@
  */
 
 #include <cupsfilters/driver.h>
+#include <cupsfilters/raster.h>
 #include "escp.h"
 #include <signal.h>
 #include <string.h>
@@ -101,7 +102,7 @@ void	CompressData(ppd_file_t *, const unsigned char *, const int,
 		     const int);
 void	OutputBand(ppd_file_t *, cups_page_header2_t *,
 	           cups_weave_t *band);
-void	ProcessLine(ppd_file_t *, cups_raster_t *,
+void	ProcessLine(ppd_file_t *, cups_raster_shm_t *,
 	            cups_page_header2_t *, const int y);
 
 
@@ -1552,7 +1553,7 @@ OutputBand(ppd_file_t         *ppd,	/* I - PPD file */
 
 void
 ProcessLine(ppd_file_t         *ppd,	/* I - PPD file */
-            cups_raster_t      *ras,	/* I - Raster stream */
+            cups_raster_shm_t  *ras,	/* I - Raster stream */
             cups_page_header2_t *header,	/* I - Page header */
             const int          y)	/* I - Current scanline */
 {
@@ -1571,7 +1572,7 @@ ProcessLine(ppd_file_t         *ppd,	/* I - PPD file */
   * Read a row of graphics...
   */
 
-  if (!cupsRasterReadPixels(ras, PixelBuffer, header->cupsBytesPerLine))
+  if (!cupsRasterShmReadPixels(ras, PixelBuffer, header->cupsBytesPerLine))
     return;
 
  /*
@@ -1748,7 +1749,7 @@ main(int  argc,				/* I - Number of command-line arguments */
 {
   int			fd;		/* File descriptor */
   int empty = 1;
-  cups_raster_t		*ras;		/* Raster stream for printing */
+  cups_raster_shm_t	*ras;		/* Raster stream for printing */
   cups_page_header2_t	header;		/* Page header from file */
   int			page;		/* Current page */
   int			y;		/* Current line */
@@ -1817,7 +1818,7 @@ main(int  argc,				/* I - Number of command-line arguments */
   else
     fd = 0;
 
-  ras = cupsRasterOpen(fd, CUPS_RASTER_READ);
+  ras = cupsRasterShmOpen(fd, CUPS_RASTER_READ, num_options, options);
 
  /*
   * Register a signal handler to eject the current page if the
@@ -1844,7 +1845,7 @@ main(int  argc,				/* I - Number of command-line arguments */
 
   page = 0;
 
-  while (cupsRasterReadHeader2(ras, &header))
+  while (cupsRasterShmReadHeader(ras, &header))
   {
    /*
     * Write a status message with the page number and number of copies.
@@ -1910,7 +1911,7 @@ main(int  argc,				/* I - Number of command-line arguments */
 
   cupsFreeOptions(num_options, options);
 
-  cupsRasterClose(ras);
+  cupsRasterShmClose(ras);
 
   if (fd != 0)
     close(fd);
@@ -28,6 +28,7 @@
 
 #include <cupsfilters/colormanager.h>
 #include <cupsfilters/driver.h>
+#include <cupsfilters/raster.h>
 #include "pcl-common.h"
 #include <signal.h>
 
@@ -97,7 +98,7 @@ void	CancelJob(int sig);
 void	CompressData(unsigned char *line, int length, int plane, int pend,
 	             int type);
 void	OutputLine(ppd_file_t *ppd, cups_page_header2_t *header);
-int	ReadLine(cups_raster_t *ras, cups_page_header2_t *header);
+int	ReadLine(cups_raster_shm_t *ras, cups_page_header2_t *header);
 
 
 /*
@@ -1697,7 +1698,7 @@ OutputLine(ppd_file_t         *ppd,	/* I - PPD file */
  */
 
 int					/* O - Number of lines (0 if blank) */
-ReadLine(cups_raster_t      *ras,	/* I - Raster stream */
+ReadLine(cups_raster_shm_t  *ras,	/* I - Raster stream */
          cups_page_header2_t *header)	/* I - Page header */
 {
   int	plane,				/* Current color plane */
@@ -1708,7 +1709,7 @@ ReadLine(cups_raster_t      *ras,	/* I - Raster stream */
   * Read raster data...
   */
 
-  cupsRasterReadPixels(ras, PixelBuffer, header->cupsBytesPerLine);
+  cupsRasterShmReadPixels(ras, PixelBuffer, header->cupsBytesPerLine);
 
  /*
   * See if it is blank; if so, return right away...
@@ -1796,7 +1797,7 @@ main(int  argc,				/* I - Number of command-line arguments */
 {
   int			fd;		/* File descriptor */
   int empty = 1;
-  cups_raster_t		*ras;		/* Raster stream for printing */
+  cups_raster_shm_t	*ras;		/* Raster stream for printing */
   cups_page_header2_t	header;		/* Page header from file */
   int			y;		/* Current line */
   ppd_file_t		*ppd;		/* PPD file */
@@ -1865,7 +1866,7 @@ main(int  argc,				/* I - Number of command-line arguments */
   else
     fd = 0;
 
-  ras = cupsRasterOpen(fd, CUPS_RASTER_READ);
+  ras = cupsRasterShmOpen(fd, CUPS_RASTER_READ, num_options, options);
 
  /*
   * Register a signal handler to eject the current page if the
@@ -1894,7 +1895,7 @@ main(int  argc,				/* I - Number of command-line arguments */
 
   Page = 0;
 
-  while (cupsRasterReadHeader2(ras, &header))
+  while (cupsRasterShmReadHeader(ras, &header))
   {
    /*
     * Write a status message with the page number and number of copies.
@@ -1958,7 +1959,7 @@ main(int  argc,				/* I - Number of command-line arguments */
 
   cupsFreeOptions(num_options, options);
 
-  cupsRasterClose(ras);
+  cupsRasterShmClose(ras);
 
   if (fd != 0)
     close(fd);
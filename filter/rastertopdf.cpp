@@ -34,6 +34,7 @@
 #include <cups/cups.h>
 #include <cups/raster.h>
 #include <cupsfilters/colormanager.h>
+#include <cupsfilters/raster.h>
 #include <cupsfilters/image.h>
 
 #include <arpa/inet.h>   // ntohl
@@ -1191,7 +1192,7 @@ void pdf_set_line(struct pdf_info * info, unsigned line_n, unsigned char *line)
     }
 }
 
-int convert_raster(cups_raster_t *ras, unsigned width, unsigned height,
+int convert_raster(cups_raster_shm_t *ras, unsigned width, unsigned height,
 		   int bpp, int bpl, struct pdf_info * info)
 {
     // We should be at raster start
@@ -1199,13 +1200,42 @@ int convert_raster(cups_raster_t *ras, unsigned width, unsigned height,
     unsigned cur_line = 0;
     unsigned char *PixelBuffer, *ptr = NULL, *buff;
 
+    // If the raster data is already in the output format, read it
+    // straight into the page (or strip) buffers, no per-line copy needed
+    if (conversion_function == noColorConversion &&
+        bit_function == noBitConversion &&
+        (unsigned)bpl == info->line_bytes
+#if !ARCH_IS_BIG_ENDIAN
+        && info->bpc != 16
+#endif /* !ARCH_IS_BIG_ENDIAN */
+       )
+    {
+      fputs("DEBUG: Raster data matches output format, passing it through\n", stderr);
+
+      switch(info->outformat)
+      {
+        case OUTPUT_FORMAT_PDF:
+          cupsRasterShmReadPixels(ras, info->page_data->getBuffer(),
+                                  info->line_bytes*height);
+          break;
+        case OUTPUT_FORMAT_PCLM:
+          for (size_t i = 0; i < info->pclm_num_strips; i ++)
+            cupsRasterShmReadPixels(ras,
+                                    info->pclm_strip_data[i]->getBuffer(),
+                                    info->line_bytes*info->pclm_strip_height[i]);
+          break;
+      }
+
+      return 0;
+    }
+
     PixelBuffer = (unsigned char *)malloc(bpl);
     buff = (unsigned char *)malloc(info->line_bytes);
 
     do
     {
         // Read raster data...
-        cupsRasterReadPixels(ras, PixelBuffer, bpl);
+        cupsRasterShmReadPixels(ras, PixelBuffer, bpl);
 
 #if !ARCH_IS_BIG_ENDIAN
 
@@ -1308,7 +1338,7 @@ int main(int argc, char **argv)
     int fd, Page, empty = 1;
     struct pdf_info pdf;
     FILE * input = NULL;
-    cups_raster_t	*ras;		/* Raster stream for printing */
+    cups_raster_shm_t	*ras;		/* Raster stream for printing */
     cups_page_header2_t	header;		/* Page header from file */
     ppd_file_t		*ppd;		/* PPD file */
     ppd_attr_t    *attr;  /* PPD attribute */
@@ -1396,7 +1426,7 @@ int main(int argc, char **argv)
     fd = fileno(input);
 
     // Transform
-    ras = cupsRasterOpen(fd, CUPS_RASTER_READ);
+    ras = cupsRasterShmOpen(fd, CUPS_RASTER_READ, num_options, options);
 
     // Process pages as needed...
     Page = 0;
@@ -1482,7 +1512,7 @@ int main(int argc, char **argv)
       }
     }
 
-    while (cupsRasterReadHeader2(ras, &header))
+    while (cupsRasterShmReadHeader(ras, &header))
     {
       if (empty)
       {
@@ -1524,7 +1554,7 @@ int main(int argc, char **argv)
     if (empty)
     {
       fprintf(stderr, "DEBUG: Input is empty, outputting empty file.\n");
-      cupsRasterClose(ras);
+      cupsRasterShmClose(ras);
       return 0;
     }
 
@@ -1536,7 +1566,7 @@ int main(int argc, char **argv)
 
     cupsFreeOptions(num_options, options);
 
-    cupsRasterClose(ras);
+    cupsRasterShmClose(ras);
 
     if (fd != 0)
       close(fd);
@@ -32,6 +32,7 @@
 #include <limits.h>
 #include <math.h>
 #include <signal.h>
+#include <time.h>
 #include <cups/cups.h>
 #include <cups/raster.h>
 #include <cupsfilters/colormanager.h>
@@ -105,7 +106,8 @@ writeImage(int           pagewidth,  /* I - width of page in points */
 	   int           bpc,	     /* I - bits per color */
 	   int           pixwidth,   /* I - width of image in pixels */
 	   int           pixheight,  /* I - height of image in pixels */
-	   cups_cspace_t mode)       /* I - color model of image */
+	   cups_cspace_t mode,       /* I - color model of image */
+	   const char    *filter)    /* I - decode filter of image data */
 {
   printf("gsave\n");
 
@@ -131,7 +133,7 @@ writeImage(int           pagewidth,  /* I - width of page in points */
   }
 
   if (bpc == 16)
-    printf("/Input currentfile /FlateDecode filter def\n");
+    printf("/Input currentfile /%s filter def\n", filter);
   printf("%d %d scale\n", pagewidth, pageheight);
   printf("<< \n"
 	 "/ImageType 1\n"
@@ -167,7 +169,7 @@ writeImage(int           pagewidth,  /* I - width of page in points */
     printf("/DataSource {3 string 0 1 2 {1 index exch Input read {pop}"
 	   "if Input read pop put } for} bind\n");
   else
-    printf("/DataSource currentfile /FlateDecode filter\n");
+    printf("/DataSource currentfile /%s filter\n", filter);
 	
   printf("/ImageMatrix [%d 0 0 %d 0 %d]\n", pixwidth, -1*pixheight, pixheight);
   printf(">> image\n");
@@ -203,75 +205,134 @@ convert_pixels(unsigned char *pixdata,      /* I - Original pixel data */
   }
 }
 
+/*
+ * 'read_line()' - Read the next line of image data, converted to what
+ *                 the image dictionary announces
+ */
+
+unsigned char *                         /* O - Line data */
+read_line(cups_raster_t       *ras,      /* I - Image data */
+	  cups_page_header2_t *header,   /* I - Page header */
+	  unsigned char       *pixdata,  /* I - Buffer for raster line */
+	  unsigned char       *convertedpix, /* I - Buffer for converted line,
+					        NULL if not needed */
+	  unsigned            *len)      /* O - Length of line data */
+{
+  /* Keep the PostScript intact if the raster data ends early */
+  if (cupsRasterReadPixels(ras, pixdata, header->cupsBytesPerLine) !=
+      header->cupsBytesPerLine)
+    memset(pixdata, 0, header->cupsBytesPerLine);
+
+  if (convertedpix)
+  {
+    convert_pixels(pixdata, convertedpix, header->cupsBytesPerLine);
+    *len = header->cupsBytesPerLine * 6;
+    return convertedpix;
+  }
+
+  *len = header->cupsBytesPerLine;
+  return pixdata;
+}
+
+/*
+ * 'alloc_lines()' - Allocate the line buffers for a page
+ */
+
+int                                     /* O - 0 on success, -1 on error */
+alloc_lines(cups_page_header2_t *header,   /* I - Page header */
+	    unsigned char       **pixdata, /* O - Buffer for raster line */
+	    unsigned char       **convertedpix) /* O - Buffer for converted
+						   line, if needed */
+{
+  int convert = header->cupsBitsPerColor == 1 &&
+		(header->cupsColorSpace == CUPS_CSPACE_RGB ||
+		 header->cupsColorSpace == CUPS_CSPACE_ADOBERGB ||
+		 header->cupsColorSpace == CUPS_CSPACE_SRGB);
+					/* Convert 1 bpc to 8 bpc? */
+
+  *pixdata = malloc(header->cupsBytesPerLine);
+  *convertedpix = convert ? malloc(header->cupsBytesPerLine * 6) : NULL;
+
+  if (!*pixdata || (convert && !*convertedpix))
+  {
+    free(*pixdata);
+    free(*convertedpix);
+    return -1;
+  }
+
+  return 0;
+}
+
 /*
  *	'write_flate()' - Write the image data in flate encoded format
+ *
+ *	The data is compressed line by line as it is read from the raster
+ *	stream, through one fixed size output buffer, so memory use does not
+ *	depend on the page size.
  */
 
 int                                     /* O - Error value */
 write_flate(cups_raster_t *ras,	        /* I - Image data */
-	    cups_page_header2_t	header)	/* I - Bytes Per Line */
+	    cups_page_header2_t	header,	/* I - Bytes Per Line */
+	    int           level,        /* I - Compression level */
+	    size_t        *outbytes)    /* O - Number of bytes written */
 {
   int            ret,                              /* Return value of this
 						      function */
-                 flush,                            /* Check the end of image
+                 flush;                            /* Check the end of image
 						      data */
-                 curr_line=1,                      /* Maitining the working
+  unsigned       curr_line,                        /* Maitining the working
 						      line of pixels */
-                 alloc,
-                 flag = 0;
-  unsigned       have;                             /* Bytes available in
+                 len,                              /* Length of line data */
+                 have;                             /* Bytes available in
 						      output buffer */
   z_stream       strm;                             /* Structure required
 						      by deflate */
-  unsigned char  *pixdata,
-                 *convertedpix;
-  unsigned char  in[header.cupsBytesPerLine * 6],  /* Input data buffer */
-                 out[header.cupsBytesPerLine * 6]; /* Output data buffer */
-		
+  unsigned char  *pixdata,                         /* Raster line */
+                 *convertedpix,                    /* Converted line */
+                 *line,                            /* Line to compress */
+                 out[65536];                       /* Output data buffer */
+
+  *outbytes = 0;
+
+  if (alloc_lines(&header, &pixdata, &convertedpix))
+    return Z_MEM_ERROR;
+
   /* allocate deflate state */
   strm.zalloc = Z_NULL;
   strm.zfree = Z_NULL;
   strm.opaque = Z_NULL;
-  ret = deflateInit(&strm, -1);
+  ret = deflateInit(&strm, level);
   if (ret != Z_OK)
+  {
+    free(pixdata);
+    free(convertedpix);
     return ret;
-
-  if(header.cupsBitsPerColor == 1 &&
-     (header.cupsColorSpace == CUPS_CSPACE_RGB ||
-      header.cupsColorSpace == CUPS_CSPACE_ADOBERGB ||
-      header.cupsColorSpace == CUPS_CSPACE_SRGB))
-    flag = 1;
+  }
 
   /* compress until end of file */
+  curr_line = 0;
   do {
-    pixdata = malloc(header.cupsBytesPerLine);
-    cupsRasterReadPixels(ras, pixdata, header.cupsBytesPerLine);
-    if (flag)
-    {
-      convertedpix = malloc(header.cupsBytesPerLine * 6);
-      convert_pixels(pixdata,convertedpix, header.cupsBytesPerLine);
-      alloc = header.cupsBytesPerLine * 6;
-    }
+    if (curr_line < header.cupsHeight)
+      line = read_line(ras, &header, pixdata, convertedpix, &len);
     else
     {
-      convertedpix = malloc(header.cupsBytesPerLine);
-      memcpy(convertedpix, pixdata, header.cupsBytesPerLine);
-      alloc = header.cupsBytesPerLine;
+      line = pixdata;
+      len = 0;
     }
 
-    if(curr_line == header.cupsHeight)
+    curr_line++;
+    if(curr_line >= header.cupsHeight)
       flush = Z_FINISH;
     else
       flush = Z_NO_FLUSH;
-    curr_line++;
-    memcpy(in, convertedpix, alloc);
-    strm.avail_in = alloc;
-    strm.next_in = in;
+    strm.avail_in = len;
+    strm.next_in = line;
 
     /* run deflate() on input until output buffer not full, finish
      * compression if all of source has been read in */
     do {
-      strm.avail_out = alloc;
+      strm.avail_out = sizeof(out);
       strm.next_out = out;
 
       /* Run the deflate algorithm on the data */
@@ -279,22 +340,21 @@ write_flate(cups_raster_t *ras,	        /* I - Image data */
 
       /* check whether state is not clobbered */
       assert(ret != Z_STREAM_ERROR);
-      have = alloc - strm.avail_out;
+      have = sizeof(out) - strm.avail_out;
       if (fwrite(out, 1, have, stdout) != have)
       {
 	(void)deflateEnd(&strm);
-	if (convertedpix != NULL)
-	  free(convertedpix);
+	free(pixdata);
+	free(convertedpix);
 	return Z_ERRNO;
       }
+      *outbytes += have;
     } while (strm.avail_out == 0);
 
     /* all input will be used */
     assert(strm.avail_in == 0);
 
     /* done when last data in file processed */
-    free(pixdata);
-    free(convertedpix);
   } while (flush != Z_FINISH);
 
   /* stream will be complete */
@@ -302,6 +362,101 @@ write_flate(cups_raster_t *ras,	        /* I - Image data */
 
   /* clean up and return */
   (void)deflateEnd(&strm);
+  free(pixdata);
+  free(convertedpix);
+  return Z_OK;
+}
+
+/*
+ *	'write_runlength()' - Write the image data in RunLength encoded
+ *			      format
+ *
+ *	RunLengthDecode is much cheaper than FlateDecode for the printer's
+ *	interpreter, and mostly white pages still compress well with it.
+ *	Runs do not span lines, so only one line is held in memory.
+ */
+
+int                                     /* O - Error value */
+write_runlength(cups_raster_t *ras,	/* I - Image data */
+		cups_page_header2_t header, /* I - Page header */
+		size_t        *outbytes) /* O - Number of bytes written */
+{
+  unsigned       curr_line,             /* Current line */
+                 len,                   /* Length of line data */
+                 i,                     /* Position in line */
+                 count;                 /* Length of current run */
+  unsigned char  *pixdata,              /* Raster line */
+                 *convertedpix,         /* Converted line */
+                 *line,                 /* Line to encode */
+                 *out,                  /* Encoded line */
+                 *outptr;               /* Current position in encoded line */
+
+  *outbytes = 0;
+
+  if (alloc_lines(&header, &pixdata, &convertedpix))
+    return Z_MEM_ERROR;
+
+  /* Worst case is one length byte for every 128 literal bytes */
+  len = convertedpix ? header.cupsBytesPerLine * 6 : header.cupsBytesPerLine;
+  if ((out = malloc(len + len / 128 + 2)) == NULL)
+  {
+    free(pixdata);
+    free(convertedpix);
+    return Z_MEM_ERROR;
+  }
+
+  for (curr_line = 0; curr_line < header.cupsHeight; curr_line ++)
+  {
+    line = read_line(ras, &header, pixdata, convertedpix, &len);
+
+    for (i = 0, outptr = out; i < len;)
+    {
+      /* Repeated bytes */
+      for (count = 1; i + count < len && count < 128 &&
+	   line[i + count] == line[i]; count ++);
+
+      if (count > 1)
+      {
+	*outptr++ = 257 - count;
+	*outptr++ = line[i];
+	i += count;
+	continue;
+      }
+
+      /* Literal bytes, up to the next run of at least 3 */
+      for (count = 1; i + count < len && count < 128; count ++)
+	if (i + count + 2 < len && line[i + count] == line[i + count + 1] &&
+	    line[i + count] == line[i + count + 2])
+	  break;
+
+      *outptr++ = count - 1;
+      memcpy(outptr, line + i, count);
+      outptr += count;
+      i += count;
+    }
+
+    if (curr_line == header.cupsHeight - 1)
+      *outptr++ = 128;			/* EOD */
+
+    if (fwrite(out, 1, outptr - out, stdout) != (size_t)(outptr - out))
+    {
+      free(pixdata);
+      free(convertedpix);
+      free(out);
+      return Z_ERRNO;
+    }
+    *outbytes += outptr - out;
+  }
+
+  if (!header.cupsHeight)
+  {
+    putchar(128);
+    *outbytes += 1;
+  }
+
+  free(pixdata);
+  free(convertedpix);
+  free(out);
   return Z_OK;
 }
 
@@ -374,6 +529,15 @@ main(int  argc,	   /* I - Number of command-line arguments */
   cups_raster_t	      *ras;          /* Raster stream for printing */
   cups_page_header2_t header;        /* Page header from file */
   cups_option_t	      *options;	     /* Options */
+  const char          *val;          /* Option value */
+  int                 runlength = 0, /* Use RunLength instead of Flate? */
+                      level = Z_DEFAULT_COMPRESSION;
+                                     /* Flate compression level */
+  double              throughput = 0.0; /* Printer throughput in kB/s */
+  size_t              outbytes;      /* Compressed bytes of a page */
+  clock_t             start;         /* CPU time at start of page */
+  double              cpusecs,       /* CPU time to compress a page */
+                      sendsecs;      /* Time to send a page to the printer */
 
  /*
   * Make sure status messages are not buffered...
@@ -392,6 +556,25 @@ main(int  argc,	   /* I - Number of command-line arguments */
 
   num_options = cupsParseOptions(argv[5], 0, &options);
 
+ /*
+  * Image data compression: "ps-image-compression" selects Flate (default)
+  * or RunLength, "ps-flate-level" a fixed Flate level.  With
+  * "ps-throughput" (kB/s the printer takes in) the level is adjusted after
+  * each page, so that compressing a page takes about as long as sending
+  * it...
+  */
+  if ((val = cupsGetOption("ps-image-compression", num_options,
+			   options)) != NULL &&
+      !strcasecmp(val, "runlength"))
+    runlength = 1;
+  if ((val = cupsGetOption("ps-flate-level", num_options, options)) != NULL &&
+      atoi(val) >= 1 && atoi(val) <= 9)
+    level = atoi(val);
+  else if ((val = cupsGetOption("ps-throughput", num_options,
+				options)) != NULL &&
+	   (throughput = atof(val)) > 0.0)
+    level = 6;
+
  /*
   * Open the PPD file...
   */
@@ -481,12 +664,34 @@ main(int  argc,	   /* I - Number of command-line arguments */
     writeImage(header.PageSize[0], header.PageSize[1],
 	       header.cupsBitsPerColor,
 	       header.cupsWidth, header.cupsHeight,
-	       header.cupsColorSpace);
+	       header.cupsColorSpace,
+	       runlength ? "RunLengthDecode" : "FlateDecode");
 
     /* Write the compressed image data*/
-    ret = write_flate(ras, header);
+    start = clock();
+    if (runlength)
+      ret = write_runlength(ras, header, &outbytes);
+    else
+      ret = write_flate(ras, header, level, &outbytes);
     if (ret != Z_OK)
       zerr(ret);
+
+   /*
+    * Raise the Flate level while the printer is the bottleneck, lower it
+    * when compressing takes longer than sending...
+    */
+    if (!runlength && throughput > 0.0)
+    {
+      cpusecs  = (double)(clock() - start) / CLOCKS_PER_SEC;
+      sendsecs = outbytes / (throughput * 1024.0);
+      if (cpusecs > sendsecs && level > 1)
+	level --;
+      else if (2.0 * cpusecs < sendsecs && level < 9)
+	level ++;
+      fprintf(stderr, "DEBUG: Page %d: %ld bytes, %.3fs compressing, "
+	      "%.3fs sending, next Flate level %d\n", Page, (long)outbytes,
+	      cpusecs, sendsecs, level);
+    }
     writeEndPage();
   }
 
@@ -14,10 +14,6 @@
  *   main()           - Main entry for filter...
  *   cancel_job()     - Flag the job as canceled.
  *   filter_present() - Is the requested filter actually installed?
- *   compare_pids()   - Compare process IDs for sorting PID list
- *   exec_filter()    - Execute a filter process
- *   exec_filters()   - Execute a filter chain
- *   open_pipe()      - Create a pipe to transfer data from filter to filter
  *   get_option_in_str() - Get an option value from a string like argv[5]
  *   set_option_in_str() - Set an option value in a string like argv[5]
  */
@@ -31,7 +27,6 @@
 #include <ppd/ppd.h>
 #include <cups/file.h>
 #include <signal.h>
-#include <sys/wait.h>
 #include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -39,6 +34,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <cupsfilters/image-private.h>
+#include <cupsfilters/filter.h>
 
 #define MAX_CHECK_COMMENT_LINES	20
 
@@ -48,11 +44,6 @@
 
 typedef unsigned output_format_t;
 enum output_format_e {PDF = 0, POSTSCRIPT = 1, PWGRASTER = 2, PCLXL = 3, PCL = 4};
-typedef struct filter_pid_s             /* Filter in filter chain */
-{
-  char          *name;                  /* Filter executable name */
-  int           pid;                    /* PID of filter process */
-} filter_pid_t;
 
 /*
  * Local functions...
@@ -60,11 +51,6 @@ typedef struct filter_pid_s             /* Filter in filter chain */
 
 static void		cancel_job(int sig);
 static int              filter_present(const char *filter);
-static int		compare_pids(filter_pid_t *a, filter_pid_t *b);
-static int		exec_filter(const char *filter, char **argv,
-			            int infd, int outfd);
-static int		exec_filters(cups_array_t *filters, char **argv);
-static int		open_pipe(int *fds);
 static char*		get_option_in_str(char *buf, const char *option,
 					  int return_value);
 static void		set_option_in_str(char *buf, int buflen,
@@ -75,7 +61,7 @@ static void		set_option_in_str(char *buf, int buflen,
  * Local globals...
  */
 
-static int		job_canceled = 0;
+static volatile sig_atomic_t job_canceled = 0;
 
 
 /*
@@ -222,11 +208,10 @@ main(int  argc,				/* I - Number of command-line args */
   filter_chain = cupsArrayNew(NULL, NULL);
 
  /*
-  * Add the gziptoany filter if installed
+  * Add the gziptoany filter, it runs in-process
   */
 
-  if (filter_present("gziptoany"))
-    cupsArrayAdd(filter_chain, "gziptoany");
+  cupsArrayAdd(filter_chain, "gziptoany");
 
  /*
   * If the rastertopdf filter is present and the input is in PWG Raster format
@@ -458,7 +443,8 @@ main(int  argc,				/* I - Number of command-line args */
   * Execute the filter chain
   */
 
-  exit_status = exec_filters(filter_chain, (char **)argv_nt);
+  exit_status = filterRunCUPSChain(filter_chain, (char **)argv_nt,
+				   &job_canceled);
 
  /*
   * Cleanup and exit...
@@ -505,328 +491,6 @@ filter_present(const char *filter)      /* I - Filter name */
 }
 
 
-/*
- * 'compare_pids()' - Compare two filter PIDs...
- */
-
-static int				/* O - Result of comparison */
-compare_pids(filter_pid_t *a,		/* I - First filter */
-             filter_pid_t *b)		/* I - Second filter */
-{
-  return (a->pid - b->pid);
-}
-
-
-/*
- * 'exec_filter()' - Execute a single filter.
- */
-
-static int				/* O - Process ID or -1 on error */
-exec_filter(const char *filter,		/* I - Filter to execute */
-	    char       **argv,		/* I - Original command line args */
-	    int        infd,		/* I - Stdin file descriptor */
-	    int        outfd)		/* I - Stdout file descriptor */
-{
-  int		pid,			/* Process ID */
-		fd;			/* Temporary file descriptor */
-
-  if ((pid = fork()) == 0)
-  {
-   /*
-    * Child process goes here...
-    *
-    * Update stdin/stdout/stderr as needed...
-    */
-
-    if (infd != 0)
-    {
-      if (infd < 0)
-        infd = open("/dev/null", O_RDONLY);
-
-      if (infd > 0)
-      {
-        dup2(infd, 0);
-	close(infd);
-      }
-    }
-
-    if (outfd != 1)
-    {
-      if (outfd < 0)
-        outfd = open("/dev/null", O_WRONLY);
-
-      if (outfd > 1)
-      {
-	dup2(outfd, 1);
-	close(outfd);
-      }
-    }
-
-    /* Send stderr to the Nirwana if we are running gziptoany, as
-       gziptoany emits a false "PAGE: 1 1" */
-    if (strcasestr(filter, "gziptoany")) {
-      if ((fd = open("/dev/null", O_RDWR)) > 2)
-      {
-	dup2(fd, 2);
-	close(fd);
-      }
-      else
-        close(fd);
-      fcntl(2, F_SETFL, O_NDELAY);
-    }
-
-    if ((fd = open("/dev/null", O_RDWR)) > 3)
-    {
-      dup2(fd, 3);
-      close(fd);
-    }
-    else
-      close(fd);
-    fcntl(3, F_SETFL, O_NDELAY);
-
-    if ((fd = open("/dev/null", O_RDWR)) > 4)
-    {
-      dup2(fd, 4);
-      close(fd);
-    }
-    else
-      close(fd);
-    fcntl(4, F_SETFL, O_NDELAY);
-
-   /*
-    * Execute command...
-    */
-
-    execvp(filter, argv);
-
-    perror(filter);
-
-    exit(errno);
-  }
-
-  return (pid);
-}
-
-
-/*
- * 'exec_filters()' - Execute filters for the given file and options.
- */
-
-static int				/* O - 0 on success, 1 on error */
-exec_filters(cups_array_t  *filters,	/* I - Array of filters to run */
-	     char	   **argv)	/* I - Filter options */
-{
-  int		i;			/* Looping var */
-  char		program[1024];		/* Program to run */
-  char		*filter,		/* Current filter */
-		*next;			/* Next filter */
-  int		current,		/* Current filter */
-		filterfds[2][2],	/* Pipes for filters */
-		pid,			/* Process ID of filter */
-		status,			/* Exit status */
-		retval;			/* Return value */
-  cups_array_t	*pids;			/* Executed filters array */
-  filter_pid_t	*pid_entry,		/* Entry in executed filters array */
-		key;			/* Search key for filters */
-  const char	*cups_serverbin;	/* CUPS_SERVERBIN environment variable */
-
- /*
-  * Remove NULL ("-") filters...
-  */
-
-  for (filter = (char *)cupsArrayFirst(filters);
-       filter;
-       filter = (char *)cupsArrayNext(filters))
-    if (!strcmp(filter, "-"))
-      cupsArrayRemove(filters, filter);
-
-  for (i = 0; argv[i]; i ++)
-    fprintf(stderr, "DEBUG: argv[%d]=\"%s\"\n", i, argv[i]);
-
- /*
-  * Execute all of the filters...
-  */
-
-  pids            = cupsArrayNew((cups_array_func_t)compare_pids, NULL);
-  current         = 0;
-  filterfds[0][0] = 0;
-  filterfds[0][1] = -1;
-  filterfds[1][0] = -1;
-  filterfds[1][1] = -1;
-
-  for (filter = (char *)cupsArrayFirst(filters);
-       filter;
-       filter = next, current = 1 - current)
-  {
-    next = (char *)cupsArrayNext(filters);
-
-    if (filter[0] == '/') {
-      strncpy(program, filter, sizeof(program) - 1);
-      if (strlen(filter) > 1023)
-        program[1023] = '\0';
-    }
-    else
-    {
-      if ((cups_serverbin = getenv("CUPS_SERVERBIN")) == NULL)
-	cups_serverbin = CUPS_SERVERBIN;
-      snprintf(program, sizeof(program), "%s/filter/%s", cups_serverbin,
-	       filter);
-    }
-
-    if (filterfds[!current][1] > 1)
-    {
-      close(filterfds[1 - current][0]);
-      close(filterfds[1 - current][1]);
-
-      filterfds[1 - current][0] = -1;
-      filterfds[1 - current][0] = -1;
-    }
-
-    if (next)
-      open_pipe(filterfds[1 - current]);
-    else
-      filterfds[1 - current][1] = 1;
-
-    pid = exec_filter(program, argv,
-                      filterfds[current][0], filterfds[1 - current][1]);
-
-    if (pid > 0)
-    {
-      fprintf(stderr, "INFO: %s (PID %d) started.\n", filter, pid);
-
-      pid_entry = malloc(sizeof(filter_pid_t));
-      pid_entry->pid = pid;
-      pid_entry->name = filter;
-      cupsArrayAdd(pids, pid_entry);
-    }
-    else
-      break;
-
-    argv[6] = NULL;
-  }
-
- /*
-  * Close remaining pipes...
-  */
-
-  if (filterfds[0][1] > 1)
-  {
-    close(filterfds[0][0]);
-    close(filterfds[0][1]);
-  }
-
-  if (filterfds[1][1] > 1)
-  {
-    close(filterfds[1][0]);
-    close(filterfds[1][1]);
-  }
-
- /*
-  * Wait for the children to exit...
-  */
-
-  retval = 0;
-
-  while (cupsArrayCount(pids) > 0)
-  {
-    if ((pid = wait(&status)) < 0)
-    {
-      if (errno == EINTR && job_canceled)
-      {
-	fprintf(stderr, "DEBUG: Job canceled, killing filters ...\n");
-	for (pid_entry = (filter_pid_t *)cupsArrayFirst(pids);
-	     pid_entry;
-	     pid_entry = (filter_pid_t *)cupsArrayNext(pids))
-	  kill(pid_entry->pid, SIGTERM);
-	job_canceled = 0;
-      }
-      else
-	continue;
-    }
-
-    key.pid = pid;
-    if ((pid_entry = (filter_pid_t *)cupsArrayFind(pids, &key)) != NULL)
-    {
-      cupsArrayRemove(pids, pid_entry);
-
-      if (status)
-      {
-	if (WIFEXITED(status))
-	  fprintf(stderr, "ERROR: %s (PID %d) stopped with status %d\n",
-		  pid_entry->name, pid, WEXITSTATUS(status));
-	else
-	  fprintf(stderr, "ERROR: %s (PID %d) crashed on signal %d\n",
-		  pid_entry->name, pid, WTERMSIG(status));
-
-        retval = 1;
-      }
-      else
-        fprintf(stderr, "INFO: %s (PID %d) exited with no errors.\n",
-	        pid_entry->name, pid);
-
-      free(pid_entry);
-    }
-  }
-
-  cupsArrayDelete(pids);
-
-  return (retval);
-}
-
-
-/*
- * 'open_pipe()' - Create a pipe which is closed on exec.
- */
-
-static int				/* O - 0 on success, -1 on error */
-open_pipe(int *fds)			/* O - Pipe file descriptors (2) */
-{
- /*
-  * Create the pipe...
-  */
-
-  if (pipe(fds))
-  {
-    fds[0] = -1;
-    fds[1] = -1;
-
-    return (-1);
-  }
-
- /*
-  * Set the "close on exec" flag on each end of the pipe...
-  */
-
-  if (fcntl(fds[0], F_SETFD, fcntl(fds[0], F_GETFD) | FD_CLOEXEC))
-  {
-    close(fds[0]);
-    close(fds[1]);
-
-    fds[0] = -1;
-    fds[1] = -1;
-
-    return (-1);
-  }
-
-  if (fcntl(fds[1], F_SETFD, fcntl(fds[1], F_GETFD) | FD_CLOEXEC))
-  {
-    close(fds[0]);
-    close(fds[1]);
-
-    fds[0] = -1;
-    fds[1] = -1;
-
-    return (-1);
-  }
-
- /*
-  * Return 0 indicating success...
-  */
-
-  return (0);
-}
-
-
 /*
  * Get option value in a string of options
  */
@@ -27,10 +27,15 @@
 #include <sys/socket.h>
 #endif /* __OpenBSD__ */
 #include <sys/types.h>
+#include <sys/un.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <ifaddrs.h>
+#ifdef __linux
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif /* __linux */
 #include <resolv.h>
 #include <stdio.h>
 #include <sys/stat.h>
@@ -91,6 +96,18 @@ char    *BrowseLDAPCACertFile = NULL;
 
 #ifdef HAVE_LDAP
 #define LDAP_BROWSE_FILTER "(objectclass=cupsPrinter)"
+#define LDAP_FULL_SCAN_POLLS 10
+/* What we have seen of an LDAP printer entry the last time */
+typedef struct ldap_printer_s {
+  char *timestamp;     /* modifyTimestamp, NULL if not supplied */
+  char *values;        /* Values which went into the discovery */
+  char *host;          /* Host and service name of the discovered */
+  char *service_name;  /* printer, NULL if it was not discovered */
+  gboolean seen;       /* Still in the directory? */
+} ldap_printer_t;
+static GHashTable *ldap_printers = NULL; /* DN -> ldap_printer_t */
+static int ldap_have_timestamps = -1;    /* -1: Not known yet */
+static unsigned int ldap_polls = 0;
 static LDAP *ldap_connect(void);
 static LDAP *ldap_reconnect(void);
 static void ldap_disconnect(LDAP *ld);
@@ -135,6 +152,11 @@ static int  ldap_rebind_proc(LDAP *RebindLDAPHandle,
    the current job */
 #define CUPS_BROWSED_DEST_PRINTER "cups-browsed-dest-printer"
 
+/* Name prefix of the UNIX socket in CUPS_STATEDIR on which a waiting
+   implicitclass backend listens for wake-ups from us, followed by the
+   queue name */
+#define CUPS_BROWSED_NOTIFY_SOCKET "cups-browsed-implicitclass-"
+
 /* Timeout values in sec */
 #define TIMEOUT_IMMEDIATELY -1
 #define TIMEOUT_CONFIRM     10
@@ -152,6 +174,15 @@ static int  ldap_rebind_proc(LDAP *RebindLDAPHandle,
 #define LOCAL_DEFAULT_PRINTER_FILE "/cups-browsed-local-default-printer"
 #define REMOTE_DEFAULT_PRINTER_FILE "/cups-browsed-remote-default-printer"
 #define SAVE_OPTIONS_FILE "/cups-browsed-options-%s"
+#define SAVE_OPTIONS_DELAY 2
+#define DISCOVERY_STATE_FILE "/cups-browsed-discovery-state"
+#define BROWSE_POLL_MAX_THREADS 8
+#define BROWSE_POLL_JITTER 10 /* % of BrowseInterval */
+#define PRINTER_ATTRS_MAX_THREADS 8
+#define BROWSE_PACKET_BATCH 16
+#define QUEUE_UPDATE_TIME_BUDGET 500000 /* usec per update_cups_queues() */
+#define QUEUE_UPDATE_SLOW 250000 /* usec per queue update when cupsd is busy */
+#define QUEUE_UPDATE_COALESCE 200 /* msec to collect changes */
 #define DEBUG_LOG_FILE "/cups-browsed_log"
 #define DEBUG_LOG_FILE_2 "/cups-browsed_previous_logs"
 
@@ -178,14 +209,20 @@ typedef struct remote_printer_s {
   char *location;
   char *info;
   char *uri;
-  char *make_model;
-  char *pdl;
+  char *make_model;     /* Interned, see intern_string() */
+  char *pdl;            /* Interned */
   int color;
   int duplex;
-  ipp_t *prattrs;
-  char *nickname;
+  ipp_t *prattrs;       /* Read-only if attrs_shared is set */
+  struct shared_attrs_s *attrs_shared;
+  ipp_t *devattrs;      /* Per-device part of the attributes if
+			   prattrs is shared */
+  char *nickname;       /* Interned */
   int num_options;
   cups_option_t *options;
+  int num_ppd_options;
+  cups_option_t *ppd_options;
+  int ppd_options_valid;
   printer_status_t status;
   time_t timeout;
   void *slave_of;
@@ -194,16 +231,43 @@ typedef struct remote_printer_s {
   char *ip;
   int port;
   char *service_name;
-  char *type;
-  char *domain;
+  char *type;           /* Interned */
+  char *domain;         /* Interned */
   cups_array_t *ipp_discoveries;
   int no_autosave;
   int overwritten;
   int netprinter;
   int is_legacy;
   int timeouted;
+  ipp_t *saved_state;
+  struct printer_attrs_job_s *attrs_job;
 } remote_printer_t;
 
+/* Data structure for fetching the IPP attributes of a remote printer in
+   a thread of printer_attrs_pool */
+typedef struct printer_attrs_job_s {
+  remote_printer_t *p;  /* NULL when the entry went away meanwhile, only
+			   accessed in the main thread */
+  char *uri;
+  int is_cups_queue;
+  ipp_t *prattrs;       /* Result, NULL on failure */
+  char error[256];
+} printer_attrs_job_t;
+
+/* IPP attributes describing the capabilities of a printer model, shared
+   by all remote printers which report exactly the same ones */
+typedef struct shared_attrs_s {
+  ipp_t *attrs;
+  char *hash;           /* Key in shared_printer_attrs */
+  int refs;
+} shared_attrs_t;
+
+/* String used by several remote printer entries, stored only once */
+typedef struct interned_string_s {
+  int refs;
+  char str[1];
+} interned_string_t;
+
 /* Data structure for network interfaces */
 typedef struct netif_s {
   char *address;
@@ -230,6 +294,12 @@ typedef struct allow_s {
   http_addr_t addr;
   http_addr_t mask;
 } allow_t;
+/* Binary trie of the IPv4 prefixes of the allow/deny rules, a node has
+   the bit (1 << sense) set in "senses" if a rule's prefix ends there */
+typedef struct allow_node_s {
+  struct allow_node_s *child[2];
+  unsigned int senses;
+} allow_node_t;
 
 /* Data structures for browse filter rules */
 typedef enum filter_sense_s {
@@ -264,6 +334,13 @@ typedef struct browsepoll_s {
    * if anything has changed, and if not we know these printers are
    * still there. */
   GList *printers; /* of browsepoll_printer_t */
+
+  /* Polling happens in a thread of browse_poll_pool, which uses the
+   * subscription data and these fields, but not "printers", until
+   * browse_poll_done() runs. */
+  http_t *conn;           /* Kept open from one poll to the next */
+  int poll_status;        /* -1: failed, 0: no change, 1: new list */
+  GList *polled_printers; /* New list of printers, for poll_status 1 */
 } browsepoll_t;
 
 /* Data structure for destination list obtained with cupsEnumDests() */
@@ -277,8 +354,30 @@ typedef struct local_printer_s {
   char *device_uri;
   char *uuid;
   gboolean cups_browsed_controlled;
+  /* Mirror of the queue's state, kept current by the CupsNotifier
+     signals, state_valid is FALSE when it has to be queried */
+  gboolean state_valid;
+  ipp_pstate_t state;
+  char *state_message;
 } local_printer_t;
 
+/* Option settings of a queue in the write-behind store, "dirty" when
+   they still need to be written to the queue's options file. Without
+   options the file gets removed. */
+typedef struct saved_options_s {
+  int num_options;
+  cups_option_t *options;
+  gboolean dirty;
+} saved_options_t;
+
+/* Options file to write (or remove, without options) in the thread of
+   saved_options_pool */
+typedef struct saved_options_job_s {
+  char *printer;
+  int num_options;
+  cups_option_t *options;
+} saved_options_job_t;
+
 /* Browse data to send for local printer */
 typedef struct browse_data_s {
   int type;
@@ -383,19 +482,32 @@ typedef struct pagesize_count_s{
 cups_array_t *remote_printers;
 static char *alt_config_file = NULL;
 static cups_array_t *command_line_config;
-static cups_array_t *netifs;
-static cups_array_t *local_hostnames;
+static cups_array_t *netifs;            /* Sorted by address */
+static GHashTable *local_hostnames;     /* Lower-case names and addresses */
+static GHashTable *netif_names = NULL;  /* Address -> name, "" if none */
+static GByteArray *netifs_snapshot = NULL;
+static gboolean netifs_dirty = TRUE;
+static int netlink_socket = -1;
 static cups_array_t *browseallow;
+static allow_node_t *browseallow_trie = NULL;
+static cups_array_t *browseallow_irregular = NULL; /* Non-prefix masks */
+static unsigned int browseallow_net_senses = 0;
+static GHashTable *browse_packets_seen = NULL;
+static time_t browse_packets_purged = 0;
 static gboolean browseallow_all = FALSE;
 static gboolean browsedeny_all = FALSE;
 static browse_order_t browse_order;
 static cups_array_t *browsefilter;
 
 static GHashTable *local_printers;
+static GHashTable *shared_printer_attrs = NULL; /* Hash -> shared_attrs_t */
+static GHashTable *interned_strings = NULL; /* String -> interned_string_t */
 static GHashTable *cups_supported_remote_printers;
 static browsepoll_t *local_printers_context = NULL;
 static http_t *local_conn = NULL;
 static gboolean inhibit_local_printers_update = FALSE;
+static char *cups_default_printer = NULL;
+static gboolean cups_default_printer_valid = FALSE;
 
 static GList *browse_data = NULL;
 
@@ -416,10 +528,17 @@ static const char * const ldap_attrs[] =/* CUPS LDAP attributes */
       "printerMakeAndModel",
       "printerType",
       "printerURI",
+      "modifyTimestamp",
+      NULL
+    };
+static const char * const ldap_timestamp_attrs[] =
+    {
+      "modifyTimestamp",
       NULL
     };
 #endif /* HAVE_LDAP */
 static guint queues_timer_id = 0;
+static gint64 queues_timer_due = 0;
 static int browsesocket = -1;
 
 #define BROWSE_DNSSD (1<<0)
@@ -435,6 +554,9 @@ static unsigned int NewBrowsePollQueuesShared = 0;
 static unsigned int AllowResharingRemoteCUPSPrinters = 0;
 static unsigned int DebugLogFileSize = 300;
 static size_t NumBrowsePoll = 0;
+static GThreadPool *browse_poll_pool = NULL;
+static GThreadPool *printer_attrs_pool = NULL;
+static GThreadPool *saved_options_pool = NULL;
 static guint update_netifs_sourceid = 0;
 static char local_server_str[1024];
 static char *DomainSocket = NULL;
@@ -465,8 +587,11 @@ static int AutoClustering = 1;
 static cups_array_t *clusters;
 static load_balancing_type_t LoadBalancingType = QUEUE_ON_CLIENT;
 static char *DefaultOptions = NULL;
-static int update_cups_queues_max_per_call = 10;
+static int update_cups_queues_max_per_call = -1; /* 0: unlimited,
+						     -1: adaptive */
 static int pause_between_cups_queue_updates = 1;
+static gint64 queue_update_latency = 0; /* Average per queue update, usec */
+static unsigned long queue_updates_total = 0;
 static remote_printer_t *deleted_master = NULL;
 static int terminating = 0; /* received SIGTERM, ignore callbacks,
              break loops */
@@ -487,6 +612,9 @@ static char logdir[1024];
 static char local_default_printer_file[2048];
 static char remote_default_printer_file[2048];
 static char save_options_file[2048];
+static GHashTable *saved_options = NULL;
+static guint saved_options_flush_id = 0;
+static char discovery_state_file[2048];
 static char debug_log_file[2048];
 static char debug_log_file_bckp[2048];
 
@@ -515,10 +643,14 @@ static char* ppd_keywords[] =
 static int timeout_reached = 0;
 
 static void recheck_timer (void);
+void remove_printer_entry(remote_printer_t *p);
 static void browse_poll_create_subscription (browsepoll_t *context,
 					     http_t *conn);
 static gboolean browse_poll_get_notifications (browsepoll_t *context,
 					       http_t *conn);
+gboolean browse_poll (gpointer data);
+static gboolean browse_poll_done (gpointer data);
+static gboolean printer_attrs_done (gpointer data);
 static remote_printer_t
 *examine_discovered_printer_record(const char *host,
 				   const char *ip,
@@ -674,13 +806,19 @@ httpAddrPort(http_addr_t *addr)         /* I - Address */
 #endif
 
 
+/* debug_printf() gets also called by the threads of the worker pools,
+   serialize the writing and the rotation of the log file */
+static pthread_mutex_t debug_log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 void
 start_debug_logging()
 {
   if (debug_log_file[0] == '\0')
     return;
+  pthread_mutex_lock(&debug_log_mutex);
   if (lfp == NULL)
     lfp = fopen(debug_log_file, "a+");
+  pthread_mutex_unlock(&debug_log_mutex);
   if (lfp == NULL) {
     fprintf(stderr, "cups-browsed: ERROR: Failed creating debug log file %s\n",
       debug_log_file);
@@ -691,10 +829,12 @@ start_debug_logging()
 void
 stop_debug_logging()
 {
+  pthread_mutex_lock(&debug_log_mutex);
   debug_logfile = 0;
   if (lfp)
     fclose(lfp);
   lfp = NULL;
+  pthread_mutex_unlock(&debug_log_mutex);
 }
 
 // returns the size of debug log file
@@ -734,6 +874,7 @@ debug_printf(const char *format, ...) {
     ctime_r(&curtime, buf);
     while(isspace(buf[strlen(buf)-1])) buf[strlen(buf)-1] = '\0';
     va_list arglist;
+    pthread_mutex_lock(&debug_log_mutex);
     if (debug_stderr) {
       va_start(arglist, format);
       fprintf(stderr, "%s ", buf);
@@ -759,6 +900,7 @@ debug_printf(const char *format, ...) {
       fclose(fp2);
       lfp = fopen(debug_log_file, "w");
     }
+    pthread_mutex_unlock(&debug_log_mutex);
 }
 }
 
@@ -770,6 +912,7 @@ debug_log_out(char *log) {
     char *ptr1, *ptr2;
     ctime_r(&curtime, buf);
     while(isspace(buf[strlen(buf)-1])) buf[strlen(buf)-1] = '\0';
+    pthread_mutex_lock(&debug_log_mutex);
     ptr1 = log;
     while(ptr1) {
       ptr2 = strchr(ptr1, '\n');
@@ -781,6 +924,7 @@ debug_log_out(char *log) {
       if (ptr2) *ptr2 = '\n';
       ptr1 = ptr2 ? (ptr2 + 1) : NULL;
     }
+    pthread_mutex_unlock(&debug_log_mutex);
   }
 }
 
@@ -1277,6 +1421,15 @@ http_timeout_cb(http_t *http, void *user_data)
   return 0;
 }
 
+/* HTTP timeout callback for connections used in worker threads, unlike
+   http_timeout_cb() it does not set timeout_reached, which belongs to
+   the queue updates in the main thread */
+static int
+worker_http_timeout_cb(http_t *http, void *user_data)
+{
+  return 0;
+}
+
 static http_t *
 http_connect_local (void)
 {
@@ -3544,6 +3697,9 @@ new_local_printer (const char *device_uri,
   printer->device_uri = strdup (device_uri);
   printer->uuid = (uuid ? strdup (uuid) : NULL);
   printer->cups_browsed_controlled = cups_browsed_controlled;
+  printer->state_valid = FALSE;
+  printer->state = IPP_PRINTER_IDLE;
+  printer->state_message = NULL;
   return printer;
 }
 
@@ -3554,6 +3710,7 @@ free_local_printer (gpointer data)
   debug_printf("free_local_printer() in THREAD %ld\n", pthread_self());
   free (printer->device_uri);
   if (printer->uuid) free (printer->uuid);
+  if (printer->state_message) free (printer->state_message);
   free (printer);
 }
 
@@ -3794,6 +3951,13 @@ get_local_printers (void)
 		     "localhost", 0, "/printers/%s", dest->name);
     printer = new_local_printer (device_uri, get_printer_uuid(conn, uri),
 				 cups_browsed_controlled);
+    /* cupsEnumDests() tells the state but not the state message, so the
+       mirror is only complete for queues which are not stopped */
+    if ((val = cupsGetOption ("printer-state", dest->num_options,
+			      dest->options)) != NULL) {
+      printer->state = (ipp_pstate_t)atoi (val);
+      printer->state_valid = (printer->state != IPP_PRINTER_STOPPED);
+    }
     debug_printf ("Printer %s: %s, %s%s%s\n",
 		  dest->name, device_uri, printer->uuid,
 		  cups_browsed_controlled ? ", cups_browsed" : "",
@@ -4532,11 +4696,70 @@ ldap_disconnect(LDAP *ld)   /* I - LDAP handle */
 }
 
 /*
- * 'cupsdUpdateLDAPBrowse()' - Scan for new printers via LDAP...
+ * 'ldap_printer_free()' - Free an entry of the LDAP printer cache
  */
 
-void
-cupsdUpdateLDAPBrowse(void)
+static void
+ldap_printer_free(gpointer data)
+{
+  ldap_printer_t *entry = data;
+
+  free(entry->timestamp);
+  free(entry->values);
+  free(entry->host);
+  free(entry->service_name);
+  free(entry);
+}
+
+
+/*
+ * 'ldap_printer_remove()' - Remove the printer discovered from an LDAP entry
+ */
+
+static void
+ldap_printer_remove(ldap_printer_t *entry)
+{
+  remote_printer_t *p;
+
+  if (entry->service_name == NULL)
+    return;
+
+  /* Printers discovered by LDAP have neither DNS-SD type and domain nor
+     a legacy CUPS browsing timeout */
+  for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
+       p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
+    if (p->status != STATUS_DISAPPEARED &&
+	p->status != STATUS_TO_BE_RELEASED &&
+	!p->is_legacy &&
+	(p->type == NULL || p->type[0] == '\0') &&
+	(p->domain == NULL || p->domain[0] == '\0') &&
+	!strcasecmp(p->service_name, entry->service_name) &&
+	!strcasecmp(p->host, entry->host))
+      break;
+
+  if (p) {
+    debug_printf("LDAP: Printer %s got removed from the directory.\n",
+		 p->queue_name);
+    remove_printer_entry(p);
+  }
+
+  free(entry->host);
+  free(entry->service_name);
+  entry->host = NULL;
+  entry->service_name = NULL;
+}
+
+
+/*
+ * 'ldap_process_entry()' - Discover the printer of an LDAP entry if it is
+ *                          new or has changed
+ */
+
+static int                                  /* O - 1 if examined */
+ldap_process_entry(LDAPMessage *e,          /* I - Entry with all values */
+		   const char  *dn,         /* I - DN of the entry */
+		   const char  *timestamp,  /* I - modifyTimestamp or NULL */
+		   int         force)       /* I - Examine unchanged entries? */
 {
   char    uri[HTTP_MAX_URI],            /* Printer URI */
           host[HTTP_MAX_URI],           /* Hostname */
@@ -4551,11 +4774,146 @@ cupsdUpdateLDAPBrowse(void)
           username[64];                 /* URI's username */
   int     port;                         /* URI's port number */
   char    *c;
+  char    *values;                      /* All values, for comparison */
   int     hl;
+  ldap_printer_t *entry;                /* Cache entry */
+
+  if ((entry = g_hash_table_lookup(ldap_printers, dn)) == NULL) {
+    entry = calloc(1, sizeof(ldap_printer_t));
+    g_hash_table_insert(ldap_printers, g_strdup(dn), entry);
+  }
+  entry->seen = TRUE;
+  free(entry->timestamp);
+  entry->timestamp = (timestamp ? strdup(timestamp) : NULL);
+
+ /*
+  * Get the required values from this entry...
+  */
+
+  if (ldap_getval_firststring(BrowseLDAPHandle, e,
+			      "printerDescription", info, sizeof(info)) == -1 ||
+      ldap_getval_firststring(BrowseLDAPHandle, e,
+			      "printerLocation", location,
+			      sizeof(location)) == -1 ||
+      ldap_getval_firststring(BrowseLDAPHandle, e,
+			      "printerMakeAndModel", make_model,
+			      sizeof(make_model)) == -1 ||
+      ldap_getval_firststring(BrowseLDAPHandle, e,
+			      "printerType", type_num,
+			      sizeof(type_num)) == -1 ||
+      ldap_getval_firststring(BrowseLDAPHandle, e,
+			      "printerURI", uri, sizeof(uri)) == -1) {
+    ldap_printer_remove(entry);
+    free(entry->values);
+    entry->values = NULL;
+    return (0);
+  }
+
+ /*
+  * Nothing to do if the entry did not change...
+  */
+
+  values = malloc(strlen(uri) + strlen(info) + strlen(location) +
+		  strlen(make_model) + strlen(type_num) + 5);
+  sprintf(values, "%s\n%s\n%s\n%s\n%s", uri, info, location, make_model,
+	  type_num);
+  if (!force && entry->values && !strcmp(entry->values, values)) {
+    free(values);
+    return (0);
+  }
+  free(entry->values);
+  entry->values = values;
+
+ /*
+  * Process the entry...
+  */
+
+  memset(scheme, 0, sizeof(scheme));
+  memset(username, 0, sizeof(username));
+  memset(host, 0, sizeof(host));
+  memset(resource, 0, sizeof(resource));
+  memset(local_resource, 0, sizeof(local_resource));
+
+  httpSeparateURI (HTTP_URI_CODING_ALL, uri,
+		   scheme, sizeof(scheme) - 1,
+		   username, sizeof(username) - 1,
+		   host, sizeof(host) - 1,
+		   &port,
+		   resource, sizeof(resource)- 1);
+
+  if (strncasecmp (resource, "/printers/", 10) &&
+      strncasecmp (resource, "/classes/", 9)) {
+    debug_printf("don't understand URI: %s\n", uri);
+    ldap_printer_remove(entry);
+    return (0);
+  }
+
+  strncpy (local_resource, resource + 1, sizeof (local_resource) - 1);
+  local_resource[sizeof (local_resource) - 1] = '\0';
+  c = strchr (local_resource, '?');
+  if (c)
+    *c = '\0';
+
+  /* Build the DNS-SD service name which CUPS would give to this printer
+     when DNS-SD-broadcasting it */
+  snprintf(service_name, sizeof (service_name), "%s @ %s",
+	   (strlen(info) > 0 ? info : strchr(local_resource, '/') + 1), host);
+  /* Cut off trailing ".local" of host name */
+  hl = strlen(service_name);
+  if (hl > 6 && !strcasecmp(service_name + hl - 6, ".local"))
+    service_name[hl - 6] = '\0';
+  if (hl > 7 && !strcasecmp(service_name + hl - 7, ".local."))
+    service_name[hl - 7] = '\0';
+  /* DNS-SD service name has max. 63 characters */
+  service_name[63] = '\0';
+
+  /* The entry now points to another printer */
+  if (entry->service_name &&
+      (strcasecmp(entry->service_name, service_name) ||
+       strcasecmp(entry->host, host)))
+    ldap_printer_remove(entry);
+
+  debug_printf("LDAP: Remote host: %s; Port: %d; Remote queue name: %s; Service Name: %s\n",
+	       host, port, strchr(local_resource, '/') + 1, service_name);
+
+  if (examine_discovered_printer_record(host, NULL, port, local_resource,
+					service_name, location, info, "", "",
+					"", 0, NULL) &&
+      entry->service_name == NULL) {
+    entry->host = strdup(host);
+    entry->service_name = strdup(service_name);
+  }
+
+  return (1);
+}
+
+
+/*
+ * 'cupsdUpdateLDAPBrowse()' - Scan for new printers via LDAP...
+ *
+ * Once we know that the server supplies "modifyTimestamp" we only ask for
+ * the timestamps and fetch the complete entries which are new or got
+ * modified. Every LDAP_FULL_SCAN_POLLS polls all entries are fetched and
+ * examined again.
+ */
+
+void
+cupsdUpdateLDAPBrowse(void)
+{
+  char    timestamp[64];                /* modifyTimestamp of the entry */
+  char    *dn;                          /* DN of the entry */
   int     rc;                           /* LDAP status */
   int     limit;                        /* Size limit */
+  int     refresh;                      /* Examine unchanged entries? */
+  int     full_scan;                    /* Fetch all entries completely? */
+  int     num_changed = 0;              /* Number of entries fetched */
   LDAPMessage *res,                     /* LDAP search results */
-          *e;                           /* Current entry from search */
+          *eres,                        /* LDAP search result for one entry */
+          *e,                           /* Current entry from search */
+          *fe;                          /* Fetched complete entry */
+  GHashTableIter iter;                  /* Iterator for the cache */
+  gpointer value;                       /* Current cache entry */
+  ldap_printer_t *entry;                /* Cache entry */
 
   debug_printf("UpdateLDAPBrowse\n");
 
@@ -4568,12 +4926,21 @@ cupsdUpdateLDAPBrowse(void)
     return;
   }
 
+  if (ldap_printers == NULL)
+    ldap_printers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+					  ldap_printer_free);
+
+  refresh = (ldap_polls % LDAP_FULL_SCAN_POLLS == 0);
+  full_scan = (ldap_have_timestamps != 1 || refresh);
+
  /*
   * Search for cups printers in LDAP directory...
   */
 
   rc = ldap_search_rec(BrowseLDAPHandle, BrowseLDAPDN, LDAP_SCOPE_SUBTREE,
-                       BrowseLDAPFilter, (char **)ldap_attrs, 0, &res);
+                       BrowseLDAPFilter,
+		       (char **)(full_scan ? ldap_attrs :
+				 ldap_timestamp_attrs), 0, &res);
 
  /*
   * If ldap search was successfull then exit function
@@ -4598,17 +4965,23 @@ cupsdUpdateLDAPBrowse(void)
     debug_printf("LDAP update enabled\n");
   }
 
+  ldap_polls ++;
+
  /*
   * Count LDAP entries and return if no entry exist...
   */
 
   limit = ldap_count_entries(BrowseLDAPHandle, res);
   debug_printf("LDAP search returned %d entries\n", limit);
-  if (limit < 1) {
+  if (limit < 1 && g_hash_table_size(ldap_printers) == 0) {
     ldap_freeres(res);
     return;
   }
 
+  g_hash_table_iter_init(&iter, ldap_printers);
+  while (g_hash_table_iter_next(&iter, NULL, &value))
+    ((ldap_printer_t *)value)->seen = FALSE;
+
  /*
   * Loop through the available printers...
   */
@@ -4616,85 +4989,62 @@ cupsdUpdateLDAPBrowse(void)
   for (e = ldap_first_entry(BrowseLDAPHandle, res);
        e;
        e = ldap_next_entry(BrowseLDAPHandle, e)) {
-   /*
-    * Get the required values from this entry...
-    */
-
-    if (ldap_getval_firststring(BrowseLDAPHandle, e,
-                                "printerDescription", info, sizeof(info)) == -1)
+    if ((dn = ldap_get_dn(BrowseLDAPHandle, e)) == NULL)
       continue;
 
-    if (ldap_getval_firststring(BrowseLDAPHandle, e,
-                                "printerLocation", location,
-				sizeof(location)) == -1)
-      continue;
+    timestamp[0] = '\0';
+    if (ldap_have_timestamps != 0 &&
+	ldap_getval_firststring(BrowseLDAPHandle, e, "modifyTimestamp",
+				timestamp, sizeof(timestamp)) == 0 &&
+	ldap_have_timestamps == -1) {
+      debug_printf("LDAP server supplies modifyTimestamp, only fetching new and modified entries from now on\n");
+      ldap_have_timestamps = 1;
+    }
+
+    if (full_scan)
+      num_changed += ldap_process_entry(e, dn,
+					(timestamp[0] ? timestamp : NULL),
+					refresh);
+    else if ((entry = g_hash_table_lookup(ldap_printers, dn)) != NULL &&
+	       entry->timestamp && !strcmp(entry->timestamp, timestamp))
+      entry->seen = TRUE;
+    else if (ldap_search_rec(BrowseLDAPHandle, dn, LDAP_SCOPE_BASE,
+			     BrowseLDAPFilter, (char **)ldap_attrs, 0,
+			     &eres) == LDAP_SUCCESS) {
+     /*
+      * New or modified entry, fetch all of it...
+      */
+
+      if ((fe = ldap_first_entry(BrowseLDAPHandle, eres)) != NULL)
+	num_changed += ldap_process_entry(fe, dn,
+					  (timestamp[0] ? timestamp : NULL),
+					  0);
+      ldap_freeres(eres);
+    } else if (entry)
+      entry->seen = TRUE; /* Try again next time */
 
-    if (ldap_getval_firststring(BrowseLDAPHandle, e,
-                                "printerMakeAndModel", make_model,
-				sizeof(make_model)) == -1)
-      continue;
+    ldap_memfree(dn);
+  }
 
-    if (ldap_getval_firststring(BrowseLDAPHandle, e,
-                                "printerType", type_num,
-				sizeof(type_num)) == -1)
-      continue;
+  if (ldap_have_timestamps == -1)
+    ldap_have_timestamps = 0;
 
-    if (ldap_getval_firststring(BrowseLDAPHandle, e,
-                                "printerURI", uri, sizeof(uri)) == -1)
-      continue;
+  ldap_freeres(res);
 
-   /*
-    * Process the entry...
-    */
+ /*
+  * Remove the printers whose entries are gone...
+  */
 
-    memset(scheme, 0, sizeof(scheme));
-    memset(username, 0, sizeof(username));
-    memset(host, 0, sizeof(host));
-    memset(resource, 0, sizeof(resource));
-    memset(local_resource, 0, sizeof(local_resource));
-
-    httpSeparateURI (HTTP_URI_CODING_ALL, uri,
-		     scheme, sizeof(scheme) - 1,
-		     username, sizeof(username) - 1,
-		     host, sizeof(host) - 1,
-		     &port,
-		     resource, sizeof(resource)- 1);
-
-    if (strncasecmp (resource, "/printers/", 10) &&
-	strncasecmp (resource, "/classes/", 9)) {
-      debug_printf("don't understand URI: %s\n", uri);
-      return;
+  g_hash_table_iter_init(&iter, ldap_printers);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    entry = value;
+    if (!entry->seen) {
+      ldap_printer_remove(entry);
+      g_hash_table_iter_remove(&iter);
     }
-
-    strncpy (local_resource, resource + 1, sizeof (local_resource) - 1);
-    local_resource[sizeof (local_resource) - 1] = '\0';
-    c = strchr (local_resource, '?');
-    if (c)
-      *c = '\0';
-
-    /* Build the DNS-SD service name which CUPS would give to this printer
-       when DNS-SD-broadcasting it */
-    snprintf(service_name, sizeof (service_name), "%s @ %s",
-	     (strlen(info) > 0 ? info : strchr(local_resource, '/') + 1), host);
-    /* Cut off trailing ".local" of host name */
-    hl = strlen(service_name);
-    if (hl > 6 && !strcasecmp(service_name + hl - 6, ".local"))
-      service_name[hl - 6] = '\0';
-    if (hl > 7 && !strcasecmp(service_name + hl - 7, ".local."))
-      service_name[hl - 7] = '\0';
-    /* DNS-SD service name has max. 63 characters */
-    service_name[63] = '\0';
-
-    debug_printf("LDAP: Remote host: %s; Port: %d; Remote queue name: %s; Service Name: %s\n",
-		 host, port, strchr(local_resource, '/') + 1, service_name);
-
-    examine_discovered_printer_record(host, NULL, port, local_resource,
-				      service_name, location, info, "", "",
-				      "", 0, NULL);
-
   }
 
-  ldap_freeres(res);
+  debug_printf("LDAP: %d of %d entries examined\n", num_changed, limit);
 }
 
 /*
@@ -5024,6 +5374,246 @@ log_cluster(remote_printer_t *p) {
 		   (i == q->last_printer ? " (last job printed)" : ""));
 }
 
+/* Get a copy of a string which is shared with all other users of the
+   same string, to be given back with release_string(). The result must
+   not be modified. */
+static char *
+intern_string(const char *str) {
+  interned_string_t *s;
+
+  if (str == NULL)
+    return NULL;
+  if (interned_strings == NULL)
+    interned_strings = g_hash_table_new_full(g_str_hash, g_str_equal,
+					     NULL, free);
+  if ((s = g_hash_table_lookup(interned_strings, str)) == NULL) {
+    if ((s = malloc(sizeof(interned_string_t) + strlen(str))) == NULL)
+      return NULL;
+    s->refs = 0;
+    strcpy(s->str, str);
+    g_hash_table_insert(interned_strings, s->str, s);
+  }
+  s->refs ++;
+  return s->str;
+}
+
+static void
+release_string(char *str) {
+  interned_string_t *s;
+
+  if (str == NULL || interned_strings == NULL ||
+      (s = g_hash_table_lookup(interned_strings, str)) == NULL)
+    return;
+  if (-- s->refs <= 0)
+    g_hash_table_remove(interned_strings, str);
+}
+
+/* IPP attributes which differ between printers of the same model, they
+   stay with each printer when the others get shared */
+static int
+printer_attr_is_per_device(const char *name) {
+  static const char * const prefixes[] =
+    {
+     "marker-",
+     "media-col-ready",
+     "media-ready",
+     "printer-alert",
+     "printer-charge-info",
+     "printer-config-change",
+     "printer-contact",
+     "printer-current-time",
+     "printer-device-id",
+     "printer-dns-sd-name",
+     "printer-firmware",
+     "printer-geo-location",
+     "printer-icons",
+     "printer-id",
+     "printer-impressions",
+     "printer-info",
+     "printer-input-tray",
+     "printer-is-accepting-jobs",
+     "printer-location",
+     "printer-message",
+     "printer-more-info",
+     "printer-name",
+     "printer-organization",
+     "printer-output-tray",
+     "printer-serial-number",
+     "printer-state",
+     "printer-strings-uri",
+     "printer-supply",
+     "printer-up-time",
+     "printer-uri-supported",
+     "printer-uuid",
+     "printer-xri-supported",
+     "queued-job-count",
+     "uri-authentication-supported",
+     "uri-security-supported"
+    };
+  size_t i;
+
+  for (i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i ++)
+    if (!strncmp(name, prefixes[i], strlen(prefixes[i])))
+      return 1;
+  return 0;
+}
+
+static int
+printer_attr_model_cb(void *context, ipp_t *dst, ipp_attribute_t *attr) {
+  return (ippGetName(attr) != NULL &&
+	  !printer_attr_is_per_device(ippGetName(attr)));
+}
+
+static int
+printer_attr_device_cb(void *context, ipp_t *dst, ipp_attribute_t *attr) {
+  return (ippGetName(attr) != NULL &&
+	  printer_attr_is_per_device(ippGetName(attr)));
+}
+
+static ssize_t
+ipp_buffer_write(GByteArray *buffer, ipp_uchar_t *data, size_t bytes) {
+  g_byte_array_append(buffer, data, bytes);
+  return (ssize_t)bytes;
+}
+
+/* Drop the IPP attributes of a printer, shared or not */
+static void
+printer_attrs_release(remote_printer_t *p) {
+  shared_attrs_t *shared = p->attrs_shared;
+
+  if (shared) {
+    if (-- shared->refs <= 0) {
+      g_hash_table_remove(shared_printer_attrs, shared->hash);
+      ippDelete(shared->attrs);
+      g_free(shared->hash);
+      free(shared);
+    }
+  } else if (p->prattrs)
+    ippDelete(p->prattrs);
+  if (p->devattrs)
+    ippDelete(p->devattrs);
+  p->prattrs = NULL;
+  p->attrs_shared = NULL;
+  p->devattrs = NULL;
+}
+
+/* Once the queue for a printer is set up we only need its attributes
+   for reading. Split them into the per-device ones and the ones
+   describing the model and share the latter with all printers which
+   have exactly the same, found by the hash of their IPP encoding. */
+static void
+printer_attrs_compact(remote_printer_t *p) {
+  ipp_t *model;
+  GByteArray *buffer;
+  char *hash;
+  shared_attrs_t *shared;
+
+  if (p->prattrs == NULL || p->attrs_shared)
+    return;
+
+  model = ippNew();
+  ippCopyAttributes(model, p->prattrs, 0, printer_attr_model_cb, NULL);
+  buffer = g_byte_array_new();
+  ippSetState(model, IPP_STATE_IDLE);
+  if (ippWriteIO(buffer, (ipp_iocb_t)ipp_buffer_write, 1, NULL, model) !=
+      IPP_STATE_DATA) {
+    g_byte_array_free(buffer, TRUE);
+    ippDelete(model);
+    return;
+  }
+  hash = g_compute_checksum_for_data(G_CHECKSUM_SHA256, buffer->data,
+				     buffer->len);
+  g_byte_array_free(buffer, TRUE);
+
+  if (shared_printer_attrs == NULL)
+    shared_printer_attrs = g_hash_table_new(g_str_hash, g_str_equal);
+  if ((shared = g_hash_table_lookup(shared_printer_attrs, hash)) != NULL) {
+    ippDelete(model);
+    g_free(hash);
+  } else {
+    if ((shared = calloc(1, sizeof(shared_attrs_t))) == NULL) {
+      ippDelete(model);
+      g_free(hash);
+      return;
+    }
+    shared->attrs = model;
+    shared->hash = hash;
+    g_hash_table_insert(shared_printer_attrs, shared->hash, shared);
+  }
+  shared->refs ++;
+
+  p->devattrs = ippNew();
+  ippCopyAttributes(p->devattrs, p->prattrs, 0, printer_attr_device_cb,
+		    NULL);
+  ippDelete(p->prattrs);
+  p->prattrs = shared->attrs;
+  p->attrs_shared = shared;
+}
+
+/* Give the printer a private, complete set of its IPP attributes again,
+   to be used before anything needs the per-device ones or modifies
+   them */
+static void
+printer_attrs_expand(remote_printer_t *p) {
+  ipp_t *attrs;
+
+  if (p->attrs_shared == NULL)
+    return;
+  attrs = ippNew();
+  ippCopyAttributes(attrs, p->prattrs, 0, NULL, NULL);
+  ippCopyAttributes(attrs, p->devattrs, 0, NULL, NULL);
+  printer_attrs_release(p);
+  p->prattrs = attrs;
+}
+
+/* Log how much memory the printer entries take and how much sharing
+   of attributes and strings saves */
+static void
+log_printer_memory_usage(void) {
+  remote_printer_t *p;
+  shared_attrs_t *shared;
+  interned_string_t *s;
+  GHashTableIter iter;
+  int num_printers = 0, num_private = 0, num_shared = 0, shared_refs = 0,
+    num_strings = 0, string_refs = 0;
+  unsigned long private_bytes = 0, shared_bytes = 0, shared_saved = 0,
+    string_bytes = 0, string_saved = 0;
+
+  for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
+       p; p = (remote_printer_t *)cupsArrayNext(remote_printers)) {
+    num_printers ++;
+    if (p->prattrs && !p->attrs_shared) {
+      num_private ++;
+      private_bytes += ippLength(p->prattrs);
+    }
+    if (p->devattrs)
+      private_bytes += ippLength(p->devattrs);
+  }
+  if (shared_printer_attrs) {
+    g_hash_table_iter_init(&iter, shared_printer_attrs);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&shared)) {
+      num_shared ++;
+      shared_refs += shared->refs;
+      shared_bytes += ippLength(shared->attrs);
+      shared_saved += (shared->refs - 1) * ippLength(shared->attrs);
+    }
+  }
+  if (interned_strings) {
+    g_hash_table_iter_init(&iter, interned_strings);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&s)) {
+      num_strings ++;
+      string_refs += s->refs;
+      string_bytes += strlen(s->str) + 1;
+      string_saved += (s->refs - 1) * (strlen(s->str) + 1);
+    }
+  }
+  debug_printf("Memory: %d printer entries, %d private attribute sets, %d shared attribute sets used by %d printers, %lu bytes of private and %lu bytes of shared attributes (%lu bytes saved), %d strings used %d times, %lu bytes (%lu bytes and %d allocations saved)\n",
+	       num_printers, num_private, num_shared, shared_refs,
+	       private_bytes, shared_bytes, shared_saved, num_strings,
+	       string_refs, string_bytes, string_saved,
+	       string_refs - num_strings);
+}
+
 void
 log_all_printers() {
   remote_printer_t *p, *q;
@@ -5044,33 +5634,83 @@ log_all_printers() {
 		    " (To be released from cups-browsed)" :
 		    (p->status == STATUS_TO_BE_CREATED ?
 		     " (To be created/updated)" : "")))));
+  log_printer_memory_usage();
   debug_printf("===============================\n");
 }
 
-char*
-is_disabled(const char *printer, const char *reason) {
+static local_printer_t *
+local_printer_lookup (const char *printer)
+{
+  char *local_queue_name_lower;
+  local_printer_t *local_printer;
+
+  if (printer == NULL || local_printers == NULL)
+    return NULL;
+  local_queue_name_lower = g_ascii_strdown(printer, -1);
+  local_printer = g_hash_table_lookup (local_printers,
+				       local_queue_name_lower);
+  g_free(local_queue_name_lower);
+  return local_printer;
+}
+
+static void
+local_printer_set_state (local_printer_t *local_printer,
+			 ipp_pstate_t state,
+			 const char *state_message)
+{
+  if (local_printer == NULL)
+    return;
+  if (local_printer->state_message)
+    free(local_printer->state_message);
+  local_printer->state_message = (state_message ? strdup(state_message) :
+				  NULL);
+  local_printer->state = state;
+  local_printer->state_valid = TRUE;
+}
+
+/* Get the state of a local queue. If we get CUPS' D-Bus notifications the
+   mirror in local_printers is up to date and gets used, otherwise we ask
+   CUPS about this one queue only. The state message is to be freed by the
+   caller. */
+static int
+get_local_printer_state (const char *printer,
+			 ipp_pstate_t *state,
+			 char **state_message)
+{
   ipp_t *request, *response;
   ipp_attribute_t *attr;
-  const char *pname = NULL;
-  ipp_pstate_t pstate = IPP_PRINTER_IDLE;
-  const char *p;
-  char *pstatemsg = NULL;
+  char uri[HTTP_MAX_URI];
+  local_printer_t *local_printer;
   static const char *pattrs[] =
                 {
-                  "printer-name",
                   "printer-state",
 		  "printer-state-message"
                 };
   http_t *conn = NULL;
 
+  *state = IPP_PRINTER_IDLE;
+  *state_message = NULL;
+
+  local_printer = local_printer_lookup(printer);
+  if (cups_notifier != NULL && local_printer && local_printer->state_valid) {
+    *state = local_printer->state;
+    if (local_printer->state_message)
+      *state_message = strdup(local_printer->state_message);
+    return 0;
+  }
+
   conn = http_connect_local ();
   if (conn == NULL) {
-    debug_printf("Cannot connect to local CUPS to check whether the printer %s is disabled.\n",
+    debug_printf("Cannot connect to local CUPS to check the state of printer %s.\n",
 		 printer);
-    return NULL;
+    return -1;
   }
 
-  request = ippNewRequest(CUPS_GET_PRINTERS);
+  httpAssembleURIf(HTTP_URI_CODING_ALL, uri, sizeof(uri), "ipp", NULL,
+		   "localhost", 0, "/printers/%s", printer);
+  request = ippNewRequest(IPP_GET_PRINTER_ATTRIBUTES);
+  ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
+	       "printer-uri", NULL, uri);
   ippAddStrings(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
 		"requested-attributes",
 		sizeof(pattrs) / sizeof(pattrs[0]),
@@ -5078,85 +5718,42 @@ is_disabled(const char *printer, const char *reason) {
   ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME,
 	       "requesting-user-name",
 	       NULL, cupsUser());
-  if ((response = cupsDoRequest(conn, request, "/")) != NULL) {
-    for (attr = ippFirstAttribute(response); attr != NULL;
-	 attr = ippNextAttribute(response)) {
-      while (attr != NULL && ippGetGroupTag(attr) != IPP_TAG_PRINTER)
-	attr = ippNextAttribute(response);
-      if (attr == NULL)
-	break;
-      pname = NULL;
-      pstate = IPP_PRINTER_IDLE;
-      if (pstatemsg) {
-	free(pstatemsg);
-	pstatemsg = NULL;
-      }
-      while (attr != NULL && ippGetGroupTag(attr) ==
-	     IPP_TAG_PRINTER) {
-	if (!strcmp(ippGetName(attr), "printer-name") &&
-	    ippGetValueTag(attr) == IPP_TAG_NAME)
-	  pname = ippGetString(attr, 0, NULL);
-	else if (!strcmp(ippGetName(attr), "printer-state") &&
-		 ippGetValueTag(attr) == IPP_TAG_ENUM)
-	  pstate = (ipp_pstate_t)ippGetInteger(attr, 0);
-	else if (!strcmp(ippGetName(attr), "printer-state-message") &&
-		 ippGetValueTag(attr) == IPP_TAG_TEXT) {
-	  if (pstatemsg != NULL) {
-	    free(pstatemsg);
-	    pstatemsg = NULL;
-	  }
-	  p = ippGetString(attr, 0, NULL);
-	  if (p != NULL) pstatemsg = strdup(p);
-	}
-	attr = ippNextAttribute(response);
-      }
-      if (pname == NULL) {
-	if (attr == NULL)
-	  break;
-	else
-	  continue;
-      }
-      if (!strcasecmp(pname, printer)) {
-	switch (pstate) {
-	case IPP_PRINTER_IDLE:
-	case IPP_PRINTER_PROCESSING:
-	  ippDelete(response);
-	  if (pstatemsg != NULL) {
-	    free(pstatemsg);
-	    pstatemsg = NULL;
-	  }
-	  return NULL;
-	case IPP_PRINTER_STOPPED:
-	  ippDelete(response);
-	  if (reason == NULL)
-	    return pstatemsg;
-	  else if (pstatemsg != NULL && (strcasestr(pstatemsg, reason) != NULL))
-	    return pstatemsg;
-	  else {
-            if (pstatemsg != NULL) {
-	      free(pstatemsg);
-	      pstatemsg = NULL;
-            }
-	    return NULL;
-	  }
-	}
-      }
-    }
-    debug_printf("No information regarding enabled/disabled found about the requested printer '%s'\n",
-		 printer);
+  response = cupsDoRequest(conn, request, "/");
+  if (response == NULL || cupsLastError() > IPP_STATUS_OK_EVENTS_COMPLETE) {
+    debug_printf("No information regarding enabled/disabled found about the requested printer '%s': %s\n",
+		 printer, cupsLastErrorString());
     ippDelete(response);
-    if (pstatemsg != NULL) {
-      free(pstatemsg);
-      pstatemsg = NULL;
-    }
-    return NULL;
+    return -1;
   }
-  debug_printf("ERROR: Request for printer info failed: %s\n",
-	       cupsLastErrorString());
-  if (pstatemsg != NULL) {
+
+  if ((attr = ippFindAttribute(response, "printer-state",
+			       IPP_TAG_ENUM)) != NULL)
+    *state = (ipp_pstate_t)ippGetInteger(attr, 0);
+  if ((attr = ippFindAttribute(response, "printer-state-message",
+			       IPP_TAG_TEXT)) != NULL &&
+      ippGetString(attr, 0, NULL) != NULL)
+    *state_message = strdup(ippGetString(attr, 0, NULL));
+  ippDelete(response);
+
+  local_printer_set_state(local_printer, *state, *state_message);
+  return 0;
+}
+
+char*
+is_disabled(const char *printer, const char *reason) {
+  ipp_pstate_t pstate;
+  char *pstatemsg = NULL;
+
+  if (get_local_printer_state(printer, &pstate, &pstatemsg) < 0)
+    return NULL;
+
+  if (pstate == IPP_PRINTER_STOPPED &&
+      (reason == NULL ||
+       (pstatemsg != NULL && strcasestr(pstatemsg, reason) != NULL)))
+    return pstatemsg;
+
+  if (pstatemsg != NULL)
     free(pstatemsg);
-    pstatemsg = NULL;
-  }
   return NULL;
 }
 
@@ -5185,6 +5782,8 @@ enable_printer (const char *printer) {
     return -1;
   }
   debug_printf("Enabled printer '%s'\n", printer);
+  local_printer_set_state(local_printer_lookup(printer), IPP_PRINTER_IDLE,
+			  NULL);
   return 0;
 }
 
@@ -5217,6 +5816,8 @@ disable_printer (const char *printer, const char *reason) {
     return -1;
   }
   debug_printf("Disabled printer '%s'\n", printer);
+  local_printer_set_state(local_printer_lookup(printer), IPP_PRINTER_STOPPED,
+			  reason);
   return 0;
 }
 
@@ -5250,6 +5851,10 @@ set_cups_default_printer(const char *printer) {
   }
   debug_printf("Successfully set CUPS default printer to '%s'\n",
 	       printer);
+  if (cups_default_printer != NULL)
+    free(cups_default_printer);
+  cups_default_printer = strdup(printer);
+  cups_default_printer_valid = TRUE;
   return 0;
 }
 
@@ -5261,6 +5866,11 @@ get_cups_default_printer() {
   char *name_string;
   http_t *conn = NULL;
 
+  /* With CUPS' D-Bus notifications we learn about every change of the
+     default printer, so we only need to ask once */
+  if (cups_notifier != NULL && cups_default_printer_valid)
+    return (cups_default_printer ? strdup(cups_default_printer) : NULL);
+
   conn = http_connect_local ();
   if (conn == NULL) {
     debug_printf("Cannot connect to local CUPS to find out which is the default printer.\n");
@@ -5275,7 +5885,11 @@ get_cups_default_printer() {
   response = cupsDoRequest(conn, request, "/");
   if (cupsLastError() > IPP_STATUS_OK_EVENTS_COMPLETE || !response) {
     debug_printf("Could not determine system default printer!\n");
+    if (cupsLastError() == IPP_STATUS_ERROR_NOT_FOUND)
+      /* There is no default printer */
+      cups_default_printer_valid = TRUE;
   } else {
+    cups_default_printer_valid = TRUE;
     for (attr = ippFirstAttribute(response); attr != NULL;
 	 attr = ippNextAttribute(response)) {
       while (attr != NULL && ippGetGroupTag(attr) != IPP_TAG_PRINTER)
@@ -5300,6 +5914,10 @@ get_cups_default_printer() {
   } else {
     name_string = NULL;
   }
+
+  if (cups_default_printer != NULL)
+    free(cups_default_printer);
+  cups_default_printer = (name_string ? strdup(name_string) : NULL);
   
   ippDelete(response);
   
@@ -5321,11 +5939,28 @@ is_cups_default_printer(const char *printer) {
   return 0;
 }
 
+/* The recorded default printers, [0] remote, [1] local, read from the
+   files only once */
+static char *recorded_default_printer[2] = { NULL, NULL };
+static gboolean recorded_default_printer_valid[2] = { FALSE, FALSE };
+
+static void
+set_recorded_default_printer(const char *printer, int local) {
+  local = (local != 0);
+  if (recorded_default_printer[local])
+    free(recorded_default_printer[local]);
+  recorded_default_printer[local] = (printer ? strdup(printer) : NULL);
+  recorded_default_printer_valid[local] = TRUE;
+}
+
 int
 invalidate_default_printer(int local) {
   const char *filename = local ? local_default_printer_file :
     remote_default_printer_file;
-  unlink(filename);
+  if (!recorded_default_printer_valid[local != 0] ||
+      recorded_default_printer[local != 0] != NULL)
+    unlink(filename);
+  set_recorded_default_printer(NULL, local);
   return 0;
 }
 
@@ -5338,6 +5973,12 @@ record_default_printer(const char *printer, int local) {
   if (printer == NULL || strlen(printer) == 0)
     return invalidate_default_printer(local);
 
+  /* Nothing to write if the file already has this printer */
+  if (recorded_default_printer_valid[local != 0] &&
+      recorded_default_printer[local != 0] &&
+      !strcmp(recorded_default_printer[local != 0], printer))
+    return 0;
+
   fp = fopen(filename, "w+");
   if (fp == NULL) {
     debug_printf("ERROR: Failed creating file %s\n",
@@ -5347,6 +5988,7 @@ record_default_printer(const char *printer, int local) {
   }
   fprintf(fp, "%s", printer);
   fclose(fp);
+  set_recorded_default_printer(printer, local);
   
   return 0;
 }
@@ -5360,30 +6002,251 @@ retrieve_default_printer(int local) {
   char *p, buf[1024];
   int n;
 
+  if (recorded_default_printer_valid[local != 0])
+    return recorded_default_printer[local != 0];
+
   fp = fopen(filename, "r");
   if (fp == NULL) {
     debug_printf("Failed reading file %s\n",
 		 filename);
+    set_recorded_default_printer(NULL, local);
     return NULL;
   }
   p = buf;
-  n = fscanf(fp, "%s", p);
+  n = fscanf(fp, "%1023s", p);
   if (n == 1) {
     if (strlen(p) > 0)
       printer = p;
   }
   fclose(fp);
+  set_recorded_default_printer(printer, local);
   
-  return printer;
+  return recorded_default_printer[local != 0];
 }
 
-int
-invalidate_printer_options(const char *printer) {
-  char filename[1024];
+static void
+saved_options_free (gpointer data)
+{
+  saved_options_t *entry = data;
+  cupsFreeOptions(entry->num_options, entry->options);
+  free(entry);
+}
+
+/* Write the options file of a queue, through a temporary file so that
+   a crash never leaves a truncated one */
+static int
+write_printer_options_file(const char *printer, saved_options_t *entry) {
+  char filename[1024], tempname[1040];
+  FILE *fp = NULL;
+  cups_option_t *option;
+  int i;
 
   snprintf(filename, sizeof(filename), save_options_file,
 	   printer);
-  unlink(filename);
+  snprintf(tempname, sizeof(tempname), "%s.new", filename);
+
+  fp = fopen(tempname, "w");
+  if (fp == NULL) {
+    debug_printf("ERROR: Failed creating file %s: %s\n",
+		 tempname, strerror(errno));
+    return -1;
+  }
+
+  for (i = entry->num_options, option = entry->options; i > 0;
+       i --, option ++)
+    if (fprintf (fp, "%s=%s\n", option->name, option->value) < 0)
+      break;
+
+  if (i > 0 || fclose(fp) != 0) {
+    debug_printf("ERROR: Failed to write into file %s: %s\n",
+		 tempname, strerror(errno));
+    if (i > 0)
+      fclose(fp);
+    unlink(tempname);
+    return -1;
+  }
+
+  if (rename(tempname, filename)) {
+    debug_printf("ERROR: Failed to rename %s to %s: %s\n",
+		 tempname, filename, strerror(errno));
+    unlink(tempname);
+    return -1;
+  }
+
+  return 0;
+}
+
+static gboolean flush_printer_options (gpointer data);
+
+/* A write in saved_options_pool failed, mark the settings to be written
+   again with the next flush, in the main thread */
+static gboolean
+saved_options_write_failed (gpointer data)
+{
+  char *printer = data;
+  saved_options_t *entry;
+
+  if (saved_options &&
+      (entry = g_hash_table_lookup (saved_options, printer)) != NULL &&
+      !entry->dirty) {
+    entry->dirty = TRUE;
+    if (!saved_options_flush_id && !in_shutdown)
+      saved_options_flush_id =
+	g_timeout_add_seconds (SAVE_OPTIONS_DELAY, flush_printer_options,
+			       NULL);
+  }
+
+  g_free (printer);
+  return FALSE;
+}
+
+/* Write or remove an options file, in the only thread of
+   saved_options_pool, so that the files of a queue get written in the
+   order of the changes */
+static void
+saved_options_worker (gpointer data, gpointer user_data)
+{
+  saved_options_job_t *job = data;
+  saved_options_t entry;
+  char filename[1024];
+  int ret;
+
+  if (job->num_options > 0) {
+    entry.num_options = job->num_options;
+    entry.options = job->options;
+    ret = write_printer_options_file(job->printer, &entry);
+  } else {
+    snprintf(filename, sizeof(filename), save_options_file, job->printer);
+    if ((ret = (unlink(filename) && errno != ENOENT) ? -1 : 0) != 0)
+      debug_printf("ERROR: Failed removing file %s: %s\n",
+		   filename, strerror(errno));
+  }
+
+  if (ret)
+    g_idle_add (saved_options_write_failed, job->printer);
+  else
+    g_free (job->printer);
+  cupsFreeOptions(job->num_options, job->options);
+  free(job);
+}
+
+/* Hand all option settings which changed since the last call to
+   saved_options_pool, called from the main loop a few seconds after a
+   change, so that the changes of many queues, for example when a
+   network goes away, go out in one go, and directly on shutdown. The
+   file I/O is done in the pool, the main loop only copies the
+   settings. */
+static gboolean
+flush_printer_options (gpointer data)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+  saved_options_job_t *job;
+  cups_option_t *option;
+  int i, queued = 0;
+
+  saved_options_flush_id = 0;
+  if (saved_options == NULL)
+    return FALSE;
+
+  if (saved_options_pool == NULL)
+    saved_options_pool = g_thread_pool_new (saved_options_worker, NULL, 1,
+					    FALSE, NULL);
+
+  g_hash_table_iter_init (&iter, saved_options);
+  while (g_hash_table_iter_next (&iter, &key, &value)) {
+    saved_options_t *entry = value;
+    if (!entry->dirty)
+      continue;
+    if ((job = calloc(1, sizeof(saved_options_job_t))) == NULL) {
+      debug_printf("ERROR: Unable to allocate memory.\n");
+      continue;
+    }
+    job->printer = g_strdup (key);
+    for (i = entry->num_options, option = entry->options; i > 0;
+	 i --, option ++)
+      job->num_options = cupsAddOption(option->name, option->value,
+				       job->num_options, &(job->options));
+    /* Cleared here, the pool sets it again if the write fails */
+    entry->dirty = FALSE;
+    g_thread_pool_push (saved_options_pool, job, NULL);
+    queued ++;
+  }
+
+  if (queued)
+    debug_printf("Writing the option settings of %d printers in the background.\n",
+		 queued);
+
+  return FALSE;
+}
+
+/* Put option settings of a queue into the write-behind store */
+static void
+save_printer_options(const char *printer, int num_options,
+		     cups_option_t *options) {
+  saved_options_t *entry;
+  cups_option_t *option;
+  const char *val;
+  int i;
+
+  if (saved_options == NULL)
+    saved_options = g_hash_table_new_full (g_str_hash, g_str_equal,
+					   g_free, saved_options_free);
+
+  if ((entry = g_hash_table_lookup (saved_options, printer)) != NULL) {
+    /* Do not rewrite an unchanged file */
+    if (entry->num_options == num_options) {
+      for (i = num_options, option = options; i > 0; i --, option ++)
+	if ((val = cupsGetOption(option->name, entry->num_options,
+				 entry->options)) == NULL ||
+	    strcmp(val, option->value))
+	  break;
+      if (i == 0)
+	return;
+    }
+    cupsFreeOptions(entry->num_options, entry->options);
+  } else {
+    entry = calloc(1, sizeof(saved_options_t));
+    g_hash_table_insert (saved_options, g_strdup (printer), entry);
+  }
+
+  entry->num_options = 0;
+  entry->options = NULL;
+  for (i = num_options, option = options; i > 0; i --, option ++)
+    entry->num_options = cupsAddOption(option->name, option->value,
+				       entry->num_options, &(entry->options));
+  entry->dirty = TRUE;
+
+  if (!saved_options_flush_id && !in_shutdown)
+    saved_options_flush_id =
+      g_timeout_add_seconds (SAVE_OPTIONS_DELAY, flush_printer_options,
+			     NULL);
+}
+
+int
+invalidate_printer_options(const char *printer) {
+  saved_options_t *entry;
+
+  /* An entry without options, so that the file gets removed after any
+     write of it still pending, and is not read any more meanwhile */
+  if (saved_options == NULL)
+    saved_options = g_hash_table_new_full (g_str_hash, g_str_equal,
+					   g_free, saved_options_free);
+  if ((entry = g_hash_table_lookup (saved_options, printer)) != NULL)
+    cupsFreeOptions(entry->num_options, entry->options);
+  else {
+    if ((entry = calloc(1, sizeof(saved_options_t))) == NULL)
+      return -1;
+    g_hash_table_insert (saved_options, g_strdup (printer), entry);
+  }
+  entry->num_options = 0;
+  entry->options = NULL;
+  entry->dirty = TRUE;
+
+  if (!saved_options_flush_id && !in_shutdown)
+    saved_options_flush_id =
+      g_timeout_add_seconds (SAVE_OPTIONS_DELAY, flush_printer_options,
+			     NULL);
   return 0;
 }
 
@@ -5421,17 +6284,262 @@ loadPPD(http_t *http,
   return NULL;
 }
 
+/* SHA-256 of the PPD file of a local queue, "none" if the queue has no
+   PPD file */
+static char *
+queue_ppd_hash(http_t *http, const char *name) {
+  char *ppdname, *hash;
+  char buf[8192];
+  ssize_t bytes;
+  cups_file_t *fp;
+  GChecksum *checksum;
+
+  if ((ppdname = loadPPD(http, name)) == NULL)
+    return strdup("none");
+  if ((fp = cupsFileOpen(ppdname, "r")) == NULL) {
+    unlink(ppdname);
+    free(ppdname);
+    return NULL;
+  }
+  checksum = g_checksum_new(G_CHECKSUM_SHA256);
+  while ((bytes = cupsFileRead(fp, buf, sizeof(buf))) > 0)
+    g_checksum_update(checksum, (guchar *)buf, bytes);
+  cupsFileClose(fp);
+  hash = strdup(g_checksum_get_string(checksum));
+  g_checksum_free(checksum);
+  unlink(ppdname);
+  free(ppdname);
+  return hash;
+}
+
+/* Everything of a saved discovery state which is not our own
+   bookkeeping belongs to the printer's IPP attributes */
+static int
+discovery_state_printer_attr(void *context, ipp_t *dst,
+			     ipp_attribute_t *attr) {
+  return (ippGetName(attr) != NULL &&
+	  strncmp(ippGetName(attr), "cups-browsed-", 13));
+}
+
+/* Write down the printers for which we keep our queues on shutdown,
+   with their IPP attributes and the hash of the PPD of their queues,
+   so that in the next session queues of printers which did not change
+   can be taken over without fetching all attributes and generating
+   the PPD again. One IPP message per printer. */
+static void
+save_discovery_state(void) {
+  http_t *http;
+  cups_file_t *fp;
+  remote_printer_t *p;
+  ipp_t *state;
+  char tempname[2064], *hash;
+  int saved = 0, failed = 0;
+
+  if ((http = http_connect_local ()) == NULL) {
+    debug_printf("Unable to connect to CUPS, not saving discovery state.\n");
+    return;
+  }
+
+  snprintf(tempname, sizeof(tempname), "%s.new", discovery_state_file);
+  if ((fp = cupsFileOpen(tempname, "w")) == NULL) {
+    debug_printf("ERROR: Failed creating file %s: %s\n",
+		 tempname, strerror(errno));
+    return;
+  }
+
+  for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
+       p && !failed; p = (remote_printer_t *)cupsArrayNext(remote_printers)) {
+    if (p->slave_of)
+      continue;
+    if (p->status == STATUS_UNCONFIRMED && p->saved_state) {
+      /* Not found again in this session, pass it on unchanged */
+      state = p->saved_state;
+      p->saved_state = NULL;
+    } else if (p->status == STATUS_CONFIRMED && p->prattrs &&
+	       p->uri && p->uri[0]) {
+      if ((hash = queue_ppd_hash(http, p->queue_name)) == NULL)
+	continue;
+      state = ippNew();
+      ippAddString(state, IPP_TAG_OPERATION, IPP_TAG_NAME,
+		   "cups-browsed-queue-name", NULL, p->queue_name);
+      ippAddString(state, IPP_TAG_OPERATION, IPP_TAG_URI,
+		   "cups-browsed-uri", NULL, p->uri);
+      ippAddString(state, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
+		   "cups-browsed-ppd-hash", NULL, hash);
+      if (p->nickname)
+	ippAddString(state, IPP_TAG_OPERATION, IPP_TAG_TEXT,
+		     "cups-browsed-nickname", NULL, p->nickname);
+      ippCopyAttributes(state, p->prattrs, 0,
+			discovery_state_printer_attr, NULL);
+      if (p->devattrs)
+	ippCopyAttributes(state, p->devattrs, 0,
+			  discovery_state_printer_attr, NULL);
+      free(hash);
+    } else
+      continue;
+
+    ippSetState(state, IPP_STATE_IDLE);
+    if (ippWriteIO(fp, (ipp_iocb_t)cupsFileWrite, 1, NULL, state) !=
+	IPP_STATE_DATA)
+      failed = 1;
+    else
+      saved ++;
+    ippDelete(state);
+  }
+
+  if (cupsFileClose(fp) != 0 || failed) {
+    debug_printf("ERROR: Failed to write into file %s: %s\n",
+		 tempname, strerror(errno));
+    unlink(tempname);
+    return;
+  }
+
+  if (rename(tempname, discovery_state_file)) {
+    debug_printf("ERROR: Failed to rename %s to %s: %s\n",
+		 tempname, discovery_state_file, strerror(errno));
+    unlink(tempname);
+    return;
+  }
+
+  debug_printf("Saved the discovery state of %d printers.\n", saved);
+}
+
+/* Read the discovery state saved at the end of the previous session
+   into a hash table, queue name -> IPP message. The file gets removed
+   as the state is only valid until our queues get updated. */
+static GHashTable *
+load_discovery_state(void) {
+  GHashTable *states;
+  cups_file_t *fp;
+  ipp_t *state;
+  ipp_attribute_t *attr;
+
+  if ((fp = cupsFileOpen(discovery_state_file, "r")) == NULL)
+    return NULL;
+
+  /* Keyed by the lower-case queue name, like local_printers */
+  states = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+				 (GDestroyNotify)ippDelete);
+  for (;;) {
+    state = ippNew();
+    if (ippReadIO(fp, (ipp_iocb_t)cupsFileRead, 1, NULL, state) !=
+	IPP_STATE_DATA) {
+      ippDelete(state);
+      break;
+    }
+    if ((attr = ippFindAttribute(state, "cups-browsed-queue-name",
+				 IPP_TAG_NAME)) == NULL) {
+      ippDelete(state);
+      continue;
+    }
+    g_hash_table_replace(states,
+			 g_ascii_strdown(ippGetString(attr, 0, NULL), -1),
+			 state);
+  }
+  cupsFileClose(fp);
+  unlink(discovery_state_file);
+
+  debug_printf("Read the discovery state of %d printers from the previous session.\n",
+	       g_hash_table_size(states));
+  return states;
+}
+
+/* Check, without asking the printer, whether a printer which we have
+   discovered again is still the same as in the previous session and our
+   queue for it is unchanged. Then we take over the saved IPP attributes
+   and do not need to create the queue again. The configuration change
+   time stamps are compared with the IPP attributes fetched in the
+   background and the PPD of the queue is compared by its hash. The
+   saved state is used up by this check. */
+static int
+discovery_state_unchanged(http_t *http, remote_printer_t *p) {
+  ipp_t *state = p->saved_state;
+  ipp_attribute_t *attr, *saved;
+  remote_printer_t *q;
+  local_printer_t *local;
+  char *hash = NULL;
+  int unchanged = 0;
+
+  p->saved_state = NULL;
+
+  /* Same URI as the one our queue points to */
+  if ((attr = ippFindAttribute(state, "cups-browsed-uri",
+			       IPP_TAG_URI)) == NULL ||
+      strcmp(ippGetString(attr, 0, NULL), p->uri))
+    goto out;
+
+  /* The PPD of a cluster depends on all its member printers */
+  cupsArraySave(remote_printers);
+  for (q = (remote_printer_t *)cupsArrayFirst(remote_printers);
+       q; q = (remote_printer_t *)cupsArrayNext(remote_printers))
+    if (q != p && !strcasecmp(q->queue_name, p->queue_name))
+      break;
+  cupsArrayRestore(remote_printers);
+  if (q)
+    goto out;
+
+  /* Our queue is still there and not taken over by someone else */
+  if ((local = local_printer_lookup(p->queue_name)) == NULL ||
+      !local->cups_browsed_controlled)
+    goto out;
+
+  /* The printer's configuration did not change, according to the
+     attributes fetched in the background, we never ask the printer
+     from here */
+  if ((saved = ippFindAttribute(state, "printer-config-change-time",
+				IPP_TAG_INTEGER)) == NULL ||
+      p->prattrs == NULL ||
+      (attr = ippFindAttribute(p->prattrs, "printer-config-change-time",
+			       IPP_TAG_INTEGER)) == NULL ||
+      ippGetInteger(attr, 0) != ippGetInteger(saved, 0))
+    goto out;
+  if ((saved = ippFindAttribute(state, "printer-config-change-date-time",
+				IPP_TAG_DATE)) != NULL &&
+      ((attr = ippFindAttribute(p->prattrs, "printer-config-change-date-time",
+				IPP_TAG_DATE)) == NULL ||
+       memcmp(ippGetDate(attr, 0), ippGetDate(saved, 0), 11)))
+    goto out;
+
+  /* The PPD of our queue did not change */
+  if ((attr = ippFindAttribute(state, "cups-browsed-ppd-hash",
+			       IPP_TAG_KEYWORD)) == NULL ||
+      (hash = queue_ppd_hash(http, p->queue_name)) == NULL ||
+      strcmp(hash, ippGetString(attr, 0, NULL)))
+    goto out;
+
+  /* Take over what creating the queue would have given to us */
+  release_string(p->nickname);
+  if ((attr = ippFindAttribute(state, "cups-browsed-nickname",
+			       IPP_TAG_TEXT)) != NULL)
+    p->nickname = intern_string(ippGetString(attr, 0, NULL));
+  else
+    p->nickname = NULL;
+  printer_attrs_release(p);
+  p->prattrs = ippNew();
+  ippCopyAttributes(p->prattrs, state, 0,
+		    discovery_state_printer_attr, NULL);
+  unchanged = 1;
+
+ out:
+  if (!unchanged)
+    debug_printf("Printer %s changed since the previous session or cannot be checked.\n",
+		 p->queue_name);
+  free(hash);
+  ippDelete(state);
+  return unchanged;
+}
+
 int
 record_printer_options(const char *printer) {
   remote_printer_t *p;
   char filename[1024];
-  FILE *fp = NULL;
   char uri[HTTP_MAX_URI], *resource;
   ipp_t *request, *response;
   ipp_attribute_t *attr;
   const char *key;
   char buf[65536], *c;
   char *ppdname = NULL;
+  int ppd_cached = 0;
   ppd_file_t *ppd;
   ppd_option_t *ppd_opt;
   cups_option_t *option;
@@ -5492,8 +6600,18 @@ record_printer_options(const char *printer) {
   conn = http_connect_local ();
   if (conn) {
     /* If there is a PPD file for this printer, we save the local
-       settings for the PPD options. */
-    if (cups_notifier != NULL || (p && p->netprinter)) {
+       settings for the PPD options. We have them already from creating
+       the queue or from the last time here, as long as CUPS did not
+       notify us about a modification of the queue. */
+    if (cups_notifier != NULL && p->ppd_options_valid) {
+      debug_printf("Recording option settings of the PPD file for %s from the cache:\n",
+		   printer);
+      for (i = p->num_ppd_options, option = p->ppd_options; i > 0;
+	   i --, option ++)
+	p->num_options = cupsAddOption(option->name, option->value,
+				       p->num_options, &(p->options));
+      ppd_cached = 1;
+    } else if (cups_notifier != NULL || (p && p->netprinter)) {
       if ((ppdname = loadPPD(conn, printer)) == NULL) {
 	debug_printf("Unable to get PPD file for %s: %s\n",
 		     printer, cupsLastErrorString());
@@ -5505,6 +6623,9 @@ record_printer_options(const char *printer) {
 	debug_printf("Recording option settings of the PPD file for %s (%s):\n",
 		     printer, ppd->nickname);
 	ppdMarkDefaults(ppd);
+	cupsFreeOptions(p->num_ppd_options, p->ppd_options);
+	p->num_ppd_options = 0;
+	p->ppd_options = NULL;
 	for (ppd_opt = ppdFirstOption(ppd); ppd_opt;
 	     ppd_opt = ppdNextOption(ppd))
 	  if (strcasecmp(ppd_opt->keyword, "PageRegion") != 0) {
@@ -5513,7 +6634,11 @@ record_printer_options(const char *printer) {
 	    strncpy(buf, ppd_opt->keyword, sizeof(buf));
 	    p->num_options = cupsAddOption(buf, ppd_opt->defchoice,
 					   p->num_options, &(p->options));
+	    p->num_ppd_options = cupsAddOption(buf, ppd_opt->defchoice,
+					       p->num_ppd_options,
+					       &(p->ppd_options));
 	  }
+	p->ppd_options_valid = 1;
 	ppdClose(ppd);
 	unlink(ppdname);
       }
@@ -5541,7 +6666,7 @@ record_printer_options(const char *printer) {
 	    break;
 	if (*ptr != NULL) {
 	  if (strcasecmp(key, CUPS_BROWSED_DEST_PRINTER "-default") != 0 &&
-	      (ppdname == NULL ||
+	      ((ppdname == NULL && !ppd_cached) ||
 	       strncasecmp(key + strlen(key) - 8, "-default", 8))) {
 	    ippAttributeString(attr, buf, sizeof(buf));
 	    buf[sizeof(buf) - 1] = '\0';
@@ -5569,23 +6694,8 @@ record_printer_options(const char *printer) {
     free(ppdname);
 
   if (p->num_options > 0) {
-    fp = fopen(filename, "w+");
-    if (fp == NULL) {
-      debug_printf("ERROR: Failed creating file %s: %s\n",
-		   filename, strerror(errno));
-      return -1;
-    }
-
-    for (i = p->num_options, option = p->options; i > 0; i --, option ++)
-      if (fprintf (fp, "%s=%s\n", option->name, option->value) < 0) {
-	debug_printf("ERROR: Failed to write into file %s: %s\n",
-		     filename, strerror(errno));
-	fclose(fp);
-	return -1;
-      }
-
-    fclose(fp);
-
+    /* The file gets written by flush_printer_options() */
+    save_printer_options(printer, p->num_options, p->options);
     return 0;
   } else
     return -1;
@@ -5598,10 +6708,29 @@ load_printer_options(const char *printer, int num_options,
   FILE *fp = NULL;
   char *opt = NULL, *val;
   size_t optlen = 0;
+  saved_options_t *entry;
+  cups_option_t *option;
+  int i, num_loaded = 0;
+  cups_option_t *loaded = NULL;
 
   if (printer == NULL || strlen(printer) == 0 || options == NULL)
     return 0;
 
+  /* Settings recorded in this session are in the store, no need to wait
+     for them to be written and to read them back */
+  if (saved_options &&
+      (entry = g_hash_table_lookup (saved_options, printer)) != NULL) {
+    debug_printf("Loading following option settings for printer %s:\n",
+		 printer);
+    for (i = entry->num_options, option = entry->options; i > 0;
+	 i --, option ++) {
+      debug_printf("   %s=%s\n", option->name, option->value);
+      num_options = cupsAddOption(option->name, option->value, num_options,
+				  options);
+    }
+    return (num_options);
+  }
+
   /* Prepare reading file with saved option settings */
   snprintf(filename, sizeof(filename), save_options_file,
 	   printer);
@@ -5626,6 +6755,7 @@ load_printer_options(const char *printer, int num_options,
 	val[strlen(val)-1] = '\0';
 	debug_printf("   %s=%s\n", opt, val);
 	num_options = cupsAddOption(opt, val, num_options, options);
+	num_loaded = cupsAddOption(opt, val, num_loaded, &loaded);
       }
     }
     debug_printf("\n");
@@ -5634,6 +6764,14 @@ load_printer_options(const char *printer, int num_options,
 		   filename, strerror(errno));
     free(opt);
     fclose(fp);
+
+    /* Keep what the file contains, it only gets rewritten on a change */
+    if (num_loaded > 0) {
+      save_printer_options(printer, num_loaded, loaded);
+      if ((entry = g_hash_table_lookup (saved_options, printer)) != NULL)
+	entry->dirty = FALSE;
+      cupsFreeOptions(num_loaded, loaded);
+    }
   }
   return (num_options);
 }
@@ -5929,6 +7067,49 @@ join_cluster_if_needed(remote_printer_t *p,
   return (q ? 1 : 0);
 }
 
+/* Keep the mirror of a queue's state current, the state message is not
+   in the notifications, so a stopped queue gets queried when it is
+   needed */
+static void
+local_printer_state_notified (const char *printer,
+			      guint printer_state)
+{
+  local_printer_t *local_printer;
+
+  if ((local_printer = local_printer_lookup(printer)) != NULL) {
+    local_printer->state = (ipp_pstate_t)printer_state;
+    local_printer->state_valid = (printer_state != IPP_PRINTER_STOPPED);
+    if (local_printer->state_message) {
+      free(local_printer->state_message);
+      local_printer->state_message = NULL;
+    }
+  }
+}
+
+/* cupsd reports a queue getting stopped, for example by a backend
+   error, and a queue getting added, which can replace one we know
+   about, not as a state change */
+static void
+on_printer_stopped_or_added (CupsNotifier *object,
+			     const gchar *text,
+			     const gchar *printer_uri,
+			     const gchar *printer,
+			     guint printer_state,
+			     const gchar *printer_state_reasons,
+			     gboolean printer_is_accepting_jobs,
+			     gpointer user_data)
+{
+  debug_printf("[CUPS Notification] Printer %s stopped or added: %s\n",
+	       printer, text);
+
+  if (terminating) {
+    debug_printf("[CUPS Notification]: Ignoring because cups-browsed is terminating.\n");
+    return;
+  }
+
+  local_printer_state_notified(printer, printer_state);
+}
+
 static void
 on_printer_state_changed (CupsNotifier *object,
                           const gchar *text,
@@ -5953,6 +7134,8 @@ on_printer_state_changed (CupsNotifier *object,
     return;
   }
 
+  local_printer_state_notified(printer, printer_state);
+
   if (autoshutdown && autoshutdown_on == NO_JOBS) {
     if (check_jobs() == 0) {
       /* If auto shutdown is active for triggering on no jobs being left, we
@@ -6012,6 +7195,10 @@ on_printer_state_changed (CupsNotifier *object,
     if (default_printer != NULL)
       free((void *)default_printer);
     default_printer = strdup(buf);
+    if (cups_default_printer != NULL)
+      free(cups_default_printer);
+    cups_default_printer = strdup(buf);
+    cups_default_printer_valid = TRUE;
   } else if ((ptr = strstr(text, " is no longer the default printer"))
 	     != NULL) {
     /* Default printer has changed, we are triggered by the former default
@@ -6019,9 +7206,41 @@ on_printer_state_changed (CupsNotifier *object,
     strncpy(buf, text, ptr - text);
     buf[ptr - text] = '\0';
     debug_printf("[CUPS Notification] %s not default printer any more.\n", buf);
+    if (cups_default_printer != NULL &&
+	!strcasecmp(cups_default_printer, buf))
+      cups_default_printer_valid = FALSE;
   }
 }
 
+/* Wake up the implicitclass backend waiting for a destination on the
+   given queue, so that it does not need to poll for the
+   CUPS_BROWSED_DEST_PRINTER attribute. If no backend is waiting, the
+   datagram simply gets dropped. */
+static void
+notify_implicitclass_backend (const char *queue_name)
+{
+  static int fd = -1;
+  struct sockaddr_un addr;
+  const char *statedir;
+
+  if (fd < 0 &&
+      (fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) < 0)
+    return;
+
+  if ((statedir = getenv("CUPS_STATEDIR")) == NULL)
+    statedir = CUPS_STATEDIR;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (snprintf(addr.sun_path, sizeof(addr.sun_path),
+	       "%s/" CUPS_BROWSED_NOTIFY_SOCKET "%s", statedir, queue_name) >=
+      (int)sizeof(addr.sun_path))
+    return;
+
+  if (sendto(fd, "", 1, 0, (struct sockaddr *)&addr, sizeof(addr)) == 1)
+    debug_printf("Woke up implicitclass backend of queue %s.\n", queue_name);
+}
+
 static void
 on_job_state (CupsNotifier *object,
 	      const gchar *text,
@@ -6111,6 +7330,21 @@ on_job_state (CupsNotifier *object,
     }
   }
 
+  if (job_id != 0 && job_state >= IPP_JOB_CANCELED &&
+      (q = printer_record(printer)) != NULL) {
+    /* A job on one of our queues has finished, so the remote printer to
+       which it was sent is free again. Wake up the implicitclass backends
+       which are waiting for a free destination, instead of letting them
+       retry after a fixed delay */
+    if (q->slave_of)
+      q = q->slave_of;
+    for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
+	 p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
+      if (p->slave_of == NULL && p->status == STATUS_CONFIRMED &&
+	  p != q && !p->netprinter)
+	notify_implicitclass_backend(p->queue_name);
+  }
+
   if (job_id != 0 && job_state == IPP_JOB_PROCESSING) {
     /* Printer started processing a job, check if it uses the implicitclass
        backend and if so, we select the remote queue to which to send the job
@@ -6498,6 +7732,7 @@ on_job_state (CupsNotifier *object,
 		     cupsLastErrorString());
 	return;
       }
+      notify_implicitclass_backend(printer);
     }
   }
 }
@@ -6527,6 +7762,12 @@ on_printer_deleted (CupsNotifier *object,
     return;
   }
 
+  /* CUPS does not tell us when a deleted queue takes the default printer
+     with it */
+  if (cups_default_printer != NULL && printer != NULL &&
+      !strcasecmp(cups_default_printer, printer))
+    cups_default_printer_valid = FALSE;
+
   if (is_created_by_cups_browsed(printer)) {
     /* Get available CUPS queues to check whether the queue did not
        already get re-created */
@@ -6856,6 +8097,7 @@ on_printer_modified (CupsNotifier *object,
 	debug_printf("Settings of printer %s got modified, doing backup.\n",
 		     p->queue_name);
 	p->no_autosave = 1; /* Avoid infinite recursion */
+	p->ppd_options_valid = 0; /* The PPD defaults may have changed */
 	record_printer_options(p->queue_name);
 	p->no_autosave = 0;
       }
@@ -6959,29 +8201,61 @@ ipp_discoveries_add(cups_array_t *a,
   return 1;
 }
 
-static remote_printer_t *
-create_remote_printer_entry (const char *queue_name,
-			     const char *location,
-			     const char *info,
-			     const char *uri,
-			     const char *host,
-			     const char *ip,
-			     int port,
-			     const char *service_name,
-			     const char *type,
-			     const char *domain,
-			     const char *interface,
-			     int family,
-			     const char *pdl,
-			     int color,
-			     int duplex,
-			     const char *make_model,
-			     int is_cups_queue)
-{
-  remote_printer_t *p;
-  remote_printer_t *q;
-  http_t *http_printer = NULL;
+/* Free a printer entry which is not in remote_printers (any more) */
+static void
+free_printer_entry(remote_printer_t *p) {
+  if (p->queue_name) free (p->queue_name);
+  if (p->location) free (p->location);
+  if (p->info) free (p->info);
+  release_string(p->make_model);
+  release_string(p->pdl);
+  if (p->uri) free (p->uri);
+  cupsFreeOptions(p->num_options, p->options);
+  cupsFreeOptions(p->num_ppd_options, p->ppd_options);
+  if (p->host) free (p->host);
+  if (p->ip) free (p->ip);
+  if (p->service_name) free (p->service_name);
+  release_string(p->type);
+  release_string(p->domain);
+  cupsArrayDelete(p->ipp_discoveries);
+  printer_attrs_release(p);
+  if (p->saved_state) ippDelete (p->saved_state);
+  release_string(p->nickname);
+  free(p);
+}
+
+/* Remove the entry of a printer for which we did not create a CUPS
+   queue yet, if other printers have joined its cluster meanwhile, one
+   of them becomes the master */
+static void
+drop_printer_entry(remote_printer_t *p) {
+  remote_printer_t *q, *master = NULL;
+
+  for (q = (remote_printer_t *)cupsArrayFirst(remote_printers);
+       q; q = (remote_printer_t *)cupsArrayNext(remote_printers))
+    if (q->slave_of == p) {
+      if (master == NULL &&
+	  q->status != STATUS_DISAPPEARED && q->status != STATUS_UNCONFIRMED &&
+	  q->status != STATUS_TO_BE_RELEASED) {
+	master = q;
+	q->slave_of = NULL;
+	q->status = STATUS_TO_BE_CREATED;
+	q->timeout = time(NULL) + TIMEOUT_IMMEDIATELY;
+      } else
+	q->slave_of = master;
+    }
+
+  debug_printf("Removing entry of printer %s (%s)%s.\n", p->queue_name, p->uri,
+	       (master ? ", its cluster continues with the next printer" : ""));
+  cupsArrayRemove(remote_printers, p);
+  free_printer_entry(p);
+}
+
 #ifdef HAVE_CUPS_1_6
+/* Check by its IPP attributes whether an IPP network printer is of the
+   kind which we are configured to set up */
+static int
+printer_attrs_acceptable(remote_printer_t *p) {
   int i;
   ipp_attribute_t *attr;
   char valuebuffer[65536];
@@ -6989,7 +8263,440 @@ create_remote_printer_entry (const char *queue_name,
   int is_appleraster = 0;
   int is_pclm = 0;
   int is_pdf = 0;
+
+  /* If we have opted for only printers designed for driverless use (PWG
+     Raster + Apple Raster + PCLm + PDF) being set up automatically, we check
+     first, whether our printer supports IPP 2.0 or newer. If not, we
+     skip this printer */
+  if (CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS) {
+    valuebuffer[0] = '\0';
+    debug_printf("Checking whether printer %s supports IPP 2.x or newer:\n",
+		 p->queue_name);
+    if ((attr = ippFindAttribute(p->prattrs,
+				 "ipp-versions-supported",
+				 IPP_TAG_KEYWORD)) != NULL) {
+      debug_printf("  Attr: %s\n", ippGetName(attr));
+      for (i = 0; i < ippGetCount(attr); i ++) {
+	strncpy(valuebuffer, ippGetString(attr, i, NULL),
+		sizeof(valuebuffer) - 1);
+	if (strlen(ippGetString(attr, i, NULL)) > 65535)
+	  valuebuffer[65535] = '\0';
+	debug_printf("  Keyword: %s\n", valuebuffer);
+	if (valuebuffer[0] > '1')
+	  break;
+      }
+    }
+    if (!attr || valuebuffer[0] == '\0' || valuebuffer[0] <= '1') {
+      debug_printf("  --> cups-browsed is configured to auto-setup only printers which are designed for driverless printing. These printers require IPP 2.x or newer, but this printer only supports IPP 1.x or older. Skipping.\n");
+      return 0;
+    } else
+      debug_printf("  --> Printer supports IPP 2.x or newer.\n");
+  }
+
+  /* If we have opted for only PWG Raster printers or for only printers 
+     designed for driverless use (PWG Raster + Apple Raster + PCLm + PDF)
+     being set up automatically, we check whether the printer has a non-empty
+     string in its "pwg-raster-document-resolution-supported" IPP attribute
+     to see whether we have a PWG Raster printer. */
+  if (CreateIPPPrinterQueues == IPP_PRINTERS_PWGRASTER ||
+      CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS) {
+    valuebuffer[0] = '\0';
+    debug_printf("Checking whether printer %s understands PWG Raster:\n",
+		 p->queue_name);
+    if ((attr = ippFindAttribute(p->prattrs,
+				 "pwg-raster-document-resolution-supported",
+				 IPP_TAG_RESOLUTION)) != NULL) {
+      debug_printf("  Attr: %s\n", ippGetName(attr));
+      ippAttributeString(attr, valuebuffer, sizeof(valuebuffer));
+      debug_printf("  Value: %s\n", valuebuffer);
+      if (valuebuffer[0] == '\0') {
+	for (i = 0; i < ippGetCount(attr); i ++) {
+	  strncpy(valuebuffer, ippGetString(attr, i, NULL),
+		  sizeof(valuebuffer) - 1);
+	  if (strlen(ippGetString(attr, i, NULL)) > 65535)
+	    valuebuffer[65535] = '\0';
+	  debug_printf("  Keyword: %s\n", valuebuffer);
+	  if (valuebuffer[0] != '\0')
+	    break;
+	}
+      }
+    }
+    if (attr && valuebuffer[0] != '\0')
+      is_pwgraster = 1;
+    debug_printf("  --> Printer %s PWG Raster.\n",
+		 is_pwgraster ? "supports" : "does not support");
+  }
+
+#ifdef CUPS_RASTER_HAVE_APPLERASTER
+  /* If we have opted for only Apple Raster printers or for only printers 
+     designed for driverless use (PWG Raster + Apple Raster + PCLm + PDF)
+     being set up automatically, we check whether the printer has a non-empty
+     string in its "urf-supported" IPP attribute to see whether we have an
+     Apple Raster printer. */
+  if (CreateIPPPrinterQueues == IPP_PRINTERS_APPLERASTER ||
+      CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS) {
+    valuebuffer[0] = '\0';
+    debug_printf("Checking whether printer %s understands Apple Raster:\n",
+		 p->queue_name);
+    if ((attr = ippFindAttribute(p->prattrs, "urf-supported", IPP_TAG_KEYWORD)) != NULL) {
+      debug_printf("  Attr: %s\n", ippGetName(attr));
+      ippAttributeString(attr, valuebuffer, sizeof(valuebuffer));
+      debug_printf("  Value: %s\n", valuebuffer);
+      if (valuebuffer[0] == '\0') {
+	for (i = 0; i < ippGetCount(attr); i ++) {
+	  strncpy(valuebuffer, ippGetString(attr, i, NULL),
+		  sizeof(valuebuffer) - 1);
+	  if (strlen(ippGetString(attr, i, NULL)) > 65535)
+	    valuebuffer[65535] = '\0';
+	  debug_printf("  Keyword: %s\n", valuebuffer);
+	  if (valuebuffer[0] != '\0')
+	    break;
+	}
+      }
+    }
+    if (attr && valuebuffer[0] != '\0')
+      is_appleraster = 1;
+    debug_printf("  --> Printer %s Apple Raster.\n",
+		 is_appleraster ? "supports" : "does not support");
+  }
+#endif
+
+#ifdef QPDF_HAVE_PCLM
+  /* If we have opted for only PCLm printers or for only printers 
+     designed for driverless use (PWG Raster + Apple Raster + PCLm + PDF)
+     being set up automatically, we check whether the printer has a non-empty
+     string in its "pclm-compression-method-preferred" IPP attribute to see
+     whether we have a PCLm printer. */
+  if (CreateIPPPrinterQueues == IPP_PRINTERS_PCLM ||
+      CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS) {
+    valuebuffer[0] = '\0';
+    debug_printf("Checking whether printer %s understands PCLm:\n",
+		 p->queue_name);
+    if ((attr = ippFindAttribute(p->prattrs,
+				 "pclm-compression-method-preferred",
+				 IPP_TAG_KEYWORD)) != NULL) {
+      debug_printf("  Attr: %s\n", ippGetName(attr));
+      ippAttributeString(attr, valuebuffer, sizeof(valuebuffer));
+      debug_printf("  Value: %s\n", valuebuffer);
+      if (valuebuffer[0] == '\0') {
+	for (i = 0; i < ippGetCount(attr); i ++) {
+	  strncpy(valuebuffer, ippGetString(attr, i, NULL),
+		  sizeof(valuebuffer) - 1);
+	  if (strlen(ippGetString(attr, i, NULL)) > 65535)
+	    valuebuffer[65535] = '\0';
+	  debug_printf("  Keyword: %s\n", valuebuffer);
+	  if (valuebuffer[0] != '\0')
+	    break;
+	}
+      }
+    }
+    if (attr && valuebuffer[0] != '\0')
+      is_pclm = 1;
+    debug_printf("  --> Printer %s PCLm.\n",
+		 is_pclm ? "supports" : "does not support");
+  }
+#endif
+
+  /* If we have opted for only PDF printers or for only printers 
+     designed for driverless use (PWG Raster + Apple Raster + PCLm + PDF)
+     being set up automatically, we check whether the printer has 
+     "application/pdf" under its PDLs. */
+  if (CreateIPPPrinterQueues == IPP_PRINTERS_PDF ||
+      CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS) {
+    debug_printf("Checking whether printer %s understands PDF: PDLs: %s\n",
+		 p->queue_name, p->pdl);
+    if(strcasestr(p->pdl, "application/pdf"))
+      is_pdf = 1;
+    debug_printf("  --> Printer %s PDF.\n",
+		 is_pdf ? "supports" : "does not support");
+  }
+
+  /* If the printer is not the driverless printer we opted for, we skip
+     this printer. */
+  if ((CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS &&
+       is_pwgraster == 0 && is_appleraster == 0 && is_pclm == 0 &&
+       is_pdf == 0) ||
+      (CreateIPPPrinterQueues == IPP_PRINTERS_PWGRASTER &&
+       is_pwgraster == 0) ||
+      (CreateIPPPrinterQueues == IPP_PRINTERS_APPLERASTER &&
+       is_appleraster == 0) ||
+      (CreateIPPPrinterQueues == IPP_PRINTERS_PCLM &&
+       is_pclm == 0) ||
+      (CreateIPPPrinterQueues == IPP_PRINTERS_PDF &&
+       is_pdf == 0)) {
+    debug_printf("Printer %s (%s%s%s%s%s%s%s%s%s%s%s%s%s) does not support the driverless printing protocol cups-browsed is configured to accept for setting up such printers automatically, ignoring this printer.\n",
+		 p->queue_name, p->uri,
+		 (CreateIPPPrinterQueues == IPP_PRINTERS_PWGRASTER ||
+		  CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
+		  ", " : ""),
+		 (CreateIPPPrinterQueues == IPP_PRINTERS_PWGRASTER ||
+		  CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
+		  (is_pwgraster ? "" : "not ") : ""),
+		 (CreateIPPPrinterQueues == IPP_PRINTERS_PWGRASTER ||
+		  CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
+		  "PWG Raster" : ""),
+		 (CreateIPPPrinterQueues == IPP_PRINTERS_APPLERASTER ||
+		  CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
+		  ", " : ""),
+		 (CreateIPPPrinterQueues == IPP_PRINTERS_APPLERASTER ||
+		  CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
+		  (is_appleraster ? "" : "not ") : ""),
+		 (CreateIPPPrinterQueues == IPP_PRINTERS_APPLERASTER ||
+		  CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
+		  "Apple Raster" : ""),
+		 (CreateIPPPrinterQueues == IPP_PRINTERS_PCLM ||
+		  CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
+		  ", " : ""),
+		 (CreateIPPPrinterQueues == IPP_PRINTERS_PCLM ||
+		  CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
+		  (is_pclm ? "" : "not ") : ""),
+		 (CreateIPPPrinterQueues == IPP_PRINTERS_PCLM ||
+		  CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
+		  "PCLm" : ""),
+		 (CreateIPPPrinterQueues == IPP_PRINTERS_PDF ||
+		  CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
+		  ", " : ""),
+		 (CreateIPPPrinterQueues == IPP_PRINTERS_PDF ||
+		  CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
+		  (is_pdf ? "" : "not ") : ""),
+		 (CreateIPPPrinterQueues == IPP_PRINTERS_PDF ||
+		  CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
+		  "PDF" : ""));
+    return 0;
+  }
+
+  return 1;
+}
+#endif /* HAVE_CUPS_1_6 */
+
+/* Get the IPP attributes of a remote printer in a thread of
+   printer_attrs_pool, so that a slow or unreachable printer does not
+   hold up the main loop. We do the same requests with the same
+   fallbacks as get_printer_attributes(), which cannot be used in
+   threads, as it logs into a global buffer and redirects stderr for
+   resolving DNS-SD-service-name-based URIs, which ours are not. */
+static void
+printer_attrs_worker(gpointer data, gpointer user_data) {
+  printer_attrs_job_t *job = data;
+  char scheme[10], userpass[1024], host[1024], resource[1024];
+  int port, fallback, count, i;
+  http_t *http;
+  ipp_t *request, *response;
+  ipp_attribute_t *attr;
+  ipp_status_t status;
+  static const char * const pattrs[] =
+    {
+     "all",
+     "media-col-database"
+    };
+  /* Attributes required in the response, as in get_printer_attributes() */
+  static const char * const req_attrs[] =
+    {
+     "attributes-charset",
+     "attributes-natural-language",
+     "charset-configured",
+     "charset-supported",
+     "compression-supported",
+     "document-format-default",
+     "document-format-supported",
+     "generated-natural-language-supported",
+     "ipp-versions-supported",
+     "natural-language-configured",
+     "operations-supported",
+     "printer-is-accepting-jobs",
+     "printer-name",
+     "printer-state",
+     "printer-state-reasons",
+     "printer-up-time",
+     "printer-uri-supported",
+     "uri-authentication-supported",
+     "uri-security-supported"
+    };
+
+  debug_printf("printer_attrs_worker() in THREAD %ld\n", pthread_self());
+
+  res_init ();
+
+  /* libcups keeps the password callback per thread, never prompt on the
+     terminal here */
+  cupsSetPasswordCB2 (password_callback, NULL);
+
+  if (httpSeparateURI(HTTP_URI_CODING_ALL, job->uri,
+		      scheme, sizeof(scheme), userpass, sizeof(userpass),
+		      host, sizeof(host), &port,
+		      resource, sizeof(resource)) != HTTP_URI_OK) {
+    snprintf(job->error, sizeof(job->error), "Cannot parse the URI");
+    goto done;
+  }
+
+  if ((http = httpConnect2(host, port, NULL, AF_UNSPEC,
+			   HTTP_ENCRYPT_IF_REQUESTED, 1, 3000,
+			   NULL)) == NULL) {
+    snprintf(job->error, sizeof(job->error), "Cannot connect to %s:%d",
+	     host, port);
+    goto done;
+  }
+  httpSetTimeout(http, HttpRemoteTimeout, worker_http_timeout_cb, NULL);
+
+  /* IPP 2.0, IPP 1.1, and finally only "all" without
+     "media-col-database" */
+  for (fallback = 0; fallback < 3 && job->prattrs == NULL; fallback ++) {
+    request = ippNewRequest(IPP_OP_GET_PRINTER_ATTRIBUTES);
+    if (fallback == 1)
+      ippSetVersion(request, 1, 1);
+    ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI, "printer-uri",
+		 NULL, job->uri);
+    ippAddStrings(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
+		  "requested-attributes", (fallback == 2 ? 1 : 2), NULL,
+		  pattrs);
+    response = cupsDoRequest(http, request, resource);
+    status = cupsLastError();
+    if (response == NULL) {
+      snprintf(job->error, sizeof(job->error), "%s", cupsLastErrorString());
+      continue;
+    }
+
+    /* Check whether the response is complete */
+    for (count = 0, attr = ippFirstAttribute(response); attr;
+	 attr = ippNextAttribute(response))
+      count ++;
+    for (i = 0; i < (int)(sizeof(req_attrs) / sizeof(req_attrs[0])); i ++)
+      if (ippFindAttribute(response, req_attrs[i], IPP_TAG_ZERO) == NULL)
+	break;
+    if (status == IPP_STATUS_ERROR_BAD_REQUEST ||
+	status == IPP_STATUS_ERROR_VERSION_NOT_SUPPORTED ||
+	i < (int)(sizeof(req_attrs) / sizeof(req_attrs[0])) || count < 20) {
+      snprintf(job->error, sizeof(job->error),
+	       "Incomplete response (%s, %d attributes%s%s)",
+	       ippErrorString(status), count,
+	       (i < (int)(sizeof(req_attrs) / sizeof(req_attrs[0])) ?
+		", missing " : ""),
+	       (i < (int)(sizeof(req_attrs) / sizeof(req_attrs[0])) ?
+		req_attrs[i] : ""));
+      ippDelete(response);
+    } else
+      job->prattrs = response;
+  }
+
+  httpClose(http);
+
+ done:
+  g_idle_add(printer_attrs_done, job);
+}
+
+/* Start getting the IPP attributes of a printer in the background */
+static void
+printer_attrs_fetch(remote_printer_t *p, int is_cups_queue) {
+  printer_attrs_job_t *job;
+
+  if (printer_attrs_pool == NULL)
+    printer_attrs_pool = g_thread_pool_new (printer_attrs_worker, NULL,
+					    PRINTER_ATTRS_MAX_THREADS, FALSE,
+					    NULL);
+
+  if ((job = calloc(1, sizeof(printer_attrs_job_t))) == NULL ||
+      (job->uri = strdup(p->uri)) == NULL) {
+    debug_printf("ERROR: Unable to allocate memory.\n");
+    free(job);
+    return;
+  }
+  job->p = p;
+  job->is_cups_queue = is_cups_queue;
+  p->attrs_job = job;
+
+  debug_printf("Getting the IPP attributes of printer %s (%s) in the background.\n",
+	       p->queue_name, p->uri);
+  g_thread_pool_push (printer_attrs_pool, job, NULL);
+}
+
+/* Continue with a printer entry when its IPP attributes are there, in
+   the main thread. Entries for IPP network printers which are not what
+   we are configured to set up get removed, all others get their CUPS
+   queues created by update_cups_queues() now. is_cups_queue is -1 when
+   update_cups_queues() fetches the attributes again for an entry which
+   is already set up, then a failure only makes it retry later. */
+static gboolean
+printer_attrs_done(gpointer data) {
+  printer_attrs_job_t *job = data;
+  remote_printer_t *p = job->p;
+
+  debug_printf("printer_attrs_done() in THREAD %ld\n", pthread_self());
+
+  if (p == NULL)
+    /* The entry got removed meanwhile */
+    goto out;
+
+  p->attrs_job = NULL;
+
+  if (strcmp(job->uri, p->uri)) {
+    /* We have switched over to another service of this printer
+       meanwhile */
+    debug_printf("Printer %s changed its URI from %s to %s while we were getting its IPP attributes, getting them again.\n",
+		 p->queue_name, job->uri, p->uri);
+    printer_attrs_fetch(p, job->is_cups_queue);
+    goto out;
+  }
+
+  if (job->prattrs == NULL)
+    debug_printf("get-printer-attributes IPP call failed on printer %s (%s): %s\n",
+		 p->queue_name, p->uri, job->error);
+  else {
+    debug_printf("Got the IPP attributes of printer %s (%s).\n",
+		 p->queue_name, p->uri);
+    printer_attrs_release(p);
+    p->prattrs = job->prattrs;
+    job->prattrs = NULL;
+    /* A queue waiting for the attributes can get created right away */
+    if (p->status == STATUS_TO_BE_CREATED)
+      p->timeout = time(NULL) + TIMEOUT_IMMEDIATELY;
+  }
+
+  /* For an IPP network printer the attributes tell whether we set it
+     up */
+  if (job->is_cups_queue == 0 && p->status == STATUS_TO_BE_CREATED &&
+      (p->prattrs == NULL
+#ifdef HAVE_CUPS_1_6
+       || !printer_attrs_acceptable(p)
 #endif /* HAVE_CUPS_1_6 */
+       )) {
+    debug_printf("ERROR: Unable to create print queue, ignoring printer.\n");
+    drop_printer_entry(p);
+  } else if (job->is_cups_queue == 0 && join_cluster_if_needed(p, 0) < 0)
+    /* Accepted, now it can join a cluster */
+    drop_printer_entry(p);
+
+  recheck_timer();
+
+ out:
+  if (job->prattrs)
+    ippDelete(job->prattrs);
+  free(job->uri);
+  free(job);
+  return FALSE;
+}
+
+static remote_printer_t *
+create_remote_printer_entry (const char *queue_name,
+			     const char *location,
+			     const char *info,
+			     const char *uri,
+			     const char *host,
+			     const char *ip,
+			     int port,
+			     const char *service_name,
+			     const char *type,
+			     const char *domain,
+			     const char *interface,
+			     int family,
+			     const char *pdl,
+			     int color,
+			     int duplex,
+			     const char *make_model,
+			     int is_cups_queue)
+{
+  remote_printer_t *p;
+  remote_printer_t *q;
+  http_t *http_printer = NULL;
 
   if (!queue_name || !location || !info || !uri || !host || !service_name ||
       !type || !domain) {
@@ -7020,15 +8727,8 @@ create_remote_printer_entry (const char *queue_name,
   if (!p->info)
     goto fail;
 
-  if (make_model)
-    p->make_model = strdup(make_model);
-  else
-    p->make_model = NULL;
-
-  if (pdl)
-    p->pdl = strdup(pdl);
-  else
-    p->pdl = NULL;
+  p->make_model = intern_string(make_model);
+  p->pdl = intern_string(pdl);
 
   p->color = color;
 
@@ -7058,11 +8758,11 @@ create_remote_printer_entry (const char *queue_name,
 
   /* Record DNS-SD service parameters to identify print queue
      entry for removal when service disappears */
-  p->type = strdup (type);
+  p->type = intern_string (type);
   if (!p->type)
     goto fail;
 
-  p->domain = strdup (domain);
+  p->domain = intern_string (domain);
   if (!p->domain)
     goto fail;
 
@@ -7113,13 +8813,6 @@ create_remote_printer_entry (const char *queue_name,
        or interface script at this point. */
     p->netprinter = 0;
     p->nickname = NULL;
-    if (p->uri[0] != '\0') {
-      p->prattrs = get_printer_attributes(p->uri, NULL, 0, NULL, 0, 1);
-      debug_log_out(get_printer_attributes_log);
-      if (p->prattrs == NULL)
-	debug_printf("get-printer-attributes IPP call failed on printer %s (%s).\n",
-		     p->queue_name, p->uri);
-    }
   } else {
 #ifndef HAVE_CUPS_1_6
     /* The following code uses a lot of CUPS >= 1.6 specific stuff.
@@ -7195,220 +8888,16 @@ create_remote_printer_entry (const char *queue_name,
 
     p->slave_of = NULL;
     p->netprinter = 1;
-    p->prattrs = get_printer_attributes(p->uri, NULL, 0, NULL, 0, 1);
-    debug_log_out(get_printer_attributes_log);
-    if (p->prattrs == NULL) {
-      debug_printf("get-printer-attributes IPP call failed on printer %s (%s).\n",
-		   p->queue_name, p->uri);
-      goto fail;
-    }
-
-    /* If we have opted for only printers designed for driverless use (PWG
-       Raster + Apple Raster + PCLm + PDF) being set up automatically, we check
-       first, whether our printer supports IPP 2.0 or newer. If not, we
-       skip this printer */
-    if (CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS) {
-      valuebuffer[0] = '\0';
-      debug_printf("Checking whether printer %s supports IPP 2.x or newer:\n",
-		   p->queue_name);
-      if ((attr = ippFindAttribute(p->prattrs,
-				   "ipp-versions-supported",
-				   IPP_TAG_KEYWORD)) != NULL) {
-	debug_printf("  Attr: %s\n", ippGetName(attr));
-	for (i = 0; i < ippGetCount(attr); i ++) {
-	  strncpy(valuebuffer, ippGetString(attr, i, NULL),
-		  sizeof(valuebuffer) - 1);
-	  if (strlen(ippGetString(attr, i, NULL)) > 65535)
-	    valuebuffer[65535] = '\0';
-	  debug_printf("  Keyword: %s\n", valuebuffer);
-	  if (valuebuffer[0] > '1')
-	    break;
-	}
-      }
-      if (!attr || valuebuffer[0] == '\0' || valuebuffer[0] <= '1') {
-	debug_printf("  --> cups-browsed is configured to auto-setup only printers which are designed for driverless printing. These printers require IPP 2.x or newer, but this printer only supports IPP 1.x or older. Skipping.\n");
-	goto fail;
-      } else
-	debug_printf("  --> Printer supports IPP 2.x or newer.\n");
-    }
-
-    /* If we have opted for only PWG Raster printers or for only printers 
-       designed for driverless use (PWG Raster + Apple Raster + PCLm + PDF)
-       being set up automatically, we check whether the printer has a non-empty
-       string in its "pwg-raster-document-resolution-supported" IPP attribute
-       to see whether we have a PWG Raster printer. */
-    if (CreateIPPPrinterQueues == IPP_PRINTERS_PWGRASTER ||
-	CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS) {
-      valuebuffer[0] = '\0';
-      debug_printf("Checking whether printer %s understands PWG Raster:\n",
-		   p->queue_name);
-      if ((attr = ippFindAttribute(p->prattrs,
-				   "pwg-raster-document-resolution-supported",
-				   IPP_TAG_RESOLUTION)) != NULL) {
-	debug_printf("  Attr: %s\n", ippGetName(attr));
-	ippAttributeString(attr, valuebuffer, sizeof(valuebuffer));
-	debug_printf("  Value: %s\n", valuebuffer);
-	if (valuebuffer[0] == '\0') {
-	  for (i = 0; i < ippGetCount(attr); i ++) {
-	    strncpy(valuebuffer, ippGetString(attr, i, NULL),
-		    sizeof(valuebuffer) - 1);
-	    if (strlen(ippGetString(attr, i, NULL)) > 65535)
-	      valuebuffer[65535] = '\0';
-	    debug_printf("  Keyword: %s\n", valuebuffer);
-	    if (valuebuffer[0] != '\0')
-	      break;
-	  }
-	}
-      }
-      if (attr && valuebuffer[0] != '\0')
-        is_pwgraster = 1;
-      debug_printf("  --> Printer %s PWG Raster.\n",
-		   is_pwgraster ? "supports" : "does not support");
-    }
-
-#ifdef CUPS_RASTER_HAVE_APPLERASTER
-    /* If we have opted for only Apple Raster printers or for only printers 
-       designed for driverless use (PWG Raster + Apple Raster + PCLm + PDF)
-       being set up automatically, we check whether the printer has a non-empty
-       string in its "urf-supported" IPP attribute to see whether we have an
-       Apple Raster printer. */
-    if (CreateIPPPrinterQueues == IPP_PRINTERS_APPLERASTER ||
-	CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS) {
-      valuebuffer[0] = '\0';
-      debug_printf("Checking whether printer %s understands Apple Raster:\n",
-		   p->queue_name);
-      if ((attr = ippFindAttribute(p->prattrs, "urf-supported", IPP_TAG_KEYWORD)) != NULL) {
-	debug_printf("  Attr: %s\n", ippGetName(attr));
-	ippAttributeString(attr, valuebuffer, sizeof(valuebuffer));
-	debug_printf("  Value: %s\n", valuebuffer);
-	if (valuebuffer[0] == '\0') {
-	  for (i = 0; i < ippGetCount(attr); i ++) {
-	    strncpy(valuebuffer, ippGetString(attr, i, NULL),
-		    sizeof(valuebuffer) - 1);
-	    if (strlen(ippGetString(attr, i, NULL)) > 65535)
-	      valuebuffer[65535] = '\0';
-	    debug_printf("  Keyword: %s\n", valuebuffer);
-	    if (valuebuffer[0] != '\0')
-	      break;
-	  }
-	}
-      }
-      if (attr && valuebuffer[0] != '\0')
-        is_appleraster = 1;
-      debug_printf("  --> Printer %s Apple Raster.\n",
-		   is_appleraster ? "supports" : "does not support");
-    }
-#endif
-
-#ifdef QPDF_HAVE_PCLM
-    /* If we have opted for only PCLm printers or for only printers 
-       designed for driverless use (PWG Raster + Apple Raster + PCLm + PDF)
-       being set up automatically, we check whether the printer has a non-empty
-       string in its "pclm-compression-method-preferred" IPP attribute to see
-       whether we have a PCLm printer. */
-    if (CreateIPPPrinterQueues == IPP_PRINTERS_PCLM ||
-	CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS) {
-      valuebuffer[0] = '\0';
-      debug_printf("Checking whether printer %s understands PCLm:\n",
-		   p->queue_name);
-      if ((attr = ippFindAttribute(p->prattrs,
-				   "pclm-compression-method-preferred",
-				   IPP_TAG_KEYWORD)) != NULL) {
-	debug_printf("  Attr: %s\n", ippGetName(attr));
-	ippAttributeString(attr, valuebuffer, sizeof(valuebuffer));
-	debug_printf("  Value: %s\n", p->queue_name, valuebuffer);
-	if (valuebuffer[0] == '\0') {
-	  for (i = 0; i < ippGetCount(attr); i ++) {
-	    strncpy(valuebuffer, ippGetString(attr, i, NULL),
-		    sizeof(valuebuffer) - 1);
-	    if (strlen(ippGetString(attr, i, NULL)) > 65535)
-	      valuebuffer[65535] = '\0';
-	    debug_printf("  Keyword: %s\n", valuebuffer);
-	    if (valuebuffer[0] != '\0')
-	      break;
-	  }
-	}
-      }
-      if (attr && valuebuffer[0] != '\0')
-        is_pclm = 1;
-      debug_printf("  --> Printer %s PCLm.\n",
-		   is_pclm ? "supports" : "does not support");
-    }
-#endif
-
-    /* If we have opted for only PDF printers or for only printers 
-       designed for driverless use (PWG Raster + Apple Raster + PCLm + PDF)
-       being set up automatically, we check whether the printer has 
-       "application/pdf" under its PDLs. */
-    if (CreateIPPPrinterQueues == IPP_PRINTERS_PDF ||
-	CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS) {
-      debug_printf("Checking whether printer %s understands PDF: PDLs: %s\n",
-		   p->queue_name, pdl);
-      if(strcasestr(pdl, "application/pdf"))
-        is_pdf = 1;
-      debug_printf("  --> Printer %s PDF.\n",
-		   is_pdf ? "supports" : "does not support");
-    }
-
-    /* If the printer is not the driverless printer we opted for, we skip
-       this printer. */
-    if ((CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS &&
-	 is_pwgraster == 0 && is_appleraster == 0 && is_pclm == 0 &&
-	 is_pdf == 0) ||
-	(CreateIPPPrinterQueues == IPP_PRINTERS_PWGRASTER &&
-	 is_pwgraster == 0) ||
-	(CreateIPPPrinterQueues == IPP_PRINTERS_APPLERASTER &&
-	 is_appleraster == 0) ||
-	(CreateIPPPrinterQueues == IPP_PRINTERS_PCLM &&
-	 is_pclm == 0) ||
-	(CreateIPPPrinterQueues == IPP_PRINTERS_PDF &&
-	 is_pdf == 0)) {
-      debug_printf("Printer %s (%s%s%s%s%s%s%s%s%s%s%s%s%s) does not support the driverless printing protocol cups-browsed is configured to accept for setting up such printers automatically, ignoring this printer.\n",
-		   p->queue_name, p->uri,
-		   (CreateIPPPrinterQueues == IPP_PRINTERS_PWGRASTER ||
-		    CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
-		    ", " : ""),
-		   (CreateIPPPrinterQueues == IPP_PRINTERS_PWGRASTER ||
-		    CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
-		    (is_pwgraster ? "" : "not ") : ""),
-		   (CreateIPPPrinterQueues == IPP_PRINTERS_PWGRASTER ||
-		    CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
-		    "PWG Raster" : ""),
-		   (CreateIPPPrinterQueues == IPP_PRINTERS_APPLERASTER ||
-		    CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
-		    ", " : ""),
-		   (CreateIPPPrinterQueues == IPP_PRINTERS_APPLERASTER ||
-		    CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
-		    (is_appleraster ? "" : "not ") : ""),
-		   (CreateIPPPrinterQueues == IPP_PRINTERS_APPLERASTER ||
-		    CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
-		    "Apple Raster" : ""),
-		   (CreateIPPPrinterQueues == IPP_PRINTERS_PCLM ||
-		    CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
-		    ", " : ""),
-		   (CreateIPPPrinterQueues == IPP_PRINTERS_PCLM ||
-		    CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
-		    (is_pclm ? "" : "not ") : ""),
-		   (CreateIPPPrinterQueues == IPP_PRINTERS_PCLM ||
-		    CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
-		    "PCLm" : ""),
-		   (CreateIPPPrinterQueues == IPP_PRINTERS_PDF ||
-		    CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
-		    ", " : ""),
-		   (CreateIPPPrinterQueues == IPP_PRINTERS_PDF ||
-		    CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
-		    (is_pdf ? "" : "not ") : ""),
-		   (CreateIPPPrinterQueues == IPP_PRINTERS_PDF ||
-		    CreateIPPPrinterQueues == IPP_PRINTERS_DRIVERLESS ?
-		    "PDF" : ""));
-      goto fail;
-    }
 
+    /* Whether the printer is of a type which we set up we can only see
+       from its IPP attributes, which get fetched in the background, see
+       printer_attrs_done() */
 #endif /* HAVE_CUPS_1_6 */
   }
   /* Check whether we have an equally named queue already from another
-     server and join a cluster if needed */
-  if (join_cluster_if_needed(p, is_cups_queue) < 0)
+     server and join a cluster if needed. An IPP network printer only
+     joins when we know that we set it up, see printer_attrs_done() */
+  if (is_cups_queue != 0 && join_cluster_if_needed(p, is_cups_queue) < 0)
     goto fail;
   /* Add the new remote printer entry */
   log_all_printers();
@@ -7425,29 +8914,35 @@ create_remote_printer_entry (const char *queue_name,
     autoshutdown_exec_id = 0;
   }
 
+  /* Get the printer's IPP attributes without blocking the main loop, the
+     queue gets created when they are there */
+  if (p->uri[0] != '\0')
+    printer_attrs_fetch(p, is_cups_queue);
+
   if (http_printer)
     httpClose(http_printer);
   return p;
 
  fail:
   debug_printf("ERROR: Unable to create print queue, ignoring printer.\n");
-  if (p->prattrs) ippDelete(p->prattrs);
+  printer_attrs_release(p);
   if (http_printer)
     httpClose(http_printer);
-  if (p->type) free (p->type);
+  release_string(p->type);
   if (p->service_name) free (p->service_name);
   if (p->host) free (p->host);
-  if (p->domain) free (p->domain);
+  release_string(p->domain);
   cupsArrayDelete(p->ipp_discoveries);
   if (p->ip) free (p->ip);
   cupsFreeOptions(p->num_options, p->options);
+  cupsFreeOptions(p->num_ppd_options, p->ppd_options);
   if (p->uri) free (p->uri);
-  if (p->pdl) free (p->pdl);
-  if (p->make_model) free (p->make_model);
+  release_string(p->pdl);
+  release_string(p->make_model);
   if (p->location) free (p->location);
   if (p->info) free (p->info);
   if (p->queue_name) free (p->queue_name);
-  if (p->nickname) free (p->nickname);
+  release_string(p->nickname);
   free (p);
   return NULL;
 }
@@ -7532,6 +9027,7 @@ gboolean update_cups_queues(gpointer unused) {
 #endif
   const char    *loadedppd = NULL;
   ppd_file_t    *ppd = NULL;
+  ppd_option_t  *ppd_opt;
   ppd_choice_t  *choice;
   cups_file_t   *in, *out;
   char          keyword[1024], *keyptr;
@@ -7550,6 +9046,9 @@ gboolean update_cups_queues(gpointer unused) {
   char          *default_pagesize;
   const char    *default_color = NULL;
   int           cups_queues_updated = 0;
+  int           pass, pending, pause, stopped = 0;
+  gint64        call_start = g_get_monotonic_time(), op_start;
+  int           op_updated;
 
   /* Create dummy entry to point slaves at when their master is about to
      get removed now (if we point them to NULL, we would try to remove
@@ -7579,558 +9078,582 @@ gboolean update_cups_queues(gpointer unused) {
 
   debug_printf("Processing printer list ...\n");
   log_all_printers();
-  for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
-       p; p = (remote_printer_t *)cupsArrayNext(remote_printers)) {
-
-    /* We need to get the current time as precise as possible for retries
-       and reset the timeout flag */
-    current_time = time(NULL);
-    timeout_reached = 0;
-
-    /* terminating means we have received a signal and should shut down.
-       in_shutdown means we have exited the main loop.
-       update_cups_queues() is called after having exited the main loop
-       in order to remove any queues we have set up */
-    if (terminating && !in_shutdown) {
-      debug_printf("Stopping processing printer list because cups-browsed is terminating.\n");
-      break;
-    }
-
-    /* We do not necessarily update all local CUPS queues which are
-       scheduled for creation, update, or removal in a single call of
-       the update_cups_queues() function, as then we could be stuck in
-       this function for a long time and other tasks of cups-browsed,
-       especially directing print jobs to destination printers before
-       the implicitclass backend times out, will not get done in time.
-       We schedule a new call of update_cups_queues() after a short
-       delay to continue with the next local CUPS queues. */
-    if (!in_shutdown && update_cups_queues_max_per_call > 0 &&
-	cups_queues_updated >= update_cups_queues_max_per_call) {
-      debug_printf("Stopping processing printer list here because the update_cups_queues() function has reached its per-call limit of %d queue updates. Continuing in further calls.\n",
-		   update_cups_queues_max_per_call);
-      break;
-    }
+  /* Do the removals first, then the creations and updates, so that
+     queues which got replaced by another one, for example after a
+     network change, are out of the way when their successors get
+     created */
+  for (pass = 0; pass < 2 && !stopped; pass ++) {
+    for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
+	 p; p = (remote_printer_t *)cupsArrayNext(remote_printers)) {
 
-    switch (p->status) {
+      if ((pass == 0) !=
+	  (p->status == STATUS_UNCONFIRMED || p->status == STATUS_DISAPPEARED ||
+	   p->status == STATUS_TO_BE_RELEASED))
+	continue;
 
-      /* Print queue generated by us in a previous session */
-    case STATUS_UNCONFIRMED:
+      /* We need to get the current time as precise as possible for retries
+	 and reset the timeout flag */
+      current_time = time(NULL);
+      timeout_reached = 0;
+      op_start = g_get_monotonic_time();
+      op_updated = cups_queues_updated;
+
+      /* terminating means we have received a signal and should shut down.
+	 in_shutdown means we have exited the main loop.
+	 update_cups_queues() is called after having exited the main loop
+	 in order to remove any queues we have set up */
+      if (terminating && !in_shutdown) {
+	debug_printf("Stopping processing printer list because cups-browsed is terminating.\n");
+	stopped = 1;
+	break;
+      }
 
-      /* Only act if the timeout has passed */
-      if (p->timeout > current_time)
+      /* We do not necessarily update all local CUPS queues which are
+	 scheduled for creation, update, or removal in a single call of
+	 the update_cups_queues() function, as then we could be stuck in
+	 this function for a long time and other tasks of cups-browsed,
+	 especially directing print jobs to destination printers before
+	 the implicitclass backend times out, will not get done in time.
+	 We schedule a new call of update_cups_queues() to continue with
+	 the next local CUPS queues. Without a configured limit we stop
+	 when the next update would probably exceed our time budget,
+	 measured by how long cupsd took for the updates recently. */
+      if (!in_shutdown && update_cups_queues_max_per_call > 0 &&
+	  cups_queues_updated >= update_cups_queues_max_per_call) {
+	debug_printf("Stopping processing printer list here because the update_cups_queues() function has reached its per-call limit of %d queue updates. Continuing in further calls.\n",
+		     update_cups_queues_max_per_call);
+	stopped = 1;
 	break;
+      }
+      if (!in_shutdown && update_cups_queues_max_per_call < 0 &&
+	  cups_queues_updated > 0 &&
+	  op_start - call_start + queue_update_latency >
+	  QUEUE_UPDATE_TIME_BUDGET) {
+	debug_printf("Stopping processing printer list here after %d queue updates in %d msec. Continuing in further calls.\n",
+		     cups_queues_updated, (int)((op_start - call_start) / 1000));
+	stopped = 1;
+	break;
+      }
 
-      /* Queue not reported again by DNS-SD, remove it */
-      debug_printf("No remote printer named %s available, removing entry from previous session.\n",
-		   p->queue_name);
-      remove_printer_entry(p);
+      switch (p->status) {
 
-    /* DNS-SD has reported this printer as disappeared or we have replaced
-       this printer by another one */
-    case STATUS_DISAPPEARED:
-    case STATUS_TO_BE_RELEASED:
+	/* Print queue generated by us in a previous session */
+      case STATUS_UNCONFIRMED:
 
-      /* Only act if the timeout has passed */
-      if (p->timeout > current_time)
-	break;
+	/* Only act if the timeout has passed */
+	if (p->timeout > current_time)
+	  break;
 
-      debug_printf("Removing entry %s (%s)%s.\n", p->queue_name, p->uri,
-		   (p->slave_of ||
-		    p->status == STATUS_TO_BE_RELEASED ? "" :
-		    " and its CUPS queue"));
+	/* Queue not reported again by DNS-SD, remove it */
+	debug_printf("No remote printer named %s available, removing entry from previous session.\n",
+		     p->queue_name);
+	remove_printer_entry(p);
 
-      /* Slaves do not have a CUPS queue */
-      if ((q = p->slave_of) == NULL) {
-	if ((http = http_connect_local ()) == NULL) {
-	  debug_printf("Unable to connect to CUPS!\n");
-	  if (in_shutdown == 0) {
-            current_time = time(NULL);
-	    p->timeout = current_time + TIMEOUT_RETRY;
-	  }
-	  break;
-	}
+      /* DNS-SD has reported this printer as disappeared or we have replaced
+	 this printer by another one */
+      case STATUS_DISAPPEARED:
+      case STATUS_TO_BE_RELEASED:
 
-	/* Do not auto-save option settings due to the print queue removal
-	   process or release process */
-	p->no_autosave = 1;
+	/* Only act if the timeout has passed */
+	if (p->timeout > current_time)
+	  break;
 
-	/* Record the option settings to retrieve them when the remote
-	   queue re-appears later or when cups-browsed gets started again */
-	record_printer_options(p->queue_name);
+	debug_printf("Removing entry %s (%s)%s.\n", p->queue_name, p->uri,
+		     (p->slave_of ||
+		      p->status == STATUS_TO_BE_RELEASED ? "" :
+		      " and its CUPS queue"));
 
-	if (p->status != STATUS_TO_BE_RELEASED &&
-	    !queue_overwritten(p)) {
-	  /* Remove the CUPS queue */
-
-	  /* Check whether there are still jobs and do not remove the queue
-	     then */
-	  num_jobs = 0;
-	  jobs = NULL;
-	  num_jobs = cupsGetJobs2(http, &jobs, p->queue_name, 0,
-				  CUPS_WHICHJOBS_ACTIVE);
-	  if (num_jobs > 0) { /* There are still jobs */
-	    debug_printf("Queue has still jobs or CUPS error!\n");
-	    cupsFreeJobs(num_jobs, jobs);
-	    /* Disable the queue */
-#ifdef HAVE_AVAHI
-	    if (avahi_present || p->domain == NULL || p->domain[0] == '\0')
-	      /* If avahi has got shut down, do not disable queues which are,
-		 created based on DNS-SD broadcasts as the server has most
-		 probably not gone away */
-#endif /* HAVE_AVAHI */
-	      disable_printer(p->queue_name,
-			      "Printer disappeared or cups-browsed shutdown");
-	    /* Schedule the removal of the queue for later */
+	/* Slaves do not have a CUPS queue */
+	if ((q = p->slave_of) == NULL) {
+	  if ((http = http_connect_local ()) == NULL) {
+	    debug_printf("Unable to connect to CUPS!\n");
 	    if (in_shutdown == 0) {
-              current_time = time(NULL);
+	      current_time = time(NULL);
 	      p->timeout = current_time + TIMEOUT_RETRY;
-	      p->no_autosave = 0;
-	      break;
-	    } else
-	      /* Make sure queue's list entry gets freed */
-	      goto keep_queue;
+	    }
+	    break;
 	  }
 
-	  /* If this queue was the default printer, note that fact so that
-	     it gets the default printer again when it re-appears, also switch
-	     back to the last local default printer */
-	  queue_removal_handle_default(p->queue_name);
-
-	  /* If we do not have a subscription to CUPS' D-Bus notifications and
-	     so no default printer management, we simply do not remove this
-	     CUPS queue if it is the default printer, to not cause a change
-	     of the default printer or the loss of the information that this
-	     printer is the default printer. */
-	  if (cups_notifier == NULL && is_cups_default_printer(p->queue_name)) {
-	    /* Schedule the removal of the queue for later */
-	    if (in_shutdown == 0) {
-              current_time = time(NULL);
-	      p->timeout = current_time + TIMEOUT_RETRY;
-	      p->no_autosave = 0;
-	      break;
-	    } else
-	      /* Make sure queue's list entry gets freed */
-	      goto keep_queue;
-	  }
-
-	  /* No jobs, remove the CUPS queue */
-	  debug_printf("Removing local CUPS queue %s (%s).\n", p->queue_name,
-		       p->uri);
-	  request = ippNewRequest(CUPS_DELETE_PRINTER);
-	  /* Printer URI: ipp://localhost/printers/<queue name> */
-	  httpAssembleURIf(HTTP_URI_CODING_ALL, uri, sizeof(uri), "ipp", NULL,
-			   "localhost", 0, "/printers/%s",
-			   p->queue_name);
-	  ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
-		       "printer-uri", NULL, uri);
-	  /* Default user */
-	  ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME,
-		       "requesting-user-name", NULL, cupsUser());
-	  /* Do it */
-	  ippDelete(cupsDoRequest(http, request, "/admin/"));
-
-	  cups_queues_updated ++;
-
-	  if (cupsLastError() > IPP_STATUS_OK_EVENTS_COMPLETE &&
-	      cupsLastError() != IPP_STATUS_ERROR_NOT_FOUND) {
-	    debug_printf("Unable to remove CUPS queue! (%s)\n",
-			 cupsLastErrorString());
-	    if (in_shutdown == 0) {
-              current_time = time(NULL);
-	      p->timeout = current_time + TIMEOUT_RETRY;
-	      p->no_autosave = 0;
-	      break;
-	    }
-	  }
-	}
-      }
-
-    keep_queue:
-
-      /* CUPS queue removed or released from cups-browsed, remove the list
-	 entry */
-      /* Note that we do not need to break out of the loop passing through
-	 all elements of a CUPS array when we remove an element via the
-	 cupsArrayRemove() function, as the function decreases the array-
-	 internal index by one and so the cupsArrayNext() call gives us
-	 the element right after the deleted element. So no skipping
-         of an element and especially no reading beyond the end of the
-         array. */
-      cupsArrayRemove(remote_printers, p);
-      if (p->queue_name) free (p->queue_name);
-      if (p->location) free (p->location);
-      if (p->info) free (p->info);
-      if (p->make_model) free (p->make_model);
-      if (p->pdl) free (p->pdl);
-      if (p->uri) free (p->uri);
-      cupsFreeOptions(p->num_options, p->options);
-      if (p->host) free (p->host);
-      if (p->ip) free (p->ip);
-      if (p->service_name) free (p->service_name);
-      if (p->type) free (p->type);
-      if (p->domain) free (p->domain);
-      cupsArrayDelete(p->ipp_discoveries);
-      if (p->prattrs) ippDelete (p->prattrs);
-      if (p->nickname) free (p->nickname);
-      free(p);
-      p = NULL;
-
-      /* If auto shutdown is active and all printers we have set up got removed
-	 again, schedule the shutdown in autoshutdown_timeout seconds
-         Note that in this case we also do not have jobs any more so if we
-         auto shutdown on running out of jobs, trigger it here, too. */
-      if (in_shutdown == 0 && autoshutdown && !autoshutdown_exec_id &&
-	  (cupsArrayCount(remote_printers) == 0 ||
-	   (autoshutdown_on == NO_JOBS && check_jobs() == 0))) {
-	debug_printf ("No printers there any more to make available or no jobs, shutting down in %d sec...\n", autoshutdown_timeout);
-	autoshutdown_exec_id =
-	  g_timeout_add_seconds (autoshutdown_timeout, autoshutdown_execute,
-				 NULL);
-      }
-
-      break;
-
-    /* DNS-SD has reported a new remote printer, create a CUPS queue for it,
-       or upgrade an existing queue, or update a queue to use a backup host
-       when it has disappeared on the currently used host */
-    /* (...or, we've just received a CUPS Browsing packet for this queue) */
-    case STATUS_TO_BE_CREATED:
-
-      /* Do not create a queue for slaves */
-      if (p->slave_of) {
-	master = p->slave_of;
-	if (master->queue_name) {
-	  p->status = STATUS_CONFIRMED;
-	  master->status = STATUS_TO_BE_CREATED;
-	  master->timeout = time(NULL) + TIMEOUT_IMMEDIATELY;
-	  if (p->is_legacy) {
-	    p->timeout = time(NULL) + BrowseTimeout;
-	    debug_printf("starting BrowseTimeout timer for %s (%ds)\n",
-			 p->queue_name, BrowseTimeout);
-	  } else
-	    p->timeout = (time_t) -1;
-	} else {
-	  debug_printf("Master for slave %s is invalid (deleted?)\n",
-		       p->queue_name);
-	  p->status = STATUS_DISAPPEARED;
-	  p->timeout = time(NULL) + TIMEOUT_IMMEDIATELY;
-	}
-	break;
-      }
+	  /* Do not auto-save option settings due to the print queue removal
+	     process or release process */
+	  p->no_autosave = 1;
 
-      /* Only act if the timeout has passed */
-      if (p->timeout > current_time)
-	break;
-
-      /* cups-browsed tried to add this print queue unsuccessfully for too
-	 many times due to timeouts - Skip print queue creation for this one */
-      if (p->timeouted >= HttpMaxRetries) {
-	debug_printf("Max number of retries (%d) for creating print queue %s reached, skipping it.\n",
-		HttpMaxRetries, p->queue_name);
-	continue;
-      }
+	  /* Record the option settings to retrieve them when the remote
+	     queue re-appears later or when cups-browsed gets started again */
+	  record_printer_options(p->queue_name);
 
-      debug_printf("Creating/Updating CUPS queue %s\n",
-		   p->queue_name);
-
-      /* Make sure to have a connection to the local CUPS daemon */
-      if ((http = http_connect_local ()) == NULL) {
-	debug_printf("Unable to connect to CUPS!\n");
-        current_time = time(NULL);
-	p->timeout = current_time + TIMEOUT_RETRY;
-	break;
-      }
-      httpSetTimeout(http, HttpLocalTimeout, http_timeout_cb, NULL);
-
-      /* Do not auto-save option settings due to the print queue creation
-	 process */
-      p->no_autosave = 1;
-
-      /* Printer URI: ipp://localhost/printers/<queue name> */
-      httpAssembleURIf(HTTP_URI_CODING_ALL, uri, sizeof(uri), "ipp", NULL,
-		       "localhost", 0, "/printers/%s", p->queue_name);
-
-      ifscript = NULL;
-      ppdfile = NULL;
+	  if (p->status != STATUS_TO_BE_RELEASED &&
+	      !queue_overwritten(p)) {
+	    /* Remove the CUPS queue */
 
-#ifdef HAVE_CUPS_1_6
-      /* Check whether there is a temporary CUPS queue which we would
-         overwrite */
-      dest = NULL;
-      if (OnlyUnsupportedByCUPS == 0)
-        dest = cupsGetNamedDest(http, p->queue_name, NULL);
-      if (dest) {
-	/* CUPS has found a queue with this name.
-	   Either CUPS generates a temporary queue here or we have already
-	   made this queue permanent. In any case, load the PPD from this
-	   queue to conserve the PPD which CUPS has originally generated. */
-	if (p->netprinter == 1 && IPPPrinterQueueType == PPD_YES &&
-	    UseCUPSGeneratedPPDs) {
-	  if (LocalQueueNamingIPPPrinter != LOCAL_QUEUE_NAMING_DNSSD) {
-	    debug_printf("Local queue %s: We can replace temporary CUPS queues and keep their PPD file only when we name our queues like them, to avoid duplicate queues to the same printer.\n",
-			 p->queue_name);
-	    debug_printf("Not loading PPD from temporary CUPS queue for this printer.\n");
-	    debug_printf("Try setting \"LocalQueueNamingIPPPrinter DNS-SD\" in cups-browsed.conf.\n");
-	  } else {
-	    /* This call makes CUPS actually create the queue so that we can
-	       grab the PPD. We discard the result of the call. */
-	    debug_printf("Establishing dummy connection to make CUPS create the temporary queue.\n");
-	    cups_dinfo_t *dinfo = cupsCopyDestInfo(http, dest);
-	    if (dinfo == NULL)
-	      debug_printf("Unable to connect to destination.\n");
-	    else {
-	      debug_printf("Temporary queue created, grabbing the PPD.\n");
-	      cupsFreeDestInfo(dinfo);
-	      loadedppd = NULL;
-	      if ((loadedppd = loadPPD(http, p->queue_name)) == NULL)
-		debug_printf("Unable to load PPD from local temporary queue %s!\n",
-			     p->queue_name);
-	      else {
-		ppdfile = strdup(loadedppd);
-		debug_printf("Loaded PPD file %s from local temporary queue %s.\n",
-			     ppdfile, p->queue_name);
-	      }
-	    }
-	  }
-	}
-	/* If we have already a temporary CUPS queue our local queue we
-	   are creating would overwrite the temporary queue, and so the
-	   resulting queue will still be considered temporary by CUPS and
-	   removed after one minute of inactivity. To avoid this we need
-	   to convert the queue into a permanent one and CUPS does this
-	   only by sharing the queue (setting its boolean printer-is-shared
-	   option. We unset the bit right after that to not actually share
-	   the queue (if we want to share the queue we take care about this
-	   later).
-	   Note that we cannot reliably determine whether we have a
-	   temporary queue via the printer-is-temporary attribute,
-	   therefore we consider only shared queues as for sure
-	   permanent and not shared queues as possibly temporary. To
-	   assure we have a permanent queue in the end we set and
-	   remove the shared bit on any queue which is not shared.
-	   If the temporary queue is pointing to a remote CUPS printer
-	   we cannot modify its printer-is-shared option as CUPS prevents
-	   this. In this case we remove the temporary queue so that we
-	   create a fresh one which will always be permanent.
-	   If the temporary queue has still jobs we will not remove it to
-	   not loose the jobs and wait with creating our new queue until
-	   the jobs are done. */
-	val = cupsGetOption ("printer-is-shared",
-			     dest->num_options,
-			     dest->options);
-	is_shared = val && (!strcasecmp (val, "yes") ||
-			    !strcasecmp (val, "on") ||
-			    !strcasecmp (val, "true"));
-	cupsFreeDests(1, dest);
-	if (!is_shared) {
-	  debug_printf("Our new queue overwrites the possibly temporary CUPS queue %s, so we need to assure the queue gets permanent.\n",
-		       p->queue_name);
-	  /* We need to modify the printer-is-shared bit twice if we need to
-	     make a temporary queue permanent but not share this queue */
-	  for (i = 0; i <= 1; i ++) {
-	    if (i == 0)
-	      debug_printf("Setting printer-is-shared bit to make this queue permanent.\n");
-	    else
-	      debug_printf("Unsetting printer-is-shared bit.\n");
-	    request = ippNewRequest(CUPS_ADD_MODIFY_PRINTER);
-	    ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
-			 "printer-uri", NULL, uri);
-	    ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME,
-			 "requesting-user-name", NULL, cupsUser());
-	    num_options = 0;
-	    options = NULL;
-	    num_options = cupsAddOption("printer-is-shared",
-					(i == 0 ? "true" : "false"),
-					num_options, &options);
-	    num_options = cupsAddOption(CUPS_BROWSED_MARK "-default", "true", num_options, &options);
-	    cupsEncodeOptions2(request, num_options, options,
-			       IPP_TAG_OPERATION);
-	    cupsEncodeOptions2(request, num_options, options, IPP_TAG_PRINTER);
-	    /*
-	     * Do IPP request for printer-is-shared option only when we have
-	     * network printer or if we have remote CUPS queue, do IPP request
-	     * only if we have CUPS older than 2.2.
-	     * When you have remote queue, clean up and break from the loop.
-	     */
-	    if (p->netprinter != 0 || !HAVE_CUPS_2_2 || AllowResharingRemoteCUPSPrinters)
-	      ippDelete(cupsDoRequest(http, request, "/admin/"));
-	    else {
-	      ippDelete(request);
-	      cupsFreeOptions(num_options, options);
-	      break;
-	    }
-	    cupsFreeOptions(num_options, options);
-	    if (cupsLastError() > IPP_STATUS_OK_EVENTS_COMPLETE) {
-	      debug_printf("Unable change printer-is-shared bit to %s (%s)!\n",
-			   (i == 0 ? "true" : "false"),
-			   cupsLastErrorString());
-	      break;
-	    }
-	  }
-	  /* Error on modifying printer-is-shared bit, removing possibly
-	     temporary queue */
-	  if (i <= 1) {
-	    debug_printf("Removing the possibly temporary CUPS queue.\n");
 	    /* Check whether there are still jobs and do not remove the queue
 	       then */
 	    num_jobs = 0;
 	    jobs = NULL;
 	    num_jobs = cupsGetJobs2(http, &jobs, p->queue_name, 0,
 				    CUPS_WHICHJOBS_ACTIVE);
-	    if (num_jobs > 0) { /* there are still jobs */
-	      debug_printf("Temporary queue has still jobs or CUPS error, retrying later.\n");
+	    if (num_jobs > 0) { /* There are still jobs */
+	      debug_printf("Queue has still jobs or CUPS error!\n");
 	      cupsFreeJobs(num_jobs, jobs);
+	      /* Disable the queue */
+#ifdef HAVE_AVAHI
+	      if (avahi_present || p->domain == NULL || p->domain[0] == '\0')
+		/* If avahi has got shut down, do not disable queues which are,
+		   created based on DNS-SD broadcasts as the server has most
+		   probably not gone away */
+#endif /* HAVE_AVAHI */
+		disable_printer(p->queue_name,
+				"Printer disappeared or cups-browsed shutdown");
 	      /* Schedule the removal of the queue for later */
 	      if (in_shutdown == 0) {
-                current_time = time(NULL);
+		current_time = time(NULL);
 		p->timeout = current_time + TIMEOUT_RETRY;
 		p->no_autosave = 0;
-	      }
-	      break;
+		break;
+	      } else
+		/* Make sure queue's list entry gets freed */
+		goto keep_queue;
 	    }
+
+	    /* If this queue was the default printer, note that fact so that
+	       it gets the default printer again when it re-appears, also switch
+	       back to the last local default printer */
+	    queue_removal_handle_default(p->queue_name);
+
+	    /* If we do not have a subscription to CUPS' D-Bus notifications and
+	       so no default printer management, we simply do not remove this
+	       CUPS queue if it is the default printer, to not cause a change
+	       of the default printer or the loss of the information that this
+	       printer is the default printer. */
+	    if (cups_notifier == NULL && is_cups_default_printer(p->queue_name)) {
+	      /* Schedule the removal of the queue for later */
+	      if (in_shutdown == 0) {
+		current_time = time(NULL);
+		p->timeout = current_time + TIMEOUT_RETRY;
+		p->no_autosave = 0;
+		break;
+	      } else
+		/* Make sure queue's list entry gets freed */
+		goto keep_queue;
+	    }
+
 	    /* No jobs, remove the CUPS queue */
+	    debug_printf("Removing local CUPS queue %s (%s).\n", p->queue_name,
+			 p->uri);
 	    request = ippNewRequest(CUPS_DELETE_PRINTER);
+	    /* Printer URI: ipp://localhost/printers/<queue name> */
+	    httpAssembleURIf(HTTP_URI_CODING_ALL, uri, sizeof(uri), "ipp", NULL,
+			     "localhost", 0, "/printers/%s",
+			     p->queue_name);
 	    ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
 			 "printer-uri", NULL, uri);
+	    /* Default user */
 	    ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME,
 			 "requesting-user-name", NULL, cupsUser());
+	    /* Do it */
 	    ippDelete(cupsDoRequest(http, request, "/admin/"));
+
+	    cups_queues_updated ++;
+
 	    if (cupsLastError() > IPP_STATUS_OK_EVENTS_COMPLETE &&
 		cupsLastError() != IPP_STATUS_ERROR_NOT_FOUND) {
-	      debug_printf("Unable to remove temporary CUPS queue (%s), retrying later\n",
+	      debug_printf("Unable to remove CUPS queue! (%s)\n",
 			   cupsLastErrorString());
 	      if (in_shutdown == 0) {
-                current_time = time(NULL);
+		current_time = time(NULL);
 		p->timeout = current_time + TIMEOUT_RETRY;
 		p->no_autosave = 0;
 		break;
 	      }
 	    }
 	  }
-	} else
-	  debug_printf("Creating/Updating permanent CUPS queue %s.\n",
-		       p ->queue_name);
-      } else
-	debug_printf("Creating permanent CUPS queue %s.\n",
+	}
+
+      keep_queue:
+
+	/* CUPS queue removed or released from cups-browsed, remove the list
+	   entry */
+	/* Note that we do not need to break out of the loop passing through
+	   all elements of a CUPS array when we remove an element via the
+	   cupsArrayRemove() function, as the function decreases the array-
+	   internal index by one and so the cupsArrayNext() call gives us
+	   the element right after the deleted element. So no skipping
+	   of an element and especially no reading beyond the end of the
+	   array. */
+	cupsArrayRemove(remote_printers, p);
+	/* Drop the result of a still running attribute fetch */
+	if (p->attrs_job)
+	  p->attrs_job->p = NULL;
+	free_printer_entry(p);
+	p = NULL;
+
+	/* If auto shutdown is active and all printers we have set up got removed
+	   again, schedule the shutdown in autoshutdown_timeout seconds
+	   Note that in this case we also do not have jobs any more so if we
+	   auto shutdown on running out of jobs, trigger it here, too. */
+	if (in_shutdown == 0 && autoshutdown && !autoshutdown_exec_id &&
+	    (cupsArrayCount(remote_printers) == 0 ||
+	     (autoshutdown_on == NO_JOBS && check_jobs() == 0))) {
+	  debug_printf ("No printers there any more to make available or no jobs, shutting down in %d sec...\n", autoshutdown_timeout);
+	  autoshutdown_exec_id =
+	    g_timeout_add_seconds (autoshutdown_timeout, autoshutdown_execute,
+				   NULL);
+	}
+
+	break;
+
+      /* DNS-SD has reported a new remote printer, create a CUPS queue for it,
+	 or upgrade an existing queue, or update a queue to use a backup host
+	 when it has disappeared on the currently used host */
+      /* (...or, we've just received a CUPS Browsing packet for this queue) */
+      case STATUS_TO_BE_CREATED:
+
+	/* The IPP attributes are still on their way, printer_attrs_done()
+	   brings us back here */
+	if (p->attrs_job)
+	  break;
+
+	/* Do not create a queue for slaves */
+	if (p->slave_of) {
+	  master = p->slave_of;
+	  if (master->queue_name) {
+	    p->status = STATUS_CONFIRMED;
+	    printer_attrs_compact(p);
+	    master->status = STATUS_TO_BE_CREATED;
+	    master->timeout = time(NULL) + TIMEOUT_IMMEDIATELY;
+	    if (p->is_legacy) {
+	      p->timeout = time(NULL) + BrowseTimeout;
+	      debug_printf("starting BrowseTimeout timer for %s (%ds)\n",
+			   p->queue_name, BrowseTimeout);
+	    } else
+	      p->timeout = (time_t) -1;
+	  } else {
+	    debug_printf("Master for slave %s is invalid (deleted?)\n",
+			 p->queue_name);
+	    p->status = STATUS_DISAPPEARED;
+	    p->timeout = time(NULL) + TIMEOUT_IMMEDIATELY;
+	  }
+	  break;
+	}
+
+	/* Only act if the timeout has passed */
+	if (p->timeout > current_time)
+	  break;
+
+	/* cups-browsed tried to add this print queue unsuccessfully for too
+	   many times due to timeouts - Skip print queue creation for this one */
+	if (p->timeouted >= HttpMaxRetries) {
+	  debug_printf("Max number of retries (%d) for creating print queue %s reached, skipping it.\n",
+		  HttpMaxRetries, p->queue_name);
+	  continue;
+	}
+
+	debug_printf("Creating/Updating CUPS queue %s\n",
 		     p->queue_name);
 
-      /* If we did not already obtain a PPD file from the temporary CUPS queue
-         or if we want to use a System V interface script for our IPP network
-	 printer, we proceed here */
-      if (p->netprinter == 1) {
-	if (p->prattrs == NULL) {
-	  p->prattrs = get_printer_attributes(p->uri, NULL, 0, NULL, 0, 1);
-	  debug_log_out(get_printer_attributes_log);
+	/* Copy-on-write: The queue's PPD gets generated from the
+	   complete attributes, which we also could modify */
+	printer_attrs_expand(p);
+
+	/* Make sure to have a connection to the local CUPS daemon */
+	if ((http = http_connect_local ()) == NULL) {
+	  debug_printf("Unable to connect to CUPS!\n");
+	  current_time = time(NULL);
+	  p->timeout = current_time + TIMEOUT_RETRY;
+	  break;
 	}
-	if (p->prattrs == NULL) {
-	  debug_printf("get-printer-attributes IPP call failed on printer %s (%s).\n",
-		       p->queue_name, p->uri);
-	  p->status = STATUS_DISAPPEARED;
-          current_time = time(NULL);
-	  p->timeout = current_time + TIMEOUT_IMMEDIATELY;
-	  goto cannot_create;
+	httpSetTimeout(http, HttpLocalTimeout, http_timeout_cb, NULL);
+
+	/* Queue from the previous session for a printer which did not
+	   change, we can keep it as it is */
+	if (p->saved_state && discovery_state_unchanged(http, p)) {
+	  debug_printf("Printer %s did not change since the previous session, keeping its CUPS queue.\n",
+		       p->queue_name);
+	  p->no_autosave = 1;
+	  /* Record the options, to record any changes which happened
+	     while cups-browsed was not running */
+	  record_printer_options(p->queue_name);
+	  goto queue_unchanged;
 	}
-	if (IPPPrinterQueueType == PPD_YES) {
-	  num_cluster_printers = 0;
-	  for (s = (remote_printer_t *)cupsArrayFirst(remote_printers);
-	       s; s = (remote_printer_t *)cupsArrayNext(remote_printers)) {
-	    if (!strcmp(s->queue_name, p->queue_name)) {
-	      if (s->status == STATUS_DISAPPEARED ||
-		  s->status == STATUS_UNCONFIRMED ||
-		  s->status == STATUS_TO_BE_RELEASED )
-		continue;
-	      num_cluster_printers ++;
-	    }
-	  }
 
-	  if (num_cluster_printers == 1) {
-	    printer_attributes = p->prattrs;
-	    conflicts = NULL;
-	    default_pagesize = NULL;
-	    default_color = NULL;
-	    make_model = p->make_model;
-	    pdl = p->pdl;
-	    color = p->color;
-	    duplex = p->duplex;
-	    sizes = NULL;
-	  } else {
-	    make_model = (char*)malloc(sizeof(char) * 256);
-	    if ((attr = ippFindAttribute(printer_attributes,
-					 "printer-make-and-model",
-					 IPP_TAG_TEXT)) != NULL)
-	      strncpy(make_model, ippGetString(attr, 0, NULL),
-		      sizeof(make_model) - 1);
-	    color = 0;
-	    duplex = 0;
-	    for (r = (remote_printer_t *)cupsArrayFirst(remote_printers);
-		 r; r = (remote_printer_t *)cupsArrayNext(remote_printers)) {
-	      if (!strcmp(p->queue_name, r->queue_name)) {
-		if (r->color == 1)
-		  color = 1;
-		if (r->duplex == 1)
-		  duplex = 1;
+	/* Do not auto-save option settings due to the print queue creation
+	   process */
+	p->no_autosave = 1;
+
+	/* Printer URI: ipp://localhost/printers/<queue name> */
+	httpAssembleURIf(HTTP_URI_CODING_ALL, uri, sizeof(uri), "ipp", NULL,
+			 "localhost", 0, "/printers/%s", p->queue_name);
+
+	ifscript = NULL;
+	ppdfile = NULL;
+
+#ifdef HAVE_CUPS_1_6
+	/* Check whether there is a temporary CUPS queue which we would
+	   overwrite */
+	dest = NULL;
+	if (OnlyUnsupportedByCUPS == 0)
+	  dest = cupsGetNamedDest(http, p->queue_name, NULL);
+	if (dest) {
+	  /* CUPS has found a queue with this name.
+	     Either CUPS generates a temporary queue here or we have already
+	     made this queue permanent. In any case, load the PPD from this
+	     queue to conserve the PPD which CUPS has originally generated. */
+	  if (p->netprinter == 1 && IPPPrinterQueueType == PPD_YES &&
+	      UseCUPSGeneratedPPDs) {
+	    if (LocalQueueNamingIPPPrinter != LOCAL_QUEUE_NAMING_DNSSD) {
+	      debug_printf("Local queue %s: We can replace temporary CUPS queues and keep their PPD file only when we name our queues like them, to avoid duplicate queues to the same printer.\n",
+			   p->queue_name);
+	      debug_printf("Not loading PPD from temporary CUPS queue for this printer.\n");
+	      debug_printf("Try setting \"LocalQueueNamingIPPPrinter DNS-SD\" in cups-browsed.conf.\n");
+	    } else {
+	      /* This call makes CUPS actually create the queue so that we can
+		 grab the PPD. We discard the result of the call. */
+	      debug_printf("Establishing dummy connection to make CUPS create the temporary queue.\n");
+	      cups_dinfo_t *dinfo = cupsCopyDestInfo(http, dest);
+	      if (dinfo == NULL)
+		debug_printf("Unable to connect to destination.\n");
+	      else {
+		debug_printf("Temporary queue created, grabbing the PPD.\n");
+		cupsFreeDestInfo(dinfo);
+		loadedppd = NULL;
+		if ((loadedppd = loadPPD(http, p->queue_name)) == NULL)
+		  debug_printf("Unable to load PPD from local temporary queue %s!\n",
+			       p->queue_name);
+		else {
+		  ppdfile = strdup(loadedppd);
+		  debug_printf("Loaded PPD file %s from local temporary queue %s.\n",
+			       ppdfile, p->queue_name);
+		}
 	      }
 	    }
-	    default_pagesize = (char *)malloc(sizeof(char)*32);
-	    printer_attributes = get_cluster_attributes(p->queue_name);
-	    debug_printf("Generated Merged Attributes for local queue %s\n",
-			 p->queue_name);
-	    conflicts = generate_cluster_conflicts(p->queue_name,
-						   printer_attributes);
-	    debug_printf("Generated Constraints for queue %s\n",
-			 p->queue_name);
-	    sizes = get_cluster_sizes(p->queue_name);
-	    get_cluster_default_attributes(&printer_attributes,
-					   p->queue_name, default_pagesize,
-					   &default_color);
-	    debug_printf("Generated Default Attributes for local queue %s\n",
-			 p->queue_name);
 	  }
-	  p->nickname = NULL;
-	  if (ppdfile == NULL) {
-	    /* If we do not want CUPS-generated PPDs or we cannot obtain a
-	       CUPS-generated PPD, for example if CUPS does not create a 
-	       temporary queue for this printer, we generate a PPD by
-	       ourselves */
-	    printer_ipp_response = (num_cluster_printers == 1) ? p->prattrs :
-	      printer_attributes; 
-	    if (!ppdCreateFromIPP2(buffer, sizeof(buffer), printer_ipp_response,
-				   make_model,
-				   pdl, color, duplex, conflicts, sizes,
-				   default_pagesize, default_color)) {
-	      if (errno != 0)
-		debug_printf("Unable to create PPD file: %s\n",
-			     strerror(errno));
+	  /* If we have already a temporary CUPS queue our local queue we
+	     are creating would overwrite the temporary queue, and so the
+	     resulting queue will still be considered temporary by CUPS and
+	     removed after one minute of inactivity. To avoid this we need
+	     to convert the queue into a permanent one and CUPS does this
+	     only by sharing the queue (setting its boolean printer-is-shared
+	     option. We unset the bit right after that to not actually share
+	     the queue (if we want to share the queue we take care about this
+	     later).
+	     Note that we cannot reliably determine whether we have a
+	     temporary queue via the printer-is-temporary attribute,
+	     therefore we consider only shared queues as for sure
+	     permanent and not shared queues as possibly temporary. To
+	     assure we have a permanent queue in the end we set and
+	     remove the shared bit on any queue which is not shared.
+	     If the temporary queue is pointing to a remote CUPS printer
+	     we cannot modify its printer-is-shared option as CUPS prevents
+	     this. In this case we remove the temporary queue so that we
+	     create a fresh one which will always be permanent.
+	     If the temporary queue has still jobs we will not remove it to
+	     not loose the jobs and wait with creating our new queue until
+	     the jobs are done. */
+	  val = cupsGetOption ("printer-is-shared",
+			       dest->num_options,
+			       dest->options);
+	  is_shared = val && (!strcasecmp (val, "yes") ||
+			      !strcasecmp (val, "on") ||
+			      !strcasecmp (val, "true"));
+	  cupsFreeDests(1, dest);
+	  if (!is_shared) {
+	    debug_printf("Our new queue overwrites the possibly temporary CUPS queue %s, so we need to assure the queue gets permanent.\n",
+			 p->queue_name);
+	    /* We need to modify the printer-is-shared bit twice if we need to
+	       make a temporary queue permanent but not share this queue */
+	    for (i = 0; i <= 1; i ++) {
+	      if (i == 0)
+		debug_printf("Setting printer-is-shared bit to make this queue permanent.\n");
 	      else
-		debug_printf("Unable to create PPD file: %s\n",
-			     ppdgenerator_msg);
-	      p->status = STATUS_DISAPPEARED;
-              current_time = time(NULL);
-	      p->timeout = current_time + TIMEOUT_IMMEDIATELY;
-	      goto cannot_create;
-	    } else {
-	      debug_printf("PPD generation successful: %s\n", ppdgenerator_msg);
-	      debug_printf("Created temporary PPD file: %s\n", buffer);
-	      ppdfile = strdup(buffer);
+		debug_printf("Unsetting printer-is-shared bit.\n");
+	      request = ippNewRequest(CUPS_ADD_MODIFY_PRINTER);
+	      ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
+			   "printer-uri", NULL, uri);
+	      ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME,
+			   "requesting-user-name", NULL, cupsUser());
+	      num_options = 0;
+	      options = NULL;
+	      num_options = cupsAddOption("printer-is-shared",
+					  (i == 0 ? "true" : "false"),
+					  num_options, &options);
+	      num_options = cupsAddOption(CUPS_BROWSED_MARK "-default", "true", num_options, &options);
+	      cupsEncodeOptions2(request, num_options, options,
+				 IPP_TAG_OPERATION);
+	      cupsEncodeOptions2(request, num_options, options, IPP_TAG_PRINTER);
+	      /*
+	       * Do IPP request for printer-is-shared option only when we have
+	       * network printer or if we have remote CUPS queue, do IPP request
+	       * only if we have CUPS older than 2.2.
+	       * When you have remote queue, clean up and break from the loop.
+	       */
+	      if (p->netprinter != 0 || !HAVE_CUPS_2_2 || AllowResharingRemoteCUPSPrinters)
+		ippDelete(cupsDoRequest(http, request, "/admin/"));
+	      else {
+		ippDelete(request);
+		cupsFreeOptions(num_options, options);
+		break;
+	      }
+	      cupsFreeOptions(num_options, options);
+	      if (cupsLastError() > IPP_STATUS_OK_EVENTS_COMPLETE) {
+		debug_printf("Unable change printer-is-shared bit to %s (%s)!\n",
+			     (i == 0 ? "true" : "false"),
+			     cupsLastErrorString());
+		break;
+	      }
+	    }
+	    /* Error on modifying printer-is-shared bit, removing possibly
+	       temporary queue */
+	    if (i <= 1) {
+	      debug_printf("Removing the possibly temporary CUPS queue.\n");
+	      /* Check whether there are still jobs and do not remove the queue
+		 then */
+	      num_jobs = 0;
+	      jobs = NULL;
+	      num_jobs = cupsGetJobs2(http, &jobs, p->queue_name, 0,
+				      CUPS_WHICHJOBS_ACTIVE);
+	      if (num_jobs > 0) { /* there are still jobs */
+		debug_printf("Temporary queue has still jobs or CUPS error, retrying later.\n");
+		cupsFreeJobs(num_jobs, jobs);
+		/* Schedule the removal of the queue for later */
+		if (in_shutdown == 0) {
+		  current_time = time(NULL);
+		  p->timeout = current_time + TIMEOUT_RETRY;
+		  p->no_autosave = 0;
+		}
+		break;
+	      }
+	      /* No jobs, remove the CUPS queue */
+	      request = ippNewRequest(CUPS_DELETE_PRINTER);
+	      ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
+			   "printer-uri", NULL, uri);
+	      ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME,
+			   "requesting-user-name", NULL, cupsUser());
+	      ippDelete(cupsDoRequest(http, request, "/admin/"));
+	      if (cupsLastError() > IPP_STATUS_OK_EVENTS_COMPLETE &&
+		  cupsLastError() != IPP_STATUS_ERROR_NOT_FOUND) {
+		debug_printf("Unable to remove temporary CUPS queue (%s), retrying later\n",
+			     cupsLastErrorString());
+		if (in_shutdown == 0) {
+		  current_time = time(NULL);
+		  p->timeout = current_time + TIMEOUT_RETRY;
+		  p->no_autosave = 0;
+		  break;
+		}
+	      }
 	    }
+	  } else
+	    debug_printf("Creating/Updating permanent CUPS queue %s.\n",
+			 p ->queue_name);
+	} else
+	  debug_printf("Creating permanent CUPS queue %s.\n",
+		       p->queue_name);
+
+	/* If we did not already obtain a PPD file from the temporary CUPS queue
+	   or if we want to use a System V interface script for our IPP network
+	   printer, we proceed here */
+	if (p->netprinter == 1) {
+	  if (p->prattrs == NULL) {
+	    /* Never wait for a remote printer here, get its attributes in
+	       the background and come back when they are there */
+	    debug_printf("No IPP attributes of printer %s (%s), getting them and retrying later.\n",
+			 p->queue_name, p->uri);
+	    free(ppdfile);
+	    printer_attrs_fetch(p, -1);
+	    current_time = time(NULL);
+	    p->timeout = current_time + TIMEOUT_RETRY;
+	    break;
 	  }
-	} else if (IPPPrinterQueueType == PPD_NO) {
-	  ppdfile = NULL;
+	  if (IPPPrinterQueueType == PPD_YES) {
+	    num_cluster_printers = 0;
+	    for (s = (remote_printer_t *)cupsArrayFirst(remote_printers);
+		 s; s = (remote_printer_t *)cupsArrayNext(remote_printers)) {
+	      if (!strcmp(s->queue_name, p->queue_name)) {
+		if (s->status == STATUS_DISAPPEARED ||
+		    s->status == STATUS_UNCONFIRMED ||
+		    s->status == STATUS_TO_BE_RELEASED )
+		  continue;
+		num_cluster_printers ++;
+	      }
+	    }
 
-	  /* Find default page size of the printer */
-	  attr = ippFindAttribute(p->prattrs,
-				  "media-default",
-				  IPP_TAG_ZERO);
-	  if (attr) {
-	    default_page_size = ippGetString(attr, 0, NULL);
-	    debug_printf("Default page size: %s\n",
-			 default_page_size);
-	    p->num_options = cupsAddOption("media-default",
-					   default_page_size,
-					   p->num_options, &(p->options));
-	  } else {
+	    if (num_cluster_printers == 1) {
+	      printer_attributes = p->prattrs;
+	      conflicts = NULL;
+	      default_pagesize = NULL;
+	      default_color = NULL;
+	      make_model = p->make_model;
+	      pdl = p->pdl;
+	      color = p->color;
+	      duplex = p->duplex;
+	      sizes = NULL;
+	    } else {
+	      make_model = (char*)malloc(sizeof(char) * 256);
+	      if ((attr = ippFindAttribute(printer_attributes,
+					   "printer-make-and-model",
+					   IPP_TAG_TEXT)) != NULL)
+		strncpy(make_model, ippGetString(attr, 0, NULL),
+			sizeof(make_model) - 1);
+	      color = 0;
+	      duplex = 0;
+	      for (r = (remote_printer_t *)cupsArrayFirst(remote_printers);
+		   r; r = (remote_printer_t *)cupsArrayNext(remote_printers)) {
+		if (!strcmp(p->queue_name, r->queue_name)) {
+		  if (r->color == 1)
+		    color = 1;
+		  if (r->duplex == 1)
+		    duplex = 1;
+		}
+	      }
+	      default_pagesize = (char *)malloc(sizeof(char)*32);
+	      printer_attributes = get_cluster_attributes(p->queue_name);
+	      debug_printf("Generated Merged Attributes for local queue %s\n",
+			   p->queue_name);
+	      conflicts = generate_cluster_conflicts(p->queue_name,
+						     printer_attributes);
+	      debug_printf("Generated Constraints for queue %s\n",
+			   p->queue_name);
+	      sizes = get_cluster_sizes(p->queue_name);
+	      get_cluster_default_attributes(&printer_attributes,
+					     p->queue_name, default_pagesize,
+					     &default_color);
+	      debug_printf("Generated Default Attributes for local queue %s\n",
+			   p->queue_name);
+	    }
+	    release_string(p->nickname);
+	    p->nickname = NULL;
+	    if (ppdfile == NULL) {
+	      /* If we do not want CUPS-generated PPDs or we cannot obtain a
+		 CUPS-generated PPD, for example if CUPS does not create a 
+		 temporary queue for this printer, we generate a PPD by
+		 ourselves */
+	      printer_ipp_response = (num_cluster_printers == 1) ? p->prattrs :
+		printer_attributes; 
+	      if (!ppdCreateFromIPP2(buffer, sizeof(buffer), printer_ipp_response,
+				     make_model,
+				     pdl, color, duplex, conflicts, sizes,
+				     default_pagesize, default_color)) {
+		if (errno != 0)
+		  debug_printf("Unable to create PPD file: %s\n",
+			       strerror(errno));
+		else
+		  debug_printf("Unable to create PPD file: %s\n",
+			       ppdgenerator_msg);
+		p->status = STATUS_DISAPPEARED;
+		current_time = time(NULL);
+		p->timeout = current_time + TIMEOUT_IMMEDIATELY;
+		goto cannot_create;
+	      } else {
+		debug_printf("PPD generation successful: %s\n", ppdgenerator_msg);
+		debug_printf("Created temporary PPD file: %s\n", buffer);
+		ppdfile = strdup(buffer);
+	      }
+	    }
+	  } else if (IPPPrinterQueueType == PPD_NO) {
+	    ppdfile = NULL;
+
+	    /* Find default page size of the printer */
 	    attr = ippFindAttribute(p->prattrs,
-				    "media-ready",
+				    "media-default",
 				    IPP_TAG_ZERO);
 	    if (attr) {
 	      default_page_size = ippGetString(attr, 0, NULL);
@@ -8139,569 +9662,556 @@ gboolean update_cups_queues(gpointer unused) {
 	      p->num_options = cupsAddOption("media-default",
 					     default_page_size,
 					     p->num_options, &(p->options));
+	    } else {
+	      attr = ippFindAttribute(p->prattrs,
+				      "media-ready",
+				      IPP_TAG_ZERO);
+	      if (attr) {
+		default_page_size = ippGetString(attr, 0, NULL);
+		debug_printf("Default page size: %s\n",
+			     default_page_size);
+		p->num_options = cupsAddOption("media-default",
+					       default_page_size,
+					       p->num_options, &(p->options));
+	      } else
+		debug_printf("No default page size found!\n");
+	    }
+
+	    /* Find maximum unprintable margins of the printer */
+	    if ((attr = ippFindAttribute(p->prattrs,
+					 "media-bottom-margin-supported",
+					 IPP_TAG_INTEGER)) != NULL) {
+	      for (i = 1, bottom = ippGetInteger(attr, 0),
+		     count = ippGetCount(attr);
+		   i < count;
+		   i ++)
+		if (ippGetInteger(attr, i) > bottom)
+		  bottom = ippGetInteger(attr, i);
 	    } else
-	      debug_printf("No default page size found!\n");
-	  }
+	      bottom = 1270;
+	    snprintf(buffer, sizeof(buffer), "%d", bottom);
+	    p->num_options = cupsAddOption("media-bottom-margin-default",
+					   buffer,
+					   p->num_options, &(p->options));
 
-	  /* Find maximum unprintable margins of the printer */
-	  if ((attr = ippFindAttribute(p->prattrs,
-				       "media-bottom-margin-supported",
-				       IPP_TAG_INTEGER)) != NULL) {
-	    for (i = 1, bottom = ippGetInteger(attr, 0),
-		   count = ippGetCount(attr);
-		 i < count;
-		 i ++)
-	      if (ippGetInteger(attr, i) > bottom)
-		bottom = ippGetInteger(attr, i);
-	  } else
-	    bottom = 1270;
-	  snprintf(buffer, sizeof(buffer), "%d", bottom);
-	  p->num_options = cupsAddOption("media-bottom-margin-default",
-					 buffer,
-					 p->num_options, &(p->options));
-
-	  if ((attr = ippFindAttribute(p->prattrs,
-				       "media-left-margin-supported",
-				       IPP_TAG_INTEGER)) != NULL) {
-	    for (i = 1, left = ippGetInteger(attr, 0),
-		   count = ippGetCount(attr);
-		 i < count;
-		 i ++)
-	      if (ippGetInteger(attr, i) > left)
-		left = ippGetInteger(attr, i);
-	  } else
-	    left = 635;
-	  snprintf(buffer, sizeof(buffer), "%d", left);
-	  p->num_options = cupsAddOption("media-left-margin-default",
-					 buffer,
-					 p->num_options, &(p->options));
-
-	  if ((attr = ippFindAttribute(p->prattrs,
-				       "media-right-margin-supported",
-				       IPP_TAG_INTEGER)) != NULL) {
-	    for (i = 1, right = ippGetInteger(attr, 0),
-		   count = ippGetCount(attr);
-		 i < count;
-		 i ++)
-	      if (ippGetInteger(attr, i) > right)
-		right = ippGetInteger(attr, i);
-	  } else
-	    right = 635;
-	  snprintf(buffer, sizeof(buffer), "%d", right);
-	  p->num_options = cupsAddOption("media-right-margin-default",
-					 buffer,
-					 p->num_options, &(p->options));
-
-	  if ((attr = ippFindAttribute(p->prattrs,
-				       "media-top-margin-supported",
-				       IPP_TAG_INTEGER)) != NULL) {
-	    for (i = 1, top = ippGetInteger(attr, 0),
-		   count = ippGetCount(attr);
-		 i < count;
-		 i ++)
-	      if (ippGetInteger(attr, i) > top)
-		top = ippGetInteger(attr, i);
-	  } else
-	    top = 1270;
-	  snprintf(buffer, sizeof(buffer), "%d", top);
-	  p->num_options = cupsAddOption("media-top-margin-default",
-					 buffer,
-					 p->num_options, &(p->options));
-
-	  debug_printf("Margins: Left: %d, Right: %d, Top: %d, Bottom: %d\n",
-		       left, right, top, bottom);
-
-	  /* Find best color space of the printer */
-	  attr = ippFindAttribute(p->prattrs,
-				  "pwg-raster-document-type-supported",
-				  IPP_TAG_ZERO);
-	  if (attr) {
-	    for (i = 0; i < ippGetCount(attr); i ++) {
-	      color_space = ippGetString(attr, i, NULL);
-	      debug_printf("Supported color space: %s\n", color_space);
-	      if (color_space_score(color_space) >
-		  color_space_score(best_color_space))
-		best_color_space = color_space;
-	    }
-	    debug_printf("Best color space: %s\n",
-			 best_color_space);
-	    p->num_options = cupsAddOption("print-color-mode-default",
-					   best_color_space,
+	    if ((attr = ippFindAttribute(p->prattrs,
+					 "media-left-margin-supported",
+					 IPP_TAG_INTEGER)) != NULL) {
+	      for (i = 1, left = ippGetInteger(attr, 0),
+		     count = ippGetCount(attr);
+		   i < count;
+		   i ++)
+		if (ippGetInteger(attr, i) > left)
+		  left = ippGetInteger(attr, i);
+	    } else
+	      left = 635;
+	    snprintf(buffer, sizeof(buffer), "%d", left);
+	    p->num_options = cupsAddOption("media-left-margin-default",
+					   buffer,
 					   p->num_options, &(p->options));
-	  } else {
-	    debug_printf("No info about supported color spaces found!\n");
-	    p->num_options = cupsAddOption("print-color-mode-default",
-					   p->color == 1 ? "rgb" : "black",
+
+	    if ((attr = ippFindAttribute(p->prattrs,
+					 "media-right-margin-supported",
+					 IPP_TAG_INTEGER)) != NULL) {
+	      for (i = 1, right = ippGetInteger(attr, 0),
+		     count = ippGetCount(attr);
+		   i < count;
+		   i ++)
+		if (ippGetInteger(attr, i) > right)
+		  right = ippGetInteger(attr, i);
+	    } else
+	      right = 635;
+	    snprintf(buffer, sizeof(buffer), "%d", right);
+	    p->num_options = cupsAddOption("media-right-margin-default",
+					   buffer,
 					   p->num_options, &(p->options));
-	  }
 
-	  if (p->duplex)
-	    p->num_options = cupsAddOption("sides-default",
-					   "two-sided-long-edge",
+	    if ((attr = ippFindAttribute(p->prattrs,
+					 "media-top-margin-supported",
+					 IPP_TAG_INTEGER)) != NULL) {
+	      for (i = 1, top = ippGetInteger(attr, 0),
+		     count = ippGetCount(attr);
+		   i < count;
+		   i ++)
+		if (ippGetInteger(attr, i) > top)
+		  top = ippGetInteger(attr, i);
+	    } else
+	      top = 1270;
+	    snprintf(buffer, sizeof(buffer), "%d", top);
+	    p->num_options = cupsAddOption("media-top-margin-default",
+					   buffer,
 					   p->num_options, &(p->options));
 
-	  p->num_options = cupsAddOption("output-format-default",
-					 p->pdl,
-					 p->num_options, &(p->options));
-	  p->num_options = cupsAddOption("make-and-model-default",
-					 remove_bad_chars(p->make_model, 0),
-					 p->num_options, &(p->options));
+	    debug_printf("Margins: Left: %d, Right: %d, Top: %d, Bottom: %d\n",
+			 left, right, top, bottom);
 
-	  if ((cups_serverbin = getenv("CUPS_SERVERBIN")) == NULL)
-	    cups_serverbin = CUPS_SERVERBIN;
+	    /* Find best color space of the printer */
+	    attr = ippFindAttribute(p->prattrs,
+				    "pwg-raster-document-type-supported",
+				    IPP_TAG_ZERO);
+	    if (attr) {
+	      for (i = 0; i < ippGetCount(attr); i ++) {
+		color_space = ippGetString(attr, i, NULL);
+		debug_printf("Supported color space: %s\n", color_space);
+		if (color_space_score(color_space) >
+		    color_space_score(best_color_space))
+		  best_color_space = color_space;
+	      }
+	      debug_printf("Best color space: %s\n",
+			   best_color_space);
+	      p->num_options = cupsAddOption("print-color-mode-default",
+					     best_color_space,
+					     p->num_options, &(p->options));
+	    } else {
+	      debug_printf("No info about supported color spaces found!\n");
+	      p->num_options = cupsAddOption("print-color-mode-default",
+					     p->color == 1 ? "rgb" : "black",
+					     p->num_options, &(p->options));
+	    }
 
-	  if ((fd = cupsTempFd(tempfile, sizeof(tempfile))) < 0) {
-	    debug_printf("Unable to create interface script file\n");
-	    p->status = STATUS_DISAPPEARED;
-            current_time = time(NULL);
-	    p->timeout = current_time + TIMEOUT_IMMEDIATELY;
-	    goto cannot_create;
-	  }
+	    if (p->duplex)
+	      p->num_options = cupsAddOption("sides-default",
+					     "two-sided-long-edge",
+					     p->num_options, &(p->options));
 
-	  debug_printf("Creating temp script file \"%s\"\n", tempfile);
-
-	  snprintf(buffer, sizeof(buffer),
-		   "#!/bin/sh\n"
-		   "# System V interface script for printer %s generated by cups-browsed\n"
-		   "\n"
-		   "if [ $# -lt 5 -o $# -gt 6 ]; then\n"
-		   "  echo \"ERROR: $0 job-id user title copies options [file]\" >&2\n"
-		   "  exit 1\n"
-		   "fi\n"
-		   "\n"
-		   "# Read from given file\n"
-		   "if [ -n \"$6\" ]; then\n"
-		   "  exec \"$0\" \"$1\" \"$2\" \"$3\" \"$4\" \"$5\" < \"$6\"\n"
-		   "fi\n"
-		   "\n"
-		   "%s/filter/sys5ippprinter \"$1\" \"$2\" \"$3\" \"$4\" \"$5\"\n",
-		   p->queue_name, cups_serverbin);
-
-	  bytes = write(fd, buffer, strlen(buffer));
-	  if (bytes != strlen(buffer)) {
-	    debug_printf("Unable to write interface script into the file\n");
-	    p->status = STATUS_DISAPPEARED;
-            current_time = time(NULL);
-	    p->timeout = current_time + TIMEOUT_IMMEDIATELY;
-	    goto cannot_create;
-	  }
+	    p->num_options = cupsAddOption("output-format-default",
+					   p->pdl,
+					   p->num_options, &(p->options));
+	    p->num_options = cupsAddOption("make-and-model-default",
+					   remove_bad_chars(p->make_model, 0),
+					   p->num_options, &(p->options));
 
-	  close(fd);
+	    if ((cups_serverbin = getenv("CUPS_SERVERBIN")) == NULL)
+	      cups_serverbin = CUPS_SERVERBIN;
 
-	  ifscript = strdup(tempfile);
+	    if ((fd = cupsTempFd(tempfile, sizeof(tempfile))) < 0) {
+	      debug_printf("Unable to create interface script file\n");
+	      p->status = STATUS_DISAPPEARED;
+	      current_time = time(NULL);
+	      p->timeout = current_time + TIMEOUT_IMMEDIATELY;
+	      goto cannot_create;
+	    }
+
+	    debug_printf("Creating temp script file \"%s\"\n", tempfile);
+
+	    snprintf(buffer, sizeof(buffer),
+		     "#!/bin/sh\n"
+		     "# System V interface script for printer %s generated by cups-browsed\n"
+		     "\n"
+		     "if [ $# -lt 5 -o $# -gt 6 ]; then\n"
+		     "  echo \"ERROR: $0 job-id user title copies options [file]\" >&2\n"
+		     "  exit 1\n"
+		     "fi\n"
+		     "\n"
+		     "# Read from given file\n"
+		     "if [ -n \"$6\" ]; then\n"
+		     "  exec \"$0\" \"$1\" \"$2\" \"$3\" \"$4\" \"$5\" < \"$6\"\n"
+		     "fi\n"
+		     "\n"
+		     "%s/filter/sys5ippprinter \"$1\" \"$2\" \"$3\" \"$4\" \"$5\"\n",
+		     p->queue_name, cups_serverbin);
+
+	    bytes = write(fd, buffer, strlen(buffer));
+	    if (bytes != strlen(buffer)) {
+	      debug_printf("Unable to write interface script into the file\n");
+	      p->status = STATUS_DISAPPEARED;
+	      current_time = time(NULL);
+	      p->timeout = current_time + TIMEOUT_IMMEDIATELY;
+	      goto cannot_create;
+	    }
+
+	    close(fd);
+
+	    ifscript = strdup(tempfile);
+	  }
 	}
-      }
 #endif /* HAVE_CUPS_1_6 */
 
-      /* Do we have default option settings in cups-browsed.conf? */
-      if (DefaultOptions) {
-	debug_printf("Applying default option settings to printer %s: %s\n",
-		     p->queue_name, DefaultOptions);
-	p->num_options = cupsParseOptions(DefaultOptions, p->num_options,
-					  &p->options);
-      }
-
-      /* Loading saved option settings from last session */
-      p->num_options = load_printer_options(p->queue_name, p->num_options,
+	/* Do we have default option settings in cups-browsed.conf? */
+	if (DefaultOptions) {
+	  debug_printf("Applying default option settings to printer %s: %s\n",
+		       p->queue_name, DefaultOptions);
+	  p->num_options = cupsParseOptions(DefaultOptions, p->num_options,
 					    &p->options);
+	}
+
+	/* Loading saved option settings from last session */
+	p->num_options = load_printer_options(p->queue_name, p->num_options,
+					      &p->options);
+
+	/* Determine whether we have an IPP network printer. If not we
+	   have remote CUPS queue(s) and so we use an implicit class for
+	   load balancing. In this case we will assign an
+	   implicitclass://...  device URI, which makes cups-browsed find
+	   the best destination for each job. */
+	loadedppd = NULL;
+	if (cups_notifier != NULL && p->netprinter == 0) {
+	  /* We are not an IPP network printer, so we use the device URI
+	     implicitclass://<queue name>/
+	     We use the httpAssembleURI() function here, to percent-encode
+	     the queue name in the URI, so that any allowed character in
+	     a queue name, especially the '@' when we add the server name
+	     to a remote queue's name, goes safely into the URI.
+	     The implicitclass backend uses httpSeparateURI() to decode the
+	     queue name.
+	     We never use the implicitclass backend if we do not have D-Bus
+	     notification from CUPS as we cannot assign a destination printer
+	     to an incoming job then. */
+	  httpAssembleURI(HTTP_URI_CODING_ALL, device_uri, sizeof(device_uri),
+			  "implicitclass", NULL, p->queue_name, 0, NULL);
+	  debug_printf("Print queue %s is for remote CUPS queue(s) and we get notifications from CUPS, using implicit class device URI %s\n",
+		       p->queue_name, device_uri);
+	  if (!ppdfile && !ifscript) {
+	    /* Having another backend than the CUPS "ipp" backend the
+	       options from the PPD of the queue on the server are not
+	       automatically used on the client any more, so we have to
+	       explicitly load the PPD from one of the servers, apply it
+	       to our local queue, and replace its "*cupsFilter(2): ..."
+	       lines by one line making the print data get passed through
+	       to the server without filtering on the client (where not
+	       necessarily the right filters/drivers are installed) so
+	       that it gets filtered on the server. In addition, we prefix
+	       the PPD's NickName, so that automatic PPD updating by the
+	       distribution's package installation/update infrastructure
+	       is suppressed. */
+	    /* Generating the ppd file for the remote cups queue */
+	    if (p->prattrs == NULL) {
+	      /* Never wait for a remote server here, get the attributes in
+		 the background and come back when they are there */
+	      debug_printf("No IPP attributes of printer %s (%s), getting them and retrying later.\n",
+			   p->queue_name, p->uri);
+	      printer_attrs_fetch(p, -1);
+	      current_time = time(NULL);
+	      p->timeout = current_time + TIMEOUT_RETRY;
+	      break;
+	    }
+	    release_string(p->nickname);
+	    p->nickname = NULL;
+	    num_cluster_printers = 0;
+	    for (s = (remote_printer_t *)cupsArrayFirst(remote_printers);
+		 s; s = (remote_printer_t *)cupsArrayNext(remote_printers)) {
+	      if (!strcmp(s->queue_name, p->queue_name)) {
+		if (s->status == STATUS_DISAPPEARED ||
+		    s->status == STATUS_UNCONFIRMED ||
+		    s->status == STATUS_TO_BE_RELEASED )
+		  continue;
+		num_cluster_printers++;
+	      }
+	    }
+	    if (num_cluster_printers == 1) {
+	      printer_attributes = p->prattrs;
+	      conflicts = NULL;
+	      default_pagesize = NULL;
+	      default_color = NULL;
+	      make_model = p->make_model;
+	      pdl = p->pdl;
+	      color = p->color;
+	      duplex = p->duplex;
+	      sizes = NULL;
+	    } else {
+	      make_model = (char*)malloc(sizeof(char)*256);
+	      if((attr = ippFindAttribute(printer_attributes,
+					  "printer-make-and-model",
+					  IPP_TAG_TEXT)) != NULL)
+		strncpy(make_model, ippGetString(attr, 0, NULL),
+			sizeof(make_model) - 1);
+	      color = 0;
+	      duplex = 0;
+	      for (r = (remote_printer_t *)cupsArrayFirst(remote_printers);
+		   r; r = (remote_printer_t *)cupsArrayNext(remote_printers)) {
+		if (!strcmp(p->queue_name, r->queue_name)) {
+		  if (r->color == 1)
+		    color = 1;
+		  if (r->duplex == 1)
+		    duplex = 1;
+		}
+	      }
+	      default_pagesize = (char *)malloc(sizeof(char)*32);
+	      printer_attributes = get_cluster_attributes(p->queue_name);
+	      debug_printf("Generated Merged Attributes for local queue %s\n",
+			   p->queue_name);
+	      conflicts = generate_cluster_conflicts(p->queue_name,
+						     printer_attributes);
+	      debug_printf("Generated Constraints for queue %s\n",p->queue_name);
+	      sizes = get_cluster_sizes(p->queue_name);
+	      get_cluster_default_attributes(&printer_attributes, p->queue_name,
+					     default_pagesize,&default_color);
+	      debug_printf("Generated Default Attributes for local queue %s\n",
+			   p->queue_name);
+	    }
+	    if (ppdfile == NULL) {
+	      /* If we do not want CUPS-generated PPDs or we cannot obtain a
+		 CUPS-generated PPD, for example if CUPS does not create a
+		 temporary queue for this printer, we generate a PPD by
+		 ourselves */
+	      printer_ipp_response = (num_cluster_printers == 1) ? p->prattrs :
+		printer_attributes;
+	      if (!ppdCreateFromIPP2(buffer, sizeof(buffer), printer_ipp_response,
+				     make_model,
+				     pdl, color, duplex, conflicts, sizes,
+				     default_pagesize, default_color)) {
+		if (errno != 0)
+		  debug_printf("Unable to create PPD file: %s\n",
+			       strerror(errno));
+		else
+		  debug_printf("Unable to create PPD file: %s\n", ppdgenerator_msg);
+		p->status = STATUS_DISAPPEARED;
+		current_time = time(NULL);
+		p->timeout = current_time + TIMEOUT_IMMEDIATELY;
+		goto cannot_create;
+	      } else {
+		debug_printf("PPD generation successful: %s\n", ppdgenerator_msg);
+		debug_printf("Created temporary PPD file: %s\n", buffer);
+		ppdfile = strdup(buffer);
+	      }
+	    }
+	  }
+	} else {
+	  /* Device URI: using implicitclass backend for IPP network printer */
+	  httpAssembleURI(HTTP_URI_CODING_ALL, device_uri, sizeof(device_uri),
+			  "implicitclass", NULL, p->queue_name, 0, NULL);
+	  if (strlen(device_uri) > HTTP_MAX_URI-1)
+	    device_uri[HTTP_MAX_URI-1] = '\0';
+	  debug_printf("Print queue %s is for an IPP network printer, using implicitclass backend for the printer: %s\n",
+		       p->queue_name, device_uri);
+	}
 
-      /* Determine whether we have an IPP network printer. If not we
-	 have remote CUPS queue(s) and so we use an implicit class for
-	 load balancing. In this case we will assign an
-	 implicitclass://...  device URI, which makes cups-browsed find
-	 the best destination for each job. */
-      loadedppd = NULL;
-      if (cups_notifier != NULL && p->netprinter == 0) {
-	/* We are not an IPP network printer, so we use the device URI
-	   implicitclass://<queue name>/
-	   We use the httpAssembleURI() function here, to percent-encode
-	   the queue name in the URI, so that any allowed character in
-	   a queue name, especially the '@' when we add the server name
-	   to a remote queue's name, goes safely into the URI.
-	   The implicitclass backend uses httpSeparateURI() to decode the
-	   queue name.
-	   We never use the implicitclass backend if we do not have D-Bus
-	   notification from CUPS as we cannot assign a destination printer
-	   to an incoming job then. */
-	httpAssembleURI(HTTP_URI_CODING_ALL, device_uri, sizeof(device_uri),
-			"implicitclass", NULL, p->queue_name, 0, NULL);
-	debug_printf("Print queue %s is for remote CUPS queue(s) and we get notifications from CUPS, using implicit class device URI %s\n",
-		     p->queue_name, device_uri);
-	if (!ppdfile && !ifscript) {
-	  /* Having another backend than the CUPS "ipp" backend the
-	     options from the PPD of the queue on the server are not
-	     automatically used on the client any more, so we have to
-	     explicitly load the PPD from one of the servers, apply it
-	     to our local queue, and replace its "*cupsFilter(2): ..."
-	     lines by one line making the print data get passed through
-	     to the server without filtering on the client (where not
-	     necessarily the right filters/drivers are installed) so
-	     that it gets filtered on the server. In addition, we prefix
-	     the PPD's NickName, so that automatic PPD updating by the
-	     distribution's package installation/update infrastructure
-	     is suppressed. */
-	  /* Generating the ppd file for the remote cups queue */
-	  if (p->prattrs == NULL) {
-	    p->prattrs = get_printer_attributes(p->uri, NULL, 0, NULL, 0, 1);
-	    debug_log_out(get_printer_attributes_log);
+	/* PPD readily available */
+	p->ppd_options_valid = 0;
+	if (ppdfile) {
+	  debug_printf("Using PPD %s for queue %s.\n",
+		       ppdfile, p->queue_name);
+	  loadedppd = ppdfile;
+	}
+	if (loadedppd) {
+	  if ((ppd = ppdOpenFile(loadedppd)) == NULL) {
+	    int linenum; /* Line number of error */
+	    ppd_status_t status = ppdLastError(&linenum);
+	    debug_printf("Unable to open PPD \"%s\": %s on line %d.",
+			 loadedppd, ppdErrorString(status), linenum);
+	    current_time = time(NULL);
+	    p->timeout = current_time + TIMEOUT_RETRY;
+	    p->no_autosave = 0;
+	    unlink(loadedppd);
+	    break;
 	  }
-	  if (p->prattrs == NULL) {
-	    debug_printf("get-printer-attributes IPP call failed on printer %s (%s).\n",
-			 p->queue_name, p->uri);
-	    goto cannot_create;
+	  ppdMarkDefaults(ppd);
+	  ppdMarkOptions(ppd, p->num_options, p->options);
+	  if ((out = cupsTempFile2(buf, sizeof(buf))) == NULL) {
+	    debug_printf("Unable to create temporary file!\n");
+	    current_time = time(NULL);
+	    p->timeout = current_time + TIMEOUT_RETRY;
+	    p->no_autosave = 0;
+	    ppdClose(ppd);
+	    ppd = NULL;
+	    unlink(loadedppd);
+	    break;
 	  }
-	  p->nickname = NULL;
-	  num_cluster_printers = 0;
-	  for (s = (remote_printer_t *)cupsArrayFirst(remote_printers);
-	       s; s = (remote_printer_t *)cupsArrayNext(remote_printers)) {
-	    if (!strcmp(s->queue_name, p->queue_name)) {
-	      if (s->status == STATUS_DISAPPEARED ||
-		  s->status == STATUS_UNCONFIRMED ||
-		  s->status == STATUS_TO_BE_RELEASED )
-		continue;
-	      num_cluster_printers++;
-	    }
+	  if ((in = cupsFileOpen(loadedppd, "r")) == NULL) {
+	    debug_printf("Unable to open the downloaded PPD file!\n");
+	    current_time = time(NULL);
+	    p->timeout = current_time + TIMEOUT_RETRY;
+	    p->no_autosave = 0;
+	    cupsFileClose(out);
+	    ppdClose(ppd);
+	    ppd = NULL;
+	    unlink(loadedppd);
+	    break;
 	  }
-	  if (num_cluster_printers == 1) {
-	    printer_attributes = p->prattrs;
-	    conflicts = NULL;
-	    default_pagesize = NULL;
-	    default_color = NULL;
-	    make_model = p->make_model;
-	    pdl = p->pdl;
-	    color = p->color;
-	    duplex = p->duplex;
-	    sizes = NULL;
-	  } else {
-	    make_model = (char*)malloc(sizeof(char)*256);
-	    if((attr = ippFindAttribute(printer_attributes,
-					"printer-make-and-model",
-					IPP_TAG_TEXT)) != NULL)
-	      strncpy(make_model, ippGetString(attr, 0, NULL),
-		      sizeof(make_model) - 1);
-	    color = 0;
-	    duplex = 0;
-	    for (r = (remote_printer_t *)cupsArrayFirst(remote_printers);
-		 r; r = (remote_printer_t *)cupsArrayNext(remote_printers)) {
-	      if (!strcmp(p->queue_name, r->queue_name)) {
-		if (r->color == 1)
-		  color = 1;
-		if (r->duplex == 1)
-		  duplex = 1;
+	  debug_printf("Editing PPD file %s for printer %s, setting the option defaults of the previous cups-browsed session%s, saving the resulting PPD in %s.\n",
+		       loadedppd, p->queue_name,
+		       " and doing client-side filtering of the job" ,
+		       buf);
+	  ap_remote_queue_id_line_inserted = 0;
+	  while (cupsFileGets(in, line, sizeof(line))) {
+	    if (!strncmp(line, "*Default", 8)) {
+	      strncpy(keyword, line + 8, sizeof(keyword) - 1);
+	      if ((strlen(line) + 8) > 1023)
+		keyword[1023] = '\0';
+	      for (keyptr = keyword; *keyptr; keyptr ++)
+		if (*keyptr == ':' || isspace(*keyptr & 255))
+		  break;
+	      *keyptr++ = '\0';
+	      while (isspace(*keyptr & 255))
+		keyptr ++;
+	      if (!strcmp(keyword, "PageRegion") ||
+		  !strcmp(keyword, "PageSize") ||
+		  !strcmp(keyword, "PaperDimension") ||
+		  !strcmp(keyword, "ImageableArea")) {
+		if ((choice = ppdFindMarkedChoice(ppd, "PageSize")) == NULL)
+		  choice = ppdFindMarkedChoice(ppd, "PageRegion");
+	      } else
+		choice = ppdFindMarkedChoice(ppd, keyword);
+	      if (choice && strcmp(choice->choice, keyptr)) {
+		if (strcmp(choice->choice, "Custom"))
+		  cupsFilePrintf(out, "*Default%s: %s\n", keyword,
+				 choice->choice);
+		else if ((customval = cupsGetOption(keyword, p->num_options,
+						    p->options)) != NULL)
+		  cupsFilePrintf(out, "*Default%s: %s\n", keyword, customval);
+		else
+		  cupsFilePrintf(out, "%s\n", line);
+	      } else
+		cupsFilePrintf(out, "%s\n", line);
+	    } else if (strncmp(line, "*End", 4)) {
+	      /* Write an "APRemoteQueueID" line to make this queue marked
+		 as remote printer by CUPS */
+	      if (p->netprinter == 0 &&
+		  strncmp(line, "*%", 2) &&
+		  strncmp(line, "*PPD-Adobe:", 11) &&
+		  ap_remote_queue_id_line_inserted == 0 &&
+		!AllowResharingRemoteCUPSPrinters) {
+		ap_remote_queue_id_line_inserted = 1;
+		cupsFilePrintf(out, "*APRemoteQueueID: \"\"\n");
 	      }
+	      /* Simply write out the line as we read it */
+	      cupsFilePrintf(out, "%s\n", line);
 	    }
-	    default_pagesize = (char *)malloc(sizeof(char)*32);
-	    printer_attributes = get_cluster_attributes(p->queue_name);
-	    debug_printf("Generated Merged Attributes for local queue %s\n",
-			 p->queue_name);
-	    conflicts = generate_cluster_conflicts(p->queue_name,
-						   printer_attributes);
-	    debug_printf("Generated Constraints for queue %s\n",p->queue_name);
-	    sizes = get_cluster_sizes(p->queue_name);
-	    get_cluster_default_attributes(&printer_attributes, p->queue_name,
-					   default_pagesize,&default_color);
-	    debug_printf("Generated Default Attributes for local queue %s\n",
-			 p->queue_name);
-	  }
-	  if (ppdfile == NULL) {
-	    /* If we do not want CUPS-generated PPDs or we cannot obtain a
-	       CUPS-generated PPD, for example if CUPS does not create a
-	       temporary queue for this printer, we generate a PPD by
-	       ourselves */
-	    printer_ipp_response = (num_cluster_printers == 1) ? p->prattrs :
-	      printer_attributes;
-	    if (!ppdCreateFromIPP2(buffer, sizeof(buffer), printer_ipp_response,
-				   make_model,
-				   pdl, color, duplex, conflicts, sizes,
-				   default_pagesize, default_color)) {
-	      if (errno != 0)
-		debug_printf("Unable to create PPD file: %s\n",
-			     strerror(errno));
-	      else
-		debug_printf("Unable to create PPD file: %s\n", ppdgenerator_msg);
-	      p->status = STATUS_DISAPPEARED;
-	      current_time = time(NULL);
-	      p->timeout = current_time + TIMEOUT_IMMEDIATELY;
-	      goto cannot_create;
-	    } else {
-	      debug_printf("PPD generation successful: %s\n", ppdgenerator_msg);
-	      debug_printf("Created temporary PPD file: %s\n", buffer);
-	      ppdfile = strdup(buffer);
+	    /* Save the NickName of the PPD to check whether external
+	       manipulations of the print queue have replaced the PPD */
+	    if (!strncmp(line, "*NickName:", 10)) {
+	      ptr = strchr(line, '"');
+	      if (ptr) {
+		ptr ++;
+		ptr[strcspn(ptr, "\"")] = '\0';
+		release_string(p->nickname);
+		p->nickname = intern_string(ptr);
+	      }
 	    }
 	  }
-	}
-      } else {
-	/* Device URI: using implicitclass backend for IPP network printer */
-	httpAssembleURI(HTTP_URI_CODING_ALL, device_uri, sizeof(device_uri),
-			"implicitclass", NULL, p->queue_name, 0, NULL);
-	if (strlen(device_uri) > HTTP_MAX_URI-1)
-	  device_uri[HTTP_MAX_URI-1] = '\0';
-	debug_printf("Print queue %s is for an IPP network printer, using implicitclass backend for the printer: %s\n",
-		     p->queue_name, device_uri);
-      }
-
-      /* PPD readily available */
-      if (ppdfile) {
-	debug_printf("Using PPD %s for queue %s.\n",
-		     ppdfile, p->queue_name);
-	loadedppd = ppdfile;
-      }
-      if (loadedppd) {
-	if ((ppd = ppdOpenFile(loadedppd)) == NULL) {
-	  int linenum; /* Line number of error */
-	  ppd_status_t status = ppdLastError(&linenum);
-	  debug_printf("Unable to open PPD \"%s\": %s on line %d.",
-		       loadedppd, ppdErrorString(status), linenum);
-          current_time = time(NULL);
-	  p->timeout = current_time + TIMEOUT_RETRY;
-	  p->no_autosave = 0;
-	  unlink(loadedppd);
-	  break;
-	}
-	ppdMarkDefaults(ppd);
-	ppdMarkOptions(ppd, p->num_options, p->options);
-	if ((out = cupsTempFile2(buf, sizeof(buf))) == NULL) {
-	  debug_printf("Unable to create temporary file!\n");
-          current_time = time(NULL);
-	  p->timeout = current_time + TIMEOUT_RETRY;
-	  p->no_autosave = 0;
-	  ppdClose(ppd);
-          ppd = NULL;
-	  unlink(loadedppd);
-	  break;
-	}
-	if ((in = cupsFileOpen(loadedppd, "r")) == NULL) {
-	  debug_printf("Unable to open the downloaded PPD file!\n");
-          current_time = time(NULL);
-	  p->timeout = current_time + TIMEOUT_RETRY;
-	  p->no_autosave = 0;
+	  cupsFilePrintf(out,"*cupsFilter2: \"application/vnd.cups-pdf application/pdf 0 -\"\n");
+
+	  /* Remember the option defaults which we have written into the
+	     PPD, so that record_printer_options() does not need to download
+	     and parse it again */
+	  cupsFreeOptions(p->num_ppd_options, p->ppd_options);
+	  p->num_ppd_options = 0;
+	  p->ppd_options = NULL;
+	  for (ppd_opt = ppdFirstOption(ppd); ppd_opt;
+	       ppd_opt = ppdNextOption(ppd)) {
+	    if (!strcasecmp(ppd_opt->keyword, "PageRegion"))
+	      continue;
+	    choice = ppdFindMarkedChoice(ppd, ppd_opt->keyword);
+	    if (choice && strcmp(choice->choice, "Custom"))
+	      val = choice->choice;
+	    else if (choice &&
+		     (customval = cupsGetOption(ppd_opt->keyword,
+						p->num_options,
+						p->options)) != NULL)
+	      val = customval;
+	    else
+	      val = ppd_opt->defchoice;
+	    p->num_ppd_options = cupsAddOption(ppd_opt->keyword, val,
+					       p->num_ppd_options,
+					       &(p->ppd_options));
+	  }
+	  p->ppd_options_valid = 1;
+
+	  cupsFileClose(in);
 	  cupsFileClose(out);
 	  ppdClose(ppd);
-          ppd = NULL;
+	  ppd = NULL;
 	  unlink(loadedppd);
-	  break;
-	}
-	debug_printf("Editing PPD file %s for printer %s, setting the option defaults of the previous cups-browsed session%s, saving the resulting PPD in %s.\n",
-		     loadedppd, p->queue_name,
-		     " and doing client-side filtering of the job" ,
-		     buf);
-	ap_remote_queue_id_line_inserted = 0;
-	while (cupsFileGets(in, line, sizeof(line))) {
-	  if (!strncmp(line, "*Default", 8)) {
-	    strncpy(keyword, line + 8, sizeof(keyword) - 1);
-	    if ((strlen(line) + 8) > 1023)
-	      keyword[1023] = '\0';
-	    for (keyptr = keyword; *keyptr; keyptr ++)
-	      if (*keyptr == ':' || isspace(*keyptr & 255))
-		break;
-	    *keyptr++ = '\0';
-	    while (isspace(*keyptr & 255))
-	      keyptr ++;
-	    if (!strcmp(keyword, "PageRegion") ||
-		!strcmp(keyword, "PageSize") ||
-		!strcmp(keyword, "PaperDimension") ||
-		!strcmp(keyword, "ImageableArea")) {
-	      if ((choice = ppdFindMarkedChoice(ppd, "PageSize")) == NULL)
-		choice = ppdFindMarkedChoice(ppd, "PageRegion");
-	    } else
-	      choice = ppdFindMarkedChoice(ppd, keyword);
-	    if (choice && strcmp(choice->choice, keyptr)) {
-	      if (strcmp(choice->choice, "Custom"))
-		cupsFilePrintf(out, "*Default%s: %s\n", keyword,
-			       choice->choice);
-	      else if ((customval = cupsGetOption(keyword, p->num_options,
-						  p->options)) != NULL)
-		cupsFilePrintf(out, "*Default%s: %s\n", keyword, customval);
-	      else
-		cupsFilePrintf(out, "%s\n", line);
-	    } else
-	      cupsFilePrintf(out, "%s\n", line);
-	  } else if (strncmp(line, "*End", 4)) {
-	    /* Write an "APRemoteQueueID" line to make this queue marked
-	       as remote printer by CUPS */
-	    if (p->netprinter == 0 &&
-		strncmp(line, "*%", 2) &&
-		strncmp(line, "*PPD-Adobe:", 11) &&
-		ap_remote_queue_id_line_inserted == 0 &&
-              !AllowResharingRemoteCUPSPrinters) {
-	      ap_remote_queue_id_line_inserted = 1;
-	      cupsFilePrintf(out, "*APRemoteQueueID: \"\"\n");
-	    }
-	    /* Simply write out the line as we read it */
-	    cupsFilePrintf(out, "%s\n", line);
-	  }
-	  /* Save the NickName of the PPD to check whether external
-	     manipulations of the print queue have replaced the PPD */
-	  if (!strncmp(line, "*NickName:", 10)) {
-	    ptr = strchr(line, '"');
-	    if (ptr) {
-	      ptr ++;
-	      p->nickname = strdup(ptr);
-	      ptr = strchr(p->nickname, '"');
-	      if (ptr)
-		*ptr = '\0';
-	    }
+	  loadedppd = NULL;
+	  if (ppdfile)
+	  {
+	    free(ppdfile);
+	    ppdfile = NULL;
 	  }
+	  ppdfile = strdup(buf);
 	}
-	cupsFilePrintf(out,"*cupsFilter2: \"application/vnd.cups-pdf application/pdf 0 -\"\n");
-
-	cupsFileClose(in);
-	cupsFileClose(out);
-	ppdClose(ppd);
-        ppd = NULL;
-	unlink(loadedppd);
-	loadedppd = NULL;
-	if (ppdfile)
-        {
-	  free(ppdfile);
-          ppdfile = NULL;
-        }
-	ppdfile = strdup(buf);
-      }
 
-      /* Create a new CUPS queue or modify the existing queue */
-      request = ippNewRequest(CUPS_ADD_MODIFY_PRINTER);
-      ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
-		   "printer-uri", NULL, uri);
-      /* Default user */
-      ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME,
-		   "requesting-user-name", NULL, cupsUser());
-      /* Queue should be enabled ... */
-      ippAddInteger(request, IPP_TAG_PRINTER, IPP_TAG_ENUM, "printer-state",
-		    IPP_PRINTER_IDLE);
-      /* ... and accepting jobs */
-      ippAddBoolean(request, IPP_TAG_PRINTER, "printer-is-accepting-jobs", 1);
-      /* Location */
-      ippAddString(request, IPP_TAG_PRINTER, IPP_TAG_TEXT,
-		   "printer-location", NULL, p->location);
-      num_options = 0;
-      options = NULL;
-      /* Device URI: ipp(s)://<remote host>:631/printers/<remote queue>
-         OR          implicitclass://<queue name>/ */
-      num_options = cupsAddOption("device-uri", device_uri,
-				  num_options, &options);
-      /* Option cups-browsed=true, marking that we have created this queue */
-      num_options = cupsAddOption(CUPS_BROWSED_MARK "-default", "true",
-				  num_options, &options);
-      /* Description */
-      num_options = cupsAddOption("printer-info", p->info,
-				  num_options, &options);
+	/* Create a new CUPS queue or modify the existing queue */
+	request = ippNewRequest(CUPS_ADD_MODIFY_PRINTER);
+	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
+		     "printer-uri", NULL, uri);
+	/* Default user */
+	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME,
+		     "requesting-user-name", NULL, cupsUser());
+	/* Queue should be enabled ... */
+	ippAddInteger(request, IPP_TAG_PRINTER, IPP_TAG_ENUM, "printer-state",
+		      IPP_PRINTER_IDLE);
+	/* ... and accepting jobs */
+	ippAddBoolean(request, IPP_TAG_PRINTER, "printer-is-accepting-jobs", 1);
+	/* Location */
+	ippAddString(request, IPP_TAG_PRINTER, IPP_TAG_TEXT,
+		     "printer-location", NULL, p->location);
+	num_options = 0;
+	options = NULL;
+	/* Device URI: ipp(s)://<remote host>:631/printers/<remote queue>
+	   OR          implicitclass://<queue name>/ */
+	num_options = cupsAddOption("device-uri", device_uri,
+				    num_options, &options);
+	/* Option cups-browsed=true, marking that we have created this queue */
+	num_options = cupsAddOption(CUPS_BROWSED_MARK "-default", "true",
+				    num_options, &options);
+	/* Description */
+	num_options = cupsAddOption("printer-info", p->info,
+				    num_options, &options);
 
-      /* Default option settings from printer entry */
-      for (i = 0; i < p->num_options; i ++)
-	if (strcasecmp(p->options[i].name, "printer-is-shared"))
-	  num_options = cupsAddOption(p->options[i].name,
-				      p->options[i].value,
-				      num_options, &options);
-      /* Encode option list into IPP attributes */
-      cupsEncodeOptions2(request, num_options, options, IPP_TAG_OPERATION);
-      cupsEncodeOptions2(request, num_options, options, IPP_TAG_PRINTER);
-      /* Do it */
-      if (ppdfile) {
-	debug_printf("Non-raw queue %s with PPD file: %s\n", p->queue_name, ppdfile);
-	ippDelete(cupsDoFileRequest(http, request, "/admin/", ppdfile));
-	want_raw = 0;
-	unlink(ppdfile);
-	free(ppdfile);
-	ppdfile = NULL;
-      } else if (ifscript) {
-	debug_printf("Non-raw queue %s with interface script: %s\n", p->queue_name, ifscript);
-	ippDelete(cupsDoFileRequest(http, request, "/admin/", ifscript));
-	want_raw = 0;
-	unlink(ifscript);
-	free(ifscript);
-	ifscript = NULL;
-      } else {
-	if (p->netprinter == 0) {
-	  debug_printf("Raw queue %s\n", p->queue_name);
-	  want_raw = 1;
-	} else {
-	  debug_printf("Queue %s keeping its current PPD file/interface script\n", p->queue_name);
+	/* Default option settings from printer entry */
+	for (i = 0; i < p->num_options; i ++)
+	  if (strcasecmp(p->options[i].name, "printer-is-shared"))
+	    num_options = cupsAddOption(p->options[i].name,
+					p->options[i].value,
+					num_options, &options);
+	/* Encode option list into IPP attributes */
+	cupsEncodeOptions2(request, num_options, options, IPP_TAG_OPERATION);
+	cupsEncodeOptions2(request, num_options, options, IPP_TAG_PRINTER);
+	/* Do it */
+	if (ppdfile) {
+	  debug_printf("Non-raw queue %s with PPD file: %s\n", p->queue_name, ppdfile);
+	  ippDelete(cupsDoFileRequest(http, request, "/admin/", ppdfile));
+	  want_raw = 0;
+	  unlink(ppdfile);
+	  free(ppdfile);
+	  ppdfile = NULL;
+	} else if (ifscript) {
+	  debug_printf("Non-raw queue %s with interface script: %s\n", p->queue_name, ifscript);
+	  ippDelete(cupsDoFileRequest(http, request, "/admin/", ifscript));
 	  want_raw = 0;
+	  unlink(ifscript);
+	  free(ifscript);
+	  ifscript = NULL;
+	} else {
+	  if (p->netprinter == 0) {
+	    debug_printf("Raw queue %s\n", p->queue_name);
+	    want_raw = 1;
+	  } else {
+	    debug_printf("Queue %s keeping its current PPD file/interface script\n", p->queue_name);
+	    want_raw = 0;
+	  }
+	  ippDelete(cupsDoRequest(http, request, "/admin/"));
 	}
-	ippDelete(cupsDoRequest(http, request, "/admin/"));
-      }
-      cupsFreeOptions(num_options, options);
-      cups_queues_updated ++;
-
-      if (cupsLastError() > IPP_STATUS_OK_EVENTS_COMPLETE) {
-	debug_printf("Unable to create/modify CUPS queue (%s)!\n",
-		     cupsLastErrorString());
-        current_time = time(NULL);
-	p->timeout = current_time + TIMEOUT_RETRY;
-	p->no_autosave = 0;
-	break;
-      }
-
-      /* Do not share a queue which serves only to point to a remote CUPS
-	 printer
+	cupsFreeOptions(num_options, options);
+	cups_queues_updated ++;
 
-	 We do this in a seperate IPP request as on newer CUPS versions we
-         get an error when changing the printer-is-shared bit on a queue
-         pointing to a remote CUPS printer, this way we assure all other
-	 settings be applied amd when setting the printer-is-shared to
-         false amd this errors, we can safely ignore the error as on queues
-	 pointing to remote CUPS printers the bit is set to false by default
-	 (these printers are never shared)
+	if (cupsLastError() > IPP_STATUS_OK_EVENTS_COMPLETE) {
+	  debug_printf("Unable to create/modify CUPS queue (%s)!\n",
+		       cupsLastErrorString());
+	  current_time = time(NULL);
+	  p->timeout = current_time + TIMEOUT_RETRY;
+	  p->no_autosave = 0;
+	  break;
+	}
 
-	 If our printer is an IPP network printer and not a CUPS queue, we
-         keep track of whether the user has changed the printer-is-shared
-         bit and recover this setting. The default setting for a new
-         queue is configurable via the NewIPPPrinterQueuesShared directive
-         in cups-browsed.conf */
+	/* Do not share a queue which serves only to point to a remote CUPS
+	   printer
 
-      request = ippNewRequest(CUPS_ADD_MODIFY_PRINTER);
-      ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
-		   "printer-uri", NULL, uri);
-      ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME,
-		   "requesting-user-name", NULL, cupsUser());
-      num_options = 0;
-      options = NULL;
-      if (p->netprinter == 1 &&
-	  (val = cupsGetOption("printer-is-shared", p->num_options,
-			       p->options)) != NULL) {
-	num_options = cupsAddOption("printer-is-shared", val,
-				    num_options, &options);
-	debug_printf("Setting printer-is-shared bit to %s.\n", val);
-      } else if (p->netprinter == 1 && NewIPPPrinterQueuesShared) { 
-	num_options = cupsAddOption("printer-is-shared", "true",
-				    num_options, &options);
-	debug_printf("Setting printer-is-shared bit.\n");
-      } else if (NewBrowsePollQueuesShared &&
-      (val = cupsGetOption("printer-to-be-shared", p->num_options,
-               p->options)) != NULL) {
-	num_options = cupsAddOption("printer-is-shared", "true",
-				    num_options, &options);
-	debug_printf("Setting printer-is-shared bit.\n");
-      } else {
-	num_options = cupsAddOption("printer-is-shared", "false",
-				    num_options, &options);
-	debug_printf("Unsetting printer-is-shared bit.\n");
-      }
-      cupsEncodeOptions2(request, num_options, options, IPP_TAG_OPERATION);
-      cupsEncodeOptions2(request, num_options, options, IPP_TAG_PRINTER);
-      /*
-       * Do IPP request for printer-is-shared option only when we have
-       * network printer or if we have remote CUPS queue, do IPP request
-       * only if we have CUPS older than 2.2.
-       */
-      if (p->netprinter != 0 || !HAVE_CUPS_2_2 || AllowResharingRemoteCUPSPrinters)
-        ippDelete(cupsDoRequest(http, request, "/admin/"));
-      else
-        ippDelete(request);
-      cupsFreeOptions(num_options, options);
-      if (cupsLastError() > IPP_STATUS_OK_EVENTS_COMPLETE)
-	debug_printf("Unable to modify the printer-is-shared bit (%s)!\n",
-		     cupsLastErrorString());
+	   We do this in a seperate IPP request as on newer CUPS versions we
+	   get an error when changing the printer-is-shared bit on a queue
+	   pointing to a remote CUPS printer, this way we assure all other
+	   settings be applied amd when setting the printer-is-shared to
+	   false amd this errors, we can safely ignore the error as on queues
+	   pointing to remote CUPS printers the bit is set to false by default
+	   (these printers are never shared)
 
-      /* If we are about to create a raw queue or turn a non-raw queue
-	 into a raw one, we apply the "ppd-name=raw" option to remove any
-	 existing PPD file assigned to the queue.
+	   If our printer is an IPP network printer and not a CUPS queue, we
+	   keep track of whether the user has changed the printer-is-shared
+	   bit and recover this setting. The default setting for a new
+	   queue is configurable via the NewIPPPrinterQueuesShared directive
+	   in cups-browsed.conf */
 
-         Also here we do a separate IPP request as it errors in some
-         cases. */
-      if (want_raw) {
-	debug_printf("Removing local PPD file for printer %s\n", p->queue_name);
 	request = ippNewRequest(CUPS_ADD_MODIFY_PRINTER);
 	ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
 		     "printer-uri", NULL, uri);
@@ -8709,95 +10219,183 @@ gboolean update_cups_queues(gpointer unused) {
 		     "requesting-user-name", NULL, cupsUser());
 	num_options = 0;
 	options = NULL;
-	num_options = cupsAddOption("ppd-name", "raw",
-				    num_options, &options);
+	if (p->netprinter == 1 &&
+	    (val = cupsGetOption("printer-is-shared", p->num_options,
+				 p->options)) != NULL) {
+	  num_options = cupsAddOption("printer-is-shared", val,
+				      num_options, &options);
+	  debug_printf("Setting printer-is-shared bit to %s.\n", val);
+	} else if (p->netprinter == 1 && NewIPPPrinterQueuesShared) { 
+	  num_options = cupsAddOption("printer-is-shared", "true",
+				      num_options, &options);
+	  debug_printf("Setting printer-is-shared bit.\n");
+	} else if (NewBrowsePollQueuesShared &&
+	(val = cupsGetOption("printer-to-be-shared", p->num_options,
+		 p->options)) != NULL) {
+	  num_options = cupsAddOption("printer-is-shared", "true",
+				      num_options, &options);
+	  debug_printf("Setting printer-is-shared bit.\n");
+	} else {
+	  num_options = cupsAddOption("printer-is-shared", "false",
+				      num_options, &options);
+	  debug_printf("Unsetting printer-is-shared bit.\n");
+	}
 	cupsEncodeOptions2(request, num_options, options, IPP_TAG_OPERATION);
 	cupsEncodeOptions2(request, num_options, options, IPP_TAG_PRINTER);
-	ippDelete(cupsDoRequest(http, request, "/admin/"));
+	/*
+	 * Do IPP request for printer-is-shared option only when we have
+	 * network printer or if we have remote CUPS queue, do IPP request
+	 * only if we have CUPS older than 2.2.
+	 */
+	if (p->netprinter != 0 || !HAVE_CUPS_2_2 || AllowResharingRemoteCUPSPrinters)
+	  ippDelete(cupsDoRequest(http, request, "/admin/"));
+	else
+	  ippDelete(request);
 	cupsFreeOptions(num_options, options);
 	if (cupsLastError() > IPP_STATUS_OK_EVENTS_COMPLETE)
-	  debug_printf("Unable to remove PPD file from the print queue (%s)!\n",
+	  debug_printf("Unable to modify the printer-is-shared bit (%s)!\n",
 		       cupsLastErrorString());
-      }
 
-      /* If this queue was the default printer in its previous life, make
-	 it the default printer again. */
-      queue_creation_handle_default(p->queue_name);
+	/* If we are about to create a raw queue or turn a non-raw queue
+	   into a raw one, we apply the "ppd-name=raw" option to remove any
+	   existing PPD file assigned to the queue.
 
-      /* If cups-browsed or a failed backend has disabled this
-	 queue, re-enable it. */
-      if ((disabled_str = is_disabled(p->queue_name, "cups-browsed")) != NULL) {
-	enable_printer(p->queue_name);
-	free(disabled_str);
-      } else if ((disabled_str =
-		  is_disabled(p->queue_name,
-			      "Printer stopped due to backend errors")) !=
-		 NULL) {
-	enable_printer(p->queue_name);
-	free(disabled_str);
-      }
+	   Also here we do a separate IPP request as it errors in some
+	   cases. */
+	if (want_raw) {
+	  debug_printf("Removing local PPD file for printer %s\n", p->queue_name);
+	  request = ippNewRequest(CUPS_ADD_MODIFY_PRINTER);
+	  ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI,
+		       "printer-uri", NULL, uri);
+	  ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME,
+		       "requesting-user-name", NULL, cupsUser());
+	  num_options = 0;
+	  options = NULL;
+	  num_options = cupsAddOption("ppd-name", "raw",
+				      num_options, &options);
+	  cupsEncodeOptions2(request, num_options, options, IPP_TAG_OPERATION);
+	  cupsEncodeOptions2(request, num_options, options, IPP_TAG_PRINTER);
+	  ippDelete(cupsDoRequest(http, request, "/admin/"));
+	  cupsFreeOptions(num_options, options);
+	  if (cupsLastError() > IPP_STATUS_OK_EVENTS_COMPLETE)
+	    debug_printf("Unable to remove PPD file from the print queue (%s)!\n",
+			 cupsLastErrorString());
+	}
 
-      p->status = STATUS_CONFIRMED;
-      if (p->is_legacy) {
-	p->timeout = time(NULL) + BrowseTimeout;
-	debug_printf("starting BrowseTimeout timer for %s (%ds)\n",
-		     p->queue_name, BrowseTimeout);
-      } else
-	p->timeout = (time_t) -1;
+      queue_unchanged:
+
+	/* If this queue was the default printer in its previous life, make
+	   it the default printer again. */
+	queue_creation_handle_default(p->queue_name);
+
+	/* If cups-browsed or a failed backend has disabled this
+	   queue, re-enable it. */
+	if ((disabled_str = is_disabled(p->queue_name, "cups-browsed")) != NULL) {
+	  enable_printer(p->queue_name);
+	  free(disabled_str);
+	} else if ((disabled_str =
+		    is_disabled(p->queue_name,
+				"Printer stopped due to backend errors")) !=
+		   NULL) {
+	  enable_printer(p->queue_name);
+	  free(disabled_str);
+	}
 
-      /* Check if an HTTP timeout happened during the print queue creation
-	 If it does - increment p->timeouted and set status to TO_BE_CREATED
-	 because the creation can fall through the process, have state changed
-	 to STATUS_CONFIRMED and experience the timeout */
-      /* If no timeout has happened, clear p->timeouted */
-      if (timeout_reached == 1) {
-	debug_printf("Timeout happened during creation of the queue %s.\n",
-		     p->queue_name);
-	p->timeouted ++;
-	debug_printf("The queue %s already timeouted %d times in a row.\n",
-		     p->queue_name, p->timeouted);
-	p->status = STATUS_TO_BE_CREATED;
-	p->timeout = current_time + TIMEOUT_RETRY;
-      } else if (p->timeouted != 0) {
-	debug_printf("Creating the queue %s went smoothly after %d timeouts.\n",
-		     p->queue_name, p->timeouted);
-	p->timeouted = 0;
-      }
-
-      p->no_autosave = 0;
-      break;
+	p->status = STATUS_CONFIRMED;
+	if (p->is_legacy) {
+	  p->timeout = time(NULL) + BrowseTimeout;
+	  debug_printf("starting BrowseTimeout timer for %s (%ds)\n",
+		       p->queue_name, BrowseTimeout);
+	} else
+	  p->timeout = (time_t) -1;
+
+	/* Check if an HTTP timeout happened during the print queue creation
+	   If it does - increment p->timeouted and set status to TO_BE_CREATED
+	   because the creation can fall through the process, have state changed
+	   to STATUS_CONFIRMED and experience the timeout */
+	/* If no timeout has happened, clear p->timeouted */
+	if (timeout_reached == 1) {
+	  debug_printf("Timeout happened during creation of the queue %s.\n",
+		       p->queue_name);
+	  p->timeouted ++;
+	  debug_printf("The queue %s already timeouted %d times in a row.\n",
+		       p->queue_name, p->timeouted);
+	  p->status = STATUS_TO_BE_CREATED;
+	  p->timeout = current_time + TIMEOUT_RETRY;
+	} else if (p->timeouted != 0) {
+	  debug_printf("Creating the queue %s went smoothly after %d timeouts.\n",
+		       p->queue_name, p->timeouted);
+	  p->timeouted = 0;
+	}
+
+	/* Share the attributes with other printers of the same model */
+	if (p->status == STATUS_CONFIRMED)
+	  printer_attrs_compact(p);
 
-    case STATUS_CONFIRMED:
-      /* Only act if the timeout has passed */
-      if (p->timeout > current_time)
+	p->no_autosave = 0;
 	break;
 
-      if (p->is_legacy) {
-	/* Remove a queue based on a legacy CUPS broadcast when the
-	   broadcast timeout expires without a new broadcast of this
-	   queue from the server */
-	remove_printer_entry(p);
-      } else
-	p->timeout = (time_t) -1;
+      case STATUS_CONFIRMED:
+	/* Only act if the timeout has passed */
+	if (p->timeout > current_time)
+	  break;
 
-      break;
+	if (p->is_legacy) {
+	  /* Remove a queue based on a legacy CUPS broadcast when the
+	     broadcast timeout expires without a new broadcast of this
+	     queue from the server */
+	  remove_printer_entry(p);
+	} else
+	  p->timeout = (time_t) -1;
+
+	break;
 
+      }
+
+      /* Keep track of how fast cupsd handles our requests */
+      if (cups_queues_updated > op_updated) {
+	gint64 elapsed = g_get_monotonic_time() - op_start;
+	queue_update_latency = (queue_update_latency ?
+				(7 * queue_update_latency + elapsed) / 8 :
+				elapsed);
+      }
     }
   }
 
   /* If we have printer entries which we did not treat yet because of
-     update_cups_queues_max_per_call we push their timeouts by the
-     value of pause_between_cups_queue_updates into the future, so
-     that they only get worked on then. Also printer entries which are
-     scheduled in a time less than the value of
-     pause_between_cups_queue_updates will be pushed, so that
-     update_cups_queues will run the next time only after this
-     interval */
-  if (p && !in_shutdown)
+     the limits above we push their timeouts by the value of
+     pause_between_cups_queue_updates into the future, so that they
+     only get worked on then. Also printer entries which are scheduled
+     in a time less than the value of pause_between_cups_queue_updates
+     will be pushed, so that update_cups_queues will run the next time
+     only after this interval. Without a configured limit we only pause
+     when cupsd is slow, otherwise we continue as soon as the main loop
+     has handled other events. */
+  p = NULL;
+  pause = ((update_cups_queues_max_per_call > 0 ||
+	    queue_update_latency >= QUEUE_UPDATE_SLOW) ?
+	   pause_between_cups_queue_updates : 0);
+  if (stopped && !in_shutdown && pause > 0)
     for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
 	 p; p = (remote_printer_t *)cupsArrayNext(remote_printers))
-      if (p->timeout <= current_time + pause_between_cups_queue_updates)
-	p->timeout = current_time + pause_between_cups_queue_updates;
+      if (p->timeout <= current_time + pause)
+	p->timeout = current_time + pause;
+
+  /* Progress and backlog */
+  queue_updates_total += cups_queues_updated;
+  if (cups_queues_updated > 0) {
+    current_time = time(NULL);
+    for (pending = 0, q = (remote_printer_t *)cupsArrayFirst(remote_printers);
+	 q; q = (remote_printer_t *)cupsArrayNext(remote_printers))
+      if (q->timeout != (time_t) -1 && q->timeout <= current_time + pause &&
+	  q->status != STATUS_CONFIRMED)
+	pending ++;
+    debug_printf("Queue updates: %d in %d msec (%lu in total), %d pending, cupsd needs %d msec per update\n",
+		 cups_queues_updated,
+		 (int)((g_get_monotonic_time() - call_start) / 1000),
+		 queue_updates_total, pending,
+		 (int)(queue_update_latency / 1000));
+  }
 
  cannot_create:
   if (p && !in_shutdown)
@@ -8812,6 +10410,14 @@ gboolean update_cups_queues(gpointer unused) {
   return FALSE;
 }
 
+static gboolean
+update_cups_queues_timeout (gpointer data)
+{
+  /* The timer is done, recheck_timer() must not remove it any more */
+  queues_timer_id = 0;
+  return (update_cups_queues (data));
+}
+
 static void
 recheck_timer (void)
 {
@@ -8825,7 +10431,8 @@ recheck_timer (void)
   for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
        p;
        p = (remote_printer_t *)cupsArrayNext(remote_printers))
-    if (p->timeout == (time_t) -1)
+    if (p->timeout == (time_t) -1 || p->attrs_job)
+      /* Nothing to do or waiting for the IPP attributes */
       continue;
     else if (now > p->timeout) {
       timeout = 0;
@@ -8833,14 +10440,31 @@ recheck_timer (void)
     } else if (timeout == (time_t) -1 || p->timeout - now < timeout)
       timeout = p->timeout - now;
 
-  if (queues_timer_id)
-    g_source_remove (queues_timer_id);
-
   if (timeout != (time_t) -1) {
-    debug_printf("checking queues in %ds\n", timeout);
-    queues_timer_id =
-      g_timeout_add_seconds (timeout, update_cups_queues, NULL);
+    /* Changes which come in quickly one after the other, like during a
+       burst of DNS-SD events, get handled together. If the timer is
+       already set to run early enough, we keep it. */
+    gint64 due = g_get_monotonic_time() +
+      (timeout == 0 ? QUEUE_UPDATE_COALESCE * 1000 :
+       (gint64)timeout * G_USEC_PER_SEC);
+    if (queues_timer_id && queues_timer_due <= due)
+      return;
+    if (queues_timer_id)
+      g_source_remove (queues_timer_id);
+    queues_timer_due = due;
+    if (timeout == 0) {
+      debug_printf("checking queues in %dms\n", QUEUE_UPDATE_COALESCE);
+      queues_timer_id =
+	g_timeout_add (QUEUE_UPDATE_COALESCE, update_cups_queues_timeout,
+		       NULL);
+    } else {
+      debug_printf("checking queues in %ds\n", timeout);
+      queues_timer_id =
+	g_timeout_add_seconds (timeout, update_cups_queues_timeout, NULL);
+    }
   } else {
+    if (queues_timer_id)
+      g_source_remove (queues_timer_id);
     debug_printf("listening\n");
     queues_timer_id = 0;
   }
@@ -8989,32 +10613,105 @@ matched_filters (const char *queue_name,
   return FALSE;
 }
 
+static int
+netif_compare (netif_t *a, netif_t *b, void *data)
+{
+  return (strcasecmp (a->address, b->address));
+}
+
+/* Record the interface data which update_netifs() uses, to find out
+   whether anything changed since the last time */
+static GByteArray *
+netifs_take_snapshot (struct ifaddrs *ifaddr)
+{
+  GByteArray *snapshot = g_byte_array_new ();
+  struct ifaddrs *ifa;
+  int addr_size;
+
+  for (ifa = ifaddr; ifa; ifa = ifa->ifa_next) {
+    if (ifa->ifa_addr == NULL)
+      continue;
+    if (ifa->ifa_addr->sa_family == AF_INET)
+      addr_size = sizeof (struct sockaddr_in);
+    else if (ifa->ifa_addr->sa_family == AF_INET6)
+      addr_size = sizeof (struct sockaddr_in6);
+    else
+      continue;
+    g_byte_array_append (snapshot, (guint8 *)ifa->ifa_name,
+			 strlen (ifa->ifa_name) + 1);
+    g_byte_array_append (snapshot, (guint8 *)&ifa->ifa_flags,
+			 sizeof (ifa->ifa_flags));
+    g_byte_array_append (snapshot, (guint8 *)ifa->ifa_addr, addr_size);
+    if (ifa->ifa_broadaddr)
+      g_byte_array_append (snapshot, (guint8 *)ifa->ifa_broadaddr,
+			   addr_size);
+  }
+
+  return (snapshot);
+}
+
+/* Add a name or address to the local host names, returns 0 if we have
+   it already */
+static int
+add_local_hostname (const char *name)
+{
+  char *key = g_ascii_strdown (name, -1);
+
+  if (g_hash_table_contains (local_hostnames, key)) {
+    g_free (key);
+    return 0;
+  }
+  g_hash_table_add (local_hostnames, key);
+  return 1;
+}
+
 static gboolean
 update_netifs (gpointer data)
 {
   struct ifaddrs *ifaddr, *ifa;
   netif_t *iface, *iface2;
   int i, add_to_netifs, addr_size, dupe, if_found, addr_found;
-  char *host, buf[HTTP_MAX_HOST], *p, list[65536], *l;
+  char buf[HTTP_MAX_HOST], numeric[HTTP_MAX_HOST], *p, list[65536], *l;
+  const char *name;
+  GByteArray *snapshot;
+  GHashTable *names;
 
   debug_printf("update_netifs() in THREAD %ld\n", pthread_self());
 
   update_netifs_sourceid = 0;
+  if (netlink_socket >= 0 && !netifs_dirty)
+    /* The netlink events tell us when something changes */
+    return FALSE;
+  netifs_dirty = FALSE;
+
   if (getifaddrs (&ifaddr) == -1) {
     debug_printf("unable to get interface addresses: %s\n",
 		 strerror (errno));
     return FALSE;
   }
 
+  /* Nothing to do if the interfaces did not change */
+  snapshot = netifs_take_snapshot (ifaddr);
+  if (netifs_snapshot && netifs_snapshot->len == snapshot->len &&
+      !memcmp (netifs_snapshot->data, snapshot->data, snapshot->len)) {
+    g_byte_array_free (snapshot, TRUE);
+    freeifaddrs (ifaddr);
+    return FALSE;
+  }
+  if (netifs_snapshot)
+    g_byte_array_free (netifs_snapshot, TRUE);
+  netifs_snapshot = snapshot;
+
   while ((iface = cupsArrayFirst (netifs)) != NULL) {
     cupsArrayRemove (netifs, iface);
     free (iface->address);
     free (iface);
   }
-  while ((host = cupsArrayFirst (local_hostnames)) != NULL) {
-    cupsArrayRemove (local_hostnames, host);
-    free (host);
-  }
+  g_hash_table_remove_all (local_hostnames);
+
+  /* Host names of the addresses, we only ask the resolver for the
+     addresses which are new */
+  names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
 
   memset(list, 0, sizeof(list));
   snprintf(list, sizeof(list) - 1, "Network interfaces: ");
@@ -9054,47 +10751,53 @@ update_netifs (gpointer data)
 	l = list + strlen(list);
 	if_found = 1;
       }
-      for (i = 0; i <= 1; i ++)
-        if (getnameinfo (ifa->ifa_addr, addr_size,
-			 buf, HTTP_MAX_HOST, NULL, 0,
-			 i == 0 ? NI_NUMERICHOST : NI_NAMEREQD) == 0)
-	  if (buf[0]) {
-	    /* Cut off "%..." from IPv6 IP addresses */
-	    if (ifa->ifa_addr->sa_family == AF_INET6 && i == 0 &&
-		(p = strchr(buf, '%')) != NULL)
-	      *p = '\0';
-	    /* discard if we already have this name or address */
-	    dupe = 0;
-	    for (host = (char *)cupsArrayFirst (local_hostnames);
-		 host != NULL;
-		 host = (char *)cupsArrayNext (local_hostnames))
-	      if (strcasecmp(buf, host) == 0) {
-		dupe = 1;
-		break;
-	      }
-	    if (dupe == 0) {
-	      cupsArrayAdd (local_hostnames, strdup(buf));
-	      if (addr_found == 1 && strlen(list) + 3 <=
-		  sizeof(list)) {
-		snprintf(l, sizeof(list) - strlen(list) - 1,
-			 ", ");
-		l = list + strlen(list);
-	      }
-	      if (addr_found == 0 && strlen(list) + 3 <=
-		  sizeof(list)) {
-		snprintf(l, sizeof(list) - strlen(list) - 1,
-			 " (");
-		l = list + strlen(list);
-		addr_found = 1;
-	      }
-	      if (strlen(list) + strlen(buf) + 1 <=
-		  sizeof(list)) {
-		snprintf(l, sizeof(list) - strlen(list) - 1,
-			 "%s", buf);
-		l = list + strlen(list);
-	      }
+      for (i = 0; i <= 1; i ++) {
+	if (i == 0) {
+	  if (getnameinfo (ifa->ifa_addr, addr_size,
+			   buf, HTTP_MAX_HOST, NULL, 0, NI_NUMERICHOST) != 0)
+	    break;
+	  /* Cut off "%..." from IPv6 IP addresses */
+	  if (ifa->ifa_addr->sa_family == AF_INET6 &&
+	      (p = strchr(buf, '%')) != NULL)
+	    *p = '\0';
+	  strncpy (numeric, buf, sizeof (numeric) - 1);
+	  numeric[sizeof (numeric) - 1] = '\0';
+	} else {
+	  if (netif_names &&
+	      (name = g_hash_table_lookup (netif_names, numeric)) != NULL) {
+	    strncpy (buf, name, sizeof (buf) - 1);
+	    buf[sizeof (buf) - 1] = '\0';
+	  } else if (getnameinfo (ifa->ifa_addr, addr_size,
+				  buf, HTTP_MAX_HOST, NULL, 0,
+				  NI_NAMEREQD) != 0)
+	    buf[0] = '\0';
+	  g_hash_table_replace (names, g_strdup (numeric), g_strdup (buf));
+	}
+	if (buf[0]) {
+	  /* discard if we already have this name or address */
+	  if (add_local_hostname (buf)) {
+	    if (addr_found == 1 && strlen(list) + 3 <=
+		sizeof(list)) {
+	      snprintf(l, sizeof(list) - strlen(list) - 1,
+		       ", ");
+	      l = list + strlen(list);
+	    }
+	    if (addr_found == 0 && strlen(list) + 3 <=
+		sizeof(list)) {
+	      snprintf(l, sizeof(list) - strlen(list) - 1,
+		       " (");
+	      l = list + strlen(list);
+	      addr_found = 1;
+	    }
+	    if (strlen(list) + strlen(buf) + 1 <=
+		sizeof(list)) {
+	      snprintf(l, sizeof(list) - strlen(list) - 1,
+		       "%s", buf);
+	      l = list + strlen(list);
 	    }
 	  }
+	}
+      }
     }
 
     if (add_to_netifs == 0)
@@ -9216,26 +10919,42 @@ update_netifs (gpointer data)
 
   freeifaddrs (ifaddr);
 
+  if (netif_names)
+    g_hash_table_destroy (netif_names);
+  netif_names = names;
+
   /* If run as a timeout, don't run it again. */
   return FALSE;
 }
 
 int
 is_local_hostname(const char *host_name) {
-  char *host;
+  char buf[HTTP_MAX_HOST];
+  size_t len;
+  int i;
 
   if (host_name == NULL)
     return 0;
 
-  for (host = (char *)cupsArrayFirst (local_hostnames);
-       host != NULL;
-       host = (char *)cupsArrayNext (local_hostnames))
-    if (strncasecmp(host_name, host, strlen(host)) == 0 &&
-	(strlen(host_name) == strlen(host) ||
-	 (strlen(host_name) > strlen(host) &&
-	  (strcasecmp(host_name + strlen(host), ".local") == 0 ||
-	   strcasecmp(host_name + strlen(host), ".local.") == 0))))
-      return 1;
+  /* Local host names are stored in lower case, a name also matches with
+     ".local" or ".local." appended */
+  for (len = 0; host_name[len] && len < sizeof(buf) - 1; len ++)
+    buf[len] = tolower(host_name[len]);
+  if (host_name[len])
+    return 0;
+  buf[len] = '\0';
+
+  if (g_hash_table_contains (local_hostnames, buf))
+    return 1;
+
+  for (i = 0; i <= 1; i ++) {
+    const char *suffix = (i == 0 ? ".local" : ".local.");
+    size_t slen = strlen(suffix);
+    if (len > slen && !strcmp(buf + len - slen, suffix)) {
+      buf[len - slen] = '\0';
+      return (g_hash_table_contains (local_hostnames, buf) ? 1 : 0);
+    }
+  }
 
   return 0;
 }
@@ -9593,19 +11312,19 @@ examine_discovered_printer_record(const char *host,
       free(p->queue_name);
       free(p->location);
       free(p->info);
-      free(p->make_model);
-      free(p->pdl);
+      release_string(p->make_model);
+      release_string(p->pdl);
       free(p->uri);
       free(p->host);
       free(p->ip);
       free(p->service_name);
-      free(p->type);
-      free(p->domain);
+      release_string(p->type);
+      release_string(p->domain);
       p->queue_name = strdup(local_queue_name);
       p->location = strdup(location);
       p->info = strdup(info);
-      p->make_model = (make_model != NULL ? strdup(make_model) : NULL);
-      p->pdl = (pdl != NULL ? strdup(pdl) : NULL);
+      p->make_model = intern_string(make_model);
+      p->pdl = intern_string(pdl);
       p->color = color;
       p->duplex = duplex;
       p->uri = strdup(uri);
@@ -9615,8 +11334,8 @@ examine_discovered_printer_record(const char *host,
       p->ip = (ip != NULL ? strdup(ip) : NULL);
       p->port = port;
       p->service_name = strdup(service_name);
-      p->type = strdup(type);
-      p->domain = strdup(domain);
+      p->type = intern_string(type);
+      p->domain = intern_string(domain);
       debug_printf("Switched over to newly discovered entry for this printer.\n");
     } else
       debug_printf("Staying with previously discovered entry for this printer.\n");
@@ -9658,12 +11377,12 @@ examine_discovered_printer_record(const char *host,
       p->info = strdup(info);
     }
     if (p->make_model == NULL || p->make_model[0] == '\0') {
-      if (p->make_model) free (p->make_model);
-      p->make_model = (make_model != NULL ? strdup(make_model) : NULL);
+      release_string(p->make_model);
+      p->make_model = intern_string(make_model);
     }
     if (p->pdl == NULL || p->pdl[0] == '\0') {
-      if (p->pdl) free (p->pdl);
-      p->pdl = (pdl != NULL ? strdup(pdl) : NULL);
+      release_string(p->pdl);
+      p->pdl = intern_string(pdl);
     }
     p->color = color;
     p->duplex = duplex;
@@ -9682,12 +11401,12 @@ examine_discovered_printer_record(const char *host,
       p->service_name = strdup(service_name);
     }
     if (p->type[0] == '\0' && type) {
-      free (p->type);
-      p->type = strdup(type);
+      release_string(p->type);
+      p->type = intern_string(type);
     }
     if (p->domain[0] == '\0' && domain) {
-      free (p->domain);
-      p->domain = strdup(domain);
+      release_string(p->domain);
+      p->domain = intern_string(domain);
     }
     if (domain != NULL && domain[0] != '\0' &&
 	type != NULL && type[0] != '\0')
@@ -9721,113 +11440,104 @@ examine_discovered_printer_record(const char *host,
   return p;
 }
 
-static gboolean
-allowed (struct sockaddr *srcaddr)
+/* Put the allow/deny rules into browseallow_trie, rules with a netmask
+   which is not a prefix go to browseallow_irregular */
+static void
+compile_browseallow (void)
 {
   allow_t *allow;
-  int i;
-  gboolean server_allowed;
-  allow_sense_t sense;
-
-  if (browse_order == ORDER_DENY_ALLOW)
-    /* BrowseOrder Deny,Allow: Allow server, then apply BrowseDeny lines,
-       after that BrowseAllow lines */
-    server_allowed = TRUE;
-  else
-    /* BrowseOrder Allow,Deny: Deny server, then apply BrowseAllow lines,
-       after that BrowseDeny lines */
-    server_allowed = FALSE;
+  allow_node_t *node;
+  uint32_t addr, mask;
+  int bits, i;
 
-  for (i = 0; i <= 1; i ++) {
-    if (browse_order == ORDER_DENY_ALLOW)
-      /* Treat BrowseDeny lines first, then BrowseAllow lines */
-      sense = (i == 0 ? ALLOW_DENY : ALLOW_ALLOW);
-    else
-      /* Treat BrowseAllow lines first, then BrowseDeny lines */
-      sense = (i == 0 ? ALLOW_ALLOW : ALLOW_DENY);
+  browseallow_trie = calloc (1, sizeof (allow_node_t));
+  browseallow_irregular = cupsArrayNew (NULL, NULL);
 
-    if (server_allowed == (sense == ALLOW_ALLOW ? TRUE : FALSE))
+  for (allow = cupsArrayFirst (browseallow);
+       allow;
+       allow = cupsArrayNext (browseallow)) {
+    if (allow->type == ALLOW_INVALID)
       continue;
 
-    if (browseallow_all && sense == ALLOW_ALLOW) {
-      server_allowed = TRUE;
-      continue;
+    addr = ntohl (allow->addr.ipv4.sin_addr.s_addr);
+    if (allow->type == ALLOW_IP)
+      mask = 0xffffffff;
+    else {
+      mask = ntohl (allow->mask.ipv4.sin_addr.s_addr);
+      browseallow_net_senses |= (1 << allow->sense);
     }
-    if (browsedeny_all && sense == ALLOW_DENY) {
-      server_allowed = FALSE;
+
+    if ((~mask & (~mask + 1)) != 0) {
+      cupsArrayAdd (browseallow_irregular, allow);
       continue;
     }
 
-    for (allow = cupsArrayFirst (browseallow);
-	 allow;
-	 allow = cupsArrayNext (browseallow)) {
-      if (allow->sense != sense)
-	continue;
+    /* An address with bits outside the mask never matches */
+    if (addr & ~mask)
+      continue;
 
-      switch (allow->type) {
-      case ALLOW_INVALID:
-	break;
+    for (bits = 0; bits < 32 && (mask & (0x80000000 >> bits)); bits ++);
 
-      case ALLOW_IP:
-	switch (srcaddr->sa_family) {
-	case AF_INET:
-	  if (((struct sockaddr_in *) srcaddr)->sin_addr.s_addr ==
-	      allow->addr.ipv4.sin_addr.s_addr) {
-	    server_allowed = (sense == ALLOW_ALLOW ? TRUE : FALSE);
-	    goto match;
-	  }
-	  break;
+    node = browseallow_trie;
+    for (i = 0; i < bits; i ++) {
+      int bit = (addr >> (31 - i)) & 1;
+      if (node->child[bit] == NULL)
+	node->child[bit] = calloc (1, sizeof (allow_node_t));
+      node = node->child[bit];
+    }
+    node->senses |= (1 << allow->sense);
+  }
+}
 
-	case AF_INET6:
-	  if (!memcmp (&((struct sockaddr_in6 *) srcaddr)->sin6_addr,
-		       &allow->addr.ipv6.sin6_addr,
-		       sizeof (allow->addr.ipv6.sin6_addr))) {
-	    server_allowed = (sense == ALLOW_ALLOW ? TRUE : FALSE);
-	    goto match;
-	  }
-	  break;
-	}
-	break;
+static gboolean
+allowed (struct sockaddr *srcaddr)
+{
+  allow_t *allow;
+  allow_node_t *node;
+  unsigned int senses = 0;
+  uint32_t addr;
+  int i;
 
-      case ALLOW_NET:
-	switch (srcaddr->sa_family) {
-	  struct sockaddr_in6 *src6addr;
+  if (browseallow_trie == NULL)
+    compile_browseallow ();
 
-	case AF_INET:
-	  if ((((struct sockaddr_in *) srcaddr)->sin_addr.s_addr &
-	       allow->mask.ipv4.sin_addr.s_addr) ==
-	      allow->addr.ipv4.sin_addr.s_addr) {
-	    server_allowed = (sense == ALLOW_ALLOW ? TRUE : FALSE);
-	    goto match;
-	  }
-	  break;
+  /* Find out which kinds of rules match the address. The rules are for
+     IPv4 addresses, IPv6 addresses match all network rules, as they
+     always did. */
+  if (srcaddr->sa_family == AF_INET6)
+    senses = browseallow_net_senses;
+  else if (srcaddr->sa_family == AF_INET) {
+    addr = ntohl (((struct sockaddr_in *) srcaddr)->sin_addr.s_addr);
 
-	case AF_INET6:
-	  src6addr = (struct sockaddr_in6 *) srcaddr;
-	  if (((src6addr->sin6_addr.s6_addr[0] &
-		allow->mask.ipv6.sin6_addr.s6_addr[0]) ==
-	       allow->addr.ipv6.sin6_addr.s6_addr[0]) &&
-	      ((src6addr->sin6_addr.s6_addr[1] &
-		allow->mask.ipv6.sin6_addr.s6_addr[1]) ==
-	       allow->addr.ipv6.sin6_addr.s6_addr[1]) &&
-	      ((src6addr->sin6_addr.s6_addr[2] &
-		allow->mask.ipv6.sin6_addr.s6_addr[2]) ==
-	       allow->addr.ipv6.sin6_addr.s6_addr[2]) &&
-	      ((src6addr->sin6_addr.s6_addr[3] &
-		allow->mask.ipv6.sin6_addr.s6_addr[3]) ==
-	       allow->addr.ipv6.sin6_addr.s6_addr[3])) {
-	    server_allowed = (sense == ALLOW_ALLOW ? TRUE : FALSE);
-	    goto match;
-	  }
-	  break;
-	}
-      }
+    for (node = browseallow_trie, i = 31; node; i --) {
+      senses |= node->senses;
+      if (i < 0)
+	break;
+      node = node->child[(addr >> i) & 1];
     }
-  match:
-    continue;
+
+    for (allow = cupsArrayFirst (browseallow_irregular);
+	 allow;
+	 allow = cupsArrayNext (browseallow_irregular))
+      if ((((struct sockaddr_in *) srcaddr)->sin_addr.s_addr &
+	   allow->mask.ipv4.sin_addr.s_addr) ==
+	  allow->addr.ipv4.sin_addr.s_addr)
+	senses |= (1 << allow->sense);
   }
 
-  return server_allowed;
+  if (browseallow_all)
+    senses |= (1 << ALLOW_ALLOW);
+  if (browsedeny_all)
+    senses |= (1 << ALLOW_DENY);
+
+  if (browse_order == ORDER_DENY_ALLOW)
+    /* BrowseOrder Deny,Allow: Allow server, then apply BrowseDeny lines,
+       after that BrowseAllow lines */
+    return (!(senses & (1 << ALLOW_DENY)) || (senses & (1 << ALLOW_ALLOW)));
+  else
+    /* BrowseOrder Allow,Deny: Deny server, then apply BrowseAllow lines,
+       after that BrowseDeny lines */
+    return ((senses & (1 << ALLOW_ALLOW)) && !(senses & (1 << ALLOW_DENY)));
 }
 
 #ifdef HAVE_AVAHI
@@ -10437,7 +12147,7 @@ found_cups_printer (const char *remote_host, const char *uri,
   char host[HTTP_MAX_HOST];
   char resource[HTTP_MAX_URI];
   int port;
-  netif_t *iface;
+  netif_t *iface, key;
   char local_resource[HTTP_MAX_URI];
   char service_name[HTTP_MAX_URI];
   char *c;
@@ -10458,12 +12168,8 @@ found_cups_printer (const char *remote_host, const char *uri,
 		   resource, sizeof(resource)- 1);
 
   /* Check this isn't one of our own broadcasts */
-  for (iface = cupsArrayFirst (netifs);
-       iface;
-       iface = cupsArrayNext (netifs))
-    if (!strcasecmp (host, iface->address))
-      break;
-  if (iface) {
+  key.address = host;
+  if ((iface = cupsArrayFind (netifs, &key)) != NULL) {
     debug_printf("ignoring own broadcast on %s\n",
 		 iface->address);
     return;
@@ -10521,15 +12227,75 @@ found_cups_printer (const char *remote_host, const char *uri,
 
 }
 
-gboolean
-process_browse_data (GIOChannel *source,
-		     GIOCondition condition,
-		     gpointer data)
+/* Last packet received from a sender for a printer URI */
+typedef struct browse_packet_s {
+  char *packet;
+  time_t time;
+} browse_packet_t;
+
+static void
+browse_packet_free (gpointer data)
+{
+  browse_packet_t *seen = data;
+  free (seen->packet);
+  free (seen);
+}
+
+static gboolean
+browse_packet_expired (gpointer key, gpointer value, gpointer user_data)
+{
+  browse_packet_t *seen = value;
+  time_t *now = user_data;
+  return (*now - seen->time >= BrowseTimeout / 2);
+}
+
+/* Check whether we got the same packet for the same printer from the
+   same sender already recently. Processing it again would only refresh
+   the printer's BrowseTimeout, so we do that only every BrowseTimeout / 2
+   seconds. */
+static gboolean
+browse_packet_unchanged (http_addr_t *srcaddr, const char *packet,
+			 time_t now)
+{
+  browse_packet_t *seen;
+  unsigned int type, state;
+  char uri[1024], *key;
+
+  if (srcaddr->addr.sa_family != AF_INET ||
+      sscanf (packet, "%x%x%1023s", &type, &state, uri) < 3)
+    return FALSE;
+
+  if (browse_packets_seen == NULL)
+    browse_packets_seen = g_hash_table_new_full (g_str_hash, g_str_equal,
+						 g_free, browse_packet_free);
+
+  /* Forget the packets of printers which stopped broadcasting */
+  if (now - browse_packets_purged >= BrowseTimeout) {
+    g_hash_table_foreach_remove (browse_packets_seen, browse_packet_expired,
+				 &now);
+    browse_packets_purged = now;
+  }
+
+  key = g_strdup_printf ("%08x %s",
+			 (unsigned int)srcaddr->ipv4.sin_addr.s_addr, uri);
+  if ((seen = g_hash_table_lookup (browse_packets_seen, key)) != NULL &&
+      !strcmp (seen->packet, packet) &&
+      now - seen->time < BrowseTimeout / 2) {
+    g_free (key);
+    return TRUE;
+  }
+
+  seen = calloc (1, sizeof (browse_packet_t));
+  seen->packet = strdup (packet);
+  seen->time = now;
+  g_hash_table_replace (browse_packets_seen, key, seen);
+
+  return FALSE;
+}
+
+static void
+process_browse_packet (char *packet, size_t packetsize, http_addr_t *srcaddr)
 {
-  char packet[2048];
-  http_addr_t srcaddr;
-  socklen_t srclen;
-  ssize_t got;
   unsigned int type;
   unsigned int state;
   char remote_host[256];
@@ -10538,48 +12304,27 @@ process_browse_data (GIOChannel *source,
   char info[1024];
   char *c = NULL, *end = NULL;
 
-  debug_printf("process_browse_data() in THREAD %ld\n", pthread_self());
-
-  memset(packet, 0, sizeof(packet));
   memset(remote_host, 0, sizeof(remote_host));
   memset(uri, 0, sizeof(uri));
   memset(info, 0, sizeof(info));
 
-  srclen = sizeof (srcaddr);
-  got = recvfrom (browsesocket, packet, sizeof (packet) - 1, 0,
-		  &srcaddr.addr, &srclen);
-  if (got == -1) {
-    debug_printf ("cupsd-browsed: error receiving browse packet: %s\n",
-		  strerror (errno));
-    /* Remove this I/O source */
-    return FALSE;
-  }
-
-  packet[got] = '\0';
-  httpAddrString (&srcaddr, remote_host, sizeof (remote_host) - 1);
-
-  /* Check this packet is allowed */
-  if (!allowed ((struct sockaddr *) &srcaddr)) {
-    debug_printf("browse packet from %s disallowed\n",
-		 remote_host);
-    return TRUE;
-  }
+  httpAddrString (srcaddr, remote_host, sizeof (remote_host) - 1);
 
   debug_printf("browse packet received from %s\n",
 	       remote_host);
 
   if (sscanf (packet, "%x%x%1023s", &type, &state, uri) < 3) {
     debug_printf("incorrect browse packet format\n");
-    return TRUE;
+    return;
   }
 
   info[0] = '\0';
 
   /* do not read OOB */
-  end = packet + sizeof(packet);
+  end = packet + packetsize;
   c = strchr (packet, '\"');
   if (c >= end)
-    return TRUE;
+    return;
 
   if (c) {
     /* Extract location field */
@@ -10597,7 +12342,7 @@ process_browse_data (GIOChannel *source,
       ;
 
     if (c >= end)
-      return TRUE;
+      return;
 
     if (*c == '\"') {
       for (c++; c < end && isspace(*c); c++)
@@ -10605,7 +12350,7 @@ process_browse_data (GIOChannel *source,
     }
 
     if (c >= end)
-      return TRUE;
+      return;
 
     /* Is there an info field? */
     if (*c == '\"') {
@@ -10620,10 +12365,96 @@ process_browse_data (GIOChannel *source,
     }
   }
   if (c >= end)
-    return TRUE;
+    return;
 
   if (!(type & CUPS_PRINTER_DELETE))
     found_cups_printer (remote_host, uri, location, info);
+}
+
+gboolean
+process_browse_data (GIOChannel *source,
+		     GIOCondition condition,
+		     gpointer data)
+{
+  /* Receive all packets which are waiting, up to BROWSE_PACKET_BATCH
+     per call */
+  static char packets[BROWSE_PACKET_BATCH][2048];
+  http_addr_t srcaddrs[BROWSE_PACKET_BATCH];
+  ssize_t got[BROWSE_PACKET_BATCH];
+  char remote_host[256];
+  int num_packets, num_unchanged = 0, i;
+  time_t now;
+#ifdef __linux
+  struct mmsghdr msgs[BROWSE_PACKET_BATCH];
+  struct iovec iovecs[BROWSE_PACKET_BATCH];
+#else
+  socklen_t srclen;
+#endif /* __linux */
+
+  debug_printf("process_browse_data() in THREAD %ld\n", pthread_self());
+
+#ifdef __linux
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < BROWSE_PACKET_BATCH; i ++) {
+    iovecs[i].iov_base = packets[i];
+    iovecs[i].iov_len = sizeof (packets[i]) - 1;
+    msgs[i].msg_hdr.msg_iov = &iovecs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &srcaddrs[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof (srcaddrs[i]);
+  }
+
+  num_packets = recvmmsg (browsesocket, msgs, BROWSE_PACKET_BATCH,
+			  MSG_DONTWAIT, NULL);
+  for (i = 0; i < num_packets; i ++)
+    got[i] = msgs[i].msg_len;
+#else
+  for (num_packets = 0; num_packets < BROWSE_PACKET_BATCH; num_packets ++) {
+    srclen = sizeof (srcaddrs[num_packets]);
+    got[num_packets] = recvfrom (browsesocket, packets[num_packets],
+				 sizeof (packets[num_packets]) - 1,
+				 MSG_DONTWAIT, &srcaddrs[num_packets].addr,
+				 &srclen);
+    if (got[num_packets] == -1)
+      break;
+  }
+  if (num_packets == 0)
+    num_packets = -1;
+#endif /* __linux */
+
+  if (num_packets == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return TRUE;
+    debug_printf ("cupsd-browsed: error receiving browse packet: %s\n",
+		  strerror (errno));
+    /* Remove this I/O source */
+    return FALSE;
+  }
+
+  now = time(NULL);
+
+  for (i = 0; i < num_packets; i ++) {
+    memset(packets[i] + got[i], 0, sizeof (packets[i]) - got[i]);
+
+    /* Check this packet is allowed */
+    if (!allowed ((struct sockaddr *) &srcaddrs[i])) {
+      httpAddrString (&srcaddrs[i], remote_host, sizeof (remote_host) - 1);
+      debug_printf("browse packet from %s disallowed\n",
+		   remote_host);
+      continue;
+    }
+
+    if (browse_packet_unchanged (&srcaddrs[i], packets[i], now)) {
+      num_unchanged ++;
+      continue;
+    }
+
+    process_browse_packet (packets[i], sizeof (packets[i]), &srcaddrs[i]);
+  }
+
+  if (num_unchanged)
+    debug_printf("%d of %d browse packets unchanged, skipped\n",
+		 num_unchanged, num_packets);
 
   if (in_shutdown == 0)
     recheck_timer ();
@@ -10647,16 +12478,17 @@ broadcast_browse_packets (gpointer data, gpointer user_data)
 
   debug_printf("broadcast_browse_packets() in THREAD %ld\n", pthread_self());
 
+  httpSeparateURI(HTTP_URI_CODING_ALL, bdata->uri,
+		  scheme, sizeof(scheme),
+		  username, sizeof(username),
+		  host, sizeof(host),
+		  &port,
+		  resource, sizeof(resource));
+
   for (browse = (netif_t *)cupsArrayFirst (netifs);
        browse != NULL;
        browse = (netif_t *)cupsArrayNext (netifs)) {
     /* Replace 'localhost' with our IP address on this interface */
-    httpSeparateURI(HTTP_URI_CODING_ALL, bdata->uri,
-		    scheme, sizeof(scheme),
-		    username, sizeof(username),
-		    host, sizeof(host),
-		    &port,
-		    resource, sizeof(resource));
     httpAssembleURI(HTTP_URI_CODING_ALL, uri, sizeof (uri),
 		    scheme, username, browse->address, port, resource);
 
@@ -10733,7 +12565,7 @@ browsepoll_printer_free (gpointer data)
   free (printer);
 }
 
-static void
+static gboolean
 browse_poll_get_printers (browsepoll_t *context, http_t *conn)
 {
   static const char * const rattrs[] = { "printer-uri-supported",
@@ -10742,6 +12574,7 @@ browse_poll_get_printers (browsepoll_t *context, http_t *conn)
   ipp_t *request, *response = NULL;
   ipp_attribute_t *attr;
   GList *printers = NULL;
+  gboolean ret = FALSE;
 
   debug_printf ("cups-browsed [BrowsePoll %s:%d]: CUPS-Get-Printers\n",
 		context->server, context->port);
@@ -10806,21 +12639,25 @@ browse_poll_get_printers (browsepoll_t *context, http_t *conn)
     }
 
     if (uri) {
-      found_cups_printer (context->server, uri, location, info);
       printer = new_browsepoll_printer (uri, location, info);
-      printers = g_list_insert (printers, printer, 0);
+      printers = g_list_prepend (printers, printer);
     }
 
     if (!attr)
       break;
   }
 
-  g_list_free_full (context->printers, browsepoll_printer_free);
-  context->printers = printers;
+  /* The printers get reported by browse_poll_done() in the main
+     thread */
+  g_list_free_full (context->polled_printers, browsepoll_printer_free);
+  context->polled_printers = g_list_reverse (printers);
+  ret = TRUE;
 
 fail:
   if (response)
     ippDelete(response);
+
+  return ret;
 }
 
 static void
@@ -10899,16 +12736,19 @@ static void
 browse_poll_cancel_subscription (browsepoll_t *context)
 {
   ipp_t *request, *response = NULL;
-  http_t *conn = httpConnectEncryptShortTimeout (context->server, context->port,
-						 HTTP_ENCRYPT_IF_REQUESTED);
+  http_t *conn = context->conn;
 
   if (conn == NULL) {
-    debug_printf("cups-browsed [BrowsePoll %s:%d]: connection failure "
-		 "attempting to cancel\n", context->server, context->port);
-    return;
-  }
+    conn = httpConnectEncryptShortTimeout (context->server, context->port,
+					   HTTP_ENCRYPT_IF_REQUESTED);
+    if (conn == NULL) {
+      debug_printf("cups-browsed [BrowsePoll %s:%d]: connection failure "
+		   "attempting to cancel\n", context->server, context->port);
+      return;
+    }
 
-  httpSetTimeout(conn, HttpRemoteTimeout, http_timeout_cb, NULL);
+    httpSetTimeout(conn, HttpRemoteTimeout, worker_http_timeout_cb, NULL);
+  }
 
   debug_printf ("cups-browsed [BrowsePoll %s:%d]: IPP-Cancel-Subscription\n",
 		context->server, context->port);
@@ -10936,7 +12776,7 @@ browse_poll_cancel_subscription (browsepoll_t *context)
 
   if (response)
     ippDelete(response);
-  if (conn)
+  if (conn != context->conn)
     httpClose (conn);
 }
 
@@ -10991,26 +12831,36 @@ browse_poll_get_notifications (browsepoll_t *context, http_t *conn)
 
   if (!get_printers) {
     ipp_attribute_t *attr;
-    gboolean seen_event = FALSE;
+    gboolean seen_event = FALSE, list_changed = FALSE;
     int last_seq = context->sequence_number;
     if (response == NULL)
       return FALSE;
     for (attr = ippFirstAttribute(response); attr;
 	 attr = ippNextAttribute(response))
       if (ippGetGroupTag (attr) == IPP_TAG_EVENT_NOTIFICATION) {
-	/* There is a printer-* event here. */
+	/* There is a printer-* event here. Only events which can change
+	   the list of printers, not state changes, make us fetch the list
+	   again. */
 	seen_event = TRUE;
 
 	if (!strcmp (ippGetName (attr), "notify-sequence-number") &&
 	    ippGetValueTag (attr) == IPP_TAG_INTEGER)
 	  last_seq = ippGetInteger (attr, 0);
+	else if (!strcmp (ippGetName (attr), "notify-subscribed-event") &&
+		 strcmp (ippGetString (attr, 0, NULL),
+			 "printer-state-changed"))
+	  list_changed = TRUE;
       }
 
     if (seen_event) {
-      debug_printf("cups-browsed [BrowsePoll %s:%d]: printer-* event\n",
-		   context->server, context->port);
       context->sequence_number = last_seq;
-      get_printers = TRUE;
+      if (list_changed) {
+	debug_printf("cups-browsed [BrowsePoll %s:%d]: printer-* event\n",
+		     context->server, context->port);
+	get_printers = TRUE;
+      } else
+	debug_printf("cups-browsed [BrowsePoll %s:%d]: only printer state changes\n",
+		     context->server, context->port);
     } else
       debug_printf("cups-browsed [BrowsePoll %s:%d]: no events\n",
 		   context->server, context->port);
@@ -11033,66 +12883,146 @@ browsepoll_printer_keepalive (gpointer data, gpointer user_data)
 		      printer->info);
 }
 
-gboolean
-browse_poll (gpointer data)
+/* Schedule the next poll of a BrowsePoll server. The polls of the
+   servers get spread over time, so that they do not all hit the
+   network and the thread pool at the same moment. */
+static void
+browse_poll_schedule (browsepoll_t *context, gboolean first)
+{
+  guint interval = BrowseInterval * 1000;
+  guint jitter = interval * BROWSE_POLL_JITTER / 100;
+  guint delay;
+
+  if (first)
+    /* Start all servers within the first seconds */
+    delay = g_random_int_range (0, MIN (interval, 5000) + 1);
+  else
+    delay = interval - jitter + g_random_int_range (0, 2 * jitter + 1);
+
+  g_timeout_add (delay, browse_poll, context);
+}
+
+/* Poll a BrowsePoll server in a thread of browse_poll_pool, so that a
+   slow server does not hold up the others or the main loop */
+static void
+browse_poll_worker (gpointer data, gpointer user_data)
 {
   browsepoll_t *context = data;
-  http_t *conn = NULL;
   gboolean get_printers = FALSE;
+  ipp_status_t status;
 
-  debug_printf("browse_poll() in THREAD %ld\n", pthread_self());
-
-  debug_printf ("browse polling %s:%d\n",
-		context->server, context->port);
+  debug_printf("browse_poll_worker() in THREAD %ld\n", pthread_self());
 
   res_init ();
 
-  conn = httpConnectEncryptShortTimeout (context->server, context->port,
-					 HTTP_ENCRYPT_IF_REQUESTED);
-  if (conn == NULL) {
-    debug_printf("cups-browsed [BrowsePoll %s:%d]: failed to connect\n",
-		 context->server, context->port);
-    goto fail;
+  /* libcups keeps the password callback per thread, never prompt on the
+     terminal here */
+  cupsSetPasswordCB2 (password_callback, NULL);
+
+  context->poll_status = -1;
+
+  /* An idle connection which the server has closed meanwhile shows up
+     as readable (EOF) */
+  if (context->conn && httpWait (context->conn, 0) &&
+      httpReconnect2 (context->conn, 3000, NULL)) {
+    httpClose (context->conn);
+    context->conn = NULL;
   }
 
-  httpSetTimeout(conn, HttpRemoteTimeout, http_timeout_cb, NULL);
+  if (context->conn == NULL) {
+    context->conn = httpConnectEncryptShortTimeout (context->server,
+						    context->port,
+						    HTTP_ENCRYPT_IF_REQUESTED);
+    if (context->conn == NULL) {
+      debug_printf("cups-browsed [BrowsePoll %s:%d]: failed to connect\n",
+		   context->server, context->port);
+      goto done;
+    }
+
+    httpSetTimeout(context->conn, HttpRemoteTimeout, worker_http_timeout_cb,
+		   NULL);
+  }
 
   if (context->can_subscribe) {
     if (context->subscription_id == -1) {
       /* The first time this callback is run we need to create the IPP
        * subscription to watch to printer-* events. */
-      browse_poll_create_subscription (context, conn);
+      browse_poll_create_subscription (context, context->conn);
       get_printers = TRUE;
     } else
       /* On subsequent runs, check for notifications using our
        * subscription. */
-      get_printers = browse_poll_get_notifications (context, conn);
+      get_printers = browse_poll_get_notifications (context, context->conn);
   }
   else
     get_printers = TRUE;
 
-  update_local_printers ();
-  inhibit_local_printers_update = TRUE;
-  if (get_printers)
-    browse_poll_get_printers (context, conn);
-  else
+  if (!get_printers)
+    context->poll_status = 0;
+  else if (browse_poll_get_printers (context, context->conn))
+    context->poll_status = 1;
+
+  /* Do not keep a broken connection for the next poll */
+  status = cupsLastError ();
+  if (status == IPP_STATUS_ERROR_SERVICE_UNAVAILABLE ||
+      status == IPP_STATUS_ERROR_INTERNAL) {
+    httpClose (context->conn);
+    context->conn = NULL;
+  }
+
+ done:
+  g_idle_add (browse_poll_done, context);
+}
+
+/* Report the result of a poll in the main thread */
+static gboolean
+browse_poll_done (gpointer data)
+{
+  browsepoll_t *context = data;
+
+  debug_printf("browse_poll_done() in THREAD %ld\n", pthread_self());
+
+  if (context->poll_status >= 0) {
+    update_local_printers ();
+    inhibit_local_printers_update = TRUE;
+    if (context->poll_status == 1) {
+      g_list_free_full (context->printers, browsepoll_printer_free);
+      context->printers = context->polled_printers;
+      context->polled_printers = NULL;
+    }
     g_list_foreach (context->printers, browsepoll_printer_keepalive,
 		    context->server);
+    inhibit_local_printers_update = FALSE;
 
-  inhibit_local_printers_update = FALSE;
+    if (in_shutdown == 0)
+      recheck_timer ();
+  }
 
   if (in_shutdown == 0)
-    recheck_timer ();
+    browse_poll_schedule (context, FALSE);
 
- fail:
+  return FALSE;
+}
 
-  if (conn)
-    httpClose (conn);
+gboolean
+browse_poll (gpointer data)
+{
+  browsepoll_t *context = data;
 
-  /* Call a new timeout handler so that we run again */
-  g_timeout_add_seconds (BrowseInterval, browse_poll, data);
+  debug_printf("browse_poll() in THREAD %ld\n", pthread_self());
 
-  /* Stop this timeout handler, we called a new one */
+  debug_printf ("browse polling %s:%d\n",
+		context->server, context->port);
+
+  if (browse_poll_pool == NULL)
+    browse_poll_pool = g_thread_pool_new (browse_poll_worker, NULL,
+					  BROWSE_POLL_MAX_THREADS, FALSE,
+					  NULL);
+
+  /* The next poll gets scheduled by browse_poll_done() */
+  g_thread_pool_push (browse_poll_pool, context, NULL);
+
+  /* Stop this timeout handler */
   return FALSE;
 }
 
@@ -11856,7 +13786,10 @@ read_configuration (const char *filename)
 		     value);
     } else if (!strcasecmp(line, "UpdateCUPSQueuesMaxPerCall") && value) {
       int n = atoi(value);
-      if (n >= 0) {
+      if (!strcasecmp(value, "adaptive")) {
+	update_cups_queues_max_per_call = -1;
+	debug_printf("Limit the CUPS queue updates per call of update_cups_queues() by time, adapting to how fast CUPS responds.\n");
+      } else if (n >= 0) {
 	update_cups_queues_max_per_call = n;
 	if (n > 0)
 	  debug_printf("Set maximum of CUPS queue updates per call of update_cups_queues() to %d.\n",
@@ -11934,9 +13867,70 @@ defer_update_netifs (void)
   if (update_netifs_sourceid)
     g_source_remove (update_netifs_sourceid);
 
+  netifs_dirty = TRUE;
   update_netifs_sourceid = g_timeout_add_seconds (10, update_netifs, NULL);
 }
 
+#ifdef __linux
+static gboolean
+netlink_event (GIOChannel *source,
+	       GIOCondition condition,
+	       gpointer data)
+{
+  char buf[8192];
+  ssize_t got;
+
+  /* We only need to know that something changed, update_netifs() reads
+     the new state. ENOBUFS means that we have missed events. */
+  while ((got = recv (netlink_socket, buf, sizeof(buf), MSG_DONTWAIT)) > 0);
+  if (got == 0 ||
+      (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+       errno != ENOBUFS)) {
+    debug_printf ("Netlink socket failed: %s, updating network interfaces on each use\n",
+		  got == 0 ? "closed" : strerror (errno));
+    close (netlink_socket);
+    netlink_socket = -1;
+    netifs_dirty = TRUE;
+    return FALSE;
+  }
+
+  debug_printf ("Netlink: network interfaces changed\n");
+  defer_update_netifs ();
+
+  return TRUE;
+}
+
+/* Watch for changes of links and addresses, so that update_netifs()
+   does not need to read the interfaces every time it is called */
+static void
+netlink_watch (void)
+{
+  struct sockaddr_nl addr;
+  GIOChannel *channel;
+
+  netlink_socket = socket (AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+			   NETLINK_ROUTE);
+  if (netlink_socket < 0) {
+    debug_printf ("Unable to create netlink socket: %s\n", strerror (errno));
+    return;
+  }
+
+  memset (&addr, 0, sizeof (addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+  if (bind (netlink_socket, (struct sockaddr *)&addr, sizeof (addr))) {
+    debug_printf ("Unable to bind netlink socket: %s\n", strerror (errno));
+    close (netlink_socket);
+    netlink_socket = -1;
+    return;
+  }
+
+  channel = g_io_channel_unix_new (netlink_socket);
+  g_io_add_watch (channel, G_IO_IN, netlink_event, NULL);
+  g_io_channel_unref (channel);
+}
+#endif /* __linux */
+
 static void
 nm_properties_changed (GDBusProxy *proxy,
 		       GVariant *changed_properties,
@@ -11966,6 +13960,8 @@ find_previous_queue (gpointer key,
 {
   const char *name = key;
   const local_printer_t *printer = value;
+  GHashTable *states = user_data;
+  gpointer state_key, state;
   remote_printer_t *p;
   debug_printf("find_previous_queue() in THREAD %ld\n", pthread_self());
   if (printer->cups_browsed_controlled) {
@@ -11984,8 +13980,19 @@ find_previous_queue (gpointer key,
 	p->timeout = time(NULL) + TIMEOUT_CONFIRM;
 
       p->slave_of = NULL;
-      debug_printf("Found CUPS queue %s (URI: %s) from previous session.\n",
-		   p->queue_name, p->uri);
+
+      /* What we knew about the printer, to check it when it gets
+	 discovered again */
+      if (states &&
+	  g_hash_table_lookup_extended(states, name, &state_key, &state)) {
+	g_hash_table_steal(states, name);
+	g_free(state_key);
+	p->saved_state = state;
+      }
+
+      debug_printf("Found CUPS queue %s (URI: %s) from previous session%s.\n",
+		   p->queue_name, p->uri,
+		   (p->saved_state ? ", with saved discovery state" : ""));
     } else
       debug_printf("ERROR: Unable to create print queue entry for printer of previous session: %s (%s).\n",
 		   name, printer->device_uri);
@@ -12001,6 +14008,7 @@ int main(int argc, char*argv[]) {
   GDBusProxy *proxy = NULL;
   GError *error = NULL;
   int subscription_id = 0;
+  GHashTable *saved_states;
 
   /* Initialise the command_line_config array */
   command_line_config = cupsArrayNew(NULL, NULL);
@@ -12185,6 +14193,11 @@ int main(int argc, char*argv[]) {
   strncpy(save_options_file + strlen(cachedir),
 	  SAVE_OPTIONS_FILE,
 	  sizeof(save_options_file) - strlen(cachedir) - 1);
+  strncpy(discovery_state_file, cachedir,
+	  sizeof(discovery_state_file) - 1);
+  strncpy(discovery_state_file + strlen(cachedir),
+	  DISCOVERY_STATE_FILE,
+	  sizeof(discovery_state_file) - strlen(cachedir) - 1);
   strncpy(debug_log_file, logdir,
 	  sizeof(debug_log_file) - 1);
   strncpy(debug_log_file + strlen(logdir),
@@ -12277,8 +14290,14 @@ int main(int argc, char*argv[]) {
     sleep(1);
 
   /* Initialise the array of network interfaces */
-  netifs = cupsArrayNew(NULL, NULL);
-  local_hostnames = cupsArrayNew(NULL, NULL);
+  netifs = cupsArrayNew((cups_array_func_t)netif_compare, NULL);
+  local_hostnames = g_hash_table_new_full (g_str_hash, g_str_equal,
+					   g_free, NULL);
+  /* Subscribe to the changes before reading the interfaces, so that no
+     change gets lost in between */
+#ifdef __linux
+  netlink_watch ();
+#endif /* __linux */
   update_netifs (NULL);
 
   local_printers = g_hash_table_new_full (g_str_hash,
@@ -12298,7 +14317,10 @@ int main(int argc, char*argv[]) {
     free(val);
   }
   remote_printers = cupsArrayNew(NULL, NULL);
-  g_hash_table_foreach (local_printers, find_previous_queue, NULL);
+  saved_states = load_discovery_state ();
+  g_hash_table_foreach (local_printers, find_previous_queue, saved_states);
+  if (saved_states)
+    g_hash_table_destroy (saved_states);
 
   /* Redirect SIGINT and SIGTERM so that we do a proper shutdown, removing
      the CUPS queues which we have created
@@ -12451,7 +14473,7 @@ int main(int argc, char*argv[]) {
 	 index++) {
       debug_printf ("will browse poll %s every %ds\n",
 		    BrowsePoll[index]->server, BrowseInterval);
-      g_idle_add (browse_poll, BrowsePoll[index]);
+      browse_poll_schedule (BrowsePoll[index], TRUE);
     }
   }
 
@@ -12475,6 +14497,10 @@ int main(int argc, char*argv[]) {
   if (cups_notifier != NULL) {
     g_signal_connect (cups_notifier, "printer-state-changed",
 		      G_CALLBACK (on_printer_state_changed), NULL);
+    g_signal_connect (cups_notifier, "printer-stopped",
+		      G_CALLBACK (on_printer_stopped_or_added), NULL);
+    g_signal_connect (cups_notifier, "printer-added",
+		      G_CALLBACK (on_printer_stopped_or_added), NULL);
     g_signal_connect (cups_notifier, "job-state",
 		      G_CALLBACK (on_job_state), NULL);
     g_signal_connect (cups_notifier, "printer-deleted",
@@ -12509,6 +14535,11 @@ fail:
   if (proxy)
     g_object_unref (proxy);
 
+  /* Drop queued attribute fetches and let the running ones finish, they
+     use the log and the printer entries which we free now */
+  if (printer_attrs_pool)
+    g_thread_pool_free (printer_attrs_pool, TRUE, TRUE);
+
   /* Remove all queues which we have set up */
   if (KeepGeneratedQueuesOnShutdown == 0)
     for (p = (remote_printer_t *)cupsArrayFirst(remote_printers);
@@ -12519,12 +14550,34 @@ fail:
     }
   update_cups_queues(NULL);
 
+  /* Remember the printers of the queues which we keep, for a quick
+     start next time */
+  if (KeepGeneratedQueuesOnShutdown)
+    save_discovery_state();
+
+  /* Write the option settings recorded while removing the queues, and
+     wait for them to be written */
+  if (saved_options_flush_id)
+    g_source_remove (saved_options_flush_id);
+  flush_printer_options (NULL);
+  if (saved_options_pool)
+    g_thread_pool_free (saved_options_pool, FALSE, TRUE);
+  if (saved_options) {
+    g_hash_table_destroy (saved_options);
+    saved_options = NULL;
+  }
+
   cancel_subscription (subscription_id);
   if (cups_notifier)
     g_object_unref (cups_notifier);
 
   if (BrowsePoll) {
     size_t index;
+
+    /* Let running polls finish, drop the queued ones */
+    if (browse_poll_pool)
+      g_thread_pool_free (browse_poll_pool, TRUE, TRUE);
+
     for (index = 0;
 	 index < NumBrowsePoll;
 	 index++) {
@@ -12532,9 +14585,13 @@ fail:
 	  BrowsePoll[index]->subscription_id != -1)
 	browse_poll_cancel_subscription (BrowsePoll[index]);
 
+      if (BrowsePoll[index]->conn)
+	httpClose (BrowsePoll[index]->conn);
       free (BrowsePoll[index]->server);
       g_list_free_full (BrowsePoll[index]->printers,
 			browsepoll_printer_free);
+      g_list_free_full (BrowsePoll[index]->polled_printers,
+			browsepoll_printer_free);
       free (BrowsePoll[index]);
     }
 
@@ -12563,10 +14620,16 @@ fail:
     ldap_disconnect(BrowseLDAPHandle);
     BrowseLDAPHandle = NULL;
   }
+  if (ldap_printers)
+    g_hash_table_destroy(ldap_printers);
 #endif /* HAVE_LDAP */
 
   if (browsesocket != -1)
     close (browsesocket);
+  if (browse_packets_seen)
+    g_hash_table_destroy (browse_packets_seen);
+  if (netlink_socket != -1)
+    close (netlink_socket);
 
   g_hash_table_destroy (local_printers);
   g_hash_table_destroy (cups_supported_remote_printers);